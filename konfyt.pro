@@ -28,6 +28,8 @@ SOURCES += src/main.cpp\
     src/konfytLayerWidget.cpp \
     src/konfytFluidsynthEngine.cpp \
     src/konfytJackEngine.cpp \
+    src/konfytJackConnections.cpp \
+    src/konfytJackPortRegistry.cpp \
     src/konfytDatabase.cpp \
     src/konfytProject.cpp \
     src/konfytDbTree.cpp \
@@ -37,8 +39,17 @@ SOURCES += src/main.cpp\
     src/konfytMidi.cpp \
     src/konfytArrayList.cpp \
     src/konfytBridgeEngine.cpp \
+    src/konfytBridgeShm.cpp \
     src/konfytBaseSoundEngine.cpp \
     src/konfytLscpEngine.cpp \
+    src/konfytLayerLoader.cpp \
+    src/konfytLibraryWatcher.cpp \
+    src/konfytDatabaseFile.cpp \
+    src/konfytDirWalker.cpp \
+    src/konfytSfzReader.cpp \
+    src/konfytLibraryModel.cpp \
+    src/konfytSearchIndex.cpp \
+    src/konfytSoundfontReader.cpp \
     src/menuEntryWidget.cpp \
     src/midiEventListWidgetAdapter.cpp \
     src/midiMapGraphWidget.cpp \
@@ -58,6 +69,8 @@ HEADERS  += src/mainwindow.h \
     src/konfytFluidsynthEngine.h \
     src/konfytStructs.h \
     src/konfytJackEngine.h \
+    src/konfytJackConnections.h \
+    src/konfytJackPortRegistry.h \
     src/konfytDatabase.h \
     src/konfytProject.h \
     src/konfytDbTree.h \
@@ -68,8 +81,17 @@ HEADERS  += src/mainwindow.h \
     src/konfytMidi.h \
     src/konfytArrayList.h \
     src/konfytBridgeEngine.h \
+    src/konfytBridgeShm.h \
     src/konfytBaseSoundEngine.h \
     src/konfytLscpEngine.h \
+    src/konfytLayerLoader.h \
+    src/konfytLibraryWatcher.h \
+    src/konfytDatabaseFile.h \
+    src/konfytDirWalker.h \
+    src/konfytSfzReader.h \
+    src/konfytLibraryModel.h \
+    src/konfytSearchIndex.h \
+    src/konfytSoundfontReader.h \
     src/menuEntryWidget.h \
     src/midiEventListWidgetAdapter.h \
     src/midiMapGraphWidget.h \
@@ -97,6 +119,26 @@ PKGCONFIG += lscp
     HEADERS += src/konfytCarlaEngine.h
     DEFINES += KONFYT_USE_CARLA
     PKGCONFIG += carla-standalone
+
+    # Running Carla in Konfyt's own JACK process callback (--inprocess) uses
+    # Carla as a native plugin.
+    packagesExist(carla-native-plugin) {
+        DEFINES += KONFYT_CARLA_INPROCESS
+        PKGCONFIG += carla-native-plugin
+    }
+}
+
+# Sampler stuff
+# Konfyt's own SFZ sampler uses libsndfile. To build without it, run qmake
+# with the option "CONFIG+=KONFYT_NO_SAMPLER".
+
+!KONFYT_NO_SAMPLER {
+    SOURCES += src/konfytSampler.cpp \
+        src/konfytSamplerEngine.cpp
+    HEADERS += src/konfytSampler.h \
+        src/konfytSamplerEngine.h
+    DEFINES += KONFYT_USE_SAMPLER
+    PKGCONFIG += sndfile
 }
 
 # Fluidsynth
@@ -42,11 +42,22 @@ public:
     virtual QStringList audioOutJackPortNames(int id) = 0;
     virtual void removeSfz(int id) = 0;
     virtual void setGain(int id, float newGain) = 0;
+    // True if the engine emits sfzLoadProgress() for added SFZs
+    virtual bool reportsLoadProgress() { return false; }
+    // SFZ rendered in our JACK process callback instead of connected through
+    // JACK ports, or null.
+    virtual KfJackInternalPlugin* internalPlugin(int /*id*/) { return nullptr; }
 
 signals:
     void print(QString msg);
     void statusInfo(QString msg);
     void initDone(QString error);
+    // Emitted by engines that add SFZs asynchronously once the JACK ports of
+    // the SFZ are known, or with an error message if adding failed.
+    void sfzAdded(int id, QString error);
+    // Progress of an SFZ that is still being loaded after it has been added,
+    // 100 when ready to play and negative if loading failed.
+    void sfzLoadProgress(int id, int percent);
 };
 
 #endif // KONFYTBASESOUNDENGINE_H
@@ -21,22 +21,21 @@
 
 #include "konfytBridgeEngine.h"
 
+#include <QCoreApplication>
+#include <QTimer>
+
 KonfytBridgeEngine::KonfytBridgeEngine(QObject *parent) :
     KonfytBaseSoundEngine(parent)
 {
-
+    connect(&server, &QLocalServer::newConnection,
+            this, &KonfytBridgeEngine::onNewConnection);
 }
 
 KonfytBridgeEngine::~KonfytBridgeEngine()
 {
     // Stop all processes
-    QList<int> ids = items.keys();
-    for (int i=0; i < ids.count(); i++) {
-        int id = ids[i];
-        KonfytBridgeItem &item = items[id];
-        item.process->blockSignals(true);
-        item.process->kill();
-        delete item.process;
+    foreach (KonfytBridgeItem* worker, workers) {
+        removeWorker(worker);
     }
 }
 
@@ -50,39 +49,61 @@ void KonfytBridgeEngine::setKonfytExePath(QString path)
     exePath = path;
 }
 
+/* Render SFZs in shared memory instead of connecting to JACK ports of the
+ * workers. Must be set before initEngine(). */
+void KonfytBridgeEngine::setSharedMemoryTransport(bool shm)
+{
+    mShm = shm;
+}
+
 void KonfytBridgeEngine::initEngine(KonfytJackEngine *jackEngine)
 {
     jack = jackEngine;
+
+    QString serverName = QString("konfyt_bridge_%1").arg(qApp->applicationPid());
+    QLocalServer::removeServer(serverName);
+    if (!server.listen(serverName)) {
+        emit initDone("Could not start bridge server: " + server.errorString());
+        return;
+    }
+
+    // Start the pool of idle workers
+    fillPool();
+
     print("KonfytBridgeEngine initialised.");
+    emit initDone("");
 }
 
 int KonfytBridgeEngine::addSfz(QString soundfilePath)
 {
-    KonfytBridgeItem item;
-
-    item.soundfilePath = soundfilePath;
-
     int id = idCounter++;
-    item.jackname = jack->clientName() + "_subclient_" + n2s(id);
 
-    item.cmd = exePath + " -q -c -j " + item.jackname + " \"" + soundfilePath + "\"";
+    KfBridgeShmHost* shm = nullptr;
+    if (mShm) {
+        shm = new KfBridgeShmHost();
+        QString error;
+        QString key = QString("%1_%2").arg(server.serverName()).arg(id);
+        if (!shm->create(key, jack->getSampleRate(), &error)) {
+            print("Bridge: Could not create shared memory: " + error);
+            delete shm;
+            return -1;
+        }
+    }
 
-    item.process = new QProcess();
-    connect(item.process, &QProcess::started, this, [=](){
-        KonfytBridgeItem &item = items[id];
-        item.state = "Started";
-        sendAllStatusInfo();
-        print("Bridge client " + n2s(id) + " started.");
-    });
-    connect(item.process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-            this, [=](int returnCode, QProcess::ExitStatus /*exitStatus*/){
-        // Process has finished. Restart.
-        print("Bridge client " + n2s(id) + " stopped: " + n2s(returnCode) + ". Restarting...");
-        startProcess(id);
-    });
+    KonfytBridgeItem* worker = idleWorker();
+    if (!worker) {
+        // Pool is empty, start a worker for this SFZ
+        worker = newWorker();
+    }
+    worker->soundfilePath = soundfilePath;
+    worker->shm = shm;
+    items.insert(id, worker);
+    // If the worker has not connected yet, the SFZ is sent when it does.
+    sendSfz(worker);
+    sendAllStatusInfo();
 
-    items.insert(id, item);
-    startProcess(id);
+    // Replace the worker taken from the pool in the background
+    QTimer::singleShot(0, this, &KonfytBridgeEngine::fillPool);
 
     return id;
 }
@@ -92,12 +113,14 @@ QString KonfytBridgeEngine::pluginName(int id)
     return "bridge_" + n2s(id);
 }
 
+/* Empty until the worker has loaded the SFZ, see sfzAdded(). */
 QString KonfytBridgeEngine::midiInJackPortName(int id)
 {
     KONFYT_ASSERT_RETURN_VAL(items.contains(id), QString("Invalid id %1").arg(id));
 
-    KonfytBridgeItem &item = items[id];
-    return item.jackname + ":" + "midi_in_0"; // TODO BRIDGE Detect ports with less fragility
+    KonfytBridgeItem* item = items[id];
+    if (!item->loaded || item->shm) { return ""; }
+    return item->jackname + ":" + "midi_in_0"; // TODO BRIDGE Detect ports with less fragility
 }
 
 QStringList KonfytBridgeEngine::audioOutJackPortNames(int id)
@@ -106,17 +129,22 @@ QStringList KonfytBridgeEngine::audioOutJackPortNames(int id)
 
     KONFYT_ASSERT_RETURN_VAL(items.contains(id), ret);
 
-    KonfytBridgeItem &item = items[id];
-    ret.append( item.jackname + ":" + "bus_0_L" ); // TODO BRIDGE Detect ports with less fragility
-    ret.append( item.jackname + ":" + "bus_0_R" ); // TODO BRIDGE Detect ports with less fragility
+    KonfytBridgeItem* item = items[id];
+    if (!item->loaded || item->shm) { return {"", ""}; }
+    ret.append( item->jackname + ":" + "bus_0_L" ); // TODO BRIDGE Detect ports with less fragility
+    ret.append( item->jackname + ":" + "bus_0_R" ); // TODO BRIDGE Detect ports with less fragility
 
     return ret;
 }
 
+/* The worker is stopped and not returned to the pool, so each SFZ starts with
+ * a fresh process. */
 void KonfytBridgeEngine::removeSfz(int id)
 {
-    // TODO BRIDGE
-    print("TODO BRIDGE: removeSfz " + n2s(id));
+    KONFYT_ASSERT_RETURN(items.contains(id));
+
+    removeWorker(items.take(id));
+    sendAllStatusInfo();
 }
 
 void KonfytBridgeEngine::setGain(int id, float newGain)
@@ -125,47 +153,235 @@ void KonfytBridgeEngine::setGain(int id, float newGain)
     print("TODO BRIDGE: setGain of " + n2s(id) + " to " + n2s(newGain));
 }
 
+bool KonfytBridgeEngine::reportsLoadProgress()
+{
+    return mShm;
+}
+
+KfJackInternalPlugin *KonfytBridgeEngine::internalPlugin(int id)
+{
+    KONFYT_ASSERT_RETURN_VAL(items.contains(id), nullptr);
+
+    return items[id]->shm;
+}
+
 QString KonfytBridgeEngine::getAllStatusInfo()
 {
     int crashes = 0;
-    QList<int> ids = items.keys();
-    for (int i=0; i < ids.count(); i++) {
-        KonfytBridgeItem &item = items[ids[i]];
-        if (item.startCount > 1) {
-            crashes += item.startCount-1;
-        }
+    int idle = 0;
+    int stalls = 0;
+    foreach (KonfytBridgeItem* worker, workers) {
+        crashes += worker->crashes;
+        if (worker->soundfilePath.isEmpty()) { idle++; }
+        if (worker->shm) { stalls += worker->shm->stalls(); }
     }
 
     QString ret;
-    ret += "Subclients: " + n2s(ids.count()) + "\n";
+    ret += "Subclients: " + n2s(items.count()) + "\n";
+    ret += "Idle: " + n2s(idle) + "\n";
     ret += "Crashes: " + n2s(crashes) + "\n";
+    if (mShm) { ret += "Stalled cycles: " + n2s(stalls) + "\n"; }
     return ret;
 }
 
-void KonfytBridgeEngine::startProcess(int id)
+/* Returns an idle worker from the pool, preferring one that has already
+ * connected, or null if there is none. */
+KonfytBridgeEngine::KonfytBridgeItem *KonfytBridgeEngine::idleWorker()
 {
-    KonfytBridgeItem &item = items[id];
+    KonfytBridgeItem* ret = nullptr;
+    foreach (KonfytBridgeItem* worker, workers) {
+        if (!worker->soundfilePath.isEmpty()) { continue; }
+        if (worker->socket) { return worker; }
+        if (!ret) { ret = worker; }
+    }
+    return ret;
+}
+
+KonfytBridgeEngine::KonfytBridgeItem *KonfytBridgeEngine::newWorker()
+{
+    KonfytBridgeItem* worker = new KonfytBridgeItem();
+    worker->jackname = jack->clientName() + "_subclient_" + n2s(workerCounter++);
+    workers.append(worker);
+    startProcess(worker);
+    return worker;
+}
 
-    print("Bridge client " + n2s(id) + " starting:");
-    print(   item.cmd);
+/* Start idle workers until the pool is full. */
+void KonfytBridgeEngine::fillPool()
+{
+    if (!server.isListening()) { return; }
+
+    int idle = 0;
+    foreach (KonfytBridgeItem* worker, workers) {
+        if (worker->soundfilePath.isEmpty()) { idle++; }
+    }
+    for (int i = idle; i < KONFYT_BRIDGE_POOL_SIZE; i++) {
+        newWorker();
+    }
+    sendAllStatusInfo();
+}
+
+void KonfytBridgeEngine::startProcess(KonfytBridgeItem *worker)
+{
+    worker->process = new QProcess(this);
+    worker->process->setProgram(exePath);
+    if (mShm) {
+        worker->process->setArguments({"--bridgeworker", server.serverName(),
+                                       "--bridgeshm"});
+    } else {
+        worker->process->setArguments({"-q", "-c", "-j", worker->jackname,
+                                       "--bridgeworker", server.serverName()});
+    }
+    connect(worker->process, &QProcess::started, this, [=]()
+    {
+        worker->state = "Started";
+        sendAllStatusInfo();
+        print("Bridge client " + worker->jackname + " started.");
+    });
+    connect(worker->process,
+            QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished),
+            this, [=]()
+    {
+        onProcessFinished(worker);
+    });
 
-    item.startCount++;
-    item.state = "Starting...";
+    print("Bridge client " + worker->jackname + " starting.");
+    worker->startCount++;
+    worker->state = "Starting...";
+    worker->loaded = false;
     sendAllStatusInfo();
 
-    item.process->start(item.cmd);
+    worker->process->start();
+}
+
+/* Send the worker its SFZ to load, if it has connected. */
+void KonfytBridgeEngine::sendSfz(KonfytBridgeItem *worker)
+{
+    if (!worker->socket) { return; }
+    if (worker->soundfilePath.isEmpty()) { return; }
+
+    worker->state = "Loading";
+    if (worker->shm) {
+        worker->socket->write(QString("shm %1\n").arg(worker->shm->key()).toLocal8Bit());
+    }
+    worker->socket->write(QString("load %1\n").arg(worker->soundfilePath).toLocal8Bit());
+}
+
+void KonfytBridgeEngine::removeWorker(KonfytBridgeItem *worker)
+{
+    workers.removeAll(worker);
+    if (worker->socket) {
+        worker->socket->disconnect(this);
+        worker->socket->deleteLater();
+    }
+    if (worker->process) {
+        worker->process->disconnect(this);
+        worker->process->terminate();
+        worker->process->deleteLater();
+    }
+    // Removed from the JACK engine by the patch engine before the SFZ is removed
+    delete worker->shm;
+    delete worker;
+}
+
+void KonfytBridgeEngine::onProcessFinished(KonfytBridgeItem *worker)
+{
+    bool connected = (worker->socket != nullptr);
+    if (worker->socket) {
+        worker->socket->disconnect(this);
+        worker->socket->deleteLater();
+        worker->socket = nullptr;
+    }
+    worker->process->deleteLater();
+    worker->process = nullptr;
+    worker->crashes++;
+
+    if (!worker->soundfilePath.isEmpty()) {
+        // Restart with the same JACK client name and load the SFZ again
+        print("Bridge client " + worker->jackname + " stopped. Restarting...");
+        startProcess(worker);
+        if (worker->shm) { emit sfzLoadProgress(items.key(worker), 0); }
+    } else if (connected) {
+        // Replace idle worker
+        print("Idle bridge client " + worker->jackname + " stopped. Restarting...");
+        startProcess(worker);
+    } else {
+        print("Bridge client " + worker->jackname + " failed to start.");
+        removeWorker(worker);
+        sendAllStatusInfo();
+    }
+}
+
+void KonfytBridgeEngine::onNewConnection()
+{
+    QLocalSocket* socket = server.nextPendingConnection();
+    connect(socket, &QLocalSocket::readyRead, this, [=]()
+    {
+        onSocketReadyRead(socket);
+    });
+}
+
+void KonfytBridgeEngine::onSocketReadyRead(QLocalSocket *socket)
+{
+    KonfytBridgeItem* worker = nullptr;
+    foreach (KonfytBridgeItem* w, workers) {
+        if (w->socket == socket) { worker = w; }
+    }
+
+    while (socket->canReadLine()) {
+        QString line = QString::fromLocal8Bit(socket->readLine());
+        line.replace("\n", "");
+
+        // See KonfytBridgeClient for format of messages
+
+        if (line.startsWith("hello ")) {
+            qint64 pid = line.mid(6).toLongLong();
+            foreach (KonfytBridgeItem* w, workers) {
+                if (w->process && (w->process->processId() == pid)) { worker = w; }
+            }
+            if (!worker) {
+                print("Unknown bridge client connected.");
+                socket->deleteLater();
+                return;
+            }
+            worker->socket = socket;
+            worker->state = "Idle";
+            sendSfz(worker);
+            sendAllStatusInfo();
+
+        } else if (line.startsWith("loaded") && worker) {
+            int id = items.key(worker, -1);
+            if (id < 0) { continue; } // SFZ removed in the meantime
+            QString error = line.mid(7);
+            worker->loaded = error.isEmpty();
+            worker->state = worker->loaded ? "Loaded" : "Error: " + error;
+            sendAllStatusInfo();
+            if (worker->shm) {
+                if (!error.isEmpty()) { print("Bridge: " + error); }
+                emit sfzLoadProgress(id, worker->loaded ? 100 : -1);
+            } else {
+                emit sfzAdded(id, error);
+            }
+
+        } else if (line.startsWith("progress ") && worker && worker->shm) {
+            int id = items.key(worker, -1);
+            if (id < 0) { continue; }
+            // 100 is only reported once loaded
+            emit sfzLoadProgress(id, qBound(0, line.mid(9).toInt(), 99));
+        }
+    }
 }
 
 QString KonfytBridgeEngine::getStatusInfo(int id)
 {
     if (!items.contains(id)) { return "Invalid id " + n2s(id); }
-    KonfytBridgeItem &item = items[id];
+    KonfytBridgeItem* item = items[id];
 
     QString ret;
     ret += "Subclient " + n2s(id) + "\n";
-    ret += "   State: " + item.state + "\n";
-    ret += "   StartCount: " + n2s(item.startCount) + "\n";
-    ret += "   Soundfile: " + item.soundfilePath + "\n";
+    ret += "   State: " + item->state + "\n";
+    ret += "   StartCount: " + n2s(item->startCount) + "\n";
+    ret += "   Soundfile: " + item->soundfilePath + "\n";
 
     return ret;
 }
@@ -174,3 +390,145 @@ void KonfytBridgeEngine::sendAllStatusInfo()
 {
     emit statusInfo( getAllStatusInfo() );
 }
+
+KonfytBridgeClient::KonfytBridgeClient(QObject *parent) : QObject(parent)
+{
+    connect(&socket, &QLocalSocket::readyRead,
+            this, &KonfytBridgeClient::onSocketReadyRead);
+    connect(&socket, &QLocalSocket::connected, this, [=]()
+    {
+        // Identify this process to the server
+        socket.write(QString("hello %1\n").arg(qApp->applicationPid()).toLocal8Bit());
+    });
+    connect(&socket, &QLocalSocket::disconnected,
+            this, &KonfytBridgeClient::disconnected);
+}
+
+void KonfytBridgeClient::connectToServer(QString serverName)
+{
+    socket.connectToServer(serverName);
+}
+
+/* Reply to the server that the SFZ has been loaded, with an error message that
+ * is empty on success. */
+void KonfytBridgeClient::sendSfzLoaded(QString error)
+{
+    socket.write(QString("loaded %1\n").arg(error).toLocal8Bit());
+}
+
+void KonfytBridgeClient::sendLoadProgress(int percent)
+{
+    socket.write(QString("progress %1\n").arg(percent).toLocal8Bit());
+}
+
+void KonfytBridgeClient::onSocketReadyRead()
+{
+    while (socket.canReadLine()) {
+        QString line = QString::fromLocal8Bit(socket.readLine());
+        line.replace("\n", "");
+        if (line.startsWith("shm ")) {
+            emit attachSharedMemory(line.mid(4));
+        } else if (line.startsWith("load ")) {
+            emit loadSfz(line.mid(5));
+        }
+    }
+}
+
+#ifdef KONFYT_USE_SAMPLER
+KonfytBridgeShmWorker::KonfytBridgeShmWorker(QObject *parent) : QObject(parent)
+{
+    qRegisterMetaType<KfSamplerInstrument*>("KfSamplerInstrument*");
+
+    connect(&client, &KonfytBridgeClient::attachSharedMemory,
+            this, &KonfytBridgeShmWorker::onAttachSharedMemory);
+    connect(&client, &KonfytBridgeClient::loadSfz,
+            this, &KonfytBridgeShmWorker::onLoadSfz);
+    connect(&client, &KonfytBridgeClient::disconnected,
+            this, &KonfytBridgeShmWorker::disconnected);
+
+    connect(&loader, &KfSamplerLoader::print, this, &KonfytBridgeShmWorker::print);
+    connect(&loader, &KfSamplerLoader::loadProgress, this, [=](int /*id*/, int percent)
+    {
+        client.sendLoadProgress(percent);
+    });
+    connect(&loader, &KfSamplerLoader::loaded,
+            this, &KonfytBridgeShmWorker::onLoaded);
+
+    loader.moveToThread(&loaderThread);
+    loaderThread.start();
+    streamer.start();
+
+    streamCheckTimer.setInterval(1000);
+    connect(&streamCheckTimer, &QTimer::timeout, this, [=]()
+    {
+        QString report = streamer.takeExhaustionReport();
+        if (!report.isEmpty()) { print(report); }
+    });
+    streamCheckTimer.start();
+}
+
+KonfytBridgeShmWorker::~KonfytBridgeShmWorker()
+{
+    if (loading) { instrument->cancelled = true; }
+    loaderThread.quit();
+    loaderThread.wait();
+
+    renderer.stop();
+    delete synth;
+    delete instrument;
+
+    streamer.stop();
+}
+
+void KonfytBridgeShmWorker::connectToServer(QString serverName)
+{
+    client.connectToServer(serverName);
+}
+
+void KonfytBridgeShmWorker::onAttachSharedMemory(QString key)
+{
+    QString error;
+    if (!renderer.attach(key, &error)) {
+        print("Could not attach shared memory: " + error);
+        return;
+    }
+    renderer.start();
+}
+
+void KonfytBridgeShmWorker::onLoadSfz(QString path)
+{
+    if (synth) {
+        client.sendSfzLoaded("Bridge worker already has an SFZ");
+        return;
+    }
+    if (renderer.sampleRate() <= 0) {
+        client.sendSfzLoaded("No shared memory to render SFZ in");
+        return;
+    }
+
+    instrument = new KfSamplerInstrument();
+    QString error;
+    if (!instrument->parse(path, &error)) {
+        delete instrument;
+        instrument = nullptr;
+        client.sendSfzLoaded("Failed to read SFZ " + path + ": " + error);
+        return;
+    }
+
+    synth = new KfSamplerSynth(&streamer, renderer.sampleRate());
+    renderer.setPlugin(synth);
+    loading = true;
+    print("Loading sfz: " + path);
+    emit loader.requestLoad(0, instrument);
+}
+
+void KonfytBridgeShmWorker::onLoaded(int /*id*/, KfSamplerInstrument *loadedInstrument,
+                                     QString error)
+{
+    loading = false;
+    if (error.isEmpty()) {
+        synth->setInstrument(loadedInstrument);
+    }
+    client.sendSfzLoaded(error);
+}
+#endif
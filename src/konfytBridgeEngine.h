@@ -23,34 +23,50 @@
 #define KONFYTBRIDGEENGINE_H
 
 #include "konfytBaseSoundEngine.h"
+#include "konfytBridgeShm.h"
+#ifdef KONFYT_USE_SAMPLER
+    #include "konfytSampler.h"
+#endif
 
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <QObject>
 #include <QProcess>
+#include <QTimer>
 
+#define KONFYT_BRIDGE_POOL_SIZE 2
+
+/* The bridge engine hosts each SFZ in a separate Konfyt process to protect
+ * against crashes. To avoid the process, Carla and JACK client startup time
+ * for every SFZ, a pool of idle worker processes is started in advance with
+ * the --bridgeworker option.
+ * Each worker connects to our QLocalServer with KonfytBridgeClient and sends
+ * "hello x\n" where x is its process id.
+ * When an SFZ is added, an idle worker is taken from the pool and sent
+ * "load x\n" where x is the SFZ path. The worker loads the SFZ and replies
+ * "loaded x\n" where x is an error message, empty on success.
+ * The pool is refilled in the background. If a worker with an SFZ crashes, it
+ * is restarted with the same JACK client name and the SFZ is sent again.
+ * Crashed idle workers are replaced, unless they never connected, to prevent
+ * an endless loop if the process can't start.
+ *
+ * With the shared memory transport, workers are started with --bridgeshm and
+ * have no JACK client. Before the SFZ, a worker is sent "shm x\n" where x is
+ * the key of the shared memory the SFZ is rendered in, see KfBridgeShmHost.
+ * The SFZ is then rendered in our JACK process callback like an internal
+ * plugin, and the worker reports the loading progress with "progress x\n".
+ */
 
 class KonfytBridgeEngine : public KonfytBaseSoundEngine
 {
     Q_OBJECT
 public:
-
-    struct KonfytBridgeItem
-    {
-        QString state;
-        int startCount;
-
-        QProcess* process;
-        QString soundfilePath;
-        QString jackname;
-        QString cmd;
-
-        KonfytBridgeItem() : startCount(0) {}
-    };
-
     explicit KonfytBridgeEngine(QObject *parent = 0);
     ~KonfytBridgeEngine();
 
     QString engineName();
     void setKonfytExePath(QString path);
+    void setSharedMemoryTransport(bool shm);
     void initEngine(KonfytJackEngine* jackEngine);
     int addSfz(QString soundfilePath);
     QString pluginName(int id);
@@ -58,19 +74,105 @@ public:
     QStringList audioOutJackPortNames(int id);
     void removeSfz(int id);
     void setGain(int id, float newGain);
+    bool reportsLoadProgress();
+    KfJackInternalPlugin* internalPlugin(int id);
     QString getAllStatusInfo();
 
 private:
+    struct KonfytBridgeItem
+    {
+        QString state;
+        int startCount = 0;
+        int crashes = 0;
+
+        QProcess* process = nullptr;
+        QLocalSocket* socket = nullptr;
+        QString soundfilePath; // Empty while idle in the pool
+        QString jackname;
+        bool loaded = false;
+        KfBridgeShmHost* shm = nullptr; // Shared memory transport only
+    };
+
     KonfytJackEngine* jack = nullptr;
     QString exePath;
+    bool mShm = false;
     int idCounter = 300;
-    QMap<int, KonfytBridgeItem> items;
+    int workerCounter = 0;
+    QLocalServer server;
+    QList<KonfytBridgeItem*> workers;
+    QMap<int, KonfytBridgeItem*> items; // Workers with an SFZ, by id
 
-    void startProcess(int id);
+    KonfytBridgeItem* idleWorker();
+    KonfytBridgeItem* newWorker();
+    void startProcess(KonfytBridgeItem* worker);
+    void sendSfz(KonfytBridgeItem* worker);
+    void removeWorker(KonfytBridgeItem* worker);
+    void onProcessFinished(KonfytBridgeItem* worker);
+    void onSocketReadyRead(QLocalSocket* socket);
     QString getStatusInfo(int id);
     void sendAllStatusInfo();
+
+private slots:
+    void fillPool();
+    void onNewConnection();
 };
 
-#endif // KONFYTBRIDGEENGINE_H
+/* Used in a Konfyt process started with --bridgeworker to receive SFZs to load
+ * from the bridge engine of the parent process. */
+class KonfytBridgeClient : public QObject
+{
+    Q_OBJECT
+public:
+    explicit KonfytBridgeClient(QObject *parent = nullptr);
+
+    void connectToServer(QString serverName);
+    void sendSfzLoaded(QString error);
+    void sendLoadProgress(int percent);
+
+signals:
+    void attachSharedMemory(QString key);
+    void loadSfz(QString path);
+    void disconnected();
 
+private:
+    QLocalSocket socket;
+
+private slots:
+    void onSocketReadyRead();
+};
 
+#ifdef KONFYT_USE_SAMPLER
+/* Used in a Konfyt process started with --bridgeworker and --bridgeshm. Loads
+ * the SFZ with our own sampler and renders it in the shared memory of the
+ * bridge engine, without a JACK client of its own. */
+class KonfytBridgeShmWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit KonfytBridgeShmWorker(QObject *parent = nullptr);
+    ~KonfytBridgeShmWorker();
+
+    void connectToServer(QString serverName);
+
+signals:
+    void print(QString msg);
+    void disconnected();
+
+private:
+    KonfytBridgeClient client;
+    KfBridgeShmRenderer renderer;
+    KfSamplerStreamer streamer;
+    QTimer streamCheckTimer{this};
+    KfSamplerLoader loader;
+    QThread loaderThread;
+    KfSamplerSynth* synth = nullptr;
+    KfSamplerInstrument* instrument = nullptr;
+    bool loading = false;
+
+    void onAttachSharedMemory(QString key);
+    void onLoadSfz(QString path);
+    void onLoaded(int id, KfSamplerInstrument* loadedInstrument, QString error);
+};
+#endif
+
+#endif // KONFYTBRIDGEENGINE_H
@@ -0,0 +1,268 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytBridgeShm.h"
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <climits>
+#include <new>
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "Futex words must be plain 32-bit integers");
+
+static void futexWake(std::atomic<uint32_t>* word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX,
+            nullptr, nullptr, 0);
+}
+
+static qint64 monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (qint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Waits until the word has the value, for at most the timeout. Returns false
+ * on timeout. */
+static bool futexWaitFor(std::atomic<uint32_t>* word, uint32_t value, qint64 timeoutNs)
+{
+    qint64 end = monotonicNs() + timeoutNs;
+    while (true) {
+        uint32_t current = word->load(std::memory_order_acquire);
+        if (current == value) { return true; }
+        qint64 remaining = end - monotonicNs();
+        if (remaining <= 0) { return false; }
+        struct timespec ts;
+        ts.tv_sec = remaining / 1000000000;
+        ts.tv_nsec = remaining % 1000000000;
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, current,
+                &ts, nullptr, 0);
+    }
+}
+
+/* Waits while the word has the value, for at most the timeout. */
+static void futexWaitWhile(std::atomic<uint32_t>* word, uint32_t value, qint64 timeoutNs)
+{
+    struct timespec ts;
+    ts.tv_sec = timeoutNs / 1000000000;
+    ts.tv_nsec = timeoutNs % 1000000000;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, value,
+            &ts, nullptr, 0);
+}
+
+bool KfBridgeShmHost::create(QString key, double sampleRate, QString *error)
+{
+    shm.setKey(key);
+    if (!shm.create(sizeof(KfBridgeShmBlock))) {
+        if (shm.error() == QSharedMemory::AlreadyExists) {
+            // Left behind by a crashed instance. Attaching and detaching as
+            // the last user removes it.
+            shm.attach();
+            shm.detach();
+        }
+        if (!shm.create(sizeof(KfBridgeShmBlock))) {
+            if (error) { *error = shm.errorString(); }
+            return false;
+        }
+    }
+
+    block = new (shm.data()) KfBridgeShmBlock();
+    block->sampleRate = sampleRate;
+    return true;
+}
+
+QString KfBridgeShmHost::key() const
+{
+    return shm.key();
+}
+
+int KfBridgeShmHost::stalls() const
+{
+    return mStalls;
+}
+
+void KfBridgeShmHost::midiEvent(const KonfytMidiEvent &ev, jack_nframes_t time)
+{
+    // The last slot is kept for the all notes off, see startProcess()
+    if (eventCount >= KONFYT_BRIDGE_SHM_MAX_EVENTS - 1) {
+        eventsDropped = true;
+        return;
+    }
+
+    events[eventCount].ev = ev;
+    events[eventCount].time = time;
+    eventCount++;
+}
+
+/* Post the events received in the previous cycle to the worker, which renders
+ * them while the other plugins are processed. */
+void KfBridgeShmHost::startProcess(jack_nframes_t nframes, jack_time_t deadline)
+{
+    posted = false;
+    mDeadline = deadline;
+
+    if (!block) { return; }
+    if (nframes > KONFYT_BRIDGE_SHM_MAX_FRAMES) { return; }
+
+    uint32_t cycle = block->request.load(std::memory_order_relaxed);
+    if (block->done.load(std::memory_order_acquire) != cycle) {
+        // Worker has not caught up yet or is not running. Keep the events
+        // until it has, so notes are not left hanging.
+        return;
+    }
+
+    if (eventsDropped) {
+        KonfytMidiEvent ev;
+        ev.setCC(MIDI_CC_ALL_NOTES_OFF, 0);
+        events[eventCount].ev = ev;
+        events[eventCount].time = eventCount ? events[eventCount-1].time : 0;
+        eventCount++;
+        eventsDropped = false;
+    }
+
+    block->nframes = nframes;
+    block->eventCount = eventCount;
+    for (uint32_t i=0; i < eventCount; i++) {
+        block->events[i].ev = events[i].ev;
+        // Held events may be from a cycle with a larger buffer size
+        block->events[i].time = qMin(events[i].time, nframes - 1);
+    }
+    eventCount = 0;
+
+    cycle++;
+    block->request.store(cycle, std::memory_order_release);
+    futexWake(&block->request);
+    posted = true;
+}
+
+/* Wait for the worker to render the cycle posted in startProcess(). */
+void KfBridgeShmHost::process(float *left, float *right, jack_nframes_t nframes)
+{
+    memset(left, 0, sizeof(float) * nframes);
+    memset(right, 0, sizeof(float) * nframes);
+
+    if (!posted) { return; }
+    posted = false;
+
+    uint32_t cycle = block->request.load(std::memory_order_relaxed);
+    qint64 timeoutNs = ((qint64)mDeadline - (qint64)jack_get_time()) * 1000;
+    if (!futexWaitFor(&block->done, cycle, timeoutNs)) {
+        mStalls++;
+        return;
+    }
+
+    memcpy(left, block->left, sizeof(float) * nframes);
+    memcpy(right, block->right, sizeof(float) * nframes);
+}
+
+KfBridgeShmRenderer::~KfBridgeShmRenderer()
+{
+    stop();
+}
+
+bool KfBridgeShmRenderer::attach(QString key, QString *error)
+{
+    if (block) {
+        if (shm.key() == key) { return true; }
+        if (error) { *error = "Already attached to " + shm.key(); }
+        return false;
+    }
+
+    shm.setKey(key);
+    if (!shm.attach()) {
+        if (error) { *error = shm.errorString(); }
+        return false;
+    }
+    if (shm.size() < (int)sizeof(KfBridgeShmBlock)) {
+        if (error) { *error = "Shared memory too small: " + key; }
+        shm.detach();
+        return false;
+    }
+
+    block = static_cast<KfBridgeShmBlock*>(shm.data());
+    // Ignore a cycle the host posted before we were running
+    block->done.store(block->request.load(std::memory_order_acquire),
+                      std::memory_order_release);
+    return true;
+}
+
+double KfBridgeShmRenderer::sampleRate() const
+{
+    return block ? block->sampleRate : 0;
+}
+
+void KfBridgeShmRenderer::setPlugin(KfJackInternalPlugin *plugin)
+{
+    mPlugin.store(plugin, std::memory_order_release);
+}
+
+void KfBridgeShmRenderer::stop()
+{
+    quit = true;
+    wait();
+}
+
+void KfBridgeShmRenderer::run()
+{
+    if (!block) { return; }
+
+    // Render with realtime priority like a JACK client would. Without
+    // realtime permissions this fails and we keep the normal priority.
+    struct sched_param param;
+    param.sched_priority = KONFYT_BRIDGE_SHM_RT_PRIORITY;
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+    uint32_t last = block->done.load(std::memory_order_acquire);
+    while (!quit) {
+        uint32_t cycle = block->request.load(std::memory_order_acquire);
+        if (cycle == last) {
+            // Time out regularly to check for quit
+            futexWaitWhile(&block->request, cycle, 100000000);
+            continue;
+        }
+
+        jack_nframes_t nframes = qMin(block->nframes,
+                                      (uint32_t)KONFYT_BRIDGE_SHM_MAX_FRAMES);
+        KfJackInternalPlugin* plugin = mPlugin.load(std::memory_order_acquire);
+        if (plugin) {
+            uint32_t count = qMin(block->eventCount,
+                                  (uint32_t)KONFYT_BRIDGE_SHM_MAX_EVENTS);
+            for (uint32_t i=0; i < count; i++) {
+                plugin->midiEvent(block->events[i].ev, block->events[i].time);
+            }
+            plugin->process(block->left, block->right, nframes);
+        } else {
+            memset(block->left, 0, sizeof(float) * nframes);
+            memset(block->right, 0, sizeof(float) * nframes);
+        }
+
+        last = cycle;
+        block->done.store(cycle, std::memory_order_release);
+        futexWake(&block->done);
+    }
+}
@@ -0,0 +1,115 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_BRIDGE_SHM_H
+#define KONFYT_BRIDGE_SHM_H
+
+#include "konfytJackStructs.h"
+#include "konfytMidi.h"
+
+#include <QSharedMemory>
+#include <QThread>
+
+#include <atomic>
+
+#define KONFYT_BRIDGE_SHM_MAX_FRAMES 8192   // Largest JACK buffer size supported
+#define KONFYT_BRIDGE_SHM_MAX_EVENTS 512    // MIDI events per process cycle
+#define KONFYT_BRIDGE_SHM_RT_PRIORITY 60    // Of the worker's render thread
+
+// ----------------------------------------------------
+// Shared memory between Konfyt and a bridge worker process, used instead of
+// JACK ports to transport the MIDI and audio of a bridged SFZ.
+// Each process cycle, the host writes the MIDI events, increments request and
+// wakes the worker with a futex. The worker renders into the audio buffers,
+// sets done to request and wakes the host.
+// ----------------------------------------------------
+struct KfBridgeShmBlock
+{
+    std::atomic<uint32_t> request;  // Cycle posted by the host
+    std::atomic<uint32_t> done;     // Last cycle rendered by the worker
+    double sampleRate;
+    uint32_t nframes;
+    uint32_t eventCount;
+    struct { KonfytMidiEvent ev; uint32_t time; } events[KONFYT_BRIDGE_SHM_MAX_EVENTS];
+    float left[KONFYT_BRIDGE_SHM_MAX_FRAMES];
+    float right[KONFYT_BRIDGE_SHM_MAX_FRAMES];
+};
+
+// ----------------------------------------------------
+// Host side, rendered in our JACK process callback like the other internal
+// plugins. The cycle is posted to the worker in startProcess(), so all workers
+// render in parallel, and they have to finish within half a period of the
+// cycle start. Else the layer is silenced until the worker has caught up, so
+// that a stalled worker process does not cause xruns.
+// ----------------------------------------------------
+class KfBridgeShmHost : public KfJackInternalPlugin
+{
+public:
+    bool create(QString key, double sampleRate, QString* error);
+    QString key() const;
+    int stalls() const; // Cycles silenced because the worker was too late
+
+    // KfJackInternalPlugin interface
+    void midiEvent(const KonfytMidiEvent &ev, jack_nframes_t time) override;
+    void startProcess(jack_nframes_t nframes, jack_time_t deadline) override;
+    void process(float *left, float *right, jack_nframes_t nframes) override;
+
+private:
+    QSharedMemory shm;
+    KfBridgeShmBlock* block = nullptr;
+    std::atomic<int> mStalls{0};
+    bool posted = false;     // Cycle posted in startProcess()
+    jack_time_t mDeadline = 0;
+
+    // Events are held while the worker is stalled. If they don't fit, the
+    // rest is dropped and all notes are ended once the worker has caught up,
+    // as note offs may have been dropped.
+    struct { KonfytMidiEvent ev; uint32_t time; } events[KONFYT_BRIDGE_SHM_MAX_EVENTS];
+    uint32_t eventCount = 0;
+    bool eventsDropped = false;
+};
+
+// ----------------------------------------------------
+// Worker side. Renders the plugin into the shared memory each time the host
+// posts a cycle.
+// ----------------------------------------------------
+class KfBridgeShmRenderer : public QThread
+{
+public:
+    ~KfBridgeShmRenderer();
+
+    bool attach(QString key, QString* error);
+    double sampleRate() const;
+    void setPlugin(KfJackInternalPlugin* plugin);
+    void stop();
+
+protected:
+    void run() override;
+
+private:
+    QSharedMemory shm;
+    KfBridgeShmBlock* block = nullptr;
+    std::atomic<KfJackInternalPlugin*> mPlugin{nullptr};
+    std::atomic<bool> quit{false};
+};
+
+#endif // KONFYT_BRIDGE_SHM_H
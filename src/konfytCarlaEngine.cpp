@@ -22,6 +22,7 @@
 #include "konfytCarlaEngine.h"
 
 #include <iostream>
+#include <string.h>
 
 
 KonfytCarlaEngine::KonfytCarlaEngine(QObject *parent) :
@@ -32,7 +33,26 @@ KonfytCarlaEngine::KonfytCarlaEngine(QObject *parent) :
 
 KonfytCarlaEngine::~KonfytCarlaEngine()
 {
-    CARLA_FUNC_V(carla_engine_close);
+#ifdef KONFYT_CARLA_INPROCESS
+    // Plugins have already been removed from JACK by the patch engine
+    qDeleteAll(racks);
+    racks.clear();
+#endif
+    if (!mInProcess) {
+        CARLA_FUNC_V(carla_engine_close);
+    }
+}
+
+void KonfytCarlaEngine::setInProcess(bool inProcess)
+{
+#ifdef KONFYT_CARLA_INPROCESS
+    mInProcess = inProcess;
+#else
+    if (inProcess) {
+        print("This version of Konfyt was compiled without support for running "
+              "Carla in-process. Using a separate Carla JACK client.");
+    }
+#endif
 }
 
 QString KonfytCarlaEngine::engineName()
@@ -48,6 +68,11 @@ int KonfytCarlaEngine::addSfz(QString path)
     int pluginIdInCarla = pluginList.count();
     pluginData.path = path;
     pluginData.name = "plugin_" + n2s(pluginData.ID) + "_sfz";
+
+#ifdef KONFYT_CARLA_INPROCESS
+    if (mInProcess) { return addSfzInProcess(pluginData); }
+#endif
+
     // Load the plugin
 
     bool returnValue;
@@ -91,9 +116,59 @@ int KonfytCarlaEngine::addSfz(QString path)
     return pluginData.ID;
 }
 
+#ifdef KONFYT_CARLA_INPROCESS
+/* Adds the SFZ in a new rack of its own, so it has its own audio output that is
+ * rendered in our JACK process callback. See internalPlugin().
+ * Returns the unique ID or -1 on error. */
+int KonfytCarlaEngine::addSfzInProcess(KonfytCarlaPluginData pluginData)
+{
+    print("Loading sfz in-process: " + pluginData.path + ", " + pluginData.name);
+
+    KonfytCarlaRack* rack = new KonfytCarlaRack(jack->getBufferSize(),
+                                                jack->getSampleRate(),
+                                                CARLA_RESOURCES_PATH);
+    if (!rack->isValid()) {
+        print("Failed to create Carla rack.");
+        delete rack;
+        return -1;
+    }
+
+    CarlaHostHandle h = rack->hostHandle();
+    bool ok = carla_add_plugin(h, BINARY_NATIVE, PLUGIN_SFZ,
+                               pluginData.path.toLocal8Bit(),
+                               pluginData.name.toLocal8Bit(), "sfz", 0, NULL, 0);
+    if (!ok) {
+        print("Carla failed to load plugin: " + QString(carla_get_last_error(h)));
+        delete rack;
+        return -1;
+    }
+
+    // The plugin is the only one in its rack
+    carla_set_active(h, 0, true);
+    carla_set_option(h, 0, PLUGIN_OPTION_SEND_CONTROL_CHANGES, true);
+    carla_set_option(h, 0, PLUGIN_OPTION_SEND_PITCHBEND, true);
+
+    racks.insert(pluginData.ID, rack);
+    pluginDataMap.insert(pluginData.ID, pluginData);
+    pluginUniqueIDCounter++;
+
+    return pluginData.ID;
+}
+#endif
+
 void KonfytCarlaEngine::removeSfz(int ID)
 {
     KONFYT_ASSERT( pluginDataMap.contains(ID) );
+
+#ifdef KONFYT_CARLA_INPROCESS
+    if (racks.contains(ID)) {
+        // Already removed from JACK by the patch engine
+        delete racks.take(ID);
+        pluginDataMap.remove(ID);
+        return;
+    }
+#endif
+
     KONFYT_ASSERT( pluginList.contains(ID) );
 
     pluginDataMap.remove(ID);
@@ -115,10 +190,24 @@ QString KonfytCarlaEngine::pluginName(int ID)
     return pluginDataMap.value(ID).name;
 }
 
+/* Returns the plugin to be rendered in our JACK process callback if running
+ * in-process, otherwise null. */
+KfJackInternalPlugin *KonfytCarlaEngine::internalPlugin(int id)
+{
+#ifdef KONFYT_CARLA_INPROCESS
+    return racks.value(id, nullptr);
+#else
+    Q_UNUSED(id);
+    return nullptr;
+#endif
+}
+
 QString KonfytCarlaEngine::midiInJackPortName(int ID)
 {
     KONFYT_ASSERT( pluginDataMap.contains(ID) );
 
+    if (mInProcess) { return ""; } // No JACK ports
+
     // TODO: This depends on Carla naming the ports as we expect. A better way
     // would be to get the port names from a Carla callback.
 
@@ -130,6 +219,8 @@ QStringList KonfytCarlaEngine::audioOutJackPortNames(int ID)
 {
     KONFYT_ASSERT( pluginDataMap.contains(ID) );
 
+    if (mInProcess) { return {"", ""}; } // No JACK ports
+
     // TODO: This depends on Carla naming the ports as we expect. A better way
     // would be to get the port names from a Carla callback.
 
@@ -146,10 +237,18 @@ QStringList KonfytCarlaEngine::audioOutJackPortNames(int ID)
 void KonfytCarlaEngine::initEngine(KonfytJackEngine* jackEngine)
 {
     jack = jackEngine;
-    mJackClientName = jack->clientName() + CARLA_CLIENT_POSTFIX;
 
     print("Carla version " + QString(CARLA_VERSION_STRING));
 
+    if (mInProcess) {
+        // A rack engine is created for each plugin when added
+        print("Running Carla in-process.");
+        emit initDone("");
+        return;
+    }
+
+    mJackClientName = jack->clientName() + CARLA_CLIENT_POSTFIX;
+
     // Initialise Carla Backend
 #ifdef CARLA_USE_HANDLE
     carlaHandle = carla_standalone_host_init();
@@ -160,7 +259,7 @@ void KonfytCarlaEngine::initEngine(KonfytJackEngine* jackEngine)
     // Default unset.
     // Must be set for some internal plugins to work
     CARLA_FUNC(carla_set_engine_option, ENGINE_OPTION_PATH_RESOURCES, 0,
-               "/usr/lib/lv2/carla.lv2/resources/");
+               CARLA_RESOURCES_PATH.toLocal8Bit().constData());
     // Set the engine callback
     //carla_set_engine_callback(KonfytCarlaEngine::carlaEngineCallback, this);
     // TODO: Handle the case where this name is already taken.
@@ -184,6 +283,14 @@ QString KonfytCarlaEngine::jackClientName()
 void KonfytCarlaEngine::setGain(int ID, float newGain)
 {
     KONFYT_ASSERT( pluginDataMap.contains(ID) );
+
+#ifdef KONFYT_CARLA_INPROCESS
+    if (racks.contains(ID)) {
+        carla_set_volume(racks.value(ID)->hostHandle(), 0, newGain);
+        return;
+    }
+#endif
+
     KONFYT_ASSERT( pluginList.contains(ID) );
 
     int pluginIdInCarla = pluginList.indexOf(ID);
@@ -191,3 +298,172 @@ void KonfytCarlaEngine::setGain(int ID, float newGain)
     CARLA_FUNC(carla_set_volume, pluginIdInCarla, newGain);
 }
 
+#ifdef KONFYT_CARLA_INPROCESS
+
+KonfytCarlaRack::KonfytCarlaRack(uint32_t bufferSize, double sampleRate,
+                                 QString resourcesPath) :
+    mBufferSize(bufferSize),
+    mSampleRate(sampleRate),
+    mResourcesPath(resourcesPath.toLocal8Bit())
+{
+    memset(&timeInfo, 0, sizeof(timeInfo));
+    silence = (float*)calloc(mBufferSize, sizeof(float));
+
+    memset(&host, 0, sizeof(host));
+    host.handle = this;
+    host.resourceDir = mResourcesPath.constData();
+    host.uiName = "Konfyt";
+    host.get_buffer_size = hostGetBufferSize;
+    host.get_sample_rate = hostGetSampleRate;
+    host.is_offline = hostIsOffline;
+    host.get_time_info = hostGetTimeInfo;
+    host.write_midi_event = hostWriteMidiEvent;
+    host.ui_parameter_changed = hostUiParameterChanged;
+    host.ui_midi_program_changed = hostUiMidiProgramChanged;
+    host.ui_custom_data_changed = hostUiCustomDataChanged;
+    host.ui_closed = hostUiClosed;
+    host.ui_open_file = hostUiFile;
+    host.ui_save_file = hostUiFile;
+    host.dispatcher = hostDispatcher;
+
+    descriptor = carla_get_native_rack_plugin();
+    if (!descriptor) { return; }
+    plugin = descriptor->instantiate(&host);
+    if (!plugin) { return; }
+    carlaHandle = carla_create_native_plugin_host_handle(descriptor, plugin);
+    if (descriptor->activate) { descriptor->activate(plugin); }
+}
+
+KonfytCarlaRack::~KonfytCarlaRack()
+{
+    if (plugin) {
+        if (descriptor->deactivate) { descriptor->deactivate(plugin); }
+        if (carlaHandle) { carla_host_handle_free(carlaHandle); }
+        descriptor->cleanup(plugin);
+    }
+    free(silence);
+}
+
+bool KonfytCarlaRack::isValid() const
+{
+    return (plugin != nullptr) && (carlaHandle != nullptr) && (silence != nullptr);
+}
+
+CarlaHostHandle KonfytCarlaRack::hostHandle() const
+{
+    return carlaHandle;
+}
+
+void KonfytCarlaRack::midiEvent(const KonfytMidiEvent &ev, jack_nframes_t time)
+{
+    unsigned char buffer[3];
+    if (ev.bankMSB >= 0) {
+        ev.msbToBuffer(buffer);
+        addEvent(time, buffer, 3);
+    }
+    if (ev.bankLSB >= 0) {
+        ev.lsbToBuffer(buffer);
+        addEvent(time, buffer, 3);
+    }
+
+    // Native MIDI events hold at most four bytes, i.e. no sysex
+    unsigned char data[4];
+    int size = ev.bufferSizeRequired();
+    if (size > 4) { return; }
+    ev.toBuffer(data);
+    addEvent(time, data, size);
+}
+
+/* Insert event sorted by time, after events with the same time. */
+void KonfytCarlaRack::addEvent(jack_nframes_t time, const unsigned char *data, int size)
+{
+    if (eventCount >= MAX_EVENTS) { return; }
+
+    uint32_t i = eventCount;
+    while ( (i > 0) && (events[i-1].time > time) ) {
+        events[i] = events[i-1];
+        i--;
+    }
+    NativeMidiEvent* e = &events[i];
+    e->time = time;
+    e->port = 0;
+    e->size = size;
+    memcpy(e->data, data, size);
+    eventCount++;
+}
+
+void KonfytCarlaRack::process(float *left, float *right, jack_nframes_t nframes)
+{
+    if (nframes > mBufferSize) { nframes = mBufferSize; }
+
+    const float* in[2] = {silence, silence};
+    float* out[2] = {left, right};
+    descriptor->process(plugin, in, out, nframes, events, eventCount);
+    eventCount = 0;
+}
+
+uint32_t KonfytCarlaRack::hostGetBufferSize(NativeHostHandle handle)
+{
+    return static_cast<KonfytCarlaRack*>(handle)->mBufferSize;
+}
+
+double KonfytCarlaRack::hostGetSampleRate(NativeHostHandle handle)
+{
+    return static_cast<KonfytCarlaRack*>(handle)->mSampleRate;
+}
+
+bool KonfytCarlaRack::hostIsOffline(NativeHostHandle /*handle*/)
+{
+    return false;
+}
+
+const NativeTimeInfo *KonfytCarlaRack::hostGetTimeInfo(NativeHostHandle handle)
+{
+    return &(static_cast<KonfytCarlaRack*>(handle)->timeInfo);
+}
+
+bool KonfytCarlaRack::hostWriteMidiEvent(NativeHostHandle /*handle*/,
+                                         const NativeMidiEvent* /*event*/)
+{
+    // MIDI output of plugins is not used
+    return false;
+}
+
+void KonfytCarlaRack::hostUiParameterChanged(NativeHostHandle /*handle*/,
+                                             uint32_t /*index*/, float /*value*/)
+{
+}
+
+void KonfytCarlaRack::hostUiMidiProgramChanged(NativeHostHandle /*handle*/,
+                                               uint8_t /*channel*/,
+                                               uint32_t /*bank*/,
+                                               uint32_t /*program*/)
+{
+}
+
+void KonfytCarlaRack::hostUiCustomDataChanged(NativeHostHandle /*handle*/,
+                                              const char* /*key*/,
+                                              const char* /*value*/)
+{
+}
+
+void KonfytCarlaRack::hostUiClosed(NativeHostHandle /*handle*/)
+{
+}
+
+const char *KonfytCarlaRack::hostUiFile(NativeHostHandle /*handle*/,
+                                        bool /*isDir*/, const char* /*title*/,
+                                        const char* /*filter*/)
+{
+    return nullptr;
+}
+
+intptr_t KonfytCarlaRack::hostDispatcher(NativeHostHandle /*handle*/,
+                                         NativeHostDispatcherOpcode /*opcode*/,
+                                         int32_t /*index*/, intptr_t /*value*/,
+                                         void* /*ptr*/, float /*opt*/)
+{
+    return 0;
+}
+
+#endif // KONFYT_CARLA_INPROCESS
@@ -41,6 +41,66 @@ CARLA_BACKEND_USE_NAMESPACE
 #define CARLA_FUNC_V(x) x()
 #endif
 
+// Running Carla in our own process callback requires the host handle API
+#if defined(KONFYT_CARLA_INPROCESS) && !defined(CARLA_USE_HANDLE)
+#undef KONFYT_CARLA_INPROCESS
+#endif
+
+#ifdef KONFYT_CARLA_INPROCESS
+#include <carla/CarlaNativePlugin.h>
+
+/* Carla rack engine hosting a single plugin, which is run as a native plugin
+ * inside our JACK process callback instead of as a separate JACK client. */
+class KonfytCarlaRack : public KfJackInternalPlugin
+{
+public:
+    KonfytCarlaRack(uint32_t bufferSize, double sampleRate, QString resourcesPath);
+    ~KonfytCarlaRack();
+
+    bool isValid() const;
+    CarlaHostHandle hostHandle() const;
+
+    // KfJackInternalPlugin interface
+    void midiEvent(const KonfytMidiEvent &ev, jack_nframes_t time) override;
+    void process(float *left, float *right, jack_nframes_t nframes) override;
+
+private:
+    const NativePluginDescriptor* descriptor = nullptr;
+    NativePluginHandle plugin = nullptr;
+    CarlaHostHandle carlaHandle = nullptr;
+    NativeHostDescriptor host;
+    NativeTimeInfo timeInfo;
+    uint32_t mBufferSize;
+    double mSampleRate;
+    QByteArray mResourcesPath;
+    float* silence = nullptr; // Rack audio input
+
+    // Events received in a cycle, sorted by time and rendered in the next
+    static const uint32_t MAX_EVENTS = 512;
+    NativeMidiEvent events[MAX_EVENTS];
+    uint32_t eventCount = 0;
+    void addEvent(jack_nframes_t time, const unsigned char* data, int size);
+
+    // Native host callbacks
+    static uint32_t hostGetBufferSize(NativeHostHandle handle);
+    static double hostGetSampleRate(NativeHostHandle handle);
+    static bool hostIsOffline(NativeHostHandle handle);
+    static const NativeTimeInfo* hostGetTimeInfo(NativeHostHandle handle);
+    static bool hostWriteMidiEvent(NativeHostHandle handle, const NativeMidiEvent* event);
+    static void hostUiParameterChanged(NativeHostHandle handle, uint32_t index, float value);
+    static void hostUiMidiProgramChanged(NativeHostHandle handle, uint8_t channel,
+                                         uint32_t bank, uint32_t program);
+    static void hostUiCustomDataChanged(NativeHostHandle handle, const char* key,
+                                        const char* value);
+    static void hostUiClosed(NativeHostHandle handle);
+    static const char* hostUiFile(NativeHostHandle handle, bool isDir,
+                                  const char* title, const char* filter);
+    static intptr_t hostDispatcher(NativeHostHandle handle,
+                                   NativeHostDispatcherOpcode opcode, int32_t index,
+                                   intptr_t value, void* ptr, float opt);
+};
+#endif
+
 class KonfytCarlaEngine : public KonfytBaseSoundEngine
 {
     Q_OBJECT
@@ -66,10 +126,20 @@ public:
     void removeSfz(int id);
     void setGain(int ID, float newGain);
     QString pluginName(int ID);
+    KfJackInternalPlugin* internalPlugin(int id);
+
+    // Run plugins in our own JACK process callback instead of in a separate
+    // Carla JACK client. Must be set before initEngine().
+    void setInProcess(bool inProcess);
 
 private:
 #ifdef CARLA_USE_HANDLE
-    CarlaHostHandle carlaHandle;
+    CarlaHostHandle carlaHandle = nullptr;
+#endif
+    bool mInProcess = false;
+#ifdef KONFYT_CARLA_INPROCESS
+    QMap<int, KonfytCarlaRack*> racks; // In-process plugins by ID
+    int addSfzInProcess(KonfytCarlaPluginData pluginData);
 #endif
     int pluginUniqueIDCounter = 10;
     QString mJackClientName;
@@ -78,6 +148,7 @@ private:
     QList<int> pluginList; // List with indexes matching id's in Carla engine, i.e. maps this class' unique IDs to pluginIds in Carla engine.
 
     const QString CARLA_CLIENT_POSTFIX = "_plugins";
+    const QString CARLA_RESOURCES_PATH = "/usr/lib/lv2/carla.lv2/resources/";
     const QString CARLA_MIDI_IN_PORT_POSTFIX = "events-in";
     const QString CARLA_OUT_LEFT_PORT_POSTFIX = "out-left";
     const QString CARLA_OUT_RIGHT_PORT_POSTFIX = "out-right";
@@ -21,6 +21,13 @@
 
 #include "konfytDatabase.h"
 
+#include <QCryptographicHash>
+#include <QSet>
+#include <QTimer>
+
+#include <algorithm>
+#include <sys/stat.h>
+
 
 // ============================================================================
 // KonfytDatabaseWorker
@@ -31,16 +38,31 @@ KonfytDatabaseWorker::KonfytDatabaseWorker()
     connect(this, &KonfytDatabaseWorker::scan,
             this, &KonfytDatabaseWorker::doScan,
             Qt::QueuedConnection);
+    connect(this, &KonfytDatabaseWorker::updatePaths,
+            this, &KonfytDatabaseWorker::doUpdatePaths,
+            Qt::QueuedConnection);
     connect(this, &KonfytDatabaseWorker::requestSfontFromFile,
             this, &KonfytDatabaseWorker::doRequestSfontFromFile,
             Qt::QueuedConnection);
 }
 
-void KonfytDatabaseWorker::setSfontIgnoreList(QList<KfSoundPtr> sfonts)
+void KonfytDatabaseWorker::setKnownSounds(QList<KonfytDbEntry> entries)
 {
-    sfontIgnoreList.clear();
-    foreach (KfSoundPtr sf, sfonts) {
-        sfontIgnoreList.append(sf->filename);
+    knownSounds.clear();
+    knownByFileKey.clear();
+    foreach (const KonfytDbEntry &entry, entries) {
+        knownSounds.insert(entry.filename(), entry);
+        if (entry.fileInode()) {
+            knownByFileKey.insert(FileKey(entry.fileInode(), entry.fileSize()), entry);
+        }
+    }
+}
+
+void KonfytDatabaseWorker::setQuarantine(QList<KfSoundPtr> files)
+{
+    knownQuarantine.clear();
+    foreach (KfSoundPtr file, files) {
+        knownQuarantine.insert(file->filename, file);
     }
 }
 
@@ -58,22 +80,313 @@ KfSoundPtr KonfytDatabaseWorker::patchFromFile(QString filename)
             preset.name = layer->name();
             ret->presets.append(preset);
         }
+        readFileIdentity(ret);
+    }
+
+    return ret;
+}
+
+/* Creates an SFZ/GIG entry, with info on its regions and samples. The entry is
+ * created even if the info can't be read. */
+KfSoundPtr KonfytDatabaseWorker::sfzFromFile(QString filename)
+{
+    KfSoundPtr ret(new KonfytSound(KfSoundTypeSfz));
+    ret->filename = filename;
+    ret->name = QFileInfo(filename).fileName();
+    readFileIdentity(ret);
+    QString error;
+    if (!KonfytSfzReader::readInfo(ret.data(), &error)) {
+        emit print("Could not read info of " + filename + ": " + error);
+    }
+    ret->infoRead = true;
+    return ret;
+}
+
+/* Type of sound based on the file suffix and in which library directory it is.
+ * Returns KfSoundTypeUndefined if the file does not belong in the library. */
+KonfytSoundType KonfytDatabaseWorker::soundTypeOfFile(QString path)
+{
+    QString suffix = QFileInfo(path).suffix().toLower();
+    auto inDir = [path](QString dir) {
+        return !dir.isEmpty() && path.startsWith(QDir::cleanPath(dir) + "/");
+    };
+    if (sfontSuffixes.contains(suffix) && inDir(sfontDir)) {
+        return KfSoundTypeSoundfont;
+    } else if (sfzSuffixes.contains(suffix) && inDir(sfzDir)) {
+        return KfSoundTypeSfz;
+    } else if (patchSuffixes.contains(suffix) && inDir(patchDir)) {
+        return KfSoundTypePatch;
+    }
+    return KfSoundTypeUndefined;
+}
+
+/* Set the size, modification time, inode and content fingerprint of the
+ * sound's file. */
+void KonfytDatabaseWorker::readFileIdentity(KfSoundPtr sound)
+{
+    struct stat st;
+    if (stat(sound->filename.toLocal8Bit().constData(), &st) == 0) {
+        sound->fileSize = st.st_size;
+        sound->fileModified = qint64(st.st_mtim.tv_sec) * 1000
+                              + st.st_mtim.tv_nsec / 1000000;
+        sound->fileInode = st.st_ino;
     }
+    sound->fileFingerprint = fileFingerprint(sound->filename);
+}
+
+/* Hash of the size and the start and end of the file. This is used to tell
+ * whether a file has changed when its modification time or inode has changed,
+ * without reading the whole file. */
+QByteArray KonfytDatabaseWorker::fileFingerprint(QString filename)
+{
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) { return QByteArray(); }
+
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(QByteArray::number(file.size()));
+    hash.addData(file.read(KONFYT_DB_FINGERPRINT_BLOCK));
+    if (file.size() > KONFYT_DB_FINGERPRINT_BLOCK) {
+        file.seek(qMax<qint64>(KONFYT_DB_FINGERPRINT_BLOCK,
+                               file.size() - KONFYT_DB_FINGERPRINT_BLOCK));
+        hash.addData(file.read(KONFYT_DB_FINGERPRINT_BLOCK));
+    }
+    return hash.result().toHex();
+}
+
+/* Returns the known entry if the file has not changed since it was scanned,
+ * otherwise null. If the file was touched or copied back but its content
+ * fingerprint is the same, a copy of the entry with the new file identity is
+ * returned. */
+KonfytDbEntry KonfytDatabaseWorker::unchangedEntry(QString path, KonfytDbEntry known)
+{
+    KonfytDbEntry ret;
+    if (known.isNull()) { return ret; }
+
+    struct stat st;
+    if (stat(path.toLocal8Bit().constData(), &st) != 0) { return ret; }
+    if (st.st_size != known.fileSize()) { return ret; }
 
+    qint64 modified = qint64(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+    if ( (modified == known.fileModified()) && (st.st_ino == known.fileInode()) ) {
+        return known;
+    }
+
+    QByteArray fingerprint = known.fileFingerprint();
+    if (fingerprint.isEmpty()) { return ret; }
+    if (fileFingerprint(path) != fingerprint) { return ret; }
+
+    KfSoundPtr sound(new KonfytSound(*known.sound()));
+    sound->fileModified = modified;
+    sound->fileInode = st.st_ino;
+    return KonfytDbEntry(sound);
+}
+
+/* Returns the known entry of the specified type if the file has not changed,
+ * otherwise null. Counts the file as unchanged, changed or added. */
+KonfytDbEntry KonfytDatabaseWorker::knownUnchanged(QString path, KonfytSoundType type)
+{
+    KonfytDbEntry known = knownSounds.value(path);
+    if (known.type() != type) { known = KonfytDbEntry(); }
+
+    KonfytDbEntry ret = unchangedEntry(path, known);
+    if (ret.isNull() && known.isNull()) {
+        ret = movedEntry(path, type);
+        if (!ret.isNull()) {
+            scanMoved++;
+            return ret;
+        }
+    }
+    if (!ret.isNull()) {
+        scanUnchanged++;
+    } else if (!known.isNull()) {
+        scanChanged++;
+        emit print("Changed: " + path);
+    } else {
+        scanAdded++;
+    }
     return ret;
 }
 
+/* Returns a copy of a known entry for a new path if the file was moved there,
+ * i.e. a file of the same type with the same inode, size and content
+ * fingerprint is known at a path that no longer exists. Otherwise null. */
+KonfytDbEntry KonfytDatabaseWorker::movedEntry(QString path, KonfytSoundType type)
+{
+    KonfytDbEntry ret;
+
+    struct stat st;
+    if (stat(path.toLocal8Bit().constData(), &st) != 0) { return ret; }
+    KonfytDbEntry known = knownByFileKey.value(FileKey(st.st_ino, st.st_size));
+    if (known.isNull() || (known.type() != type)) { return ret; }
+    QByteArray fingerprint = known.fileFingerprint();
+    if (fingerprint.isEmpty()) { return ret; }
+    if (QFileInfo::exists(known.filename())) { return ret; } // Copied, not moved
+    if (fileFingerprint(path) != fingerprint) { return ret; }
+
+    KfSoundPtr sound(new KonfytSound(*known.sound()));
+    sound->filename = path;
+    if (type != KfSoundTypePatch) {
+        // Patch names are read from the file, others are the file name
+        sound->name = QFileInfo(path).fileName();
+    }
+    sound->fileModified = qint64(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+    movedFrom.insert(known.filename());
+    emit print("Moved: " + known.filename() + " to " + path);
+    return KonfytDbEntry(sound);
+}
+
+/* Adds known files of the specified type that were not found in the scan to
+ * the removed list. */
+void KonfytDatabaseWorker::findRemoved(const QStringList &paths,
+                                       KonfytSoundType type, QStringList *removed)
+{
+    QSet<QString> found;
+    found.reserve(paths.count());
+    foreach (const QString& path, paths) {
+        found.insert(path);
+    }
+    foreach (const KonfytDbEntry &known, knownSounds) {
+        if (known.type() != type) { continue; }
+        if (found.contains(known.filename())) { continue; }
+        removed->append(known.filename());
+        if (movedFrom.contains(known.filename())) { continue; }
+        scanRemoved++;
+        emit print("Removed: " + known.filename());
+    }
+}
+
+void KonfytDatabaseWorker::printScanChanges()
+{
+    emit print(QString("Scan: %1 added, %2 changed, %3 moved, %4 removed, "
+                       "%5 unchanged, %6 quarantined.")
+               .arg(scanAdded).arg(scanChanged).arg(scanMoved).arg(scanRemoved)
+               .arg(scanUnchanged).arg(scanQuarantined));
+}
+
 /* Scan specified directories for soundfonts, SFZs and patches.
- * To get info on soundfonts, they have to be loaded into Fluidsynth.
- * To save time, soundfonts in the specified ignoreList will not be loaded into
- * Fluidsynth. */
+ * Soundfont info is read directly from the files. Only soundfonts that can't be
+ * read this way are loaded into Fluidsynth, in the remote scanner process.
+ * To save time, files that haven't changed since the known entries were
+ * scanned are not parsed again, and quarantined soundfonts that haven't
+ * changed are not retried. */
 void KonfytDatabaseWorker::doScan()
 {
+    scanAdded = 0;
+    scanChanged = 0;
+    scanRemoved = 0;
+    scanUnchanged = 0;
+    scanMoved = 0;
+    scanQuarantined = 0;
+    movedFrom.clear();
+
     scanSfzs();
     scanPatches();
     scanSfonts();
 
-    // Create remote scanner and scan all soundfonts discovered by scanSfonts().
+    // Load soundfonts that could not be read by scanSfonts().
+    loadSfontsRemotely(sfontsToLoad, [=]()
+    {
+        printScanChanges();
+        emit scanFinished();
+    });
+}
+
+/* Update the entries of changed paths (e.g. reported by the library watcher)
+ * without scanning the whole library. A path may be a file or directory, and
+ * entries of paths that no longer exist are removed. The files are compared
+ * with the known entries, and only new and changed files are parsed, so a
+ * directory that is reported as a whole is cheap to update. */
+void KonfytDatabaseWorker::doUpdatePaths(QStringList paths)
+{
+    movedFrom.clear();
+
+    QStringList files;
+    foreach (QString path, paths) {
+        QFileInfo fi(path);
+        if (!fi.exists()) {
+            emit pathRemoved(path);
+        } else if (fi.isDir()) {
+            QSet<QString> found;
+            scanDirForFiles(path, sfontSuffixes + sfzSuffixes + patchSuffixes,
+                            [&](QString file)
+            {
+                found.insert(file);
+                files.append(file);
+            });
+            // Files removed from the directory
+            QString prefix = QDir::cleanPath(path) + "/";
+            foreach (QString known, knownSounds.keys() + knownQuarantine.keys()) {
+                if (!known.startsWith(prefix)) { continue; }
+                if (found.contains(known)) { continue; }
+                emit pathRemoved(known);
+            }
+        } else {
+            files.append(path);
+        }
+    }
+    files.removeDuplicates();
+
+    QStringList remoteSfonts;
+    foreach (QString path, files) {
+        KonfytSoundType type = soundTypeOfFile(path);
+        if (type == KfSoundTypeUndefined) { continue; }
+
+        // Skip files that haven't changed. Entries of files that were only
+        // touched or moved are updated without parsing the file.
+        if (!unchangedEntry(path, knownQuarantine.value(path)).isNull()) { continue; }
+        KonfytDbEntry known = knownSounds.value(path);
+        if (known.type() != type) { known = KonfytDbEntry(); }
+        KonfytDbEntry unchanged = known.isNull() ? movedEntry(path, type)
+                                                 : unchangedEntry(path, known);
+        if ((type == KfSoundTypeSfz) && !unchanged.infoRead()) {
+            unchanged = KonfytDbEntry();
+        }
+        if (!unchanged.isNull()) {
+            if (unchanged != known) { emit soundScanned(unchanged.sound()); }
+            continue;
+        }
+
+        KfSoundPtr sound;
+        switch (type) {
+        case KfSoundTypeSoundfont:
+            sound = KonfytSoundfontReader::soundfontFromFile(path);
+            if (sound) {
+                readFileIdentity(sound);
+            } else {
+                remoteSfonts.append(path);
+            }
+            break;
+        case KfSoundTypeSfz:
+            sound = sfzFromFile(path);
+            break;
+        case KfSoundTypePatch:
+            sound = patchFromFile(path);
+            if (!sound) { emit print("Failed to load patch " + path); }
+            break;
+        default:
+            break;
+        }
+        if (sound) {
+            emit print("Library updated: " + path);
+            emit soundScanned(sound);
+        }
+    }
+
+    loadSfontsRemotely(remoteSfonts, [=]()
+    {
+        emit updateFinished();
+    });
+}
+
+/* Load soundfonts with Fluidsynth in the remote scanner processes, which
+ * isolates crashes. done is called when finished. */
+void KonfytDatabaseWorker::loadSfontsRemotely(QStringList sfonts,
+                                              std::function<void()> done)
+{
+    if (sfonts.isEmpty()) {
+        done();
+        return;
+    }
 
     RemoteScannerServer* scanner = new RemoteScannerServer();
     connect(scanner, &RemoteScannerServer::print,
@@ -83,123 +396,183 @@ void KonfytDatabaseWorker::doScan()
     connect(scanner, &RemoteScannerServer::finished, this, [=]()
     {
         scanner->deleteLater();
-        emit scanFinished();
+        done();
     });
     connect(scanner, &RemoteScannerServer::newSoundfont, this, [=](KfSoundPtr s)
     {
-        sfontResults.append(s);
+        readFileIdentity(s);
+        emit soundScanned(s);
     });
-    scanner->scan(sfontsToLoad);
+    connect(scanner, &RemoteScannerServer::sfontFailed, this, [=](QString filename)
+    {
+        // Don't retry the file in following scans until it changes
+        KfSoundPtr file(new KonfytSound(KfSoundTypeSoundfont));
+        file->filename = filename;
+        file->name = QFileInfo(filename).fileName();
+        readFileIdentity(file);
+        scanQuarantined++;
+        emit sfontQuarantined(file);
+    });
+    scanner->scan(sfonts);
 }
 
-/* Scans directory and subdirectories recursively and add all files with
- * specified suffixes to the list. */
+/* Scans directory and subdirectories recursively and calls found() for each
+ * file with one of the specified suffixes, as the files are found. */
 void KonfytDatabaseWorker::scanDirForFiles(QString dirname, QStringList suffixes,
-                                           QStringList &list)
+                                           std::function<void(QString)> found)
 {
     if (dirname.length() == 0) { return; }
-    QDir dir(dirname);
-    if (!dir.exists()) {
+    KonfytDirWalker walker(suffixes);
+    if (!walker.walk(dirname, found)) {
         emit print("scanDirForFiles: Dir does not exist.");
-        return;
     }
+}
 
-    // Get list of all subfiles and directories. Then for each:
-    // If a file, add it if it is a soundfont.
-    // If a directory, run this function on it.
-    QFileInfoList fil = dir.entryInfoList();
-    for (int i=0; i<fil.count(); i++) {
-        QFileInfo fi = fil.at(i);
-        if (fi.fileName() == ".") { continue; }
-        if (fi.fileName() == "..") { continue; }
-
-        if (fi.isFile()) {
-            for (int j=0; j<suffixes.count(); j++) {
-                QString suffix = suffixes[j];
-                if (fi.suffix().toLower() == suffix.toLower()) {
-                    // Add to list
-                    list.append(fi.filePath());
-                }
-            }
-        } else if (fi.isDir()) {
-            // Scan the dir
-            scanDirForFiles(fi.filePath(), suffixes, list);
-        }
-    }
+/* Scans directory and subdirectories recursively and add all files with
+ * specified suffixes to the list. */
+void KonfytDatabaseWorker::scanDirForFiles(QString dirname, QStringList suffixes,
+                                           QStringList &list)
+{
+    scanDirForFiles(dirname, suffixes, [&list](QString path)
+    {
+        list.append(path);
+    });
 }
 
-/* Scans sfontDir for soundfont files. All discovered soundfont file names are
- * added to the sfontsToLoad list which will be used by the remote scanner
- * elsewhere to actually extract info from the files.
- * Any files in the ignore list will not be added. */
+/* Scans sfontDir for soundfont files and reads the info of new and changed
+ * ones. Files that can't be read are added to the sfontsToLoad list which will
+ * be used by the remote scanner elsewhere to load them with Fluidsynth. */
 void KonfytDatabaseWorker::scanSfonts()
 {
-    QStringList sfontSuffix = {"sf2", "sf3"};
-    sfontResults.clear();
     sfontsToLoad.clear();
+    removedSfonts.clear();
 
     emit scanStatus("Scanning for soundfonts in " + sfontDir);
     QStringList sfontPaths;
-    scanDirForFiles(sfontDir, sfontSuffix, sfontPaths);
 
-    emit scanStatus("Loading new soundfonts...");
-    // Load each soundfont that is not in the ignore list.
-    foreach (QString path, sfontPaths) {
-        if (!sfontIgnoreList.contains(path)) {
+    // Read each soundfont that is new or has changed as it is found. Only the
+    // preset data is read from the file. Soundfonts that can't be read this
+    // way are loaded with the remote scanner, which isolates Fluidsynth crashes.
+    scanDirForFiles(sfontDir, sfontSuffixes, [&](QString path)
+    {
+        sfontPaths.append(path);
+
+        KonfytDbEntry quarantined = unchangedEntry(path, knownQuarantine.value(path));
+        if (!quarantined.isNull()) {
+            scanQuarantined++;
+            emit sfontQuarantined(quarantined.sound());
+            return;
+        }
+
+        KonfytDbEntry known = knownUnchanged(path, KfSoundTypeSoundfont);
+        if (!known.isNull()) {
+            if (known != knownSounds.value(path)) {
+                // Entry updated with new file identity
+                emit soundScanned(known.sound());
+            }
+            return;
+        }
+
+        emit scanStatus("Reading soundfont " + path);
+        QString error;
+        KfSoundPtr sf = KonfytSoundfontReader::soundfontFromFile(path, &error);
+        if (sf) {
+            readFileIdentity(sf);
+            emit soundScanned(sf);
+        } else {
+            emit print("Could not read soundfont " + path + ": " + error
+                       + " Loading with Fluidsynth instead.");
             sfontsToLoad.append(path);
         }
-    }
+    });
+
+    findRemoved(sfontPaths, KfSoundTypeSoundfont, &removedSfonts);
 }
 
 void KonfytDatabaseWorker::scanSfzs()
 {
-    QStringList sfzSuffix = {"sfz", "gig"};
     sfzResults.clear();
 
     emit scanStatus("Scanning for SFZs in " + sfzDir);
     QStringList sfzPaths;
-    scanDirForFiles(sfzDir, sfzSuffix, sfzPaths);
-
-    foreach (QString path, sfzPaths) {
-        KfSoundPtr sfz = KfSoundPtr(new KonfytSound(KfSoundTypeSfz));
-        sfz->filename = path;
-        sfz->name = QFileInfo(sfz->filename).fileName();
+    scanDirForFiles(sfzDir, sfzSuffixes, [&](QString path)
+    {
+        sfzPaths.append(path);
+        KonfytDbEntry sfz = knownUnchanged(path, KfSoundTypeSfz);
+        // Also read entries from before region and sample info was kept
+        if (!sfz.infoRead()) { sfz = KonfytDbEntry(sfzFromFile(path)); }
         sfzResults.append(sfz);
-    }
+    });
+    QStringList removed;
+    findRemoved(sfzPaths, KfSoundTypeSfz, &removed);
 }
 
 void KonfytDatabaseWorker::scanPatches()
 {
-    QStringList patchSuffix = {KONFYT_PATCH_SUFFIX};
-
     emit scanStatus("Scanning for patches in " + patchDir);
     QStringList patchPaths;
-    scanDirForFiles(patchDir, patchSuffix, patchPaths);
+    patchResults.clear();
 
-    // For each patch, load it to extract its data
-    foreach (QString path, patchPaths) {
+    // For each new or changed patch, load it to extract its data
+    scanDirForFiles(patchDir, patchSuffixes, [&](QString path)
+    {
+        patchPaths.append(path);
+        KonfytDbEntry known = knownUnchanged(path, KfSoundTypePatch);
+        if (!known.isNull()) {
+            patchResults.append(known);
+            return;
+        }
         emit scanStatus("Loading patch " + path);
         KfSoundPtr patch = patchFromFile(path);
         if (patch) {
-            patchResults.append(patch);
+            patchResults.append(KonfytDbEntry(patch));
         } else {
             emit print("Failed to load patch " + path);
         }
-    }
+    });
+
+    QStringList removed;
+    findRemoved(patchPaths, KfSoundTypePatch, &removed);
 }
 
-/* Slot to create a konfytSoundfont object from a filename by loading it into
- * Fluidsynth in order to extract soundfont info, returning it with a signal so
- * the rest of the application can continue during this potentially long
- * operation. */
+/* Slot to create a konfytSoundfont object from a filename by reading the
+ * soundfont info from the file (or loading it into Fluidsynth if that fails),
+ * returning it with a signal so the rest of the application can continue
+ * during this potentially long operation. */
 void KonfytDatabaseWorker::doRequestSfontFromFile(QString filename)
 {
-    KfSoundPtr newSfont = fluidsynth.soundfontFromFile(filename);
+    KfSoundPtr newSfont = KonfytSoundfontReader::soundfontFromFile(filename);
+    if (!newSfont) {
+        newSfont = fluidsynth.soundfontFromFile(filename);
+    }
     emit sfontFromFileFinished(newSfont);
 }
 
 
 
+// ============================================================================
+// KonfytSearchWorker
+// ============================================================================
+
+void KonfytSearchWorker::doBuildIndex(QList<KonfytDbEntry> sfonts,
+                                      QList<KonfytDbEntry> patches,
+                                      QList<KonfytDbEntry> sfzs)
+{
+    index.build(sfonts, patches, sfzs);
+}
+
+void KonfytSearchWorker::doSearch(QString query, int id)
+{
+    auto cancelled = [=]() { return latestSearchId.load() != id; };
+    if (cancelled()) { return; }
+
+    KonfytSearchResults results;
+    results.id = id;
+    if (index.search(query, &results, cancelled)) {
+        emit searchFinished(results);
+    }
+}
+
 // ============================================================================
 // KonfytDatabase
 // ============================================================================
@@ -215,21 +588,54 @@ KonfytDatabase::KonfytDatabase()
     connect(&worker, &KonfytDatabaseWorker::scanFinished,
             this, &KonfytDatabase::onScanFinished);
 
+    connect(&worker, &KonfytDatabaseWorker::soundScanned,
+            this, &KonfytDatabase::onSoundScanned);
+
+    connect(&worker, &KonfytDatabaseWorker::sfontQuarantined,
+            this, &KonfytDatabase::onSfontQuarantined);
+
+    connect(&worker, &KonfytDatabaseWorker::pathRemoved,
+            this, &KonfytDatabase::onPathRemoved);
+
+    connect(&worker, &KonfytDatabaseWorker::updateFinished,
+            this, &KonfytDatabase::onUpdateFinished);
+
+    connect(&watcher, &KonfytLibraryWatcher::print,
+            this, &KonfytDatabase::print);
+
+    connect(&watcher, &KonfytLibraryWatcher::pathsChanged,
+            this, &KonfytDatabase::onLibraryPathsChanged);
+
     qRegisterMetaType<KfSoundPtr>("KfSoundPtr");
     connect(&worker, &KonfytDatabaseWorker::sfontFromFileFinished,
             this, &KonfytDatabase::onSfontInfoLoadedFromFile);
 
     worker.moveToThread(&workerThread);
     workerThread.start();
+
+    qRegisterMetaType<QList<KonfytDbEntry>>("QList<KonfytDbEntry>");
+    qRegisterMetaType<KonfytSearchResults>("KonfytSearchResults");
+    connect(&searchWorker, &KonfytSearchWorker::requestBuildIndex,
+            &searchWorker, &KonfytSearchWorker::doBuildIndex, Qt::QueuedConnection);
+    connect(&searchWorker, &KonfytSearchWorker::requestSearch,
+            &searchWorker, &KonfytSearchWorker::doSearch, Qt::QueuedConnection);
+    connect(&searchWorker, &KonfytSearchWorker::searchFinished,
+            this, &KonfytDatabase::onSearchResults);
+
+    searchWorker.moveToThread(&searchThread);
+    searchThread.start();
 }
 
 KonfytDatabase::~KonfytDatabase()
 {
     workerThread.quit();
     workerThread.wait();
+    searchWorker.latestSearchId.store(-1); // Abandon a search in progress
+    searchThread.quit();
+    searchThread.wait();
 }
 
-QList<KfSoundPtr> KonfytDatabase::allSoundfonts()
+QList<KonfytDbEntry> KonfytDatabase::allSoundfonts()
 {
     return mAllSoundfonts;
 }
@@ -239,7 +645,7 @@ int KonfytDatabase::soundfontCount()
     return mAllSoundfonts.count();
 }
 
-QList<KfSoundPtr> KonfytDatabase::allPatches()
+QList<KonfytDbEntry> KonfytDatabase::allPatches()
 {
     return mAllPatches;
 }
@@ -249,7 +655,7 @@ int KonfytDatabase::patchCount()
     return mAllPatches.count();
 }
 
-QList<KfSoundPtr> KonfytDatabase::allSfzs()
+QList<KonfytDbEntry> KonfytDatabase::allSfzs()
 {
     return mAllSfzs;
 }
@@ -262,16 +668,42 @@ int KonfytDatabase::sfzCount()
 void KonfytDatabase::setSoundfontsDir(QString path)
 {
     mSfontsDir = path;
+    scheduleWatchUpdate();
 }
 
 void KonfytDatabase::setSfzDir(QString path)
 {
     mSfzDir = path;
+    scheduleWatchUpdate();
 }
 
 void KonfytDatabase::setPatchesDir(QString path)
 {
     mPatchesDir = path;
+    scheduleWatchUpdate();
+}
+
+void KonfytDatabase::setWatchEnabled(bool enabled)
+{
+    mWatchEnabled = enabled;
+    scheduleWatchUpdate();
+}
+
+/* Update the watched directories once, after all the directories have been
+ * set. */
+void KonfytDatabase::scheduleWatchUpdate()
+{
+    if (watchUpdateScheduled) { return; }
+    watchUpdateScheduled = true;
+    QTimer::singleShot(0, this, [=]()
+    {
+        watchUpdateScheduled = false;
+        if (mWatchEnabled) {
+            watcher.setDirs({mSfontsDir, mSfzDir, mPatchesDir});
+        } else {
+            watcher.setDirs({});
+        }
+    });
 }
 
 void KonfytDatabase::userMessageFromWorker(QString msg)
@@ -285,18 +717,28 @@ void KonfytDatabase::scanStatusFromWorker(QString msg)
 }
 
 /* Starts scanning directories and returns. Finished signal will be emitted
- * later when done. */
+ * later when done. If the worker is busy with an update, the scan is started
+ * after it. */
 void KonfytDatabase::scan()
+{
+    scanPending = true;
+    startPendingWork();
+}
+
+void KonfytDatabase::startScan()
 {
     emit scanStatus("Starting scan...");
 
     // Signal the worker to start scanning.
-    // We pass the current sfontlist as ignoreList parameter to not reload
-    // soundfonts we already have info on.
+    // We pass the current entries so files that haven't changed are not
+    // parsed again.
     worker.sfontDir = mSfontsDir;
-    worker.setSfontIgnoreList(mAllSoundfonts);
+    worker.setKnownSounds(mAllSoundfonts + mAllSfzs + mAllPatches);
+    worker.setQuarantine(mQuarantine);
     worker.sfzDir = mSfzDir;
     worker.patchDir = mPatchesDir;
+    mQuarantine.clear(); // Filled again by the scan
+    mWorkerBusy = true;
     worker.scan();
     // We now wait for the scanDirsFinished signal from the worker.
     // See the onScanFinished() slot.
@@ -306,26 +748,211 @@ void KonfytDatabase::onScanFinished()
 {
     // The worker has finished scanning
 
-    // Soundfonts
-    foreach (KfSoundPtr sf, worker.sfontResults) {
-        addSfont(sf);
+    // New and changed soundfonts were received as they were scanned
+    foreach (QString filename, worker.removedSfonts) {
+        removedPaths.insert(filename);
     }
+    applyScannedChanges();
     buildSfontTree();
 
     // SFZs
-    foreach (KfSoundPtr sfz, worker.sfzResults) {
-        addSfz(sfz);
-    }
+    mAllSfzs = worker.sfzResults;
+    sortSounds(&mAllSfzs);
     buildSfzTree();
 
     // Patches
-    foreach (KfSoundPtr patch, worker.patchResults) {
-        addPatch(patch);
-    }
+    mAllPatches = worker.patchResults;
+    sortSounds(&mAllPatches);
     buildPatchTree();
 
+    updateEntryIndex();
+
     // Scanning has finished. Emit signal.
+    mWorkerBusy = false;
     emit scanFinished();
+
+    startPendingWork();
+}
+
+/* A file has been scanned by the worker. The changes are collected as they
+ * arrive and applied to the database when the scan or update finishes. */
+void KonfytDatabase::onSoundScanned(KfSoundPtr sound)
+{
+    KONFYT_ASSERT_RETURN(listForType(sound->type));
+
+    scannedSounds.insert(sound->filename, sound);
+    scannedQuarantine.remove(sound->filename);
+}
+
+void KonfytDatabase::onSfontQuarantined(KfSoundPtr file)
+{
+    // Soundfont may have changed and can no longer be loaded
+    scannedQuarantine.insert(file->filename, file);
+    scannedSounds.remove(file->filename);
+}
+
+/* A file or directory has been removed from the library. */
+void KonfytDatabase::onPathRemoved(QString path)
+{
+    removedPaths.insert(path);
+}
+
+/* True if the file or one of its parent directories has been removed. */
+bool KonfytDatabase::isRemovedPath(QString filename)
+{
+    if (removedPaths.isEmpty()) { return false; }
+
+    QString path = filename;
+    while (!path.isEmpty()) {
+        if (removedPaths.contains(path)) { return true; }
+        int i = path.lastIndexOf('/');
+        if (i <= 0) { break; }
+        path.truncate(i);
+    }
+    return false;
+}
+
+/* Apply the entries scanned by the worker and the removed paths to the lists.
+ * Entries that were rescanned are replaced. Returns the types of the lists
+ * that changed. */
+QSet<int> KonfytDatabase::applyScannedChanges()
+{
+    QSet<int> changed;
+
+    auto apply = [&](QList<KonfytDbEntry>* list, const QHash<QString, KfSoundPtr> &scanned,
+                     const QHash<QString, KfSoundPtr> &other)
+    {
+        QList<KonfytDbEntry> kept;
+        kept.reserve(list->count());
+        bool listChanged = false;
+        foreach (const KonfytDbEntry &entry, *list) {
+            QString filename = entry.filename();
+            if (scanned.contains(filename) || other.contains(filename)
+                    || isRemovedPath(filename)) {
+                listChanged = true;
+            } else {
+                kept.append(entry);
+            }
+        }
+        foreach (KfSoundPtr sound, scanned) {
+            if (listForType(sound->type) == list) {
+                kept.append(KonfytDbEntry(sound));
+                listChanged = true;
+            }
+        }
+        if (listChanged) {
+            sortSounds(&kept);
+            *list = kept;
+        }
+        return listChanged;
+    };
+
+    if (apply(&mAllSoundfonts, scannedSounds, scannedQuarantine)) {
+        changed.insert(KfSoundTypeSoundfont);
+    }
+    if (apply(&mAllSfzs, scannedSounds, scannedQuarantine)) {
+        changed.insert(KfSoundTypeSfz);
+    }
+    if (apply(&mAllPatches, scannedSounds, scannedQuarantine)) {
+        changed.insert(KfSoundTypePatch);
+    }
+    // Quarantined files are not shown, so not reported as changed
+    QList<KfSoundPtr> quarantine = mQuarantine;
+    mQuarantine.clear();
+    foreach (KfSoundPtr file, quarantine) {
+        if (scannedQuarantine.contains(file->filename)) { continue; }
+        if (scannedSounds.contains(file->filename)) { continue; }
+        if (isRemovedPath(file->filename)) { continue; }
+        mQuarantine.append(file);
+    }
+    mQuarantine.append(scannedQuarantine.values());
+
+    scannedSounds.clear();
+    scannedQuarantine.clear();
+    removedPaths.clear();
+
+    updateEntryIndex();
+    return changed;
+}
+
+void KonfytDatabase::updateEntryIndex()
+{
+    mEntries.clear();
+    mEntries.reserve(mAllSoundfonts.count() + mAllSfzs.count() + mAllPatches.count());
+    foreach (const KonfytDbEntry &entry, mAllSoundfonts + mAllSfzs + mAllPatches) {
+        mEntries.insert(entry.filename(), entry);
+    }
+}
+
+void KonfytDatabase::onUpdateFinished()
+{
+    // Only rebuild the trees of which entries changed
+    QSet<int> changed = applyScannedChanges();
+    if (changed.contains(KfSoundTypeSoundfont)) { buildSfontTree(); }
+    if (changed.contains(KfSoundTypeSfz)) { buildSfzTree(); }
+    if (changed.contains(KfSoundTypePatch)) { buildPatchTree(); }
+
+    mWorkerBusy = false;
+    if (!changed.isEmpty()) {
+        emit libraryChanged();
+    }
+
+    startPendingWork();
+}
+
+/* Files changed in the library directories. */
+void KonfytDatabase::onLibraryPathsChanged(QStringList paths)
+{
+    pendingUpdatePaths.append(paths);
+    startPendingWork();
+}
+
+/* Start a scan or update that was requested while the worker was busy. A scan
+ * covers the pending updates. */
+void KonfytDatabase::startPendingWork()
+{
+    if (mWorkerBusy) { return; }
+
+    if (scanPending) {
+        scanPending = false;
+        pendingUpdatePaths.clear();
+        startScan();
+        return;
+    }
+
+    if (pendingUpdatePaths.isEmpty()) { return; }
+
+    pendingUpdatePaths.removeDuplicates();
+    worker.sfontDir = mSfontsDir;
+    worker.sfzDir = mSfzDir;
+    worker.patchDir = mPatchesDir;
+    worker.setKnownSounds(mAllSoundfonts + mAllSfzs + mAllPatches);
+    worker.setQuarantine(mQuarantine);
+    mWorkerBusy = true;
+    worker.updatePaths(pendingUpdatePaths);
+    pendingUpdatePaths.clear();
+}
+
+void KonfytDatabase::sortSounds(QList<KonfytDbEntry> *list)
+{
+    std::sort(list->begin(), list->end(), [](const KonfytDbEntry &a, const KonfytDbEntry &b)
+    {
+        return a.filename() < b.filename();
+    });
+}
+
+QList<KonfytDbEntry> *KonfytDatabase::listForType(KonfytSoundType type)
+{
+    switch (type) {
+    case KfSoundTypeSoundfont:
+        return &mAllSoundfonts;
+    case KfSoundTypeSfz:
+        return &mAllSfzs;
+    case KfSoundTypePatch:
+        return &mAllPatches;
+    default:
+        return nullptr;
+    }
 }
 
 void KonfytDatabase::onSfontInfoLoadedFromFile(KfSoundPtr sfont)
@@ -337,68 +964,134 @@ void KonfytDatabase::addPatch(QString filename)
 {
     KfSoundPtr patch = worker.patchFromFile(filename);
     if (patch) {
-        addPatch(patch);
+        addPatch(KonfytDbEntry(patch));
+        mEntries.insert(patch->filename, KonfytDbEntry(patch));
         buildPatchTree();
     }
 }
 
 void KonfytDatabase::removePatch(KfSoundPtr patch)
 {
-    mAllPatches.removeAll(patch);
+    // Sounds of entries may be decoded for each use, so find the entry by
+    // filename.
+    for (int i = mAllPatches.count() - 1; i >= 0; i--) {
+        if (mAllPatches[i].filename() == patch->filename) {
+            mAllPatches.removeAt(i);
+        }
+    }
+    mEntries.remove(patch->filename);
     buildPatchTree();
 }
 
-void KonfytDatabase::addSfont(KfSoundPtr sf)
+/* Returns an estimate of the memory (in bytes) used when the sound with the
+ * specified filename is loaded. The file size recorded in the database is used
+ * if available, otherwise the file is checked directly. */
+qint64 KonfytDatabase::estimatedMemoryUse(KonfytSoundType type, QString filename)
+{
+    if (type == KfSoundTypeSfz) {
+        // The sampler only keeps the start of each sample in memory and
+        // streams the rest from disk. Without info on the samples, use a
+        // fixed estimate.
+        KonfytDbEntry entry = mEntries.value(filename);
+        if (entry.type() != KfSoundTypeSfz) {
+            return KONFYT_DB_SAMPLER_MEMORY_ESTIMATE;
+        }
+        KfSoundPtr sfz = entry.sound();
+        if (sfz->sampleCount == 0) { return KONFYT_DB_SAMPLER_MEMORY_ESTIMATE; }
+        return qMin(sfz->sampleDataSize,
+                    qint64(sfz->sampleCount) * KONFYT_DB_SAMPLER_PRELOAD_SIZE);
+    }
+
+    qint64 size = 0;
+    KonfytDbEntry entry = mEntries.value(filename);
+    if (entry.type() == KfSoundTypeSoundfont) {
+        KfSoundPtr sf = entry.sound();
+        // Prefer the size of only the sample data if known
+        size = sf->sampleDataSize ? sf->sampleDataSize : sf->fileSize;
+    }
+    if (size == 0) {
+        size = QFileInfo(filename).size();
+    }
+
+    // Fluidsynth loads all the sample data of a soundfont into memory.
+    if (QFileInfo(filename).suffix().toLower() == "sf3") {
+        size *= KONFYT_DB_SF3_EXPANSION;
+    }
+    return size;
+}
+
+void KonfytDatabase::addSfont(KonfytDbEntry sf)
 {
     mAllSoundfonts.append(sf);
 }
 
-void KonfytDatabase::addSfz(KfSoundPtr sfz)
+void KonfytDatabase::addSfz(KonfytDbEntry sfz)
 {
     mAllSfzs.append(sfz);
 }
 
-void KonfytDatabase::addPatch(KfSoundPtr patch)
+void KonfytDatabase::addPatch(KonfytDbEntry patch)
 {
     mAllPatches.append(patch);
 }
 
 /* Build a tree of all list items based on their directory structure. */
-void KonfytDatabase::buildTree(KonfytDbTree *tree, const QList<KfSoundPtr> &list,
+void KonfytDatabase::buildTree(KonfytDbTree *tree, const QList<KonfytDbEntry> &list,
                                QString rootPath)
 {
-    tree->clearTree();
+    // A new root is created, so users of the previous tree (e.g. the library
+    // view) can keep it until they are updated.
+    KfDbTreeItemPtr root(new KonfytDbTreeItem());
 
     QDir rootDir(rootPath);
+    QHash<QString, KonfytDbTreeItem*> items; // By path
 
     // Add children to tree corresponding to directories in path
-    foreach (KfSoundPtr sound, list) {
-        QString relativePath = rootDir.relativeFilePath(sound->filename);
+    foreach (const KonfytDbEntry &entry, list) {
+        QString relativePath = rootDir.relativeFilePath(entry.filename());
         QStringList pathList = relativePath.split("/");
         if (pathList.value(0, "default") == "") { pathList.removeFirst(); }
         QString pathStr = rootPath;
-        KfDbTreeItemPtr item = tree->root;
+        KonfytDbTreeItem* item = root.data();
         foreach (QString dir, pathList) {
             pathStr += "/" + dir;
-            bool contains = false;
-            foreach (KfDbTreeItemPtr child, item->children) {
-                if (child->name == dir) {
-                    contains = true;
-                    item = child;
-                    break;
-                }
-            }
-            if (contains == false) {
-                item = item->addChild(dir, pathStr, nullptr);
+            KonfytDbTreeItem* child = items.value(pathStr);
+            if (!child) {
+                child = item->addChild(dir, pathStr, KonfytDbEntry()).data();
+                items.insert(pathStr, child);
             }
+            item = child;
         }
         // Last item is the leaf
-        item->name = sound->name;
-        item->path = sound->filename;
-        item->data = sound;
+        item->name = entry.name();
+        item->path = entry.filename();
+        item->data = entry;
     }
 
-    compactTree(tree->root);
+    compactTree(root);
+    tree->root = root;
+}
+
+/* Build a flat tree of search results in the order of the list, i.e. ranked.
+ * Items are named with their path relative to the root directory, so results
+ * with the same name in different directories can be told apart. */
+void KonfytDatabase::buildResultsTree(KonfytDbTree *tree, const QList<KfSoundPtr> &list,
+                                      QString rootPath)
+{
+    KfDbTreeItemPtr root(new KonfytDbTreeItem());
+
+    QDir rootDir(rootPath);
+    foreach (KfSoundPtr sound, list) {
+        QString name = rootDir.relativeFilePath(sound->filename);
+        if (sound->type == KfSoundTypePatch) {
+            // Patch names are not the file name
+            QString dir = QFileInfo(name).path();
+            name = (dir == ".") ? sound->name : dir + "/" + sound->name;
+        }
+        root->addChild(name, sound->filename, KonfytDbEntry(sound));
+    }
+
+    tree->root = root;
 }
 
 /* Compact a tree, by combining branches with their children
@@ -419,6 +1112,9 @@ void KonfytDatabase::compactTree(KfDbTreeItemPtr item)
     item->path = child->path;
     item->data = child->data;
     item->children = child->children;
+    foreach (KfDbTreeItemPtr c, item->children) {
+        c->parent = item.data();
+    }
 }
 
 /* Clears the database soundfont list and results. */
@@ -435,17 +1131,11 @@ void KonfytDatabase::clearDatabase()
     // Clear sfz
     mAllSfzs.clear();
     sfzResults.clear();
-}
 
-void KonfytDatabase::clearDatabase_exceptSoundfonts()
-{
-    // Clear patches
-    mAllPatches.clear();
-    patchResults.clear();
+    // Quarantined files are retried in the next scan
+    mQuarantine.clear();
 
-    // Clear sfz
-    mAllSfzs.clear();
-    sfzResults.clear();
+    mEntries.clear();
 }
 
 /* Loads soundfont info from file in worker thread. Signal is emitted when done. */
@@ -455,8 +1145,22 @@ void KonfytDatabase::loadSfontInfoFromFile(QString filename)
     // The worker thread will now load the soundfont and emit a signal when done
 }
 
-/* Save the database to an xml file. Returns true if success, false if not. */
+/* Save the database to a binary database file (see KonfytDatabaseFile).
+ * Returns true if success, false if not. */
 bool KonfytDatabase::saveDatabaseToFile(QString filename)
+{
+    QList<KonfytDbEntry> entries = mAllSoundfonts + mAllPatches + mAllSfzs;
+    QString error;
+    if (!KonfytDatabaseFile::write(filename, entries, mQuarantine, &error)) {
+        emit print("Failed to save database: " + error);
+        return false;
+    }
+    return true;
+}
+
+/* Save the database to an xml file, e.g. to export it. Entries are decoded
+ * one at a time. Returns true if success, false if not. */
+bool KonfytDatabase::saveDatabaseToXmlFile(QString filename)
 {
     QFile file(filename);
     if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
@@ -473,16 +1177,18 @@ bool KonfytDatabase::saveDatabaseToFile(QString filename)
     stream.writeStartElement(XML_DATABASE);
 
     // All the soundfonts
-    foreach (KfSoundPtr sf, mAllSoundfonts) {
-        soundfontToXml(sf, &stream);
+    foreach (const KonfytDbEntry &entry, mAllSoundfonts) {
+        soundfontToXml(entry.sound(), &stream);
     }
 
     // All the patches
-    foreach (KfSoundPtr patch, mAllPatches) {
+    foreach (const KonfytDbEntry &entry, mAllPatches) {
+        KfSoundPtr patch = entry.sound();
 
         stream.writeStartElement("patch");
         stream.writeAttribute("filename", patch->filename);
         stream.writeAttribute("name", patch->name);
+        fileIdentityToXml(patch, &stream);
 
         // Layers
         foreach (const KonfytSoundPreset &preset, patch->presets) {
@@ -497,10 +1203,28 @@ bool KonfytDatabase::saveDatabaseToFile(QString filename)
     }
 
     // All the SFZs
-    foreach (KfSoundPtr sfz, mAllSfzs) {
+    foreach (const KonfytDbEntry &entry, mAllSfzs) {
+        KfSoundPtr sfz = entry.sound();
 
         stream.writeStartElement("sfz");
         stream.writeAttribute("filename", sfz->filename);
+        fileIdentityToXml(sfz, &stream);
+        if (sfz->infoRead) {
+            // Only written if read, see loadDatabaseFromXmlFile()
+            stream.writeAttribute("sampleDataSize", n2s(sfz->sampleDataSize));
+            stream.writeAttribute("sampleCount", n2s(sfz->sampleCount));
+            stream.writeAttribute("regionCount", n2s(sfz->regionCount));
+        }
+        stream.writeEndElement();
+
+    }
+
+    // Soundfonts that failed to load
+    foreach (KfSoundPtr file, mQuarantine) {
+
+        stream.writeStartElement("quarantine");
+        stream.writeAttribute("filename", file->filename);
+        fileIdentityToXml(file, &stream);
         stream.writeEndElement();
 
     }
@@ -517,35 +1241,85 @@ bool KonfytDatabase::saveDatabaseToFile(QString filename)
 void KonfytDatabase::buildSfzTree()
 {
     buildTree(&sfzTree, mAllSfzs, mSfzDir);
+    scheduleSearchIndexUpdate();
 }
 
 void KonfytDatabase::buildSfzTree_results()
 {
-    buildTree(&sfzTree_results, sfzResults, mSfzDir);
+    buildResultsTree(&sfzTree_results, sfzResults, mSfzDir);
 }
 
 void KonfytDatabase::buildSfontTree()
 {
     buildTree(&sfontTree, mAllSoundfonts, mSfontsDir);
+    scheduleSearchIndexUpdate();
 }
 
 void KonfytDatabase::buildSfontTree_results()
 {
-    buildTree(&sfontTree_results, sfontResults, mSfontsDir);
+    buildResultsTree(&sfontTree_results, sfontResults, mSfontsDir);
 }
 
 void KonfytDatabase::buildPatchTree()
 {
     buildTree(&patchTree, mAllPatches, mPatchesDir);
+    scheduleSearchIndexUpdate();
 }
 
 void KonfytDatabase::buildPatchTree_results()
 {
-    buildTree(&patchTree_results, patchResults, mPatchesDir);
+    buildResultsTree(&patchTree_results, patchResults, mPatchesDir);
 }
 
-/* Clears the database and loads it from a single saved database xml file. */
+/* Clears the database and loads it from a database file, either binary or
+ * xml (e.g. saved by an older version). */
 bool KonfytDatabase::loadDatabaseFromFile(QString filename)
+{
+    if (KonfytDatabaseFile::isDatabaseFile(filename)) {
+        return loadDatabaseFromBinaryFile(filename);
+    } else {
+        return loadDatabaseFromXmlFile(filename);
+    }
+}
+
+/* Entries refer to the records of the mapped file, which stays open while
+ * they exist. Records are only decoded when an entry's sound is needed. */
+bool KonfytDatabase::loadDatabaseFromBinaryFile(QString filename)
+{
+    QSharedPointer<KonfytDatabaseFile> dbFile(new KonfytDatabaseFile());
+    QString error;
+    if (!dbFile->open(filename, &error)) {
+        emit print("Failed to read database file: " + error);
+        return false;
+    }
+
+    this->clearDatabase();
+
+    for (int i=0; i < dbFile->entryCount(); i++) {
+        if (dbFile->entry(i).flags & KonfytDatabaseFile::EntryQuarantined) {
+            mQuarantine.append(dbFile->sound(i));
+            continue;
+        }
+        KonfytDbEntry entry(dbFile, i);
+        if (entry.type() == KfSoundTypeSoundfont) {
+            addSfont(entry);
+        } else if (entry.type() == KfSoundTypePatch) {
+            addPatch(entry);
+        } else if (entry.type() == KfSoundTypeSfz) {
+            addSfz(entry);
+        }
+    }
+
+    updateEntryIndex();
+    buildSfontTree();
+    buildSfzTree();
+    buildPatchTree();
+
+    return true;
+}
+
+/* Clears the database and loads it from a single saved database xml file. */
+bool KonfytDatabase::loadDatabaseFromXmlFile(QString filename)
 {
     QFile file(filename);
     if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
@@ -572,6 +1346,7 @@ bool KonfytDatabase::loadDatabaseFromFile(QString filename)
                 KfSoundPtr patch(new KonfytSound(KfSoundTypePatch));
                 patch->filename = r.attributes().value("filename").toString();
                 patch->name = r.attributes().value("name").toString();
+                fileIdentityFromXml(patch, &r);
                 if (patch->name.isEmpty()) {
                     patch->name = QFileInfo(patch->filename).baseName();
                 }
@@ -596,9 +1371,23 @@ bool KonfytDatabase::loadDatabaseFromFile(QString filename)
                 KfSoundPtr sfz(new KonfytSound(KfSoundTypeSfz));
                 sfz->filename = r.attributes().value("filename").toString();
                 sfz->name = QFileInfo(sfz->filename).fileName();
+                fileIdentityFromXml(sfz, &r);
+                sfz->sampleDataSize = r.attributes().value("sampleDataSize").toLongLong();
+                sfz->sampleCount = r.attributes().value("sampleCount").toInt();
+                sfz->regionCount = r.attributes().value("regionCount").toInt();
+                sfz->infoRead = r.attributes().hasAttribute("regionCount");
                 addSfz(sfz);
                 r.skipCurrentElement();
 
+            } else if (r.name() == "quarantine") {
+
+                KfSoundPtr file(new KonfytSound(KfSoundTypeSoundfont));
+                file->filename = r.attributes().value("filename").toString();
+                file->name = QFileInfo(file->filename).fileName();
+                fileIdentityFromXml(file, &r);
+                mQuarantine.append(file);
+                r.skipCurrentElement();
+
             } else {
                 r.skipCurrentElement();
             }
@@ -607,6 +1396,7 @@ bool KonfytDatabase::loadDatabaseFromFile(QString filename)
 
     file.close();
 
+    updateEntryIndex();
     buildSfontTree();
     buildSfzTree();
     buildPatchTree();
@@ -620,6 +1410,9 @@ void KonfytDatabase::soundfontToXml(KfSoundPtr sf, QXmlStreamWriter *stream)
 
     stream->writeAttribute("filename", sf->filename);
     stream->writeAttribute("name", sf->name);
+    fileIdentityToXml(sf, stream);
+    stream->writeAttribute("sampleDataSize", n2s(sf->sampleDataSize));
+    stream->writeAttribute("sampleCount", n2s(sf->sampleCount));
 
     // All the programs ("presets")
     foreach (const KonfytSoundPreset &preset, sf->presets) {
@@ -636,11 +1429,30 @@ void KonfytDatabase::soundfontToXml(KfSoundPtr sf, QXmlStreamWriter *stream)
     stream->writeEndElement();
 }
 
+void KonfytDatabase::fileIdentityToXml(KfSoundPtr sound, QXmlStreamWriter *stream)
+{
+    stream->writeAttribute("size", n2s(sound->fileSize));
+    stream->writeAttribute("modified", n2s(sound->fileModified));
+    stream->writeAttribute("inode", n2s(sound->fileInode));
+    stream->writeAttribute("fingerprint", QString(sound->fileFingerprint));
+}
+
+void KonfytDatabase::fileIdentityFromXml(KfSoundPtr sound, QXmlStreamReader *r)
+{
+    sound->fileSize = r->attributes().value("size").toLongLong();
+    sound->fileModified = r->attributes().value("modified").toLongLong();
+    sound->fileInode = r->attributes().value("inode").toULongLong();
+    sound->fileFingerprint = r->attributes().value("fingerprint").toLatin1();
+}
+
 KfSoundPtr KonfytDatabase::soundfontFromXml(QXmlStreamReader *r)
 {
     KfSoundPtr sf(new KonfytSound(KfSoundTypeSoundfont));
     sf->filename = r->attributes().value("filename").toString();
     sf->name = r->attributes().value("name").toString();
+    fileIdentityFromXml(sf, r);
+    sf->sampleDataSize = r->attributes().value("sampleDataSize").toLongLong();
+    sf->sampleCount = r->attributes().value("sampleCount").toInt();
 
     while (r->readNextStartElement()) { // preset
 
@@ -668,66 +1480,48 @@ KfSoundPtr KonfytDatabase::soundfontFromXml(QXmlStreamReader *r)
 }
 
 /* Search all soundfonts (and their programs), SFZs and patches for the specified
- * string. Results can be accessed with the getResults functions. */
+ * string. The search is done in the background and searchFinished() is emitted
+ * when done, after which the results can be accessed with the getResults
+ * functions. Only the results of the latest search are reported. */
 void KonfytDatabase::search(QString str)
 {
-    str = str.toLower();
+    // Ensure the search is done on the latest library entries
+    if (searchIndexUpdateScheduled) { updateSearchIndex(); }
 
-    // Search all the soundfonts.
-    // If a soundfont's filename matches the search string, the entire
-    // soundfont (with all its programs) is included in the results.
-    // Otherwise, the soundfont is only included if one or more of its
-    // programs match the search string (and only those programs are included).
-    sfontResults.clear();
-    foreach (KfSoundPtr sf, mAllSoundfonts) {
-        if (sf->filename.toLower().contains(str)) {
-            // Soundfont name match. Include all programs
-            sfontResults.append(sf);
-        } else {
-            // Search soundfont programs
-            QList<KonfytSoundPreset> presetsFound;
-            foreach (const KonfytSoundPreset& preset, sf->presets) {
-                if (preset.name.toLower().contains(str)) {
-                    presetsFound.append(preset);
-                }
-            }
-            if (presetsFound.count()) {
-                KfSoundPtr sfresult(new KonfytSound(KfSoundTypeSoundfont));
-                sfresult->filename = sf->filename;
-                sfresult->name = sf->name;
-                sfresult->presets = presetsFound;
-                sfontResults.append(sfresult);
-            }
-        }
-    }
-    buildSfontTree_results();
+    mSearchId++;
+    searchWorker.latestSearchId.store(mSearchId);
+    emit searchWorker.requestSearch(str, mSearchId);
+}
 
-    // Search all the patchest
-    patchResults.clear();
-    foreach (KfSoundPtr patch, mAllPatches) {
-        // Search filename. If it doesn't match, search layers
-        if (patch->filename.toLower().contains(str)) {
-            patchResults.append(patch);
-        } else {
-            // Search layers
-            foreach (const KonfytSoundPreset& preset, patch->presets) {
-                if (preset.name.toLower().contains(str)) {
-                    patchResults.append(patch);
-                    break;
-                }
-            }
-        }
-    }
-    buildPatchTree_results();
+void KonfytDatabase::onSearchResults(KonfytSearchResults results)
+{
+    if (results.id != mSearchId) { return; } // Superseded by a newer search
 
-    // Search all the SFZs
-    sfzResults.clear();
-    foreach (KfSoundPtr sfz, mAllSfzs) {
-        if (sfz->filename.toLower().contains(str)) {
-            sfzResults.append(sfz);
-        }
-    }
+    sfontResults = results.sfonts;
+    patchResults = results.patches;
+    sfzResults = results.sfzs;
+    buildSfontTree_results();
+    buildPatchTree_results();
     buildSfzTree_results();
+
+    emit searchFinished();
+}
+
+/* Rebuild the search index once the current changes to the library are done. */
+void KonfytDatabase::scheduleSearchIndexUpdate()
+{
+    if (searchIndexUpdateScheduled) { return; }
+    searchIndexUpdateScheduled = true;
+    QTimer::singleShot(0, this, [=]()
+    {
+        if (searchIndexUpdateScheduled) { updateSearchIndex(); }
+    });
+}
+
+void KonfytDatabase::updateSearchIndex()
+{
+    searchIndexUpdateScheduled = false;
+    emit searchWorker.requestBuildIndex(mAllSoundfonts, mAllPatches, mAllSfzs);
 }
 
 /* Returns a list of patches from the search results. */
@@ -23,22 +23,42 @@
 #define KONFYT_DATABASE_H
 
 #include "remotescanner.h"
+#include "konfytDatabaseFile.h"
 #include "konfytDbTree.h"
+#include "konfytDirWalker.h"
 #include "konfytFluidsynthEngine.h"
+#include "konfytLibraryWatcher.h"
 #include "konfytPatch.h"
+#include "konfytSearchIndex.h"
+#include "konfytSfzReader.h"
+#include "konfytSoundfontReader.h"
 
+#include <QAtomicInt>
 #include <QDir>
+#include <QHash>
 #include <QList>
 #include <QMap>
 #include <QObject>
+#include <QPair>
 #include <QProcess>
+#include <QSet>
 #include <QStringList>
 #include <QThread>
 #include <QXmlStreamReader>
 #include <QXmlStreamWriter>
 
+#include <functional>
+
 #define XML_DATABASE "database"
 
+// Memory use estimates
+#define KONFYT_DB_SF3_EXPANSION 8 // SF3 samples are decompressed when loaded
+#define KONFYT_DB_SAMPLER_MEMORY_ESTIMATE (64*1024*1024) // SFZ/GIG samples are streamed, used if sample info unknown
+#define KONFYT_DB_SAMPLER_PRELOAD_SIZE (128*1024) // Start of each sample kept in memory by the sampler
+
+// Bytes read from the start and end of a file for its content fingerprint
+#define KONFYT_DB_FINGERPRINT_BLOCK (64*1024)
+
 
 // ============================================================================
 // KonfytDatabaseWorker
@@ -56,38 +76,108 @@ public:
     QString sfzDir;
     QString patchDir;
 
-    void setSfontIgnoreList(QList<KfSoundPtr> sfonts);
+    // Entries from a previous scan. Files that haven't changed since are not
+    // parsed again.
+    void setKnownSounds(QList<KonfytDbEntry> entries);
+    void setQuarantine(QList<KfSoundPtr> files);
 
-    QList<KfSoundPtr> sfontResults;
-    QList<KfSoundPtr> sfzResults;
-    QList<KfSoundPtr> patchResults;
+    // Results of scan, besides the soundfonts which are emitted as scanned
+    QList<KonfytDbEntry> sfzResults;
+    QList<KonfytDbEntry> patchResults;
+    QStringList removedSfonts;
 
     KfSoundPtr patchFromFile(QString filename);
+    KfSoundPtr sfzFromFile(QString filename);
+
+    static void readFileIdentity(KfSoundPtr sound);
+    static QByteArray fileFingerprint(QString filename);
 
 signals:
     // Signals emitted by this class
     void print(QString msg);
     void scanFinished();
     void scanStatus(QString msg);
+    // New or changed file. During a scan, only soundfonts are emitted.
+    void soundScanned(KfSoundPtr sound);
+    void sfontQuarantined(KfSoundPtr file);
+    void pathRemoved(QString path);
+    void updateFinished();
     void sfontFromFileFinished(KfSoundPtr sfont);
     // Signals to trigger work in this class/thread
     void scan();
+    void updatePaths(QStringList paths);
     void requestSfontFromFile(QString filename);
 
 private slots:
     void doScan();
+    void doUpdatePaths(QStringList paths);
     void doRequestSfontFromFile(QString filename);
 
 private:
-    QStringList sfontsToLoad;
-    QStringList sfontIgnoreList;
+    const QStringList sfontSuffixes {"sf2", "sf3"};
+    const QStringList sfzSuffixes {"sfz", "gig"};
+    const QStringList patchSuffixes {KONFYT_PATCH_SUFFIX};
+    KonfytSoundType soundTypeOfFile(QString path);
 
+    QStringList sfontsToLoad;
+    void loadSfontsRemotely(QStringList sfonts, std::function<void()> done);
+    QHash<QString, KonfytDbEntry> knownSounds;
+    QHash<QString, KfSoundPtr> knownQuarantine;
+    // Known entries by inode and size, to recognise moved files
+    typedef QPair<quint64, qint64> FileKey;
+    QHash<FileKey, KonfytDbEntry> knownByFileKey;
+    QSet<QString> movedFrom;
+
+    // Changes found in the current scan
+    int scanAdded = 0;
+    int scanChanged = 0;
+    int scanRemoved = 0;
+    int scanUnchanged = 0;
+    int scanMoved = 0;
+    int scanQuarantined = 0;
+    KonfytDbEntry unchangedEntry(QString path, KonfytDbEntry known);
+    KonfytDbEntry knownUnchanged(QString path, KonfytSoundType type);
+    KonfytDbEntry movedEntry(QString path, KonfytSoundType type);
+    void findRemoved(const QStringList &paths, KonfytSoundType type,
+                     QStringList* removed);
+    void printScanChanges();
+
+    void scanDirForFiles(QString dirname, QStringList suffixes,
+                         std::function<void(QString path)> found);
     void scanDirForFiles(QString dirname, QStringList suffixes, QStringList &list);
     void scanSfonts();
     void scanSfzs();
     void scanPatches();
 };
 
+// ============================================================================
+// KonfytSearchWorker
+// ============================================================================
+
+/* Searches the library in a separate thread. A search is abandoned as soon as
+ * a newer one is requested, e.g. while the user is typing. */
+class KonfytSearchWorker : public QObject
+{
+    Q_OBJECT
+public:
+    QAtomicInt latestSearchId;
+
+signals:
+    void searchFinished(KonfytSearchResults results);
+    // Signals to trigger work in this class/thread
+    void requestBuildIndex(QList<KonfytDbEntry> sfonts, QList<KonfytDbEntry> patches,
+                           QList<KonfytDbEntry> sfzs);
+    void requestSearch(QString query, int id);
+
+public slots:
+    void doBuildIndex(QList<KonfytDbEntry> sfonts, QList<KonfytDbEntry> patches,
+                      QList<KonfytDbEntry> sfzs);
+    void doSearch(QString query, int id);
+
+private:
+    KonfytSearchIndex index;
+};
+
 // ============================================================================
 // KonfytDatabase
 // ============================================================================
@@ -100,11 +190,11 @@ public:
     KonfytDatabase();
     ~KonfytDatabase();
 class
-    QList<KfSoundPtr> allSoundfonts();
+    QList<KonfytDbEntry> allSoundfonts();
     int soundfontCount();
-    QList<KfSoundPtr> allPatches();
+    QList<KonfytDbEntry> allPatches();
     int patchCount();
-    QList<KfSoundPtr> allSfzs();
+    QList<KonfytDbEntry> allSfzs();
     int sfzCount();
     KonfytDbTree sfzTree;
     KonfytDbTree sfzTree_results;
@@ -121,13 +211,22 @@ class
     void loadSfontInfoFromFile(QString filename);
 
     void clearDatabase();
-    void clearDatabase_exceptSoundfonts();
 
+    // Keep the database up to date with changes in the library directories
+    void setWatchEnabled(bool enabled);
+
+    // The database is saved in binary format. XML is supported for older
+    // versions and export, and the format is detected when loading.
     bool saveDatabaseToFile(QString filename);
+    bool saveDatabaseToXmlFile(QString filename);
     bool loadDatabaseFromFile(QString filename);
+    bool loadDatabaseFromBinaryFile(QString filename);
+    bool loadDatabaseFromXmlFile(QString filename);
 
     static void soundfontToXml(KfSoundPtr sf, QXmlStreamWriter* stream);
     static KfSoundPtr soundfontFromXml(QXmlStreamReader* r);
+    static void fileIdentityToXml(KfSoundPtr sound, QXmlStreamWriter* stream);
+    static void fileIdentityFromXml(KfSoundPtr sound, QXmlStreamReader* r);
 
     // Search functionality
     void search(QString str);
@@ -142,39 +241,82 @@ class
     void addPatch(QString filename);
     void removePatch(KfSoundPtr patch);
 
+    qint64 estimatedMemoryUse(KonfytSoundType type, QString filename);
+
 signals:
     // Signals intended for outside world
     void print(QString message);
     void scanStatus(QString msg);
     void scanFinished();
+    void searchFinished(); // Results are available with the getResults functions
+    void libraryChanged(); // Entries updated from changes in library dirs
     void sfontInfoLoadedFromFile(KfSoundPtr sf);
 
 private slots:
     void onScanFinished();
+    void onSoundScanned(KfSoundPtr sound);
+    void onSfontQuarantined(KfSoundPtr file);
+    void onPathRemoved(QString path);
+    void onUpdateFinished();
+    void onLibraryPathsChanged(QStringList paths);
     void onSfontInfoLoadedFromFile(KfSoundPtr sfont);
+    void onSearchResults(KonfytSearchResults results);
     void userMessageFromWorker(QString msg);
     void scanStatusFromWorker(QString msg);
 
 private:
-    QList<KfSoundPtr> mAllSoundfonts;
-    QList<KfSoundPtr> mAllPatches;
-    QList<KfSoundPtr> mAllSfzs;
+    QList<KonfytDbEntry> mAllSoundfonts;
+    QList<KonfytDbEntry> mAllPatches;
+    QList<KonfytDbEntry> mAllSfzs;
+    QList<KfSoundPtr> mQuarantine; // Soundfonts that failed to load when scanned
+    QHash<QString, KonfytDbEntry> mEntries; // All entries (not quarantined) by filename
+    void updateEntryIndex();
+
+    // Changes received from the worker, applied to the lists when it finishes
+    QHash<QString, KfSoundPtr> scannedSounds;
+    QHash<QString, KfSoundPtr> scannedQuarantine;
+    QSet<QString> removedPaths; // Files or directories
+    bool isRemovedPath(QString filename);
+    QSet<int> applyScannedChanges();
 
     QList<KfSoundPtr> sfontResults;
     QList<KfSoundPtr> patchResults;
     QList<KfSoundPtr> sfzResults;
 
+    QThread searchThread;
+    KonfytSearchWorker searchWorker;
+    int mSearchId = 0;
+    bool searchIndexUpdateScheduled = false;
+    void scheduleSearchIndexUpdate();
+    void updateSearchIndex();
+
     QThread workerThread;
     KonfytDatabaseWorker worker;
     QString mSfontsDir;
     QString mSfzDir;
     QString mPatchesDir;
 
-    void addSfont(KfSoundPtr sf);
-    void addSfz(KfSoundPtr sfz);
-    void addPatch(KfSoundPtr patch);
-
-    void buildTree(KonfytDbTree* tree, const QList<KfSoundPtr> &list, QString rootPath);
+    // Only one scan or update is done by the worker at a time. A scan
+    // requested or paths reported in the meantime are done afterwards.
+    bool mWorkerBusy = false;
+    bool scanPending = false;
+    QStringList pendingUpdatePaths;
+    void startPendingWork();
+    void startScan();
+
+    KonfytLibraryWatcher watcher;
+    bool mWatchEnabled = false;
+    bool watchUpdateScheduled = false;
+    void scheduleWatchUpdate();
+
+    void addSfont(KonfytDbEntry sf);
+    QList<KonfytDbEntry>* listForType(KonfytSoundType type);
+    void sortSounds(QList<KonfytDbEntry>* list);
+    void addSfz(KonfytDbEntry sfz);
+    void addPatch(KonfytDbEntry patch);
+
+    void buildTree(KonfytDbTree* tree, const QList<KonfytDbEntry> &list, QString rootPath);
+    void buildResultsTree(KonfytDbTree* tree, const QList<KfSoundPtr> &list, QString rootPath);
     void buildSfzTree();
     void buildSfzTree_results();
     void buildSfontTree();
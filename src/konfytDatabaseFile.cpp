@@ -0,0 +1,353 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytDatabaseFile.h"
+#include "konfytDefines.h"
+
+#include <QHash>
+#include <QSaveFile>
+#include <QVector>
+
+#include <string.h>
+
+static_assert(sizeof(KonfytDatabaseFile::Header) == 56, "Unexpected header size");
+static_assert(sizeof(KonfytDatabaseFile::Entry) == 72, "Unexpected entry size");
+static_assert(sizeof(KonfytDatabaseFile::Preset) == 16, "Unexpected preset size");
+
+
+KonfytDbEntry::KonfytDbEntry(KfSoundPtr sound) : mSound(sound)
+{
+    if (sound) {
+        mType = sound->type;
+        mFilename = sound->filename;
+    }
+}
+
+KonfytDbEntry::KonfytDbEntry(KfDatabaseFilePtr file, int record) :
+    mFile(file), mRecord(record)
+{
+    mType = file->type(record);
+    mFilename = file->string(file->entry(record).filename);
+}
+
+QString KonfytDbEntry::name() const
+{
+    if (mFile) { return mFile->string(mFile->entry(mRecord).name); }
+    return mSound ? mSound->name : QString();
+}
+
+KfSoundPtr KonfytDbEntry::sound() const
+{
+    if (mFile) { return mFile->sound(mRecord); }
+    return mSound;
+}
+
+qint64 KonfytDbEntry::fileSize() const
+{
+    if (mFile) { return mFile->entry(mRecord).fileSize; }
+    return mSound ? mSound->fileSize : 0;
+}
+
+qint64 KonfytDbEntry::fileModified() const
+{
+    if (mFile) { return mFile->entry(mRecord).fileModified; }
+    return mSound ? mSound->fileModified : 0;
+}
+
+quint64 KonfytDbEntry::fileInode() const
+{
+    if (mFile) { return mFile->entry(mRecord).fileInode; }
+    return mSound ? mSound->fileInode : 0;
+}
+
+QByteArray KonfytDbEntry::fileFingerprint() const
+{
+    if (mFile) { return mFile->string(mFile->entry(mRecord).fingerprint).toLatin1(); }
+    return mSound ? mSound->fileFingerprint : QByteArray();
+}
+
+bool KonfytDbEntry::infoRead() const
+{
+    if (mFile) {
+        return mFile->entry(mRecord).flags & KonfytDatabaseFile::EntryInfoRead;
+    }
+    return mSound ? mSound->infoRead : false;
+}
+
+bool KonfytDbEntry::operator==(const KonfytDbEntry &other) const
+{
+    return (mSound == other.mSound) && (mFile == other.mFile)
+            && (mRecord == other.mRecord);
+}
+
+
+
+KonfytDatabaseFile::~KonfytDatabaseFile()
+{
+    close();
+}
+
+/* Returns true if the file starts with the binary database magic, i.e. it is
+ * not an XML database. */
+bool KonfytDatabaseFile::isDatabaseFile(QString filename)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly)) { return false; }
+    QByteArray magic = f.read(sizeof(Header::magic));
+    return magic == QByteArray(KONFYT_DBFILE_MAGIC, sizeof(Header::magic));
+}
+
+/* Entries of records are decoded one at a time, so the mapped file they refer
+ * to may be the one being replaced. */
+bool KonfytDatabaseFile::write(QString filename, const QList<KonfytDbEntry> &entries,
+                               const QList<KfSoundPtr> &quarantine, QString *error)
+{
+    QVector<Entry> entryTable;
+    QVector<Preset> presetTable;
+    QByteArray stringTable;
+    QHash<QString, quint32> stringOffsets;
+
+    // Strings are stored as a 32-bit length followed by UTF-16 data, padded
+    // to 4 bytes. Identical strings (e.g. common preset names) are stored once.
+    auto addString = [&](const QString &s) -> quint32
+    {
+        auto it = stringOffsets.constFind(s);
+        if (it != stringOffsets.constEnd()) { return it.value(); }
+
+        quint32 offset = stringTable.size();
+        quint32 length = s.length();
+        stringTable.append((const char*)&length, sizeof(length));
+        stringTable.append((const char*)s.utf16(), length * sizeof(QChar));
+        while (stringTable.size() % 4) { stringTable.append('\0'); }
+        stringOffsets.insert(s, offset);
+        return offset;
+    };
+
+    auto addEntry = [&](KfSoundPtr sound, quint32 flags)
+    {
+        Entry e;
+        memset(&e, 0, sizeof(e));
+        e.type = sound->type;
+        e.flags = flags | (sound->infoRead ? EntryInfoRead : 0);
+        e.filename = addString(sound->filename);
+        e.name = addString(sound->name);
+        e.fingerprint = addString(QString::fromLatin1(sound->fileFingerprint));
+        e.firstPreset = presetTable.count();
+        e.presetCount = sound->presets.count();
+        e.sampleCount = sound->sampleCount;
+        e.regionCount = sound->regionCount;
+        e.fileSize = sound->fileSize;
+        e.sampleDataSize = sound->sampleDataSize;
+        e.fileModified = sound->fileModified;
+        e.fileInode = sound->fileInode;
+        entryTable.append(e);
+
+        foreach (const KonfytSoundPreset &preset, sound->presets) {
+            Preset p;
+            p.name = addString(preset.name);
+            p.bank = preset.bank;
+            p.program = preset.program;
+            p.reserved = 0;
+            presetTable.append(p);
+        }
+    };
+
+    foreach (const KonfytDbEntry &entry, entries) {
+        addEntry(entry.sound(), 0);
+    }
+    foreach (KfSoundPtr file, quarantine) {
+        addEntry(file, EntryQuarantined);
+    }
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, KONFYT_DBFILE_MAGIC, sizeof(h.magic));
+    h.version = KONFYT_DBFILE_VERSION;
+    h.byteOrder = KONFYT_DBFILE_BYTE_ORDER;
+    h.entryCount = entryTable.count();
+    h.presetCount = presetTable.count();
+    h.entriesOffset = sizeof(Header);
+    h.presetsOffset = h.entriesOffset + h.entryCount * sizeof(Entry);
+    h.stringsOffset = h.presetsOffset + h.presetCount * sizeof(Preset);
+    h.stringsSize = stringTable.size();
+
+    QSaveFile f(filename);
+    if (!f.open(QIODevice::WriteOnly)) {
+        return fail("Failed to open file for writing: " + f.errorString(), error);
+    }
+    f.write((const char*)&h, sizeof(h));
+    f.write((const char*)entryTable.constData(), h.entryCount * sizeof(Entry));
+    f.write((const char*)presetTable.constData(), h.presetCount * sizeof(Preset));
+    f.write(stringTable);
+    if (!f.commit()) {
+        return fail("Failed to write file: " + f.errorString(), error);
+    }
+    return true;
+}
+
+/* Map the file and check that the header and tables are valid. */
+bool KonfytDatabaseFile::open(QString filename, QString *error)
+{
+    close();
+
+    auto invalid = [&](QString msg)
+    {
+        close();
+        return fail(msg, error);
+    };
+
+    file.setFileName(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return invalid("Failed to open file: " + file.errorString());
+    }
+    size = file.size();
+    if (size < (qint64)sizeof(Header)) {
+        return invalid("File too small.");
+    }
+    data = file.map(0, size);
+    if (!data) {
+        return invalid("Failed to map file: " + file.errorString());
+    }
+
+    header = (const Header*)data;
+    if (memcmp(header->magic, KONFYT_DBFILE_MAGIC, sizeof(header->magic)) != 0) {
+        return invalid("Not a database file.");
+    }
+    if (header->version != KONFYT_DBFILE_VERSION) {
+        return invalid("Unsupported version " + n2s(header->version) + ".");
+    }
+    if (header->byteOrder != KONFYT_DBFILE_BYTE_ORDER) {
+        return invalid("File was written with a different byte order.");
+    }
+
+    auto inFile = [&](quint64 offset, quint64 length, quint64 alignment)
+    {
+        return (offset % alignment == 0) && (offset <= (quint64)size)
+                && (length <= (quint64)size - offset);
+    };
+    if ( !inFile(header->entriesOffset, quint64(header->entryCount) * sizeof(Entry), 8)
+         || !inFile(header->presetsOffset, quint64(header->presetCount) * sizeof(Preset), 4)
+         || !inFile(header->stringsOffset, header->stringsSize, 4) ) {
+        return invalid("File is corrupt.");
+    }
+
+    entries = (const Entry*)(data + header->entriesOffset);
+    presets = (const Preset*)(data + header->presetsOffset);
+    strings = data + header->stringsOffset;
+    return true;
+}
+
+void KonfytDatabaseFile::close()
+{
+    if (data) { file.unmap((uchar*)data); }
+    file.close();
+    data = nullptr;
+    size = 0;
+    header = nullptr;
+    entries = nullptr;
+    presets = nullptr;
+    strings = nullptr;
+}
+
+bool KonfytDatabaseFile::isOpen() const
+{
+    return header != nullptr;
+}
+
+int KonfytDatabaseFile::entryCount() const
+{
+    return header ? header->entryCount : 0;
+}
+
+const KonfytDatabaseFile::Entry &KonfytDatabaseFile::entry(int index) const
+{
+    return entries[index];
+}
+
+int KonfytDatabaseFile::presetCount() const
+{
+    return header ? header->presetCount : 0;
+}
+
+const KonfytDatabaseFile::Preset &KonfytDatabaseFile::preset(int index) const
+{
+    return presets[index];
+}
+
+QString KonfytDatabaseFile::string(quint32 offset) const
+{
+    if (!header) { return QString(); }
+    quint64 stringsSize = header->stringsSize;
+    if ( (offset % 4) || (quint64(offset) + sizeof(quint32) > stringsSize) ) {
+        return QString();
+    }
+    quint32 length;
+    memcpy(&length, strings + offset, sizeof(length));
+    quint64 available = stringsSize - offset - sizeof(quint32);
+    if (quint64(length) * sizeof(QChar) > available) { return QString(); }
+    return QString((const QChar*)(strings + offset + sizeof(quint32)), length);
+}
+
+KonfytSoundType KonfytDatabaseFile::type(int index) const
+{
+    quint32 t = entry(index).type;
+    if ( (t == KfSoundTypeSoundfont) || (t == KfSoundTypeSfz)
+         || (t == KfSoundTypePatch) ) {
+        return (KonfytSoundType)t;
+    }
+    return KfSoundTypeUndefined;
+}
+
+KfSoundPtr KonfytDatabaseFile::sound(int index) const
+{
+    const Entry &e = entry(index);
+
+    KfSoundPtr sound(new KonfytSound(type(index)));
+    sound->filename = string(e.filename);
+    sound->name = string(e.name);
+    sound->fileFingerprint = string(e.fingerprint).toLatin1();
+    sound->sampleCount = e.sampleCount;
+    sound->regionCount = e.regionCount;
+    sound->infoRead = e.flags & EntryInfoRead;
+    sound->fileSize = e.fileSize;
+    sound->sampleDataSize = e.sampleDataSize;
+    sound->fileModified = e.fileModified;
+    sound->fileInode = e.fileInode;
+
+    quint32 first = qMin(e.firstPreset, header->presetCount);
+    quint32 count = qMin(e.presetCount, header->presetCount - first);
+    sound->presets.reserve(count);
+    for (quint32 i = first; i < first + count; i++) {
+        KonfytSoundPreset p;
+        p.name = string(presets[i].name);
+        p.bank = presets[i].bank;
+        p.program = presets[i].program;
+        sound->presets.append(p);
+    }
+    return sound;
+}
+
+bool KonfytDatabaseFile::fail(QString msg, QString *error)
+{
+    if (error) { *error = msg; }
+    return false;
+}
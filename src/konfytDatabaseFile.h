@@ -0,0 +1,163 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_DATABASE_FILE_H
+#define KONFYT_DATABASE_FILE_H
+
+#include "konfytStructs.h"
+
+#include <QFile>
+#include <QList>
+#include <QSharedPointer>
+#include <QString>
+
+#define KONFYT_DBFILE_MAGIC "KFYTLIB" // Including terminating null: 8 bytes
+#define KONFYT_DBFILE_VERSION 2
+#define KONFYT_DBFILE_BYTE_ORDER 0x01020304
+
+/* Binary library database file.
+ *
+ * The file consists of a header, a table of fixed size entry records, a table
+ * of fixed size preset records and a string table. Records refer to strings by
+ * their offset in the string table, and entries to their presets by index, so
+ * the records can be read in place from the memory-mapped file. A file of
+ * another version is rejected when opened.
+ *
+ * Files are written to a temporary file which then replaces the existing one,
+ * so other instances that have the previous file mapped are not affected. */
+class KonfytDatabaseFile;
+typedef QSharedPointer<const KonfytDatabaseFile> KfDatabaseFilePtr;
+
+/* Entry of the library. Entries loaded from a database file refer to their
+ * record in the mapped file, which stays open as long as such entries exist.
+ * The record is only decoded to a sound when needed, e.g. when the entry is
+ * shown or searched. Other entries hold their sound. */
+class KonfytDbEntry
+{
+public:
+    KonfytDbEntry() {}
+    KonfytDbEntry(KfSoundPtr sound);
+    KonfytDbEntry(KfDatabaseFilePtr file, int record);
+
+    bool isNull() const { return mType == KfSoundTypeUndefined; }
+    KonfytSoundType type() const { return mType; }
+    QString filename() const { return mFilename; }
+    QString name() const;
+    KfSoundPtr sound() const; // New sound if decoded from the record
+
+    // File identity, without decoding the whole record
+    qint64 fileSize() const;
+    qint64 fileModified() const;
+    quint64 fileInode() const;
+    QByteArray fileFingerprint() const;
+    bool infoRead() const;
+
+    bool operator==(const KonfytDbEntry &other) const;
+    bool operator!=(const KonfytDbEntry &other) const { return !(*this == other); }
+
+private:
+    KonfytSoundType mType = KfSoundTypeUndefined;
+    QString mFilename;
+    KfSoundPtr mSound;
+    KfDatabaseFilePtr mFile;
+    int mRecord = -1;
+};
+
+class KonfytDatabaseFile
+{
+public:
+    struct Header
+    {
+        char magic[8];
+        quint32 version;
+        quint32 byteOrder;
+        quint32 entryCount;
+        quint32 presetCount;
+        quint64 entriesOffset;
+        quint64 presetsOffset;
+        quint64 stringsOffset;
+        quint64 stringsSize;
+    };
+
+    enum EntryFlags {
+        EntryQuarantined = 0x1,
+        EntryInfoRead = 0x2      // KonfytSound::infoRead
+    };
+
+    struct Entry
+    {
+        quint32 type;        // KonfytSoundType
+        quint32 flags;
+        quint32 filename;    // String offsets
+        quint32 name;
+        quint32 fingerprint;
+        quint32 firstPreset; // Preset indexes
+        quint32 presetCount;
+        qint32 sampleCount;
+        qint32 regionCount;
+        quint32 reserved;
+        qint64 fileSize;
+        qint64 sampleDataSize;
+        qint64 fileModified;
+        quint64 fileInode;
+    };
+
+    struct Preset
+    {
+        quint32 name;        // String offset
+        qint32 bank;
+        qint32 program;
+        quint32 reserved;
+    };
+
+    ~KonfytDatabaseFile();
+
+    static bool isDatabaseFile(QString filename);
+    // Quarantined files are written as entries with the EntryQuarantined flag.
+    static bool write(QString filename, const QList<KonfytDbEntry> &entries,
+                      const QList<KfSoundPtr> &quarantine, QString* error = nullptr);
+
+    bool open(QString filename, QString* error = nullptr);
+    void close();
+    bool isOpen() const;
+
+    int entryCount() const;
+    const Entry& entry(int index) const;
+    int presetCount() const;
+    const Preset& preset(int index) const;
+    QString string(quint32 offset) const; // Empty if out of range
+    KonfytSoundType type(int index) const; // Undefined if invalid
+    KfSoundPtr sound(int index) const;    // New sound from the entry
+
+private:
+    QFile file;
+    const uchar* data = nullptr;
+    qint64 size = 0;
+    const Header* header = nullptr;
+    const Entry* entries = nullptr;
+    const Preset* presets = nullptr;
+    const uchar* strings = nullptr;
+
+    static bool fail(QString msg, QString* error);
+};
+
+#endif // KONFYT_DATABASE_FILE_H
@@ -22,10 +22,11 @@
 #include "konfytDbTree.h"
 
 
-KfDbTreeItemPtr KonfytDbTreeItem::addChild(QString newName, QString newPath, KfSoundPtr data)
+KfDbTreeItemPtr KonfytDbTreeItem::addChild(QString newName, QString newPath, KonfytDbEntry data)
 {
     KfDbTreeItemPtr child = KfDbTreeItemPtr(new KonfytDbTreeItem());
     child->parent = this;
+    child->row = children.count();
     child->name = newName;
     child->path = newPath;
     child->data = data;
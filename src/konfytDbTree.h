@@ -22,7 +22,7 @@
 #ifndef KONFYT_DB_TREE_H
 #define KONFYT_DB_TREE_H
 
-#include "konfytStructs.h"
+#include "konfytDatabaseFile.h"
 
 #include <QList>
 #include <QSharedPointer>
@@ -34,17 +34,18 @@ typedef QSharedPointer<KonfytDbTreeItem> KfDbTreeItemPtr;
 class KonfytDbTreeItem
 {
 public:
-    KfDbTreeItemPtr addChild(QString newName, QString newPath, KfSoundPtr data);
+    KfDbTreeItemPtr addChild(QString newName, QString newPath, KonfytDbEntry data);
 
     KonfytDbTreeItem* parent = nullptr;
     QList<KfDbTreeItemPtr> children;
+    int row = 0; // Index in parent's children
 
     bool hasChildren();
     bool hasParent();
 
     QString name;
     QString path;
-    KfSoundPtr data;
+    KonfytDbEntry data;
 };
 
 class KonfytDbTree
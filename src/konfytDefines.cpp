@@ -26,6 +26,9 @@
 #endif
 #include <fluidsynth.h>
 #include <lscp/version.h>
+#ifdef KONFYT_USE_SAMPLER
+    #include <sndfile.h>
+#endif
 
 #include <iostream>
 
@@ -64,6 +67,23 @@ QString getCompileVersionText()
     txt.append( "Compiled with Carla " + QString(CARLA_VERSION_STRING));
 #else
     txt.append( "Compiled without Carla support" );
+#endif
+    txt.append("\n");
+#ifdef KONFYT_USE_SAMPLER
+    txt.append( "Compiled with sampler support" );
+#else
+    txt.append( "Compiled without sampler support" );
+#endif
+    return txt;
+}
+
+/* Versions of libraries as loaded at runtime, for libraries that only report
+ * their version at runtime. */
+QString getRuntimeVersionText()
+{
+    QString txt;
+#ifdef KONFYT_USE_SAMPLER
+    txt.append( "Running with " + QString(sf_version_string()) );
 #endif
     return txt;
 }
@@ -57,6 +57,7 @@ void konfytAssertMsg(const char* file, int line, const char* func,
 int wrapIndex(int index, int listLength);
 QString sanitiseFilename(QString path);
 QString getCompileVersionText();
+QString getRuntimeVersionText();
 
 
 #endif // KONFYT_DEFINES_H
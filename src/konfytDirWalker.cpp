@@ -0,0 +1,218 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytDirWalker.h"
+
+#include <QFile>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Directory entry as returned by getdents64
+struct KonfytLinuxDirent64
+{
+    quint64 d_ino;
+    qint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define KONFYT_DIR_WALKER_BUFFER_SIZE (32 * 1024)
+
+class KonfytDirWalkerThread : public QRunnable
+{
+public:
+    explicit KonfytDirWalkerThread(KonfytDirWalker* walker) : walker(walker) {}
+    void run() override { walker->walkThread(); }
+
+private:
+    KonfytDirWalker* walker;
+};
+
+
+KonfytDirWalker::KonfytDirWalker(QStringList suffixes)
+{
+    foreach (QString suffix, suffixes) {
+        mSuffixes.insert(suffix.toLower().toUtf8());
+    }
+    mThreadCount = qBound(1, QThread::idealThreadCount(), KONFYT_DIR_WALKER_MAX_THREADS);
+}
+
+bool KonfytDirWalker::walk(QString dir, std::function<void (QString)> found,
+                           std::function<void (QString)> foundDir)
+{
+    if (dir.isEmpty()) { return false; }
+    // Same form as paths from QDir, i.e. without a trailing slash
+    if ((dir.length() > 1) && dir.endsWith("/")) { dir.chop(1); }
+    QByteArray root = QFile::encodeName(dir);
+
+    struct stat st;
+    if ( (stat(root.constData(), &st) != 0) || !S_ISDIR(st.st_mode) ) {
+        return false;
+    }
+
+    pendingDirs = {root};
+    dirsBeingRead = 0;
+    foundFiles.clear();
+    foundDirs.clear();
+    visitedDirs.clear();
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(mThreadCount);
+    for (int i=0; i < mThreadCount; i++) {
+        pool.start(new KonfytDirWalkerThread(this));
+    }
+
+    // Pass found files on as they arrive
+    bool done = false;
+    while (!done) {
+        mutex.lock();
+        while (foundFiles.isEmpty() && foundDirs.isEmpty() && !walkDone()) {
+            changed.wait(&mutex);
+        }
+        QList<QByteArray> files = foundFiles;
+        foundFiles.clear();
+        QList<QByteArray> dirs = foundDirs;
+        foundDirs.clear();
+        done = walkDone();
+        mutex.unlock();
+
+        if (foundDir) {
+            foreach (const QByteArray &d, dirs) {
+                foundDir(QFile::decodeName(d));
+            }
+        }
+        foreach (const QByteArray &file, files) {
+            found(QFile::decodeName(file));
+        }
+    }
+
+    pool.waitForDone();
+    visitedDirs.clear();
+    return true;
+}
+
+/* Must be called with the mutex locked. */
+bool KonfytDirWalker::walkDone() const
+{
+    return pendingDirs.isEmpty() && (dirsBeingRead == 0);
+}
+
+/* Run by each thread of the pool. Takes directories from the pending list and
+ * reads them until there are no more directories to read. */
+void KonfytDirWalker::walkThread()
+{
+    QMutexLocker locker(&mutex);
+    forever {
+        while (pendingDirs.isEmpty() && (dirsBeingRead > 0)) {
+            changed.wait(&mutex);
+        }
+        if (pendingDirs.isEmpty()) { break; } // Done
+
+        // Take the most recently found, keeping the pending list short
+        QByteArray dir = pendingDirs.takeLast();
+        dirsBeingRead++;
+        locker.unlock();
+
+        QList<QByteArray> dirs;
+        QList<QByteArray> files;
+        bool read = readDir(dir, &dirs, &files);
+
+        locker.relock();
+        dirsBeingRead--;
+        pendingDirs.append(dirs);
+        foundFiles.append(files);
+        if (read) { foundDirs.append(dir); }
+        changed.wakeAll();
+    }
+}
+
+/* Returns false if the directory could not be read or was already read. */
+bool KonfytDirWalker::readDir(const QByteArray &path, QList<QByteArray> *dirs,
+                              QList<QByteArray> *files)
+{
+    int fd = openat(AT_FDCWD, path.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) { return false; }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        QPair<quint64, quint64> id(st.st_dev, st.st_ino);
+        QMutexLocker locker(&mutex);
+        if (visitedDirs.contains(id)) {
+            close(fd);
+            return false;
+        }
+        visitedDirs.insert(id);
+    }
+
+    alignas(8) char buffer[KONFYT_DIR_WALKER_BUFFER_SIZE];
+    forever {
+        long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (n <= 0) { break; }
+
+        long pos = 0;
+        while (pos < n) {
+            KonfytLinuxDirent64* d = (KonfytLinuxDirent64*)(buffer + pos);
+            pos += d->d_reclen;
+
+            const char* name = d->d_name;
+            if (name[0] == '.') { continue; } // Hidden, or . and ..
+
+            unsigned char type = d->d_type;
+            if ( (type == DT_LNK) || (type == DT_UNKNOWN) ) {
+                // Follow symlinks. Some filesystems don't report the type.
+                struct stat target;
+                if (fstatat(fd, name, &target, 0) != 0) { continue; }
+                if (S_ISDIR(target.st_mode)) {
+                    type = DT_DIR;
+                } else if (S_ISREG(target.st_mode)) {
+                    type = DT_REG;
+                } else {
+                    continue;
+                }
+            }
+
+            if (type == DT_DIR) {
+                dirs->append(path + '/' + name);
+            } else if ( (type == DT_REG) && matchesSuffix(name) ) {
+                files->append(path + '/' + name);
+            }
+        }
+    }
+
+    close(fd);
+    return true;
+}
+
+bool KonfytDirWalker::matchesSuffix(const char *name) const
+{
+    const char* dot = strrchr(name, '.');
+    if (!dot) { return false; }
+    return mSuffixes.contains(QByteArray(dot + 1).toLower());
+}
@@ -0,0 +1,80 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_DIR_WALKER_H
+#define KONFYT_DIR_WALKER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QSet>
+#include <QStringList>
+#include <QWaitCondition>
+
+#include <functional>
+
+#define KONFYT_DIR_WALKER_MAX_THREADS 8
+
+class KonfytDirWalkerThread;
+
+/* Walks directory trees to find files with specific suffixes (case
+ * insensitive). Directories are read with getdents64, using the entry types so
+ * that files don't have to be stat'ed, and subdirectories are read in parallel
+ * by a pool of threads. Directories are identified by device and inode, so a
+ * directory reachable through a symlink cycle is only read once. Symlinks are
+ * followed and hidden entries are skipped, as with QDir. */
+class KonfytDirWalker
+{
+public:
+    explicit KonfytDirWalker(QStringList suffixes);
+
+    // Calls found() in the calling thread for each file, as the files are
+    // found, until the whole tree has been walked. If set, foundDir() is
+    // called for each directory read, including dir itself. Returns false if
+    // the directory could not be read.
+    bool walk(QString dir, std::function<void(QString path)> found,
+              std::function<void(QString path)> foundDir = nullptr);
+
+private:
+    friend class KonfytDirWalkerThread;
+
+    QSet<QByteArray> mSuffixes; // Lower case
+    int mThreadCount;
+
+    // State of the current walk, shared between threads
+    QMutex mutex;
+    QWaitCondition changed;
+    QList<QByteArray> pendingDirs;
+    int dirsBeingRead = 0;
+    QList<QByteArray> foundFiles;
+    QList<QByteArray> foundDirs;
+    QSet<QPair<quint64, quint64>> visitedDirs; // Device, inode
+    bool walkDone() const;
+
+    void walkThread();
+    bool readDir(const QByteArray &path, QList<QByteArray>* dirs,
+                 QList<QByteArray>* files);
+    bool matchesSuffix(const char* name) const;
+};
+
+#endif // KONFYT_DIR_WALKER_H
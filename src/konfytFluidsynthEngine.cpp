@@ -37,6 +37,7 @@ KonfytFluidsynthEngine::~KonfytFluidsynthEngine()
     while (!synths.isEmpty()) {
         removeSoundfontProgram(synths[0]);
     }
+    setSoundfontCacheSize(0);
 }
 
 /* Generate Fluidsynth MIDI events based on buffer from JACK MIDI input. */
@@ -92,19 +93,29 @@ int KonfytFluidsynthEngine::fluidsynthWriteFloat(KfFluidSynth *synth, void *left
     return ret;
 }
 
-/* Adds a new soundfont engine and returns a pointer to the synth. Returns nullptr on error. */
+/* Adds a new soundfont engine and returns a pointer to the synth. Returns nullptr on error.
+ * This may be called from a thread other than the one the engine lives in. */
 KfFluidSynth* KonfytFluidsynthEngine::addSoundfontProgram(QString soundfontFilename, KonfytSoundPreset p)
 {
+    // Soundfont file data is shared between synths
+    KfSharedSoundfont* shared = acquireSharedSoundfont(soundfontFilename);
+    if (!shared) { return nullptr; }
+
     KfFluidSynth* s = newSynth();
-    if (!s) { return nullptr; }
+    if (!s) {
+        releaseSharedSoundfont(shared);
+        return nullptr;
+    }
 
-    // Load soundfont file
-    int sfID = fluid_synth_sfload(s->synth, soundfontFilename.toLocal8Bit().data(), 0);
-    if (sfID == -1) {
-        emit print("Failed to load soundfont " + soundfontFilename);
+    int sfID = fluid_synth_add_sfont(s->synth, shared->sfont);
+    if (sfID == FLUID_FAILED) {
+        emit print("Failed to add soundfont to synth " + soundfontFilename);
         delete s;
+        releaseSharedSoundfont(shared);
         return nullptr;
     }
+    s->sharedSfont = shared->sfont;
+    s->shared = shared;
 
     // Set the program
     fluid_synth_program_select(s->synth, 0, sfID, p.bank, p.program);
@@ -112,19 +123,155 @@ KfFluidSynth* KonfytFluidsynthEngine::addSoundfontProgram(QString soundfontFilen
     s->program = p;
     s->soundfontIDinSynth = sfID;
 
+    mutex.lock();
     synths.append(s);
+    mutex.unlock();
 
     return s;
 }
 
+/* Change the program of the synth to another one in the same soundfont. This
+ * is much quicker than replacing the synth. Returns false on error. */
+bool KonfytFluidsynthEngine::setSoundfontProgram(KfFluidSynth *synth, KonfytSoundPreset p)
+{
+    mutex.lock();
+    int ret = fluid_synth_program_select(synth->synth, 0, synth->soundfontIDinSynth,
+                                         p.bank, p.program);
+    if (ret != FLUID_FAILED) { synth->program = p; }
+    mutex.unlock();
+
+    return (ret != FLUID_FAILED);
+}
+
 void KonfytFluidsynthEngine::removeSoundfontProgram(KfFluidSynth *synth)
 {
+    KfSharedSoundfont* shared = synth->shared;
+
     mutex.lock();
 
     synths.removeAll(synth);
     delete synth;
 
     mutex.unlock();
+
+    if (shared) { releaseSharedSoundfont(shared); }
+}
+
+/* Returns the shared soundfont for the file, loading it if it isn't in use by
+ * another synth or in the cache of unused soundfonts. Returns nullptr if
+ * loading failed. Each call must be matched by a call to
+ * releaseSharedSoundfont().
+ * This may be called from multiple threads. Loading is done without holding
+ * the lock, so if two threads load the same file simultaneously, one of the
+ * loaded copies is discarded. */
+KfSharedSoundfont *KonfytFluidsynthEngine::acquireSharedSoundfont(QString filename)
+{
+    sharedSoundfontsMutex.lock();
+    KfSharedSoundfont* shared = sharedSoundfonts.value(filename, nullptr);
+    if (shared) { referenceSharedSoundfont(shared); }
+    sharedSoundfontsMutex.unlock();
+    if (shared) { return shared; }
+
+    // Load soundfont file
+    KfFluidSynth* owner = newSynth();
+    if (!owner) { return nullptr; }
+    int sfID = fluid_synth_sfload(owner->synth, filename.toLocal8Bit().data(), 0);
+    if (sfID == -1) {
+        emit print("Failed to load soundfont " + filename);
+        delete owner;
+        return nullptr;
+    }
+
+    sharedSoundfontsMutex.lock();
+    shared = sharedSoundfonts.value(filename, nullptr);
+    if (shared) {
+        // Loaded by another thread in the meantime
+        referenceSharedSoundfont(shared);
+    } else {
+        shared = new KfSharedSoundfont();
+        shared->filename = filename;
+        shared->owner = owner;
+        shared->sfont = fluid_synth_get_sfont_by_id(owner->synth, sfID);
+        shared->refCount = 1;
+        sharedSoundfonts.insert(filename, shared);
+        owner = nullptr;
+    }
+    sharedSoundfontsMutex.unlock();
+
+    if (owner) { delete owner; }
+
+    return shared;
+}
+
+/* Decrease the reference count of the shared soundfont. If it isn't used
+ * anymore, it is moved to the cache of unused soundfonts, or unloaded if the
+ * cache is full. The synths using it must already have been deleted. */
+void KonfytFluidsynthEngine::releaseSharedSoundfont(KfSharedSoundfont *shared)
+{
+    sharedSoundfontsMutex.lock();
+    shared->refCount--;
+    if (shared->refCount <= 0) { unusedSoundfonts.append(shared); }
+    QList<KfSharedSoundfont*> unload = takeExcessUnusedSoundfonts();
+    sharedSoundfontsMutex.unlock();
+
+    unloadSharedSoundfonts(unload);
+}
+
+/* Increase the reference count, taking the soundfont out of the cache of
+ * unused soundfonts if it is in there. sharedSoundfontsMutex must be locked. */
+void KonfytFluidsynthEngine::referenceSharedSoundfont(KfSharedSoundfont *shared)
+{
+    if (shared->refCount <= 0) { unusedSoundfonts.removeAll(shared); }
+    shared->refCount++;
+}
+
+/* Remove the least recently used soundfonts from the cache until it is within
+ * the cache size and return them. sharedSoundfontsMutex must be locked. */
+QList<KfSharedSoundfont*> KonfytFluidsynthEngine::takeExcessUnusedSoundfonts()
+{
+    QList<KfSharedSoundfont*> ret;
+    while (unusedSoundfonts.count() > mSoundfontCacheSize) {
+        KfSharedSoundfont* shared = unusedSoundfonts.takeFirst();
+        sharedSoundfonts.remove(shared->filename);
+        ret.append(shared);
+    }
+    return ret;
+}
+
+/* Unload soundfonts previously taken out of the shared soundfonts. This is
+ * done without holding the lock as it may take a while. */
+void KonfytFluidsynthEngine::unloadSharedSoundfonts(QList<KfSharedSoundfont*> list)
+{
+    foreach (KfSharedSoundfont* shared, list) {
+        // Deleting the owner synth also deletes the soundfont
+        delete shared->owner;
+        delete shared;
+    }
+}
+
+void KonfytFluidsynthEngine::setSoundfontCacheSize(int size)
+{
+    sharedSoundfontsMutex.lock();
+    mSoundfontCacheSize = qMax(0, size);
+    QList<KfSharedSoundfont*> unload = takeExcessUnusedSoundfonts();
+    sharedSoundfontsMutex.unlock();
+
+    unloadSharedSoundfonts(unload);
+}
+
+/* Load the soundfont into the cache of unused soundfonts (if it isn't loaded
+ * already) so that adding a program of it later is quick. Does nothing if the
+ * cache size is zero.
+ * This may be called from a thread other than the one the engine lives in. */
+void KonfytFluidsynthEngine::preloadSoundfont(QString filename)
+{
+    sharedSoundfontsMutex.lock();
+    bool cache = (mSoundfontCacheSize > 0);
+    sharedSoundfontsMutex.unlock();
+    if (!cache) { return; }
+
+    KfSharedSoundfont* shared = acquireSharedSoundfont(filename);
+    if (shared) { releaseSharedSoundfont(shared); }
 }
 
 void KonfytFluidsynthEngine::initFluidsynth(double sampleRate)
@@ -166,6 +313,7 @@ KfSoundPtr KonfytFluidsynthEngine::soundfontFromFile(QString filename)
     ret.reset(new KonfytSound(KfSoundTypeSoundfont));
     ret->filename = filename;
     ret->name = QFileInfo(filename).fileName();
+    ret->fileSize = QFileInfo(filename).size();
 
     // Get fluidsynth soundfont object
     fluid_sfont_t* sf = fluid_synth_get_sfont_by_id(synth, sfID);
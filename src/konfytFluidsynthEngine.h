@@ -28,16 +28,25 @@
 
 #include <fluidsynth.h>
 
+#include <QHash>
 #include <QObject>
 #include <QMutex>
 
 
+struct KfSharedSoundfont;
+
+/* Synth for a single soundfont program layer. Each layer has its own synth
+ * (and thus its own gain, MIDI and audio), but the soundfont data is loaded
+ * only once and shared by all synths using the same soundfont file. */
 struct KfFluidSynth
 {
     friend class KonfytFluidsynthEngine;
 
     ~KfFluidSynth()
     {
+        // The shared soundfont is not owned by this synth and must not be
+        // deleted along with it.
+        if (synth && sharedSfont) { fluid_synth_remove_sfont(synth, sharedSfont); }
         if (synth) { delete_fluid_synth(synth); }
         if (settings) { delete_fluid_settings(settings); }
     }
@@ -47,6 +56,18 @@ protected:
     fluid_settings_t* settings = nullptr;
     KonfytSoundPreset program;
     int soundfontIDinSynth;
+    fluid_sfont_t* sharedSfont = nullptr;
+    KfSharedSoundfont* shared = nullptr;
+};
+
+/* Soundfont file loaded once and shared by the synths of all layers using it.
+ * It is loaded into (and owned by) a synth that is not used for rendering. */
+struct KfSharedSoundfont
+{
+    QString filename;
+    KfFluidSynth* owner = nullptr;
+    fluid_sfont_t* sfont = nullptr;
+    int refCount = 0;
 };
 
 
@@ -65,6 +86,12 @@ public:
 
     KfFluidSynth* addSoundfontProgram(QString soundfontFilename, KonfytSoundPreset p);
     void removeSoundfontProgram(KfFluidSynth *synth);
+    bool setSoundfontProgram(KfFluidSynth *synth, KonfytSoundPreset p);
+
+    // Soundfonts no longer used by any synth are kept loaded in a cache of the
+    // specified size (none by default), least recently used ones unloaded first.
+    void setSoundfontCacheSize(int size);
+    void preloadSoundfont(QString filename);
 
     float getGain(KfFluidSynth *synth);
     void setGain(KfFluidSynth *synth, float newGain);
@@ -80,6 +107,17 @@ private:
 
     KfFluidSynth* newSynth();
 
+    QHash<QString, KfSharedSoundfont*> sharedSoundfonts;
+    QMutex sharedSoundfontsMutex;
+    KfSharedSoundfont* acquireSharedSoundfont(QString filename);
+    void releaseSharedSoundfont(KfSharedSoundfont* shared);
+    void referenceSharedSoundfont(KfSharedSoundfont* shared);
+    void unloadSharedSoundfonts(QList<KfSharedSoundfont*> list);
+
+    QList<KfSharedSoundfont*> unusedSoundfonts; // Least recently used first
+    int mSoundfontCacheSize = 0;
+    QList<KfSharedSoundfont*> takeExcessUnusedSoundfonts();
+
     QScopedPointer<KfFluidSynth> infoSynth;
 };
 
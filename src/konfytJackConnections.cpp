@@ -0,0 +1,234 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytJackConnections.h"
+
+#include <QTimer>
+
+#include <errno.h>
+
+KonfytJackConnections::KonfytJackConnections(QObject *parent) : QObject(parent)
+{
+    qRegisterMetaType<KfJackConnection>("KfJackConnection");
+    qRegisterMetaType<QList<KfJackConnection>>("QList<KfJackConnection>");
+    qRegisterMetaType<KonfytJackPortRegistry::Change>("KonfytJackPortRegistry::Change");
+
+    connect(this, &KonfytJackConnections::requestStart,
+            this, &KonfytJackConnections::doStart, Qt::QueuedConnection);
+    connect(this, &KonfytJackConnections::requestStop,
+            this, &KonfytJackConnections::doStop, Qt::BlockingQueuedConnection);
+    connect(this, &KonfytJackConnections::requestSetConnections,
+            this, &KonfytJackConnections::doSetConnections, Qt::QueuedConnection);
+    connect(this, &KonfytJackConnections::requestDisconnect,
+            this, &KonfytJackConnections::doDisconnect, Qt::QueuedConnection);
+    connect(this, &KonfytJackConnections::requestPortChanged,
+            this, &KonfytJackConnections::doPortChanged, Qt::QueuedConnection);
+    connect(this, &KonfytJackConnections::requestPortsConnected,
+            this, &KonfytJackConnections::doPortsConnected, Qt::QueuedConnection);
+}
+
+void KonfytJackConnections::setClient(jack_client_t *client)
+{
+    mClient = client;
+}
+
+void KonfytJackConnections::setPortRegistry(const KonfytJackPortRegistry *registry)
+{
+    ports = registry;
+}
+
+/* Called from the JACK notification thread. */
+void KonfytJackConnections::portChanged(KonfytJackPortRegistry::Change change)
+{
+    emit requestPortChanged(change);
+}
+
+/* Called from the JACK notification thread. */
+void KonfytJackConnections::portsConnected(jack_port_id_t a, jack_port_id_t b,
+                                           bool connected)
+{
+    if (!mClient) { return; }
+    jack_port_t* pa = jack_port_by_id(mClient, a);
+    jack_port_t* pb = jack_port_by_id(mClient, b);
+    if (!pa || !pb) { return; }
+
+    KfJackConnection c;
+    if (jack_port_flags(pa) & JackPortIsOutput) {
+        c.srcPort = jack_port_name(pa);
+        c.destPort = jack_port_name(pb);
+    } else {
+        c.srcPort = jack_port_name(pb);
+        c.destPort = jack_port_name(pa);
+    }
+    emit requestPortsConnected(c, connected);
+}
+
+void KonfytJackConnections::scheduleSync()
+{
+    if (syncScheduled) { return; }
+    syncScheduled = true;
+    // Handle all queued graph changes first
+    QTimer::singleShot(0, this, &KonfytJackConnections::sync);
+}
+
+/* Read the whole graph once, after which it is kept up to date from the
+ * callbacks. */
+void KonfytJackConnections::doStart()
+{
+    graph.clear();
+    failed.clear();
+    if (!mClient) { return; }
+
+    const char** names = jack_get_ports(mClient, NULL, NULL, 0);
+    if (names) {
+        for (int i=0; names[i]; i++) {
+            jack_port_t* port = jack_port_by_name(mClient, names[i]);
+            if (!port || !(jack_port_flags(port) & JackPortIsOutput)) { continue; }
+            const char** cons = jack_port_get_all_connections(mClient, port);
+            if (!cons) { continue; }
+            for (int j=0; cons[j]; j++) {
+                graph.insert({QByteArray(names[i]), QByteArray(cons[j])});
+            }
+            jack_free(cons);
+        }
+        jack_free(names);
+    }
+
+    running = true;
+    scheduleSync();
+}
+
+void KonfytJackConnections::doStop()
+{
+    running = false;
+    graph.clear();
+    failed.clear();
+}
+
+void KonfytJackConnections::doSetConnections(QList<KfJackConnection> connections)
+{
+    wanted.clear();
+    foreach (const KfJackConnection &c, connections) {
+        wanted.insert(c);
+        if (graph.contains(c)) { emit wantedConnectionChanged(c, true); }
+    }
+    scheduleSync();
+}
+
+void KonfytJackConnections::doDisconnect(KfJackConnection connection)
+{
+    if (!running) { return; }
+
+    wanted.remove(connection);
+    if (!graph.contains(connection)) { return; }
+    if (jack_disconnect(mClient, connection.srcPort.constData(),
+                        connection.destPort.constData()))
+    {
+        print("Failed to disconnect JACK ports "
+              + QString::fromLocal8Bit(connection.srcPort) + " and "
+              + QString::fromLocal8Bit(connection.destPort));
+    } else {
+        graph.remove(connection);
+    }
+}
+
+void KonfytJackConnections::doPortChanged(KonfytJackPortRegistry::Change change)
+{
+    QByteArray port = change.port.toLocal8Bit();
+    retryFailed(port);
+
+    if (change.kind == KonfytJackPortRegistry::Change::PortRenamed) {
+        // Connections are kept when a port is renamed
+        QByteArray oldName = change.oldName.toLocal8Bit();
+        retryFailed(oldName);
+        QList<KfJackConnection> renamed;
+        QSet<KfJackConnection>::iterator i = graph.begin();
+        while (i != graph.end()) {
+            if ((i->srcPort == oldName) || (i->destPort == oldName)) {
+                KfJackConnection c = *i;
+                if (c.srcPort == oldName) { c.srcPort = port; }
+                if (c.destPort == oldName) { c.destPort = port; }
+                renamed.append(c);
+                i = graph.erase(i);
+            } else {
+                i++;
+            }
+        }
+        foreach (const KfJackConnection &c, renamed) {
+            graph.insert(c);
+        }
+    }
+
+    if (change.kind != KonfytJackPortRegistry::Change::PortRemoved) {
+        scheduleSync();
+    }
+}
+
+/* Retry failed connections of the port. */
+void KonfytJackConnections::retryFailed(QByteArray port)
+{
+    QSet<KfJackConnection>::iterator i = failed.begin();
+    while (i != failed.end()) {
+        if ((i->srcPort == port) || (i->destPort == port)) {
+            i = failed.erase(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+void KonfytJackConnections::doPortsConnected(KfJackConnection connection, bool connected)
+{
+    if (connected) {
+        graph.insert(connection);
+    } else {
+        graph.remove(connection);
+        // Restore if disconnected by someone else
+        if (wanted.contains(connection)) { scheduleSync(); }
+    }
+    if (wanted.contains(connection)) {
+        emit wantedConnectionChanged(connection, connected);
+    }
+}
+
+/* Connect the requested connections that are missing from the graph and of
+ * which both ports exist. */
+void KonfytJackConnections::sync()
+{
+    syncScheduled = false;
+    if (!running || !ports) { return; }
+
+    foreach (const KfJackConnection &c, wanted) {
+        if (graph.contains(c) || failed.contains(c)) { continue; }
+        if (!ports->contains(QString::fromLocal8Bit(c.srcPort))) { continue; }
+        if (!ports->contains(QString::fromLocal8Bit(c.destPort))) { continue; }
+
+        int err = jack_connect(mClient, c.srcPort.constData(), c.destPort.constData());
+        if ((err == 0) || (err == EEXIST)) {
+            // Also confirmed by the connect callback
+            graph.insert(c);
+            emit wantedConnectionChanged(c, true);
+        } else {
+            failed.insert(c);
+        }
+    }
+}
@@ -0,0 +1,88 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_JACK_CONNECTIONS_H
+#define KONFYT_JACK_CONNECTIONS_H
+
+#include "konfytJackPortRegistry.h"
+#include "konfytJackStructs.h"
+
+#include <jack/jack.h>
+
+#include <QObject>
+#include <QSet>
+
+/* Keeps the JACK connections requested for our ports in its own thread.
+ * A mirror of the current connections is kept up to date from the JACK
+ * callbacks, and the registered ports are looked up in the port registry of
+ * the engine. Only the requested connections that are missing from the graph
+ * are connected, e.g. when a port of another client appears. Connecting that
+ * fails is not retried until one of the ports is registered or renamed. */
+class KonfytJackConnections : public QObject
+{
+    Q_OBJECT
+public:
+    explicit KonfytJackConnections(QObject *parent = nullptr);
+
+    // Set before the client is activated and cleared after it is closed
+    void setClient(jack_client_t* client);
+    void setPortRegistry(const KonfytJackPortRegistry* registry);
+
+    // Called from the JACK notification thread, for changes that were applied
+    // to the port registry.
+    void portChanged(KonfytJackPortRegistry::Change change);
+    void portsConnected(jack_port_id_t a, jack_port_id_t b, bool connected);
+
+signals:
+    void print(QString msg);
+    // A requested connection was confirmed in the graph, or removed from it
+    void wantedConnectionChanged(KfJackConnection connection, bool inGraph);
+
+    void requestStart();
+    void requestStop();
+    void requestSetConnections(QList<KfJackConnection> connections);
+    void requestDisconnect(KfJackConnection connection);
+    void requestPortChanged(KonfytJackPortRegistry::Change change);
+    void requestPortsConnected(KfJackConnection connection, bool connected);
+
+private:
+    jack_client_t* mClient = nullptr;
+    const KonfytJackPortRegistry* ports = nullptr;
+    bool running = false;
+    QSet<KfJackConnection> graph;     // Connections in the graph
+    QSet<KfJackConnection> wanted;    // Requested connections
+    QSet<KfJackConnection> failed;    // Requested but could not connect
+    bool syncScheduled = false;
+    void scheduleSync();
+    void retryFailed(QByteArray port);
+
+private slots:
+    void doStart();
+    void doStop();
+    void doSetConnections(QList<KfJackConnection> connections);
+    void doDisconnect(KfJackConnection connection);
+    void doPortChanged(KonfytJackPortRegistry::Change change);
+    void doPortsConnected(KfJackConnection connection, bool connected);
+    void sync();
+};
+
+#endif // KONFYT_JACK_CONNECTIONS_H
@@ -21,6 +21,8 @@
 
 #include "konfytJackEngine.h"
 
+#include <QHash>
+
 #include <iostream>
 
 
@@ -28,28 +30,50 @@ KonfytJackEngine::KonfytJackEngine(QObject *parent) :
     QObject(parent)
 {
     initMidiClosureEvents();
+
+    connect(&connections, &KonfytJackConnections::print,
+            this, &KonfytJackEngine::print);
+    connections.setPortRegistry(&portRegistry);
+    connect(&connections, &KonfytJackConnections::wantedConnectionChanged,
+            this, &KonfytJackEngine::onWantedConnectionChanged);
+    connections.moveToThread(&connectionsThread);
+    connectionsThread.start();
 }
 
 KonfytJackEngine::~KonfytJackEngine()
 {
+    connectionsThread.quit();
+    connectionsThread.wait();
     free(fadeOutValues);
 }
 
-/* Set panicCmd. The JACK process callback will behave accordingly. */
+/* Set panicCmd. The JACK process callback will behave accordingly. Direct
+ * routes are mixed again so they are silenced too. */
 void KonfytJackEngine::panic(bool p)
 {
     panicCmd = p;
+    updateDirectAudioRoutes();
 }
 
 void KonfytJackEngine::timerEvent(QTimerEvent* /*event*/)
 {
-    // JACK port connections
-    if (mConnectCallback || mRegisterCallback) {
-        mConnectCallback = false;
-        mRegisterCallback = false;
-        refreshAllPortsConnections();
-        emit jackPortRegisteredOrConnected();
+    // JACK port connections are kept by the connection manager. Report the
+    // port changes that were applied to the registry.
+    portChangesMutex.lock();
+    QList<KonfytJackPortRegistry::Change> changes;
+    changes.swap(portChanges);
+    portChangesMutex.unlock();
+    if (!changes.isEmpty()) {
+        emit jackPortsChanged(changes);
+    }
+
+    // Latencies change when the graph changes
+    if (mGraphOrderCallback.exchange(false)) {
+        if (measurePluginLatencies()) {
+            updateLatencyCompensation();
+        }
     }
+    updateDirectAudioRoutes();
 
     // Transfer events that were received in JACK tread from ringbuffers to lists
     // that will be retrieved later by the GUI thread.
@@ -72,69 +96,93 @@ void KonfytJackEngine::startTimer()
     this->timer.start(20, this);
 }
 
-void KonfytJackEngine::refreshAllPortsConnections()
+/* Give the connections of all our ports and the other connections to the
+ * connection manager, which makes the ones that are missing in the background.
+ * Call when the requested connections change, not when the JACK graph
+ * changes. */
+void KonfytJackEngine::updateConnections()
 {
     if (!clientIsActive()) { return; }
 
-    // Refresh connections to each midi input port
+    QList<KfJackConnection> list;
+
     foreach (KfJackMidiPort* port, midiInPorts) {
-        refreshConnections(port->jackPointer, port->connectionList, INPUT_PORT);
+        appendPortConnections(&list, port->jackPointer, port->connectionList, INPUT_PORT);
     }
-
-    // For each midi output port to external apps, refresh connections to all their clients
     foreach (KfJackMidiPort* port, midiOutPorts) {
-        refreshConnections(port->jackPointer, port->connectionList, OUTPUT_PORT);
+        appendPortConnections(&list, port->jackPointer, port->connectionList, OUTPUT_PORT);
     }
-
-    // Refresh connections for plugin midi and audio ports
     foreach (KfJackPluginPorts* pluginPort, pluginPorts) {
-        // Midi out
-        refreshConnections(pluginPort->midi->jackPointer,
-                           pluginPort->midi->connectionList, OUTPUT_PORT);
-        // Audio in left
-        refreshConnections(pluginPort->audioInLeft->jackPointer,
-                           pluginPort->audioInLeft->connectionList, INPUT_PORT);
-        // Audio in right
-        refreshConnections(pluginPort->audioInRight->jackPointer,
-                           pluginPort->audioInRight->connectionList, INPUT_PORT);
-    }
-
-    // Refresh connections for audio input ports
+        appendPortConnections(&list, pluginPort->midi->jackPointer,
+                              pluginPort->midi->connectionList, OUTPUT_PORT);
+        appendPortConnections(&list, pluginPort->audioInLeft->jackPointer,
+                              pluginPort->audioInLeft->connectionList, INPUT_PORT);
+        appendPortConnections(&list, pluginPort->audioInRight->jackPointer,
+                              pluginPort->audioInRight->connectionList, INPUT_PORT);
+    }
     foreach (KfJackAudioPort* port, audioInPorts) {
-        refreshConnections(port->jackPointer, port->connectionList, INPUT_PORT);
+        appendPortConnections(&list, port->jackPointer, port->connectionList, INPUT_PORT);
     }
-
-    // Refresh connections for audio output ports (aka buses)
     foreach (KfJackAudioPort* port, audioOutPorts) {
-        refreshConnections(port->jackPointer, port->connectionList, OUTPUT_PORT);
+        appendPortConnections(&list, port->jackPointer, port->connectionList, OUTPUT_PORT);
     }
-
-    // Refresh other JACK connections
     foreach (const KonfytJackConPair &p, otherConsList) {
-        jack_connect(mJackClient, p.srcPort.toLocal8Bit(), p.destPort.toLocal8Bit());
+        list.append({p.srcPort.toLocal8Bit(), p.destPort.toLocal8Bit()});
     }
 
+    // Direct connections of audio routes that bypass our process callback
+    QSet<KfJackConnection> direct;
+    foreach (KfJackAudioRoute* route, audioRoutes) {
+        if (route->directWanted) { direct.unite(directRouteConnections(route)); }
+    }
+    foreach (const KfJackConnection& c, direct) {
+        if (!list.contains(c)) { list.append(c); }
+    }
+    emit connections.requestSetConnections(list);
+
+    // Disconnect the ones that are not needed anymore, unless also requested
+    // otherwise, e.g. as other JACK connection. Routes that stop being direct
+    // are only mixed again once their confirmed connections have been
+    // removed, so the signal is not doubled. Connections that are not
+    // confirmed yet are left to the connection manager, which may still be
+    // making them.
+    foreach (const KfJackConnection& c, directConnections) {
+        if (direct.contains(c) || list.contains(c)) { continue; }
+        if (directConfirmed.contains(c)) {
+            jack_disconnect(mJackClient, c.srcPort.constData(), c.destPort.constData());
+        } else {
+            emit connections.requestDisconnect(c);
+        }
+    }
+    directConnections = direct;
+    directConfirmed.intersect(direct);
+    updateDirectRouteStates();
 }
 
-void KonfytJackEngine::refreshConnections(jack_port_t *jackPort,
-                                          QStringList clients, PortDirection dir)
+void KonfytJackEngine::appendPortConnections(QList<KfJackConnection> *list,
+                                             jack_port_t *jackPort,
+                                             QStringList clients, PortDirection dir)
 {
-    const char* src = nullptr;
-    const char* dest = nullptr;
-    const char* portname = jack_port_name(jackPort);
-    if (dir == INPUT_PORT) {
-        dest = portname;
-    } else {
-        src = portname;
-    }
-    foreach (QString s, clients) {
-        const char* clientname = s.toLocal8Bit().constData();
+    if (!jackPort) { return; }
+    QByteArray portName(jack_port_name(jackPort));
+    foreach (QString client, clients) {
         if (dir == INPUT_PORT) {
-            src = clientname;
+            list->append({client.toLocal8Bit(), portName});
         } else {
-            dest = clientname;
+            list->append({portName, client.toLocal8Bit()});
         }
-        jack_connect(mJackClient, src, dest);
+    }
+}
+
+void KonfytJackEngine::disconnectPortClient(jack_port_t *jackPort, QString client,
+                                            PortDirection dir)
+{
+    if (!jackPort) { return; }
+    QByteArray portName(jack_port_name(jackPort));
+    if (dir == INPUT_PORT) {
+        emit connections.requestDisconnect({client.toLocal8Bit(), portName});
+    } else {
+        emit connections.requestDisconnect({portName, client.toLocal8Bit()});
     }
 }
 
@@ -205,7 +253,8 @@ void KonfytJackEngine::removeSoundfont(KfJackPluginPorts *p)
 /* For the specified ports spec, create a new MIDI output port and left and
  * right audio input ports, combined in a plugin ports struct. The strings in the
  * spec are used to add to the created ports auto-connect lists and the MIDI
- * filter is applied to the MIDI port.
+ * filter is applied to the MIDI port. Empty port names are not added, e.g. if
+ * the plugin's ports are not known yet, see setPluginConnections().
  * A unique ID is returned. */
 KfJackPluginPorts* KonfytJackEngine::addPluginPortsAndConnect(const KonfytJackPortsSpec &spec)
 {
@@ -219,7 +268,9 @@ KfJackPluginPorts* KonfytJackEngine::addPluginPortsAndConnect(const KonfytJackPo
     if (midiPort->jackPointer == nullptr) {
         print("Failed to create JACK MIDI output port '" + midiName + "' for plugin.");
     }
-    midiPort->connectionList.append( spec.midiOutConnectTo );
+    if (!spec.midiOutConnectTo.isEmpty()) {
+        midiPort->connectionList.append( spec.midiOutConnectTo );
+    }
 
     // Add left audio input port where we will receive plugin audio
     QString nameL = QString("%1_in_L").arg(spec.name);
@@ -227,7 +278,9 @@ KfJackPluginPorts* KonfytJackEngine::addPluginPortsAndConnect(const KonfytJackPo
     if (alPort->jackPointer == nullptr) {
         print("Failed to create left audio input port '" + nameL + "' for plugin.");
     }
-    alPort->connectionList.append( spec.audioInLeftConnectTo );
+    if (!spec.audioInLeftConnectTo.isEmpty()) {
+        alPort->connectionList.append( spec.audioInLeftConnectTo );
+    }
 
     // Add right audio input port
     QString nameR = QString("%1_in_R").arg(spec.name);
@@ -235,7 +288,9 @@ KfJackPluginPorts* KonfytJackEngine::addPluginPortsAndConnect(const KonfytJackPo
     if (arPort->jackPointer == nullptr) {
         print("Failed to create right audio input port '" + nameR + "' for plugin.");
     }
-    arPort->connectionList.append( spec.audioInRightConnectTo );
+    if (!spec.audioInRightConnectTo.isEmpty()) {
+        arPort->connectionList.append( spec.audioInRightConnectTo );
+    }
 
     KfJackPluginPorts* p = new KfJackPluginPorts();
     p->midi = midiPort;
@@ -260,8 +315,80 @@ KfJackPluginPorts* KonfytJackEngine::addPluginPortsAndConnect(const KonfytJackPo
     p->audioLeftRoute->source = p->audioInLeft;
     p->audioRightRoute->source = p->audioInRight;
 
+    // Measured when the plugin is connected
+    p->latency = 0;
+
     pauseJackProcessing(true);
     pluginPorts.append(p);
+    updateLatencyCompensation();
+    pauseJackProcessing(false);
+
+    updateConnections();
+
+    return p;
+}
+
+/* Set the plugin ports to connect to once the ports of a plugin that is added
+ * asynchronously are known. */
+void KonfytJackEngine::setPluginConnections(KfJackPluginPorts *p,
+                                            QString midiOutConnectTo,
+                                            QString audioInLeftConnectTo,
+                                            QString audioInRightConnectTo)
+{
+    KONFYT_ASSERT_RETURN(p);
+
+    if (!clientIsActive()) { return; }
+
+    // The lists were empty, so there is nothing to disconnect
+    p->midi->connectionList.clear();
+    p->audioInLeft->connectionList.clear();
+    p->audioInRight->connectionList.clear();
+    if (!midiOutConnectTo.isEmpty()) {
+        p->midi->connectionList.append(midiOutConnectTo);
+    }
+    if (!audioInLeftConnectTo.isEmpty()) {
+        p->audioInLeft->connectionList.append(audioInLeftConnectTo);
+    }
+    if (!audioInRightConnectTo.isEmpty()) {
+        p->audioInRight->connectionList.append(audioInRightConnectTo);
+    }
+
+    updateConnections();
+}
+
+/* Add a plugin that is rendered in our process callback, e.g. by an in-process
+ * SFZ engine. Like soundfonts, the plugin doesn't need any JACK ports: MIDI is
+ * given to the plugin and it writes audio to buffers allocated here. Remove
+ * with removePlugin(). */
+KfJackPluginPorts* KonfytJackEngine::addInternalPlugin(KfJackInternalPlugin *plugin,
+                                                       KonfytMidiFilter filter)
+{
+    KfJackPluginPorts* p = new KfJackPluginPorts();
+    p->internalPlugin = plugin;
+    p->audioInLeft = new KfJackAudioPort();
+    p->audioInRight = new KfJackAudioPort();
+    p->audioInLeft->buffer = calloc(mJackBufferSize, sizeof(jack_default_audio_sample_t));
+    p->audioInRight->buffer = calloc(mJackBufferSize, sizeof(jack_default_audio_sample_t));
+    p->midi = new KfJackMidiPort(); // Dummy port for note records, etc.
+
+    p->midiRoute = addMidiRoute();
+    p->audioLeftRoute = addAudioRoute();
+    p->audioRightRoute = addAudioRoute();
+
+    // Only MIDI route is used to set plugin active/inactive.
+    setAudioRouteActive(p->audioLeftRoute, true);
+    setAudioRouteActive(p->audioRightRoute, true);
+
+    p->midiRoute->destInternalPlugin = plugin;
+    p->midiRoute->destIsJackPort = false;
+    p->midiRoute->destPort = p->midi;
+    p->midiRoute->filter = filter;
+
+    p->audioLeftRoute->source = p->audioInLeft;
+    p->audioRightRoute->source = p->audioInRight;
+
+    pauseJackProcessing(true);
+    internalPluginPorts.append(p);
     pauseJackProcessing(false);
 
     return p;
@@ -271,6 +398,11 @@ void KonfytJackEngine::removePlugin(KfJackPluginPorts *p)
 {
     KONFYT_ASSERT_RETURN(p);
 
+    if (p->internalPlugin) {
+        removeInternalPlugin(p);
+        return;
+    }
+
     pauseJackProcessing(true);
 
     // Remove everything created in addPluginPortsAndConnect()
@@ -281,6 +413,7 @@ void KonfytJackEngine::removePlugin(KfJackPluginPorts *p)
     removeAudioRoute(p->audioRightRoute);
 
     pluginPorts.removeAll(p);
+    updateLatencyCompensation();
 
     if (jack_port_unregister(mJackClient, p->midi->jackPointer)) {
         print("Failed to unregister JACK MIDI out port for plugin.");
@@ -300,6 +433,28 @@ void KonfytJackEngine::removePlugin(KfJackPluginPorts *p)
     delete p;
 
     pauseJackProcessing(false);
+
+    updateConnections();
+}
+
+/* Remove everything created in addInternalPlugin(). The plugin itself is
+ * owned by its engine. */
+void KonfytJackEngine::removeInternalPlugin(KfJackPluginPorts *p)
+{
+    pauseJackProcessing(true);
+
+    internalPluginPorts.removeAll(p);
+    removeMidiRoute(p->midiRoute);
+    removeAudioRoute(p->audioLeftRoute);
+    removeAudioRoute(p->audioRightRoute);
+    free(p->audioInLeft->buffer);
+    free(p->audioInRight->buffer);
+    delete p->audioInLeft;
+    delete p->audioInRight;
+    delete p->midi;
+    delete p;
+
+    pauseJackProcessing(false);
 }
 
 void KonfytJackEngine::setSoundfontMidiFilter(KfJackPluginPorts *p, KonfytMidiFilter filter)
@@ -492,7 +647,7 @@ void KonfytJackEngine::addPortClient(KfJackMidiPort *port, QString newClient)
     if (!clientIsActive()) { return; }
 
     port->connectionList.append(newClient);
-    refreshAllPortsConnections();
+    updateConnections();
 }
 
 void KonfytJackEngine::addPortClient(KfJackAudioPort *port, QString newClient)
@@ -502,7 +657,7 @@ void KonfytJackEngine::addPortClient(KfJackAudioPort *port, QString newClient)
     if (!clientIsActive()) { return; }
 
     port->connectionList.append(newClient);
-    refreshAllPortsConnections();
+    updateConnections();
 }
 
 void KonfytJackEngine::removeAndDisconnectPortClient(KfJackMidiPort *port, QString client)
@@ -514,26 +669,11 @@ void KonfytJackEngine::removeAndDisconnectPortClient(KfJackMidiPort *port, QStri
     if (!port->connectionList.contains(client)) { return; }
 
     bool portIsInput = midiInPorts.contains(port);
-    const char* portName = jack_port_name(port->jackPointer);
-
-    pauseJackProcessing(true);
 
-    // Disconnect client from port in JACK
-    int err = 0;
-    if (portIsInput) {
-        err = jack_disconnect(mJackClient, client.toLocal8Bit().constData(), portName);
-    } else {
-        err = jack_disconnect(mJackClient, portName, client.toLocal8Bit().constData());
-    }
-    // Remove client from port's list
+    // Remove client from port's list, then disconnect in JACK
     port->connectionList.removeAll(client);
-
-    pauseJackProcessing(false);
-
-    if (err) {
-        print("Failed to disconnect JACK MIDI port client.");
-    }
-    refreshAllPortsConnections();
+    updateConnections();
+    disconnectPortClient(port->jackPointer, client, portIsInput ? INPUT_PORT : OUTPUT_PORT);
 }
 
 void KonfytJackEngine::removeAndDisconnectPortClient(KfJackAudioPort *port, QString client)
@@ -545,26 +685,11 @@ void KonfytJackEngine::removeAndDisconnectPortClient(KfJackAudioPort *port, QStr
     if (!port->connectionList.contains(client)) { return; }
 
     bool portIsInput = audioInPorts.contains(port);
-    const char* portName = jack_port_name(port->jackPointer);
-
-    pauseJackProcessing(true);
 
-    // Disconnect client from port in JACK
-    int err = 0;
-    if (portIsInput) {
-        err = jack_disconnect(mJackClient, client.toLocal8Bit().constData(), portName);
-    } else {
-        err = jack_disconnect(mJackClient, portName, client.toLocal8Bit().constData());
-    }
-    // Remove client from port's list
+    // Remove client from port's list, then disconnect in JACK
     port->connectionList.removeAll(client);
-
-    pauseJackProcessing(false);
-
-    if (err) {
-        print("Failed to disconnect JACK audio port client.");
-    }
-    refreshAllPortsConnections();
+    updateConnections();
+    disconnectPortClient(port->jackPointer, client, portIsInput ? INPUT_PORT : OUTPUT_PORT);
 }
 
 void KonfytJackEngine::setPortFilter(KfJackMidiPort *port, KonfytMidiFilter filter)
@@ -583,6 +708,7 @@ void KonfytJackEngine::setPortGain(KfJackAudioPort *port, float gain)
     if (!clientIsActive()) { return; }
 
     port->gain = gain;
+    updateDirectAudioRoutes();
 }
 
 KfJackAudioRoute *KonfytJackEngine::addAudioRoute(KfJackAudioPort *sourcePort, KfJackAudioPort *destPort)
@@ -617,8 +743,14 @@ void KonfytJackEngine::setAudioRoute(KfJackAudioRoute *route, KfJackAudioPort *s
 
     route->source = sourcePort;
     route->dest = destPort;
+    // Determined again for the new ports
+    bool wasDirect = route->directWanted;
+    route->directWanted = false;
 
     pauseJackProcessing(false);
+
+    if (wasDirect) { updateConnections(); }
+    updateDirectAudioRoutes();
 }
 
 void KonfytJackEngine::removeAudioRoute(KfJackAudioRoute* route)
@@ -630,9 +762,13 @@ void KonfytJackEngine::removeAudioRoute(KfJackAudioRoute* route)
     pauseJackProcessing(true);
 
     audioRoutes.removeAll(route);
+    bool wasDirect = route->directWanted;
+    free(route->delayBuffer);
     delete route;
 
     pauseJackProcessing(false);
+
+    if (wasDirect) { updateConnections(); }
 }
 
 void KonfytJackEngine::setAudioRouteActive(KfJackAudioRoute *route, bool active)
@@ -642,6 +778,7 @@ void KonfytJackEngine::setAudioRouteActive(KfJackAudioRoute *route, bool active)
     if (!clientIsActive()) { return; }
 
     route->active = active;
+    updateDirectAudioRoutes();
 }
 
 void KonfytJackEngine::setAudioRouteGain(KfJackAudioRoute *route, float gain)
@@ -651,6 +788,7 @@ void KonfytJackEngine::setAudioRouteGain(KfJackAudioRoute *route, float gain)
     if (!clientIsActive()) { return; }
 
     route->gain = gain;
+    updateDirectAudioRoutes();
 }
 
 KfJackMidiRoute *KonfytJackEngine::addMidiRoute(KfJackMidiPort *sourcePort, KfJackMidiPort *destPort)
@@ -787,16 +925,24 @@ void KonfytJackEngine::pauseJackProcessing(bool pause)
     }
 }
 
-void KonfytJackEngine::jackPortConnectCallback(jack_port_id_t /*a*/, jack_port_id_t /*b*/, int /*connect*/, void* arg)
+void KonfytJackEngine::jackPortConnectCallback(jack_port_id_t a, jack_port_id_t b, int connect, void* arg)
+{
+    KonfytJackEngine* e = (KonfytJackEngine*)arg;
+    e->jackPortConnectCallback(a, b, connect);
+}
+
+void KonfytJackEngine::jackPortRegistrationCallback(jack_port_id_t port, int registered, void *arg)
 {
     KonfytJackEngine* e = (KonfytJackEngine*)arg;
-    e->jackPortConnectCallback();
+    e->jackPortRegistrationCallback(port, registered);
 }
 
-void KonfytJackEngine::jackPortRegistrationCallback(jack_port_id_t /*port*/, int /*registered*/, void *arg)
+void KonfytJackEngine::jackPortRenameCallback(jack_port_id_t port, const char *oldName,
+                                              const char *newName, void *arg)
 {
     KonfytJackEngine* e = (KonfytJackEngine*)arg;
-    e->jackPortRegistrationCallback();
+    e->jackPortRenameCallback(port, QString::fromLocal8Bit(oldName),
+                              QString::fromLocal8Bit(newName));
 }
 
 /* Static callback function given to JACK, which calls the specific class instance
@@ -814,6 +960,13 @@ int KonfytJackEngine::jackXrunCallback(void *arg)
     return 0;
 }
 
+int KonfytJackEngine::jackGraphOrderCallback(void *arg)
+{
+    KonfytJackEngine* e = (KonfytJackEngine*)arg;
+    e->mGraphOrderCallback = true;
+    return 0;
+}
+
 /* Non-static class instance-specific JACK process callback. */
 int KonfytJackEngine::jackProcessCallback(jack_nframes_t nframes)
 {
@@ -865,14 +1018,48 @@ int KonfytJackEngine::jackProcessCallback(jack_nframes_t nframes)
     return 0;
 }
 
-void KonfytJackEngine::jackPortConnectCallback()
+void KonfytJackEngine::jackPortConnectCallback(jack_port_id_t a, jack_port_id_t b, int connect)
 {
-    mConnectCallback = true;
+    connections.portsConnected(a, b, connect);
 }
 
-void KonfytJackEngine::jackPortRegistrationCallback()
+void KonfytJackEngine::jackPortRegistrationCallback(jack_port_id_t port, int registered)
 {
-    mRegisterCallback = true;
+    // The port can only be looked up here, before it is removed
+    jack_port_t* p = jack_port_by_id(mJackClient, port);
+    if (!p) { return; }
+    KonfytJackPortRegistry::Change change;
+    change.kind = registered ? KonfytJackPortRegistry::Change::PortAdded
+                             : KonfytJackPortRegistry::Change::PortRemoved;
+    change.type = KonfytJackPortRegistry::portType(p);
+    change.port = QString::fromLocal8Bit(jack_port_name(p));
+    queuePortChange(change);
+}
+
+void KonfytJackEngine::jackPortRenameCallback(jack_port_id_t port, QString oldName,
+                                              QString newName)
+{
+    jack_port_t* p = jack_port_by_id(mJackClient, port);
+    if (!p) { return; }
+    KonfytJackPortRegistry::Change change;
+    change.kind = KonfytJackPortRegistry::Change::PortRenamed;
+    change.type = KonfytJackPortRegistry::portType(p);
+    change.port = newName;
+    change.oldName = oldName;
+    queuePortChange(change);
+}
+
+/* Called from the JACK notification thread. The change is applied to the
+ * registry right away and passed on to the connection manager. It is reported
+ * in the timer event. */
+void KonfytJackEngine::queuePortChange(KonfytJackPortRegistry::Change change)
+{
+    if (!portRegistry.apply(change)) { return; }
+    connections.portChanged(change);
+
+    portChangesMutex.lock();
+    portChanges.append(change);
+    portChangesMutex.unlock();
 }
 
 void KonfytJackEngine::setFluidsynthEngine(KonfytFluidsynthEngine *e)
@@ -942,6 +1129,12 @@ void KonfytJackEngine::mixBufferToDestinationPort(KfJackAudioRoute *route,
         if (route->source->buffer) {
             frame = ((jack_default_audio_sample_t*)(route->source->buffer))[i];
         }
+        if (route->delayFrames) {
+            float delayed = route->delayBuffer[route->delayPos];
+            route->delayBuffer[route->delayPos] = frame;
+            route->delayPos = (route->delayPos + 1) % route->delayFrames;
+            frame = delayed;
+        }
         frame = frame  * gain * fadeOutValues[route->fadeoutCounter];
 
         route->rxBufferSum += qAbs(frame);
@@ -961,6 +1154,28 @@ void KonfytJackEngine::mixBufferToDestinationPort(KfJackAudioRoute *route,
         }
     }
 
+    stashRouteLevel(route, nframes);
+}
+
+/* Helper function for JACK process callback. The audio of a direct route is
+ * passed by JACK, so only the level of the source is read for display. */
+void KonfytJackEngine::readDirectRouteLevel(KfJackAudioRoute *route,
+                                            jack_nframes_t nframes)
+{
+    if (route->source->buffer) {
+        jack_default_audio_sample_t* buffer =
+                (jack_default_audio_sample_t*)route->source->buffer;
+        for (jack_nframes_t i = 0;  i < nframes; i++) {
+            route->rxBufferSum += qAbs(buffer[i]);
+        }
+    }
+
+    stashRouteLevel(route, nframes);
+}
+
+/* Helper function for JACK process callback */
+void KonfytJackEngine::stashRouteLevel(KfJackAudioRoute *route, jack_nframes_t nframes)
+{
     // Maintain a sum of the audio buffer and preiodically add it to a ringbuffer
     // so it can be given to the GUI thread later for display purposes.
     route->rxCycleCount++;
@@ -1122,6 +1337,21 @@ void KonfytJackEngine::jackProcess_prepareAudioPortBuffers(jack_nframes_t nframe
         }
     }
 
+    // Render plugins that run in our process callback. Plugins rendering in
+    // other processes all get half a period from here.
+    jack_time_t deadline = jack_get_time()
+            + (jack_time_t)(nframes * 500000.0 / mJackSampleRate);
+    for (int prt = 0; prt < internalPluginPorts.count(); prt++) {
+        internalPluginPorts.at(prt)->internalPlugin->startProcess(nframes, deadline);
+    }
+    for (int prt = 0; prt < internalPluginPorts.count(); prt++) {
+        KfJackPluginPorts* p = internalPluginPorts.at(prt);
+        p->internalPlugin->process(
+                    (jack_default_audio_sample_t*)p->audioInLeft->buffer,
+                    (jack_default_audio_sample_t*)p->audioInRight->buffer,
+                    nframes );
+    }
+
     // Get all plugin audio in port buffers
     for (int prt = 0; prt < pluginPorts.count(); prt++) {
         KfJackPluginPorts* pluginPort = pluginPorts.at(prt);
@@ -1139,6 +1369,10 @@ void KonfytJackEngine::jackProcess_processAudioRoutes(jack_nframes_t nframes)
     // For each audio route, if active, mix source buffer to destination buffer
     for (int r = 0; r < audioRoutes.count(); r++) {
         KfJackAudioRoute* route = audioRoutes[r];
+        if (route->direct) {
+            readDirectRouteLevel(route, nframes);
+            continue;
+        }
         bool outputFlag = false;
         if (route->active) {
             route->fadingOut = false;
@@ -1150,7 +1384,14 @@ void KonfytJackEngine::jackProcess_processAudioRoutes(jack_nframes_t nframes)
             }
         }
         if (outputFlag) {
+            if (route->delayStale) {
+                memset(route->delayBuffer, 0, sizeof(float)*route->delayFrames);
+                route->delayStale = false;
+            }
             mixBufferToDestinationPort(route, nframes, true);
+        } else if (route->delayFrames) {
+            // The delay line is not fed while the route is silent
+            route->delayStale = true;
         }
     }
 
@@ -1196,6 +1437,14 @@ void KonfytJackEngine::jackProcess_midiPanicOutput()
         fluidsynthEngine->processJackMidi( synth, &(evPitchbendZero) );
     }
 
+    // Also give to plugins that run in our process callback
+    for (int p = 0; p < internalPluginPorts.count(); p++) {
+        KfJackInternalPlugin* plugin = internalPluginPorts.at(p)->internalPlugin;
+        plugin->midiEvent(evAllNotesOff, 0);
+        plugin->midiEvent(evSustainZero, 0);
+        plugin->midiEvent(evPitchbendZero, 0);
+    }
+
     // Give to all output ports to external apps
     for (int p = 0; p < midiOutPorts.count(); p++) {
         KfJackMidiPort* port = midiOutPorts.at(p);
@@ -1376,6 +1625,9 @@ void KonfytJackEngine::jackProcess_sendMidiRouteTxEvents(jack_nframes_t /*nframe
                                                  event.bufferSizeRequired());
                 if (outBuffer) { event.toBuffer(outBuffer); }
 
+            } else if (route->destInternalPlugin) {
+                // Destination is plugin in our process callback
+                route->destInternalPlugin->midiEvent(event, 0);
             } else {
                 // Destination is Fluidsynth port
                 fluidsynthEngine->processJackMidi(route->destFluidsynthID,
@@ -1405,15 +1657,21 @@ bool KonfytJackEngine::initJackClient(QString name)
     }
 
 
+    connections.setClient(mJackClient);
+
     // Set up callback functions
     jack_set_port_connect_callback(mJackClient,
                 KonfytJackEngine::jackPortConnectCallback, this);
     jack_set_port_registration_callback(mJackClient,
                 KonfytJackEngine::jackPortRegistrationCallback, this);
+    jack_set_port_rename_callback(mJackClient,
+                KonfytJackEngine::jackPortRenameCallback, this);
     jack_set_process_callback (mJackClient,
                 KonfytJackEngine::jackProcessCallback, this);
     jack_set_xrun_callback(mJackClient,
                 KonfytJackEngine::jackXrunCallback, this);
+    jack_set_graph_order_callback(mJackClient,
+                KonfytJackEngine::jackGraphOrderCallback, this);
 
     mJackBufferSize = jack_get_buffer_size(mJackClient);
 
@@ -1426,6 +1684,10 @@ bool KonfytJackEngine::initJackClient(QString name)
     } else {
         print("Activated client.");
         mClientActive = true;
+        // Changes received until now are also in the filled registry and
+        // won't have an effect when applied.
+        portRegistry.fill(mJackClient);
+        emit connections.requestStart();
     }
 
     // Get sample rate
@@ -1451,40 +1713,22 @@ bool KonfytJackEngine::initJackClient(QString name)
 void KonfytJackEngine::stopJackClient()
 {
     if (clientIsActive()) {
+        emit connections.requestStop();
         pauseJackProcessing(true);
         jack_client_close(mJackClient);
         mJackClient = nullptr;
         mClientActive = false;
         pauseJackProcessing(false);
+        connections.setClient(nullptr);
+        directConnections.clear();
+        directConfirmed.clear();
+        portRegistry.clear();
+        portChangesMutex.lock();
+        portChanges.clear();
+        portChangesMutex.unlock();
     }
 }
 
-/* Get a string list of JACK ports, based on type pattern (e.g. "midi" or "audio", etc.)
- * and flags (e.g. JackPortIsInput or JackPortIsOutput). */
-QStringList KonfytJackEngine::getJackPorts(QString typePattern, unsigned long flags)
-{
-    QStringList pl;
-    char** ports;
-
-    ports = (char**)jack_get_ports(mJackClient,NULL,typePattern.toLocal8Bit(), flags);
-
-    int i=0;
-    if (ports != NULL) {
-        while (ports[i] != NULL) {
-
-            QString portname = QString::fromLocal8Bit(ports[i]);
-
-            pl.append(portname);
-
-            i++;
-        }
-
-        jack_free(ports);
-    }
-
-    return pl;
-}
-
 void KonfytJackEngine::writeRouteMidi(KfJackMidiRoute *route,
                                       KonfytMidiEvent &ev, jack_nframes_t time)
 {
@@ -1497,51 +1741,54 @@ void KonfytJackEngine::writeRouteMidi(KfJackMidiRoute *route,
 
         // Copy event to output buffer
         ev.toBuffer(outBuffer);
+    } else if (route->destInternalPlugin) {
+        // Destination is plugin in our process callback
+        route->destInternalPlugin->midiEvent(ev, time);
     } else {
         // Destination is Fluidsynth port
         fluidsynthEngine->processJackMidi(route->destFluidsynthID, &ev);
     }
 }
 
-/* Returns list of JACK midi input ports from the JACK server. */
+/* Returns list of JACK midi input ports from the port registry. */
 QStringList KonfytJackEngine::getMidiInputPortsList()
 {
-    return getJackPorts("midi", JackPortIsInput);
+    return portRegistry.ports(KonfytJackPortRegistry::MidiInput);
 }
 
-/* Returns list of JACK midi output ports from the JACK server. */
+/* Returns list of JACK midi output ports from the port registry. */
 QStringList KonfytJackEngine::getMidiOutputPortsList()
 {
-    return getJackPorts("midi", JackPortIsOutput);
+    return portRegistry.ports(KonfytJackPortRegistry::MidiOutput);
 }
 
-/* Returns list of JACK audio input ports from the JACK server. */
+/* Returns list of JACK audio input ports from the port registry. */
 QStringList KonfytJackEngine::getAudioInputPortsList()
 {
-    return getJackPorts("audio", JackPortIsInput);
+    return portRegistry.ports(KonfytJackPortRegistry::AudioInput);
 }
 
-/* Returns list of JACK audio output ports from the JACK server. */
+/* Returns list of JACK audio output ports from the port registry. */
 QStringList KonfytJackEngine::getAudioOutputPortsList()
 {
-    return getJackPorts("audio", JackPortIsOutput);
+    return portRegistry.ports(KonfytJackPortRegistry::AudioOutput);
 }
 
 QSet<QString> KonfytJackEngine::getJackClientsList()
 {
-    QSet<QString> clients;
-
-    QStringList ports;
-    ports.append(getMidiInputPortsList());
-    ports.append(getMidiOutputPortsList());
-    ports.append(getAudioInputPortsList());
-    ports.append(getAudioOutputPortsList());
+    return portRegistry.clients();
+}
 
-    foreach (const QString& port, ports) {
-        clients.insert(port.split(":").value(0));
-    }
+bool KonfytJackEngine::jackPortExists(QString port)
+{
+    return portRegistry.contains(port);
+}
 
-    return clients;
+/* Version of the port registry. This changes whenever ports are added,
+ * removed or renamed. */
+quint64 KonfytJackEngine::jackPortsVersion()
+{
+    return portRegistry.version();
 }
 
 KfJackMidiPort *KonfytJackEngine::addMidiPort(QString name, bool isInput)
@@ -1593,6 +1840,8 @@ void KonfytJackEngine::removeMidiPort(KfJackMidiPort *port)
     removePortFromAllRoutes(port);
 
     pauseJackProcessing(false);
+
+    updateConnections();
 }
 
 void KonfytJackEngine::removeAudioPort(KfJackAudioPort *port)
@@ -1610,6 +1859,8 @@ void KonfytJackEngine::removeAudioPort(KfJackAudioPort *port)
     removePortFromAllRoutes(port);
 
     pauseJackProcessing(false);
+
+    updateConnections();
 }
 
 uint32_t KonfytJackEngine::getSampleRate()
@@ -1634,37 +1885,31 @@ void KonfytJackEngine::addOtherJackConPair(KonfytJackConPair p)
 
     otherConsList.append(p);
 
-    refreshAllPortsConnections();
+    updateConnections();
 }
 
 void KonfytJackEngine::removeOtherJackConPair(KonfytJackConPair p)
 {
-    pauseJackProcessing(true);
-
     for (int i=0; i<otherConsList.count(); i++) {
         if (p.equals(otherConsList[i])) {
             otherConsList.removeAt(i);
+            updateConnections();
 
             // Disconnect JACK ports
             if (clientIsActive()) {
-                jack_disconnect(mJackClient, p.srcPort.toLocal8Bit(), p.destPort.toLocal8Bit());
+                emit connections.requestDisconnect(
+                            {p.srcPort.toLocal8Bit(), p.destPort.toLocal8Bit()});
             }
 
             break;
         }
     }
-
-    pauseJackProcessing(false);
-    refreshAllPortsConnections();
 }
 
 void KonfytJackEngine::clearOtherJackConPair()
 {
-    pauseJackProcessing(true);
-
     otherConsList.clear();
-
-    pauseJackProcessing(false);
+    updateConnections();
 }
 
 void KonfytJackEngine::setGlobalTranspose(int transpose)
@@ -1672,6 +1917,188 @@ void KonfytJackEngine::setGlobalTranspose(int transpose)
     this->mGlobalTranspose = transpose;
 }
 
+void KonfytJackEngine::setLatencyCompensation(bool enable)
+{
+    mLatencyCompensation = enable;
+    updateLatencyCompensation();
+}
+
+void KonfytJackEngine::setDirectAudioInput(bool enable)
+{
+    mDirectAudioInput = enable;
+    updateDirectAudioRoutes();
+}
+
+/* A route can be direct if the JACK connections would pass exactly the same
+ * audio as mixing it in our process callback. */
+bool KonfytJackEngine::audioRouteCanBeDirect(KfJackAudioRoute *route)
+{
+    if (!mDirectAudioInput || panicCmd) { return false; }
+    if (!route->active || route->fadeoutCounter || route->delayFrames) { return false; }
+    if (route->gain != 1) { return false; }
+    // Only audio input ports to buses, not plugin audio
+    if (!audioInPorts.contains(route->source)) { return false; }
+    if (!audioOutPorts.contains(route->dest)) { return false; }
+    return route->dest->gain == 1;
+}
+
+/* Switch routes to and from direct JACK connections when they start or stop
+ * needing processing. Called when anything that audioRouteCanBeDirect()
+ * depends on changes, and from the timer for fades. A route that stops being
+ * direct is disconnected before it is mixed again, e.g. fading out when it is
+ * deactivated. A route that becomes direct is only bypassed once the
+ * connection manager has confirmed its connections. */
+void KonfytJackEngine::updateDirectAudioRoutes()
+{
+    if (!clientIsActive()) { return; }
+
+    bool changed = false;
+    foreach (KfJackAudioRoute* route, audioRoutes) {
+        bool direct = audioRouteCanBeDirect(route);
+        if (direct != route->directWanted) {
+            route->directWanted = direct;
+            changed = true;
+        }
+    }
+    if (changed) {
+        updateConnections();
+    }
+}
+
+QSet<KfJackConnection> KonfytJackEngine::directRouteConnections(KfJackAudioRoute *route)
+{
+    QSet<KfJackConnection> ret;
+    if (!route->source || !route->dest) { return ret; }
+    foreach (QString src, route->source->connectionList) {
+        foreach (QString dest, route->dest->connectionList) {
+            ret.insert({src.toLocal8Bit(), dest.toLocal8Bit()});
+        }
+    }
+    return ret;
+}
+
+/* Bypass mixing for the routes of which all direct connections are in the
+ * graph, and mix the others. */
+void KonfytJackEngine::updateDirectRouteStates()
+{
+    foreach (KfJackAudioRoute* route, audioRoutes) {
+        bool direct = false;
+        if (route->directWanted) {
+            direct = directConfirmed.contains(directRouteConnections(route));
+        }
+        route->direct = direct;
+    }
+}
+
+void KonfytJackEngine::onWantedConnectionChanged(KfJackConnection connection, bool inGraph)
+{
+    if (!directConnections.contains(connection)) { return; }
+    if (inGraph) {
+        directConfirmed.insert(connection);
+    } else {
+        directConfirmed.remove(connection);
+    }
+    updateDirectRouteStates();
+}
+
+/* Determine the latency of each plugin, i.e. from sending MIDI to the plugin
+ * until its audio is received, from the JACK port latencies. The period it
+ * takes for the plugin audio to loop back to our client is not included: the
+ * in-process layers are rendered before the MIDI of the cycle is handled, so
+ * they are also a period late. Returns true if a latency changed. */
+bool KonfytJackEngine::measurePluginLatencies()
+{
+    if (!clientIsActive()) { return false; }
+
+    bool changed = false;
+    foreach (KfJackPluginPorts* p, pluginPorts) {
+        jack_latency_range_t midiRange;
+        jack_latency_range_t audioRange;
+        jack_port_get_latency_range(p->midi->jackPointer, JackCaptureLatency, &midiRange);
+        jack_port_get_latency_range(p->audioInLeft->jackPointer, JackCaptureLatency, &audioRange);
+
+        jack_nframes_t latency = 0;
+        if (audioRange.max > midiRange.max) {
+            latency = audioRange.max - midiRange.max;
+        }
+        if (latency != p->latency) {
+            p->latency = latency;
+            changed = true;
+            print(QString("Plugin %1 latency: %2 frames")
+                  .arg(jack_port_short_name(p->midi->jackPointer)).arg(latency));
+        }
+    }
+    return changed;
+}
+
+/* Delay the audio routes so that the routes of all layers are aligned to the
+ * active plugin with the highest latency. The delay lines are only
+ * (re)allocated for routes whose delay changes. When called while processing
+ * is paused, e.g. for a patch switch, the delays change in the same cycle as
+ * the layers. */
+void KonfytJackEngine::updateLatencyCompensation()
+{
+    if (!clientIsActive()) { return; }
+
+    // Routes of plugins receive audio with the plugin's latency already
+    QHash<KfJackAudioRoute*, jack_nframes_t> routeLatency;
+    jack_nframes_t compensation = 0;
+    foreach (KfJackPluginPorts* p, pluginPorts) {
+        routeLatency.insert(p->audioLeftRoute, p->latency);
+        routeLatency.insert(p->audioRightRoute, p->latency);
+        if (mLatencyCompensation && p->midiRoute->active) {
+            compensation = qMax(compensation, p->latency);
+        }
+    }
+
+    if (compensation != mCompensationFrames) {
+        mCompensationFrames = compensation;
+        print("Latency compensation: " + n2s(compensation) + " frames");
+    }
+
+    QList<KfJackAudioRoute*> changed;
+    QList<float*> newBuffers;
+    QList<jack_nframes_t> newFrames;
+    foreach (KfJackAudioRoute* route, audioRoutes) {
+        jack_nframes_t delay = 0;
+        // Only instrument layers are compensated, live audio inputs are not
+        // delayed.
+        if (!audioInPorts.contains(route->source)) {
+            jack_nframes_t latency = routeLatency.value(route, 0);
+            delay = (compensation > latency) ? compensation - latency : 0;
+        }
+        if (delay == route->delayFrames) { continue; }
+        float* buffer = nullptr;
+        if (delay) {
+            buffer = (float*)calloc(delay, sizeof(float));
+            if (!buffer) { continue; }
+        }
+        changed.append(route);
+        newBuffers.append(buffer);
+        newFrames.append(delay);
+    }
+    if (changed.isEmpty()) { return; }
+
+    QList<float*> oldBuffers;
+    pauseJackProcessing(true);
+    for (int i = 0; i < changed.count(); i++) {
+        KfJackAudioRoute* route = changed[i];
+        oldBuffers.append(route->delayBuffer);
+        route->delayBuffer = newBuffers[i];
+        route->delayFrames = newFrames[i];
+        route->delayPos = 0;
+        route->delayStale = false;
+    }
+    pauseJackProcessing(false);
+
+    foreach (float* buffer, oldBuffers) {
+        free(buffer);
+    }
+
+    // Delayed routes can't be direct
+    updateDirectAudioRoutes();
+}
+
 jack_port_t *KonfytJackEngine::registerJackMidiPort(QString name, bool input)
 {
     jack_port_t* port = jack_port_register( mJackClient,
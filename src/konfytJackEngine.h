@@ -25,6 +25,8 @@
 #include "konfytArrayList.h"
 #include "konfytDefines.h"
 #include "konfytFluidsynthEngine.h"
+#include "konfytJackConnections.h"
+#include "konfytJackPortRegistry.h"
 #include "konfytJackStructs.h"
 #include "konfytProject.h"
 #include "konfytStructs.h"
@@ -37,8 +39,11 @@
 #include <QObject>
 #include <QSet>
 #include <QStringList>
+#include <QThread>
 #include <QTimerEvent>
 
+#include <atomic>
+
 
 #define KONFYT_JACK_DEFAULT_CLIENT_NAME "Konfyt" // Default client name. Actual name is set in the JACK client.
 #define KONFYT_JACK_SYSTEM_OUT_LEFT "system:playback_1"
@@ -58,13 +63,17 @@ public:
     // Static JACK callback functions
     static void jackPortConnectCallback(jack_port_id_t a, jack_port_id_t b, int connect, void* arg);
     static void jackPortRegistrationCallback(jack_port_id_t port, int registered, void *arg);
+    static void jackPortRenameCallback(jack_port_id_t port, const char* oldName,
+                                       const char* newName, void *arg);
     static int jackProcessCallback(jack_nframes_t nframes, void *arg);
     static int jackXrunCallback(void *arg);
+    static int jackGraphOrderCallback(void *arg);
 
     // Non-static JACK callback functions
     int jackProcessCallback(jack_nframes_t nframes);
-    void jackPortConnectCallback();
-    void jackPortRegistrationCallback();
+    void jackPortConnectCallback(jack_port_id_t a, jack_port_id_t b, int connect);
+    void jackPortRegistrationCallback(jack_port_id_t port, int registered);
+    void jackPortRenameCallback(jack_port_id_t port, QString oldName, QString newName);
 
     void setFluidsynthEngine(KonfytFluidsynthEngine* e);
 
@@ -81,11 +90,14 @@ public:
     uint32_t getBufferSize();
 
     // JACK helper functions (Not specific to our client)
+    // The ports are kept in a registry, see jackPortsChanged().
     QStringList getMidiInputPortsList();
     QStringList getMidiOutputPortsList();
     QStringList getAudioInputPortsList();
     QStringList getAudioOutputPortsList();
     QSet<QString> getJackClientsList();
+    bool jackPortExists(QString port);
+    quint64 jackPortsVersion();
 
     // Audio / MIDI in/out ports
     KfJackMidiPort* addMidiPort(QString name, bool isInput);
@@ -123,6 +135,11 @@ public:
 
     // SFZ plugins
     KfJackPluginPorts* addPluginPortsAndConnect(const KonfytJackPortsSpec &spec);
+    void setPluginConnections(KfJackPluginPorts *p, QString midiOutConnectTo,
+                              QString audioInLeftConnectTo,
+                              QString audioInRightConnectTo);
+    KfJackPluginPorts* addInternalPlugin(KfJackInternalPlugin* plugin,
+                                         KonfytMidiFilter filter);
     void removePlugin(KfJackPluginPorts *p);
     void setPluginMidiFilter(KfJackPluginPorts *p, KonfytMidiFilter filter);
     void setPluginMidiPreFilter(KfJackPluginPorts *p, KonfytMidiFilter filter);
@@ -151,9 +168,16 @@ public:
 
     void setGlobalTranspose(int transpose);
 
+    // Delay in-process layers to align them with plugin (SFZ) layers
+    void setLatencyCompensation(bool enable);
+    // Must be called when plugins are activated or deactivated
+    void updateLatencyCompensation();
+    // Connect audio input layers that need no processing directly in JACK
+    void setDirectAudioInput(bool enable);
+
 signals:
     void print(QString msg);
-    void jackPortRegisteredOrConnected();
+    void jackPortsChanged(QList<KonfytJackPortRegistry::Change> changes);
     void midiEventsReceived();
     void audioEventsReceived();
     void xrunOccurred();
@@ -163,8 +187,7 @@ private:
     jack_nframes_t mJackBufferSize; // TODO THIS MIGHT CHANGE, REGISTER BUFSIZE CALLBACK TO UPDATE
     bool mClientActive = false; // Flag to indicate if the client has been successfully activated
     uint32_t mJackSampleRate;
-    bool mConnectCallback = false;
-    bool mRegisterCallback = false;
+    std::atomic<bool> mGraphOrderCallback{false}; // Set from JACK notification thread
 
     // MIDI data received from JACK thread
     RingbufferQMutex<KfJackMidiRxEvent> midiRxBuffer{1000};
@@ -204,6 +227,8 @@ private:
 
     QList<KfJackPluginPorts*> pluginPorts;
     QList<KfJackPluginPorts*> fluidsynthPorts;
+    QList<KfJackPluginPorts*> internalPluginPorts;
+    void removeInternalPlugin(KfJackPluginPorts* p);
 
     // MIDI and audio routes
     QList<KfJackMidiRoute*> midiRoutes;
@@ -218,24 +243,58 @@ private:
     // Other JACK connections
     QList<KonfytJackConPair> otherConsList;
 
-    // Timer for communicating data from JACK process to the rest of the app as
-    // well as restoring JACK port connections.
+    // Connections of our ports and other connections are made in the
+    // background by the connection manager, see updateConnections().
+    KonfytJackConnections connections;
+    QThread connectionsThread;
+    void updateConnections();
+    enum PortDirection { INPUT_PORT, OUTPUT_PORT };
+    void appendPortConnections(QList<KfJackConnection>* list, jack_port_t* jackPort,
+                               QStringList clients, PortDirection dir);
+    void disconnectPortClient(jack_port_t* jackPort, QString client, PortDirection dir);
+
+    // Timer for communicating data from JACK process to the rest of the app.
     QBasicTimer timer;
     void timerEvent(QTimerEvent *event);
     void startTimer();
-    void refreshAllPortsConnections();
-    enum PortDirection { INPUT_PORT, OUTPUT_PORT };
-    void refreshConnections(jack_port_t* jackPort, QStringList clients,
-                            PortDirection dir);
 
     int mGlobalTranspose = 0;
 
-    QStringList getJackPorts(QString typePattern, unsigned long flags);
+    // Latency compensation: plugin audio is received from JACK the plugin's
+    // own latency later than the audio of in-process layers. When plugin
+    // layers are active, the other audio routes are delayed so that all
+    // layers are aligned.
+    bool mLatencyCompensation = true;
+    jack_nframes_t mCompensationFrames = 0;
+    bool measurePluginLatencies();
+
+    // Audio input routes that need no processing (active, unity gain, not
+    // fading or delayed) can be passed by connecting the clients of the input
+    // port directly to the clients of the bus, bypassing our process callback.
+    // The level of the input is still read for the meters.
+    bool mDirectAudioInput = false;
+    QSet<KfJackConnection> directConnections; // Requested
+    QSet<KfJackConnection> directConfirmed;   // Confirmed in the graph
+    bool audioRouteCanBeDirect(KfJackAudioRoute* route);
+    void updateDirectAudioRoutes();
+    QSet<KfJackConnection> directRouteConnections(KfJackAudioRoute* route);
+    void updateDirectRouteStates();
+    void onWantedConnectionChanged(KfJackConnection connection, bool inGraph);
+
+    // Ports in the JACK graph, also used by the connection manager. Changes
+    // are applied in the JACK notification thread and reported in the timer
+    // event.
+    KonfytJackPortRegistry portRegistry;
+    QMutex portChangesMutex;
+    QList<KonfytJackPortRegistry::Change> portChanges;
+    void queuePortChange(KonfytJackPortRegistry::Change change);
 
     // JACK process callback helper functions
     void writeRouteMidi(KfJackMidiRoute* route, KonfytMidiEvent &ev, jack_nframes_t time);
     bool handleNoteoffEvent(const KonfytMidiEvent& ev, KfJackMidiRoute* route, jack_nframes_t time);
     void mixBufferToDestinationPort(KfJackAudioRoute* route, jack_nframes_t nframes, bool applyGain);
+    void readDirectRouteLevel(KfJackAudioRoute* route, jack_nframes_t nframes);
+    void stashRouteLevel(KfJackAudioRoute* route, jack_nframes_t nframes);
     void sendMidiClosureEvents(KfJackMidiPort* port, int channel);
     void sendMidiClosureEvents_chanZeroOnly(KfJackMidiPort* port);
     void sendMidiClosureEvents_allChannels(KfJackMidiPort* port);
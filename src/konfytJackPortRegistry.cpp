@@ -0,0 +1,167 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytJackPortRegistry.h"
+
+/* Type of the port as used by the registry, based on its JACK type and
+ * flags. Ports that aren't MIDI or audio are not kept in the registry. */
+KonfytJackPortRegistry::PortType KonfytJackPortRegistry::portType(jack_port_t *port)
+{
+    QString type = QString::fromLocal8Bit(jack_port_type(port));
+    bool input = jack_port_flags(port) & JackPortIsInput;
+    if (type.contains("midi")) {
+        return input ? MidiInput : MidiOutput;
+    } else if (type.contains("audio")) {
+        return input ? AudioInput : AudioOutput;
+    }
+    return OtherPortType;
+}
+
+QString KonfytJackPortRegistry::clientOfPort(QString port)
+{
+    return port.section(':', 0, 0);
+}
+
+/* Replace the registry contents with all the ports currently in the JACK
+ * graph. */
+void KonfytJackPortRegistry::fill(jack_client_t *client)
+{
+    QMutexLocker locker(&mutex);
+
+    clearPorts();
+
+    const char** ports = jack_get_ports(client, NULL, NULL, 0);
+    if (ports == NULL) { return; }
+
+    for (int i=0; ports[i] != NULL; i++) {
+        jack_port_t* port = jack_port_by_name(client, ports[i]);
+        if (!port) { continue; }
+        Change change;
+        change.kind = Change::PortAdded;
+        change.type = portType(port);
+        change.port = QString::fromLocal8Bit(ports[i]);
+        applyChange(change);
+    }
+    jack_free(ports);
+}
+
+void KonfytJackPortRegistry::clear()
+{
+    QMutexLocker locker(&mutex);
+    clearPorts();
+}
+
+/* Apply a change to the registry. Returns false if the change has no effect,
+ * e.g. a port that was already added when the registry was filled. */
+bool KonfytJackPortRegistry::apply(const Change &change)
+{
+    QMutexLocker locker(&mutex);
+    return applyChange(change);
+}
+
+void KonfytJackPortRegistry::clearPorts()
+{
+    portTypes.clear();
+    for (int i=0; i < OtherPortType; i++) {
+        portLists[i].clear();
+    }
+    clientPortCounts.clear();
+    mVersion++;
+}
+
+bool KonfytJackPortRegistry::applyChange(const Change &change)
+{
+    if (change.type == OtherPortType) { return false; }
+
+    switch (change.kind) {
+    case Change::PortAdded:
+        if (portTypes.contains(change.port)) { return false; }
+        addPort(change.port, change.type);
+        break;
+    case Change::PortRemoved:
+        if (!portTypes.contains(change.port)) { return false; }
+        removePort(change.port);
+        break;
+    case Change::PortRenamed:
+        if (!portTypes.contains(change.oldName)) { return false; }
+        removePort(change.oldName);
+        addPort(change.port, change.type);
+        break;
+    }
+
+    mVersion++;
+    return true;
+}
+
+quint64 KonfytJackPortRegistry::version() const
+{
+    QMutexLocker locker(&mutex);
+    return mVersion;
+}
+
+bool KonfytJackPortRegistry::contains(QString port) const
+{
+    QMutexLocker locker(&mutex);
+    return portTypes.contains(port);
+}
+
+/* Returns the ports of the specified type. The list is implicitly shared, so
+ * this is cheap as long as the caller doesn't modify it. */
+QStringList KonfytJackPortRegistry::ports(PortType type) const
+{
+    if (type == OtherPortType) { return QStringList(); }
+    QMutexLocker locker(&mutex);
+    return portLists[type];
+}
+
+QSet<QString> KonfytJackPortRegistry::clients() const
+{
+    QMutexLocker locker(&mutex);
+    QSet<QString> ret;
+    QHash<QString, int>::const_iterator i = clientPortCounts.constBegin();
+    while (i != clientPortCounts.constEnd()) {
+        ret.insert(i.key());
+        ++i;
+    }
+    return ret;
+}
+
+void KonfytJackPortRegistry::addPort(QString port, PortType type)
+{
+    portTypes.insert(port, type);
+    portLists[type].append(port);
+    clientPortCounts[clientOfPort(port)] += 1;
+}
+
+void KonfytJackPortRegistry::removePort(QString port)
+{
+    PortType type = portTypes.take(port);
+    portLists[type].removeOne(port);
+
+    QString client = clientOfPort(port);
+    int count = clientPortCounts.value(client) - 1;
+    if (count > 0) {
+        clientPortCounts.insert(client, count);
+    } else {
+        clientPortCounts.remove(client);
+    }
+}
@@ -0,0 +1,80 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_JACK_PORT_REGISTRY_H
+#define KONFYT_JACK_PORT_REGISTRY_H
+
+#include <jack/jack.h>
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSet>
+#include <QStringList>
+
+/* Ports and clients of the JACK graph, kept up to date from the JACK port
+ * registration and rename callbacks so that the port lists don't have to be
+ * requested from the JACK server each time they are needed. Every change
+ * increases the version, so a view of the ports only has to be rebuilt when
+ * the version it was built from is out of date.
+ * Changes are applied in the JACK notification thread, and the registry can be
+ * read from any thread. */
+class KonfytJackPortRegistry
+{
+public:
+    enum PortType { MidiInput, MidiOutput, AudioInput, AudioOutput, OtherPortType };
+
+    struct Change
+    {
+        enum Kind { PortAdded, PortRemoved, PortRenamed };
+        Kind kind = PortAdded;
+        PortType type = OtherPortType;
+        QString port;
+        QString oldName; // Previous name for PortRenamed
+    };
+
+    static PortType portType(jack_port_t* port);
+    static QString clientOfPort(QString port);
+
+    void fill(jack_client_t* client);
+    void clear();
+    bool apply(const Change& change);
+
+    quint64 version() const;
+    bool contains(QString port) const;
+    QStringList ports(PortType type) const;
+    QSet<QString> clients() const;
+
+private:
+    mutable QMutex mutex;
+    quint64 mVersion = 0;
+    QHash<QString, PortType> portTypes;
+    QStringList portLists[OtherPortType];
+    QHash<QString, int> clientPortCounts;
+
+    void clearPorts();
+    bool applyChange(const Change& change);
+    void addPort(QString port, PortType type);
+    void removePort(QString port);
+};
+
+#endif // KONFYT_JACK_PORT_REGISTRY_H
@@ -29,6 +29,8 @@
 
 #include <jack/jack.h>
 
+#include <QHash>
+
 
 struct KonfytJackPortsSpec
 {
@@ -71,6 +73,22 @@ struct KonfytJackNoteOnRecord
     int channel;
 };
 
+/* Plugin that is rendered inside our JACK process callback, like the
+ * Fluidsynth soundfonts, instead of being connected through JACK ports. Both
+ * functions are called from the JACK process thread. */
+class KfJackInternalPlugin
+{
+public:
+    virtual ~KfJackInternalPlugin() {}
+    // Events are rendered in the next call to process()
+    virtual void midiEvent(const KonfytMidiEvent &ev, jack_nframes_t time) = 0;
+    // Called for all plugins before any process() of the cycle, so plugins
+    // that render elsewhere can all start at once. process() has to return by
+    // the deadline (in jack_get_time() microseconds).
+    virtual void startProcess(jack_nframes_t /*nframes*/, jack_time_t /*deadline*/) {}
+    virtual void process(float* left, float* right, jack_nframes_t nframes) = 0;
+};
+
 struct KfJackMidiRoute
 {
     friend class KonfytJackEngine;
@@ -82,6 +100,7 @@ protected:
     KfJackMidiPort* source = nullptr;
     KfJackMidiPort* destPort = nullptr;
     KfFluidSynth* destFluidsynthID = nullptr;
+    KfJackInternalPlugin* destInternalPlugin = nullptr;
     bool destIsJackPort = true;
     RingbufferQMutex<KonfytMidiEvent> eventsTxBuffer{100};
     uint16_t sustain = 0;
@@ -104,6 +123,15 @@ protected:
     KfJackAudioPort* dest = nullptr;
     float rxBufferSum = 0;
     int rxCycleCount = 0;
+    // Delay line for latency compensation
+    float* delayBuffer = nullptr;
+    jack_nframes_t delayFrames = 0;
+    jack_nframes_t delayPos = 0;
+    bool delayStale = false; // Delay line holds old audio and must be cleared
+    // Direct JACK connections are requested for the route, and once they are
+    // all in the graph, audio is passed by them instead of being mixed.
+    bool directWanted = false;
+    bool direct = false;
 };
 
 struct KfJackPluginPorts
@@ -111,12 +139,14 @@ struct KfJackPluginPorts
     friend class KonfytJackEngine;
 protected:
     KfFluidSynth* fluidSynthInEngine; // Id in plugin's respective engine (used for Fluidsynth)
+    KfJackInternalPlugin* internalPlugin = nullptr; // Rendered in process callback
     KfJackMidiPort* midi;        // Send midi output to plugin
     KfJackAudioPort* audioInLeft;  // Receive plugin audio
     KfJackAudioPort* audioInRight;
     KfJackMidiRoute* midiRoute = nullptr;
     KfJackAudioRoute* audioLeftRoute = nullptr;
     KfJackAudioRoute* audioRightRoute = nullptr;
+    jack_nframes_t latency = 0;  // Latency of the plugin audio relative to in-process layers
 };
 
 struct KonfytJackConPair
@@ -134,6 +164,23 @@ struct KonfytJackConPair
     }
 };
 
+// JACK connection with the port names as C strings, converted once
+struct KfJackConnection
+{
+    QByteArray srcPort;
+    QByteArray destPort;
+
+    bool operator==(const KfJackConnection &c) const
+    {
+        return (srcPort == c.srcPort) && (destPort == c.destPort);
+    }
+};
+
+inline uint qHash(const KfJackConnection &c, uint seed = 0)
+{
+    return qHash(c.srcPort, seed) ^ qHash(c.destPort, seed + 1);
+}
+
 struct KfJackMidiRxEvent
 {
     KfJackMidiPort* sourcePort = nullptr;
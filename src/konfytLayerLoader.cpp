@@ -0,0 +1,147 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytLayerLoader.h"
+
+#include <QRunnable>
+
+
+class KonfytLayerLoadJob : public QRunnable
+{
+public:
+    KonfytLayerLoadJob(KonfytLayerLoader* loader, quint64 id,
+                       std::function<void()> job) :
+        loader(loader), id(id), job(job) {}
+
+    void run() override
+    {
+        loader->jobStarted(id);
+        job();
+    }
+
+private:
+    KonfytLayerLoader* loader;
+    quint64 id;
+    std::function<void()> job;
+};
+
+
+KonfytLayerLoader::KonfytLayerLoader(QObject *parent) :
+    QObject(parent)
+{
+    qRegisterMetaType<KfFluidSynth*>("KfFluidSynth*");
+    pool.setMaxThreadCount(KONFYT_LAYER_LOADER_THREADS);
+}
+
+KonfytLayerLoader::~KonfytLayerLoader()
+{
+    queuedJobsMutex.lock();
+    pool.clear();
+    queuedJobs.clear();
+    queuedJobsMutex.unlock();
+    pool.waitForDone();
+}
+
+void KonfytLayerLoader::setFluidsynthEngine(KonfytFluidsynthEngine *e)
+{
+    fluidsynthEngine = e;
+}
+
+/* Start loading the soundfont program in the background and return the job id.
+ * soundfontProgramLoaded() is emitted with the job id when done. */
+quint64 KonfytLayerLoader::loadSoundfontProgram(QString soundfontFilename,
+                                               KonfytSoundPreset program,
+                                               int priority)
+{
+    KONFYT_ASSERT_RETURN_VAL(fluidsynthEngine, 0);
+
+    KonfytFluidsynthEngine* engine = fluidsynthEngine;
+
+    return startJob([=](quint64 id)
+    {
+        KfFluidSynth* synth = engine->addSoundfontProgram(soundfontFilename, program);
+        emit soundfontProgramLoaded(id, synth);
+    }, priority);
+}
+
+/* Load the soundfont into the Fluidsynth engine's cache in the background, so
+ * that a program of it can be loaded quickly later. Returns the job id. */
+quint64 KonfytLayerLoader::preloadSoundfont(QString soundfontFilename, int priority)
+{
+    KONFYT_ASSERT_RETURN_VAL(fluidsynthEngine, 0);
+
+    KonfytFluidsynthEngine* engine = fluidsynthEngine;
+
+    return startJob([=](quint64 /*id*/)
+    {
+        engine->preloadSoundfont(soundfontFilename);
+    }, priority);
+}
+
+quint64 KonfytLayerLoader::startJob(std::function<void (quint64)> job, int priority)
+{
+    quint64 id = ++lastJobId;
+
+    KonfytLayerLoadJob* loadJob = new KonfytLayerLoadJob(this, id, [=]()
+    {
+        job(id);
+    });
+
+    queuedJobsMutex.lock();
+    queuedJobs.insert(id, loadJob);
+    pool.start(loadJob, priority);
+    queuedJobsMutex.unlock();
+
+    return id;
+}
+
+/* Change the priority of a job that has not started yet. */
+void KonfytLayerLoader::setJobPriority(quint64 jobId, int priority)
+{
+    queuedJobsMutex.lock();
+    KonfytLayerLoadJob* job = queuedJobs.value(jobId, nullptr);
+    if (job && pool.tryTake(job)) {
+        pool.start(job, priority);
+    }
+    queuedJobsMutex.unlock();
+}
+
+/* Remove a job that has not started yet from the queue. Jobs that have
+ * already started are not affected. */
+void KonfytLayerLoader::cancelJob(quint64 jobId)
+{
+    queuedJobsMutex.lock();
+    KonfytLayerLoadJob* job = queuedJobs.take(jobId);
+    if (job && pool.tryTake(job)) {
+        delete job;
+    }
+    queuedJobsMutex.unlock();
+}
+
+/* Called from the pool thread when a job starts. After this, the job may be
+ * deleted by the pool at any time. */
+void KonfytLayerLoader::jobStarted(quint64 jobId)
+{
+    queuedJobsMutex.lock();
+    queuedJobs.remove(jobId);
+    queuedJobsMutex.unlock();
+}
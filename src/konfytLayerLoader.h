@@ -0,0 +1,76 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_LAYER_LOADER_H
+#define KONFYT_LAYER_LOADER_H
+
+#include "konfytFluidsynthEngine.h"
+#include "konfytStructs.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QThreadPool>
+
+#include <functional>
+
+#define KONFYT_LAYER_LOADER_THREADS 2
+
+class KonfytLayerLoadJob;
+
+/* Loads layer sounds in background threads so that the GUI thread (and the
+ * triggers handled in it) is not blocked by slow file loading. Each load is a
+ * job identified by an id. Completion is signalled from the loader thread and
+ * is thus received in the receiver's thread with a queued connection. */
+class KonfytLayerLoader : public QObject
+{
+    Q_OBJECT
+public:
+    explicit KonfytLayerLoader(QObject *parent = 0);
+    ~KonfytLayerLoader();
+
+    void setFluidsynthEngine(KonfytFluidsynthEngine* e);
+
+    // Jobs with a higher priority are started first
+    quint64 loadSoundfontProgram(QString soundfontFilename,
+                                 KonfytSoundPreset program, int priority);
+    quint64 preloadSoundfont(QString soundfontFilename, int priority);
+    void setJobPriority(quint64 jobId, int priority);
+    void cancelJob(quint64 jobId);
+
+signals:
+    // synth is nullptr if loading failed
+    void soundfontProgramLoaded(quint64 jobId, KfFluidSynth* synth);
+
+private:
+    QThreadPool pool;
+    quint64 lastJobId = 0;
+
+    friend class KonfytLayerLoadJob;
+    QHash<quint64, KonfytLayerLoadJob*> queuedJobs;
+    QMutex queuedJobsMutex;
+    void jobStarted(quint64 jobId);
+    quint64 startJob(std::function<void(quint64)> job, int priority);
+    KonfytFluidsynthEngine* fluidsynthEngine = nullptr;
+};
+
+#endif // KONFYT_LAYER_LOADER_H
@@ -291,6 +291,10 @@ void KonfytLayerWidget::setUpGUI()
         muteButtonVisible = false;
         toolButtonRightVisible = false;
         backgroundFilter = false;
+    } else if (layer->isLoading()) {
+        text = "Loading... " + text;
+    } else if (!layer->isReady()) {
+        text = QString("Loading %1%... ").arg(layer->loadProgress()) + text;
     }
 
     // Apply visibility and text settings
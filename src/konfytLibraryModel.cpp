@@ -0,0 +1,235 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytLibraryModel.h"
+
+#define KONFYT_LIBRARY_KEY_GROUP "group"
+
+
+KonfytLibraryModel::KonfytLibraryModel(QObject *parent) :
+    QAbstractItemModel(parent)
+{
+}
+
+void KonfytLibraryModel::setIcons(QIcon folder, QIcon file)
+{
+    folderIcon = folder;
+    fileIcon = file;
+}
+
+void KonfytLibraryModel::setSections(QList<Section> sections, QString groupText)
+{
+    // The section roots are kept, so the trees stay valid even if the
+    // database replaces them, until the next call.
+    beginResetModel();
+    mSections = sections;
+    mGroupText = groupText;
+    endResetModel();
+}
+
+KonfytLibraryModel::ItemKind KonfytLibraryModel::itemKind(const QModelIndex &index) const
+{
+    KonfytDbTreeItem* i = item(index);
+    if (!i) { return KindInvalid; }
+    if (i == &groupItem) { return KindGroup; }
+    if (sectionOfRoot(i) >= 0) { return KindSection; }
+    if (i->children.count()) { return KindFolder; }
+    return KindSound;
+}
+
+KonfytSoundType KonfytLibraryModel::soundType(const QModelIndex &index) const
+{
+    int section = sectionOfItem(item(index));
+    if (section < 0) { return KfSoundTypeUndefined; }
+    return mSections[section].type;
+}
+
+KfSoundPtr KonfytLibraryModel::sound(const QModelIndex &index) const
+{
+    if (itemKind(index) != KindSound) { return KfSoundPtr(); }
+    return item(index)->data.sound();
+}
+
+QString KonfytLibraryModel::path(const QModelIndex &index) const
+{
+    KonfytDbTreeItem* i = item(index);
+    if (!i) { return QString(); }
+    return i->path;
+}
+
+QString KonfytLibraryModel::itemKey(const QModelIndex &index) const
+{
+    switch (itemKind(index)) {
+    case KindGroup:
+        return KONFYT_LIBRARY_KEY_GROUP;
+    case KindSection:
+        return QString("%1:").arg(soundType(index));
+    case KindFolder:
+    case KindSound:
+        return QString("%1:%2").arg(soundType(index)).arg(path(index));
+    default:
+        return QString();
+    }
+}
+
+QModelIndex KonfytLibraryModel::indexOfKey(QString key) const
+{
+    if (key == KONFYT_LIBRARY_KEY_GROUP) {
+        return mGroupText.isEmpty() ? QModelIndex() : createIndex(0, 0, &groupItem);
+    }
+
+    int colon = key.indexOf(':');
+    if (colon < 0) { return QModelIndex(); }
+    int type = key.left(colon).toInt();
+    QString itemPath = key.mid(colon + 1);
+
+    for (int section=0; section < mSections.count(); section++) {
+        if (mSections[section].type != type) { continue; }
+        if (itemPath.isEmpty()) { return sectionIndex(section); }
+
+        // Descend through the folders containing the path
+        KonfytDbTreeItem* parentItem = mSections[section].root.data();
+        bool found = true;
+        while (found) {
+            found = false;
+            foreach (KfDbTreeItemPtr child, parentItem->children) {
+                if (child->path == itemPath) {
+                    return createIndex(child->row, 0, child.data());
+                }
+                if (itemPath.startsWith(child->path + "/")) {
+                    parentItem = child.data();
+                    found = true;
+                    break;
+                }
+            }
+        }
+        return QModelIndex();
+    }
+    return QModelIndex();
+}
+
+QModelIndex KonfytLibraryModel::index(int row, int column, const QModelIndex &parent) const
+{
+    if ( (row < 0) || (column != 0) ) { return QModelIndex(); }
+
+    KonfytDbTreeItem* parentItem = item(parent);
+    if (!parentItem) {
+        // Top level
+        if (!mGroupText.isEmpty()) {
+            return (row == 0) ? createIndex(0, 0, &groupItem) : QModelIndex();
+        }
+        return sectionIndex(row);
+    } else if (parentItem == &groupItem) {
+        return sectionIndex(row);
+    } else {
+        if (row >= parentItem->children.count()) { return QModelIndex(); }
+        return createIndex(row, 0, parentItem->children[row].data());
+    }
+}
+
+QModelIndex KonfytLibraryModel::parent(const QModelIndex &child) const
+{
+    KonfytDbTreeItem* i = item(child);
+    if (!i || (i == &groupItem)) { return QModelIndex(); }
+
+    if (sectionOfRoot(i) >= 0) {
+        if (mGroupText.isEmpty()) { return QModelIndex(); }
+        return createIndex(0, 0, &groupItem);
+    }
+
+    KonfytDbTreeItem* p = i->parent;
+    if (!p) { return QModelIndex(); }
+    int section = sectionOfRoot(p);
+    if (section >= 0) { return sectionIndex(section); }
+    return createIndex(p->row, 0, p);
+}
+
+int KonfytLibraryModel::rowCount(const QModelIndex &parent) const
+{
+    if (parent.column() > 0) { return 0; }
+
+    KonfytDbTreeItem* parentItem = item(parent);
+    if (!parentItem) {
+        return mGroupText.isEmpty() ? mSections.count() : 1;
+    } else if (parentItem == &groupItem) {
+        return mSections.count();
+    } else {
+        return parentItem->children.count();
+    }
+}
+
+int KonfytLibraryModel::columnCount(const QModelIndex & /*parent*/) const
+{
+    return 1;
+}
+
+bool KonfytLibraryModel::hasChildren(const QModelIndex &parent) const
+{
+    return rowCount(parent) > 0;
+}
+
+QVariant KonfytLibraryModel::data(const QModelIndex &index, int role) const
+{
+    ItemKind kind = itemKind(index);
+    if (kind == KindInvalid) { return QVariant(); }
+
+    if ( (role == Qt::DisplayRole) || (role == Qt::ToolTipRole) ) {
+        if (kind == KindGroup) {
+            return mGroupText;
+        } else if (kind == KindSection) {
+            return mSections[sectionOfRoot(item(index))].text;
+        } else {
+            return item(index)->name;
+        }
+    } else if (role == Qt::DecorationRole) {
+        if (kind == KindGroup) { return QVariant(); }
+        return (kind == KindSound) ? fileIcon : folderIcon;
+    }
+    return QVariant();
+}
+
+KonfytDbTreeItem *KonfytLibraryModel::item(const QModelIndex &index) const
+{
+    if (!index.isValid()) { return nullptr; }
+    return static_cast<KonfytDbTreeItem*>(index.internalPointer());
+}
+
+int KonfytLibraryModel::sectionOfRoot(const KonfytDbTreeItem *item) const
+{
+    for (int i=0; i < mSections.count(); i++) {
+        if (mSections[i].root.data() == item) { return i; }
+    }
+    return -1;
+}
+
+int KonfytLibraryModel::sectionOfItem(const KonfytDbTreeItem *item) const
+{
+    if (!item) { return -1; }
+    while (item->parent) { item = item->parent; }
+    return sectionOfRoot(item);
+}
+
+QModelIndex KonfytLibraryModel::sectionIndex(int section) const
+{
+    if ( (section < 0) || (section >= mSections.count()) ) { return QModelIndex(); }
+    return createIndex(section, 0, mSections[section].root.data());
+}
@@ -0,0 +1,88 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_LIBRARY_MODEL_H
+#define KONFYT_LIBRARY_MODEL_H
+
+#include "konfytDbTree.h"
+#include "konfytStructs.h"
+
+#include <QAbstractItemModel>
+#include <QIcon>
+
+/* Item model of the library tree. It is backed directly by the database trees,
+ * so no items are created for the library entries: the view only queries the
+ * rows it shows, and changing the trees (e.g. for a search) is a cheap model
+ * reset. Sounds of entries loaded from the database file are only decoded from
+ * their records when requested with sound(). The library is shown as sections (patches, SFZ, soundfonts) that may
+ * be grouped under a single item (e.g. search results). */
+class KonfytLibraryModel : public QAbstractItemModel
+{
+    Q_OBJECT
+public:
+    enum ItemKind { KindInvalid, KindGroup, KindSection, KindFolder, KindSound };
+
+    struct Section
+    {
+        KonfytSoundType type;
+        QString text;
+        KfDbTreeItemPtr root;
+    };
+
+    explicit KonfytLibraryModel(QObject* parent = nullptr);
+
+    void setIcons(QIcon folder, QIcon file);
+    // Shown under a group item with groupText if it is not empty
+    void setSections(QList<Section> sections, QString groupText = QString());
+
+    ItemKind itemKind(const QModelIndex &index) const;
+    KonfytSoundType soundType(const QModelIndex &index) const; // Of the item's section
+    KfSoundPtr sound(const QModelIndex &index) const;
+    QString path(const QModelIndex &index) const;
+
+    // Identifies an item across changes of the trees, e.g. to restore the
+    // expanded items after a model reset.
+    QString itemKey(const QModelIndex &index) const;
+    QModelIndex indexOfKey(QString key) const;
+
+    // QAbstractItemModel
+    QModelIndex index(int row, int column, const QModelIndex &parent = QModelIndex()) const override;
+    QModelIndex parent(const QModelIndex &child) const override;
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+    bool hasChildren(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+
+private:
+    QList<Section> mSections;
+    QString mGroupText;
+    mutable KonfytDbTreeItem groupItem; // Only used to identify the group item
+    QIcon folderIcon;
+    QIcon fileIcon;
+
+    KonfytDbTreeItem* item(const QModelIndex &index) const;
+    int sectionOfRoot(const KonfytDbTreeItem* item) const;
+    int sectionOfItem(const KonfytDbTreeItem* item) const;
+    QModelIndex sectionIndex(int section) const;
+};
+
+#endif // KONFYT_LIBRARY_MODEL_H
@@ -0,0 +1,230 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytLibraryWatcher.h"
+#include "konfytDirWalker.h"
+
+#include <QDir>
+#include <QFile>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Files are reported when closed after writing, not on each write while being
+// copied. Created directories are watched as soon as they appear.
+#define KONFYT_LIBRARY_WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE \
+    | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+
+KonfytLibraryDirLister::KonfytLibraryDirLister(QObject *parent) : QObject(parent)
+{
+    connect(this, &KonfytLibraryDirLister::requestList,
+            this, &KonfytLibraryDirLister::doList, Qt::QueuedConnection);
+}
+
+void KonfytLibraryDirLister::doList(int generation, QStringList dirs)
+{
+    // Only directories are of interest, no files match
+    KonfytDirWalker walker({});
+    QStringList ret;
+    foreach (QString dir, dirs) {
+        walker.walk(dir, [](QString) {}, [&ret](QString path) { ret.append(path); });
+    }
+    emit listed(generation, ret);
+}
+
+
+KonfytLibraryWatcher::KonfytLibraryWatcher(QObject *parent) : QObject(parent)
+{
+    debounceTimer.setSingleShot(true);
+    debounceTimer.setInterval(KONFYT_LIBRARY_WATCHER_DEBOUNCE_MS);
+    connect(&debounceTimer, &QTimer::timeout,
+            this, &KonfytLibraryWatcher::onDebounceTimeout);
+
+    connect(&lister, &KonfytLibraryDirLister::listed,
+            this, &KonfytLibraryWatcher::onDirsListed);
+    lister.moveToThread(&listerThread);
+    listerThread.start();
+}
+
+KonfytLibraryWatcher::~KonfytLibraryWatcher()
+{
+    listerThread.quit();
+    listerThread.wait();
+    if (inotifyFd >= 0) { close(inotifyFd); }
+}
+
+/* Watch the specified directories, replacing the previously watched ones. */
+void KonfytLibraryWatcher::setDirs(QStringList dirs)
+{
+    dirs.removeAll("");
+    for (int i=0; i < dirs.count(); i++) {
+        dirs[i] = QDir::cleanPath(dirs[i]);
+    }
+    dirs.removeDuplicates();
+    if (dirs == mDirs) { return; }
+
+    if (inotifyFd < 0) {
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd < 0) {
+            print(QString("Library watcher: inotify init failed: %1")
+                  .arg(strerror(errno)));
+            return;
+        }
+        notifier = new QSocketNotifier(inotifyFd, QSocketNotifier::Read, this);
+        connect(notifier, &QSocketNotifier::activated,
+                this, &KonfytLibraryWatcher::onInotifyReadable);
+    }
+
+    removeAllWatches();
+    mDirs = dirs;
+    listGeneration++;
+    reportWatchCount = true;
+    emit lister.requestList(listGeneration, mDirs);
+}
+
+/* Watch the directory and its subdirectories once they have been listed. */
+void KonfytLibraryWatcher::addWatchRecursive(QString dir)
+{
+    emit lister.requestList(listGeneration, {dir});
+}
+
+void KonfytLibraryWatcher::addWatch(QString dir)
+{
+    int wd = inotify_add_watch(inotifyFd, QFile::encodeName(dir).constData(),
+                               KONFYT_LIBRARY_WATCH_MASK);
+    if (wd < 0) {
+        if ( (errno == ENOSPC) && !watchLimitReported ) {
+            print("Library watcher: inotify watch limit reached. Increase "
+                  "fs.inotify.max_user_watches to watch all directories.");
+            watchLimitReported = true;
+        }
+        return;
+    }
+    // The same directory, e.g. through a symlink, gets the same watch. Keep
+    // the path it was watched with first.
+    if (!watchDirs.contains(wd)) {
+        watchDirs.insert(wd, dir);
+    }
+}
+
+void KonfytLibraryWatcher::onDirsListed(int generation, QStringList dirs)
+{
+    if (generation != listGeneration) { return; }
+
+    foreach (QString dir, dirs) {
+        addWatch(dir);
+    }
+    if (reportWatchCount) {
+        // The first list after setDirs() is of all the directories
+        reportWatchCount = false;
+        print(QString("Library watcher: watching %1 directories.").arg(watchDirs.count()));
+    }
+}
+
+/* Remove the watches of a directory and its subdirectories, e.g. when moved
+ * away, after which their paths are no longer valid. */
+void KonfytLibraryWatcher::removeWatchesUnder(QString dir)
+{
+    QMutableHashIterator<int, QString> i(watchDirs);
+    while (i.hasNext()) {
+        i.next();
+        if ( (i.value() == dir) || i.value().startsWith(dir + "/") ) {
+            inotify_rm_watch(inotifyFd, i.key());
+            i.remove();
+        }
+    }
+}
+
+void KonfytLibraryWatcher::removeAllWatches()
+{
+    foreach (int wd, watchDirs.keys()) {
+        inotify_rm_watch(inotifyFd, wd);
+    }
+    watchDirs.clear();
+    watchLimitReported = false;
+}
+
+void KonfytLibraryWatcher::onInotifyReadable()
+{
+    alignas(struct inotify_event) char buf[4096];
+
+    ssize_t len;
+    while ( (len = read(inotifyFd, buf, sizeof(buf))) > 0 ) {
+
+        const char* ptr = buf;
+        while (ptr < buf + len) {
+            const struct inotify_event* ev = (const struct inotify_event*)ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost. Check everything.
+                foreach (QString dir, mDirs) { changedPaths.insert(dir); }
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                // Watch removed, e.g. directory deleted
+                watchDirs.remove(ev->wd);
+                continue;
+            }
+
+            QString dir = watchDirs.value(ev->wd);
+            if (dir.isEmpty()) { continue; }
+
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                changedPaths.insert(dir);
+                continue;
+            }
+
+            QString path = dir + "/" + QString::fromLocal8Bit(ev->name);
+            if ( (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) ) {
+                addWatchRecursive(path);
+            }
+            if ( (ev->mask & IN_ISDIR) && (ev->mask & IN_MOVED_FROM) ) {
+                removeWatchesUnder(path);
+            }
+            if ( (ev->mask & IN_CREATE) && !(ev->mask & IN_ISDIR) ) {
+                // Wait for a new file to be closed after writing. Symlinks and
+                // hard links to existing files are not written.
+                struct stat st;
+                bool link = (lstat(QFile::encodeName(path).constData(), &st) == 0)
+                        && (S_ISLNK(st.st_mode) || (st.st_nlink > 1));
+                if (!link) { continue; }
+            }
+            changedPaths.insert(path);
+        }
+    }
+
+    if (!changedPaths.isEmpty()) {
+        debounceTimer.start(); // Restart
+    }
+}
+
+void KonfytLibraryWatcher::onDebounceTimeout()
+{
+    QStringList paths = changedPaths.values();
+    changedPaths.clear();
+    emit pathsChanged(paths);
+}
@@ -0,0 +1,98 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_LIBRARY_WATCHER_H
+#define KONFYT_LIBRARY_WATCHER_H
+
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QSocketNotifier>
+#include <QStringList>
+#include <QThread>
+#include <QTimer>
+
+#define KONFYT_LIBRARY_WATCHER_DEBOUNCE_MS 1000
+
+/* Lists directory trees for the watcher in its own thread, with
+ * KonfytDirWalker, so that each directory is only listed once even if it is
+ * reachable through symlinks. */
+class KonfytLibraryDirLister : public QObject
+{
+    Q_OBJECT
+public:
+    explicit KonfytLibraryDirLister(QObject *parent = nullptr);
+
+signals:
+    void requestList(int generation, QStringList dirs);
+    void listed(int generation, QStringList dirs);
+
+private slots:
+    void doList(int generation, QStringList dirs);
+};
+
+/* Watches directories and all their subdirectories for changes with inotify.
+ * Changed paths are collected and reported together once no more changes
+ * occurred for a while, e.g. while a large file is being copied. A reported
+ * path may be a file or a directory, and may no longer exist if it was
+ * removed. */
+class KonfytLibraryWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit KonfytLibraryWatcher(QObject *parent = nullptr);
+    ~KonfytLibraryWatcher();
+
+    void setDirs(QStringList dirs);
+
+signals:
+    void print(QString msg);
+    void pathsChanged(QStringList paths);
+
+private:
+    int inotifyFd = -1;
+    QSocketNotifier* notifier = nullptr;
+    QHash<int, QString> watchDirs; // Watch descriptor to directory path
+    QStringList mDirs;
+    QSet<QString> changedPaths;
+    QTimer debounceTimer;
+    bool watchLimitReported = false;
+
+    // Directory trees are listed in the background and watched once listed.
+    // Lists of previously set directories are ignored.
+    KonfytLibraryDirLister lister;
+    QThread listerThread;
+    int listGeneration = 0;
+    bool reportWatchCount = false;
+
+    void addWatchRecursive(QString dir);
+    void addWatch(QString dir);
+    void removeWatchesUnder(QString dir);
+    void removeAllWatches();
+
+private slots:
+    void onInotifyReadable();
+    void onDebounceTimeout();
+    void onDirsListed(int generation, QStringList dirs);
+};
+
+#endif // KONFYT_LIBRARY_WATCHER_H
@@ -21,16 +21,37 @@
 
 #include "konfytLscp.h"
 
+#include <QCoreApplication>
+
 KonfytLscp::KonfytLscp(QObject *parent) : QObject(parent)
 {
+    connect(this, &KonfytLscp::requestInit,
+            this, &KonfytLscp::init, Qt::QueuedConnection);
+    connect(this, &KonfytLscp::requestSetupDevices,
+            this, &KonfytLscp::setupDevices, Qt::QueuedConnection);
+    connect(this, &KonfytLscp::requestRemoveAllRelatedToClient,
+            this, &KonfytLscp::removeAllRelatedToClient, Qt::QueuedConnection);
+    connect(this, &KonfytLscp::requestAddSfz,
+            this, &KonfytLscp::doAddSfz, Qt::QueuedConnection);
+    connect(this, &KonfytLscp::requestRemoveSfz,
+            this, &KonfytLscp::doRemoveSfz, Qt::QueuedConnection);
+    connect(this, &KonfytLscp::requestDeinit,
+            this, &KonfytLscp::doDeinit, Qt::BlockingQueuedConnection);
+    connect(this, &KonfytLscp::channelInfoChanged,
+            this, &KonfytLscp::onChannelInfoChanged, Qt::QueuedConnection);
+
+    loadProgressTimer.setInterval(250);
+    connect(&loadProgressTimer, &QTimer::timeout,
+            this, static_cast<void(KonfytLscp::*)()>(&KonfytLscp::checkLoadProgress));
+
     setupConnectionCheckTimer();
 }
 
 lscp_status_t KonfytLscp::client_callback(lscp_client_t* /*pClient*/,
                                           lscp_event_t event, const char *pchData,
-                                          int cchData, void* /*pvData*/)
+                                          int cchData, void* pvData)
 {
-    //KonfytLscp* k = static_cast<KonfytLscp*>(pvData);
+    KonfytLscp* k = static_cast<KonfytLscp*>(pvData);
 
     lscp_status_t ret = LSCP_FAILED;
 
@@ -38,8 +59,13 @@ lscp_status_t KonfytLscp::client_callback(lscp_client_t* /*pClient*/,
     if (pszData) {
         memcpy(pszData, pchData, cchData);
         pszData[cchData] = (char) 0;
-        printf("client_callback: event=%s (0x%04x) [%s]\n",
-               lscp_event_to_text(event), (int) event, pszData);
+        if (event == LSCP_EVENT_CHANNEL_INFO) {
+            // Handled in the worker thread, as this is the event thread
+            emit k->channelInfoChanged(atoi(pszData));
+        } else {
+            printf("client_callback: event=%s (0x%04x) [%s]\n",
+                   lscp_event_to_text(event), (int) event, pszData);
+        }
         free(pszData);
         ret = LSCP_OK;
     }
@@ -122,6 +148,10 @@ void KonfytLscp::setupDevices(QString clientName)
             print("Error creating MIDI device.");
         }
     }
+
+    // Cache our devices. From here on, they are only changed by us.
+    audioDev = adevs.value(getAudioDeviceIdByName(mClientName));
+    midiDev = mdevs.value(getMidiDeviceIdByName(mClientName));
 }
 
 void KonfytLscp::deinit()
@@ -332,8 +362,15 @@ QString KonfytLscp::printChannels()
         ret += "   MIDI channel: " + i2s(info->midi_channel) + "\n";
         ret += "   MIDI device: " + i2s(info->midi_device) + "\n";
         ret += "   MIDI port: " + i2s(info->midi_port) + "\n";
-        if (this->chans.contains(chans[i])) {
-            LsChannel info2 = getSfzChannelInfo(chans[i]);
+        bool ours = false;
+        LsChannel info2;
+        foreach (const LsChannel &c, this->chans) {
+            if (c.lsChannel == chans[i]) {
+                ours = true;
+                info2 = c;
+            }
+        }
+        if (ours) {
             ret += "   Channel belongs to us:\n";
             ret += "   Left JACK port: " + info2.audioLeftJackPort + "\n";
             ret += "   Right JACK port: " + info2.audioRightJackPort + "\n";
@@ -347,111 +384,188 @@ QString KonfytLscp::printChannels()
     return ret;
 }
 
-/* Adds channel (sfz instrument) with accompanying MIDI and audio ports and
- * returns ID. (The ID is also the same ID that Linuxsampler uses for the
- * channel.)
- * On error, -1 is returned. */
-int KonfytLscp::addSfzChannelAndPorts(QString file)
+/* Queue the SFZ to be added in the next batch. sfzAdded() is emitted with
+ * the id when done. */
+void KonfytLscp::doAddSfz(int id, QString file)
 {
-    lscp_status_t status;
+    if (pendingSfzs.isEmpty()) {
+        // Requests that are already queued will be added in the same batch
+        QTimer::singleShot(0, this, &KonfytLscp::addPendingSfzChannels);
+    }
+    pendingSfzs.append({id, file});
+}
 
-    int iAudioDev = getAudioDeviceIdByName(mClientName);
-    if (iAudioDev < 0) {
-        print("Error getting audio device named " + mClientName);
-        return -1;
+void KonfytLscp::doRemoveSfz(int id)
+{
+    // Requests are handled in order
+    addPendingSfzChannels();
+
+    removeSfzChannel(id);
+}
+
+void KonfytLscp::doDeinit()
+{
+    pendingSfzs.clear();
+    loadProgress.clear();
+    loadProgressTimer.stop();
+    deinit();
+
+    // Hand back to the main thread so we can be deleted there once the
+    // worker thread has stopped.
+    moveToThread(QCoreApplication::instance()->thread());
+}
+
+/* Adds a channel for each pending SFZ. The audio and MIDI devices are grown
+ * once for the whole batch, and only the info of the new ports is queried. */
+void KonfytLscp::addPendingSfzChannels()
+{
+    QList<PendingSfz> batch = pendingSfzs;
+    pendingSfzs.clear();
+    if (batch.isEmpty()) { return; }
+
+    int audioNeeded = 2*batch.count() - freeAudioChannels.count();
+    if (audioNeeded > 0) { addAudioChannels(audioNeeded); }
+    int midiNeeded = batch.count() - freeMidiPorts.count();
+    if (midiNeeded > 0) { addMidiPorts(midiNeeded); }
+
+    foreach (const PendingSfz &sfz, batch) {
+        LsChannel info;
+        info.path = sfz.file;
+        QString error;
+        if ( (freeAudioChannels.count() < 2) || freeMidiPorts.isEmpty() ) {
+            error = "No free audio channels or MIDI ports for " + sfz.file;
+        } else {
+            // Free lists are used LIFO, see removeSfzChannel()
+            info.audioLeftChanIndex = freeAudioChannels.takeLast();
+            info.audioRightChanIndex = freeAudioChannels.takeLast();
+            info.midiPortIndex = freeMidiPorts.takeLast();
+            error = addSfzChannel(sfz.file, &info);
+            if (!error.isEmpty()) {
+                freeAudioChannel(info.audioRightChanIndex);
+                freeAudioChannel(info.audioLeftChanIndex);
+                freeMidiPort(info.midiPortIndex);
+            }
+        }
+
+        if (error.isEmpty()) {
+            chans.insert(sfz.id, info);
+            loadProgress.insert(sfz.id, 0);
+        } else {
+            print(error);
+        }
+        emit sfzAdded(sfz.id, info, error);
     }
 
-    int iMidiDev = getMidiDeviceIdByName(mClientName);
-    if (iMidiDev < 0) {
-        print("Error getting MIDI device named " + mClientName);
-        return -1;
+    if (!loadProgress.isEmpty()) { loadProgressTimer.start(); }
+}
+
+/* Channel info event from Linuxsampler, e.g. instrument load progress. */
+void KonfytLscp::onChannelInfoChanged(int lsChannel)
+{
+    QList<int> ids = loadProgress.keys();
+    foreach (int id, ids) {
+        if (chans.value(id).lsChannel == lsChannel) {
+            checkLoadProgress(id);
+        }
+    }
+}
+
+void KonfytLscp::checkLoadProgress()
+{
+    QList<int> ids = loadProgress.keys();
+    foreach (int id, ids) {
+        checkLoadProgress(id);
+    }
+}
+
+/* Query the instrument load progress of the SFZ channel and emit
+ * sfzLoadProgress() if it changed. */
+void KonfytLscp::checkLoadProgress(int id)
+{
+    if (!loadProgress.contains(id)) { return; }
+
+    lscp_channel_info_t* info = lscp_get_channel_info(client, chans.value(id).lsChannel);
+    if (info == NULL) { return; }
+    int percent = info->instrument_status;
+
+    if (percent != loadProgress.value(id)) {
+        emit sfzLoadProgress(id, percent);
+    }
+    if ( (percent >= 100) || (percent < 0) ) {
+        loadProgress.remove(id);
+        if (loadProgress.isEmpty()) { loadProgressTimer.stop(); }
+    } else {
+        loadProgress.insert(id, percent);
+    }
+}
+
+/* Adds a Linuxsampler channel for the SFZ file using the audio channels and
+ * MIDI port already assigned in info, and fills in the rest of info. Returns
+ * an error message, or an empty string on success. */
+QString KonfytLscp::addSfzChannel(QString file, LsChannel *info)
+{
+    if (audioDev.index < 0) {
+        return "Error getting audio device named " + mClientName;
+    }
+    if (midiDev.index < 0) {
+        return "Error getting MIDI device named " + mClientName;
     }
 
     int chan = lscp_add_channel(client);
     if (chan < 0) {
-        print("Failed adding channel.");
-        print("Result: " + QString( lscp_client_get_result(client) ));
-        return -1;
+        return "Failed adding channel: " + QString(lscp_client_get_result(client));
     }
 
     QString engineName = "SFZ";
     if (file.toLower().endsWith(".gig")) {
         engineName = "GIG";
     }
-    status = lscp_load_engine(client, engineName.toLocal8Bit().constData(), chan);
-    if (status != LSCP_OK) {
-        print("Failed loading SFZ engine.");
-        print("Result: " + QString( lscp_client_get_result(client) ));
-        return -1;
-    }
-
-    int audioPortLeft = getFreeAudioChannel();
-    int audioPortRight = getFreeAudioChannel();
-    int midiPort = getFreeMidiPort();
-
-    status = lscp_set_channel_audio_device(client, chan, iAudioDev);
-    if (status != LSCP_OK) {
-        print(QString("Failed connecting audio device %1 to channel %2.")
-              .arg(iAudioDev).arg(chan));
-        print("Result: " + QString( lscp_client_get_result(client) ));
-        return -1;
-    }
-    lscp_set_channel_audio_channel(client, chan, 0, audioPortLeft);
-    lscp_set_channel_audio_channel(client, chan, 1, audioPortRight);
-
-    status = lscp_set_channel_midi_device(client, chan, iMidiDev);
-    if (status != LSCP_OK) {
-        print(QString("Failed connecting MIDI device %1 to port %2.")
-              .arg(iMidiDev).arg(chan));
-        print("Result: " + QString( lscp_client_get_result(client) ));
-        return -1;
-    }
-    lscp_set_channel_midi_port(client, chan, midiPort);
-
-    QString fileEscaped = escapeString(file);
-    status = lscp_load_instrument_non_modal(client,
-                                            fileEscaped.toLocal8Bit().constData(),
-                                            0, chan);
-    if (status != LSCP_OK) {
-        print("Failed loading instrument: " + fileEscaped);
-        print("Result: " + QString( lscp_client_get_result(client) ));
-        return -1;
-    }
-
-    LsChannel info;
-    info.path = file;
-    info.midiPortIndex = midiPort;
-    info.audioLeftChanIndex = audioPortLeft;
-    info.audioRightChanIndex = audioPortRight;
-
-    // Refresh device info for added audio/midi ports to be listed
-    refreshAudioDevices();
-    refreshMidiDevices();
 
-    LsDevice &adev = adevs[iAudioDev];
-    if (indexValid(audioPortLeft, adev.ports.count())) {
-        info.audioLeftJackPort = mClientName + ":" + adev.ports[audioPortLeft].name();
+    QString error;
+    if (lscp_load_engine(client, engineName.toLocal8Bit().constData(), chan) != LSCP_OK) {
+        error = "Failed loading " + engineName + " engine";
+    } else if (lscp_set_channel_audio_device(client, chan, audioDev.index) != LSCP_OK) {
+        error = QString("Failed connecting audio device %1 to channel %2")
+                .arg(audioDev.index).arg(chan);
+    } else if (lscp_set_channel_midi_device(client, chan, midiDev.index) != LSCP_OK) {
+        error = QString("Failed connecting MIDI device %1 to channel %2")
+                .arg(midiDev.index).arg(chan);
     } else {
-        print("Audio left port out of bounds: " + i2s(audioPortLeft));
+        lscp_set_channel_audio_channel(client, chan, 0, info->audioLeftChanIndex);
+        lscp_set_channel_audio_channel(client, chan, 1, info->audioRightChanIndex);
+        lscp_set_channel_midi_port(client, chan, info->midiPortIndex);
+
+        QString fileEscaped = escapeString(file);
+        if (lscp_load_instrument_non_modal(client,
+                                           fileEscaped.toLocal8Bit().constData(),
+                                           0, chan) != LSCP_OK) {
+            error = "Failed loading instrument: " + fileEscaped;
+        }
     }
-    if (indexValid(audioPortRight, adev.ports.count())) {
-        info.audioRightJackPort = mClientName + ":" + adev.ports[audioPortRight].name();
-    } else {
-        print("Audio right port out of bounds: " + i2s(audioPortRight));
+    if (!error.isEmpty()) {
+        error += ": " + QString(lscp_client_get_result(client));
+        lscp_remove_channel(client, chan);
+        return error;
     }
 
-    LsDevice &mdev = mdevs[iMidiDev];
-    //if (qBound(0, midiPort, mdev.ports.count()-1)) {
+    info->lsChannel = chan;
+    info->audioLeftJackPort = portName(audioDev, info->audioLeftChanIndex);
+    info->audioRightJackPort = portName(audioDev, info->audioRightChanIndex);
+    info->midiJackPort = portName(midiDev, info->midiPortIndex);
 
-    if (indexValid(midiPort, mdev.ports.count())) {
-        info.midiJackPort = mClientName + ":" + mdev.ports[midiPort].name();
-    } else {
-        print("MIDI port out of bounds: " + i2s(midiPort));
-    }
-
-    chans.insert(chan, info);
+    return "";
+}
 
-    return chan;
+/* Returns the full JACK name of the port with the index in our device. */
+QString KonfytLscp::portName(LsDevice &dev, int index)
+{
+    for (int i=0; i < dev.ports.count(); i++) {
+        if (dev.ports[i].index == index) {
+            return mClientName + ":" + dev.ports[i].name();
+        }
+    }
+    print("Port index out of bounds: " + i2s(index));
+    return "";
 }
 
 KonfytLscp::LsChannel KonfytLscp::getSfzChannelInfo(int id)
@@ -461,6 +575,8 @@ KonfytLscp::LsChannel KonfytLscp::getSfzChannelInfo(int id)
 
 void KonfytLscp::removeSfzChannel(int id)
 {
+    loadProgress.remove(id);
+
     if (chans.contains(id)) {
         LsChannel chan = chans.take(id);
         // Free right before left as they are assigned FIFO left then right again
@@ -474,13 +590,14 @@ void KonfytLscp::removeSfzChannel(int id)
         // We go one step further here by only removing the channel after some
         // delay.
 
-        lscp_set_channel_mute(client, id, 1);
+        int lsChannel = chan.lsChannel;
+        lscp_set_channel_mute(client, lsChannel, 1);
 
         QTimer* t = new QTimer();
         t->setSingleShot(true);
         connect(t, &QTimer::timeout, this, [=](){
-            lscp_reset_channel(client, id);
-            lscp_remove_channel(client, id);
+            lscp_reset_channel(client, lsChannel);
+            lscp_remove_channel(client, lsChannel);
             t->deleteLater();
         });
         t->start(1000);
@@ -526,6 +643,10 @@ void KonfytLscp::createClient()
     print("Initialising client.");
     client = lscp_client_create("localhost", SERVER_PORT, client_callback, this);
     if (client) {
+        // For instrument load progress
+        if (lscp_client_subscribe(client, LSCP_EVENT_CHANNEL_INFO) != LSCP_OK) {
+            print("Could not subscribe to channel info events.");
+        }
         emit initialised(false, "");
     }
 }
@@ -554,6 +675,13 @@ void KonfytLscp::setupConnectionCheckTimer()
             }
 
             print("LSCP server connection error. Re-initialising...");
+            // Instruments that were still loading won't finish loading
+            QList<int> loading = loadProgress.keys();
+            loadProgress.clear();
+            loadProgressTimer.stop();
+            foreach (int id, loading) {
+                emit sfzLoadProgress(id, -1);
+            }
             destroyClient();
             init();
 
@@ -566,23 +694,39 @@ void KonfytLscp::setupConnectionCheckTimer()
     connectionCheckTimer.start(1000);
 }
 
-int KonfytLscp::addAudioChannel()
+/* Adds channels to our audio device and puts them in the free list. Only the
+ * info of the new channels is queried. */
+bool KonfytLscp::addAudioChannels(int count)
 {
-    int index = getAudioDeviceIdByName(mClientName);
-    if (index < 0) {
+    if (audioDev.index < 0) {
         print("Error getting audio device named " + mClientName);
-        return -1;
+        return false;
     }
 
-    LsDevice &dev = adevs[index];
-    int chan = dev.numPorts();
+    int first = audioDev.numPorts();
+    QByteArray value = i2s(first + count).toLocal8Bit();
 
     lscp_param_t param;
     param.key = (char*)KEY_CHANNELS;
-    param.value = (char*)i2s(chan+1).toLocal8Bit().constData();
-    lscp_set_audio_device_param(client, dev.index, &param);
+    param.value = value.data();
+    if (lscp_set_audio_device_param(client, audioDev.index, &param) != LSCP_OK) {
+        print("Failed adding audio channels: " + QString(lscp_client_get_result(client)));
+        return false;
+    }
+    audioDev.params.insert(KEY_CHANNELS, i2s(first + count));
 
-    return chan;
+    for (int i = first; i < first + count; i++) {
+        lscp_device_port_info_t* port = lscp_get_audio_channel_info(client, audioDev.index, i);
+        if (port != NULL) {
+            audioDev.ports.append(LsPort(i, port));
+        }
+    }
+    // Lowest channel last so that it is used first
+    for (int i = first + count - 1; i >= first; i--) {
+        freeAudioChannels.append(i);
+    }
+
+    return true;
 }
 
 void KonfytLscp::freeAudioChannel(int index)
@@ -590,17 +734,6 @@ void KonfytLscp::freeAudioChannel(int index)
     freeAudioChannels.append(index);
 }
 
-int KonfytLscp::getFreeAudioChannel()
-{
-    int chan = -1;
-    if (freeAudioChannels.count()) {
-        chan = freeAudioChannels.takeLast();
-    } else {
-        chan = addAudioChannel();
-    }
-    return chan;
-}
-
 void KonfytLscp::refreshMidiDevices()
 {
     mdevs.clear();
@@ -654,23 +787,39 @@ bool KonfytLscp::addMidiDevice(QString name)
     return ret >= 0;
 }
 
-int KonfytLscp::addMidiPort()
+/* Adds ports to our MIDI device and puts them in the free list. Only the
+ * info of the new ports is queried. */
+bool KonfytLscp::addMidiPorts(int count)
 {
-    int index = getMidiDeviceIdByName(mClientName);
-    if (index < 0) {
+    if (midiDev.index < 0) {
         print("Error getting MIDI device named " + mClientName);
-        return -1;
+        return false;
     }
 
-    LsDevice &dev = mdevs[index];
-    int port = dev.numPorts();
+    int first = midiDev.numPorts();
+    QByteArray value = i2s(first + count).toLocal8Bit();
 
     lscp_param_t param;
     param.key = (char*)KEY_PORTS;
-    param.value = (char*)i2s(port+1).toLocal8Bit().constData();
-    lscp_set_midi_device_param(client, dev.index, &param);
+    param.value = value.data();
+    if (lscp_set_midi_device_param(client, midiDev.index, &param) != LSCP_OK) {
+        print("Failed adding MIDI ports: " + QString(lscp_client_get_result(client)));
+        return false;
+    }
+    midiDev.params.insert(KEY_PORTS, i2s(first + count));
 
-    return port;
+    for (int i = first; i < first + count; i++) {
+        lscp_device_port_info_t* port = lscp_get_midi_port_info(client, midiDev.index, i);
+        if (port != NULL) {
+            midiDev.ports.append(LsPort(i, port));
+        }
+    }
+    // Lowest port last so that it is used first
+    for (int i = first + count - 1; i >= first; i--) {
+        freeMidiPorts.append(i);
+    }
+
+    return true;
 }
 
 void KonfytLscp::freeMidiPort(int index)
@@ -678,17 +827,6 @@ void KonfytLscp::freeMidiPort(int index)
     freeMidiPorts.append(index);
 }
 
-int KonfytLscp::getFreeMidiPort()
-{
-    int port = -1;
-    if (freeMidiPorts.count()) {
-        port = freeMidiPorts.takeLast();
-    } else {
-        port = addMidiPort();
-    }
-    return port;
-}
-
 QString KonfytLscp::jackClientName()
 {
     return mClientName;
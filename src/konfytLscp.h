@@ -73,6 +73,7 @@ public:
     // ----------------------------------------------------
     struct LsChannel
     {
+        int lsChannel = -1; // Channel id in Linuxsampler
         QString midiJackPort;
         QString audioLeftJackPort;
         QString audioRightJackPort;
@@ -83,6 +84,9 @@ public:
     };
     // ----------------------------------------------------
 
+    /* LSCP commands are blocking round-trips to Linuxsampler, so this object
+     * is meant to live in a worker thread. Use the request signals to trigger
+     * work from other threads. */
     explicit KonfytLscp(QObject *parent = 0);
 
     static lscp_status_t client_callback ( lscp_client_t *pClient,
@@ -105,23 +109,20 @@ public:
     bool audioDeviceExists(QString name);
     int getAudioDeviceIdByName(QString name);
     bool addAudioDevice(QString name);
-    int addAudioChannel();
+    bool addAudioChannels(int count);
     void freeAudioChannel(int index);
-    int getFreeAudioChannel();
 
     void refreshMidiDevices();
     bool midiDeviceExists(QString name);
     int getMidiDeviceIdByName(QString name);
     bool addMidiDevice(QString name);
-    int addMidiPort();
+    bool addMidiPorts(int count);
     void freeMidiPort(int index);
-    int getFreeMidiPort();
 
     QString jackClientName();
     QString printDevices();
 
     QString printChannels();
-    int addSfzChannelAndPorts(QString file);
     LsChannel getSfzChannelInfo(int id);
     void removeSfzChannel(int id);
 
@@ -133,6 +134,29 @@ public:
 signals:
     void print(QString msg);
     void initialised(bool error, QString errString);
+    // Result of requestAddSfz(). On error, the error message is set.
+    void sfzAdded(int id, KonfytLscp::LsChannel info, QString error);
+    // Instrument load progress of an added SFZ, 100 when done and negative
+    // if loading failed.
+    void sfzLoadProgress(int id, int percent);
+    // Emitted from the LSCP event thread
+    void channelInfoChanged(int lsChannel);
+
+    // Signals to trigger work in this class/thread
+    void requestInit();
+    void requestSetupDevices(QString clientName);
+    void requestRemoveAllRelatedToClient(QString clientName);
+    void requestAddSfz(int id, QString file); // id is chosen by the caller
+    void requestRemoveSfz(int id);
+    void requestDeinit(); // Blocks until done
+
+private slots:
+    void doAddSfz(int id, QString file);
+    void doRemoveSfz(int id);
+    void doDeinit();
+    void addPendingSfzChannels();
+    void onChannelInfoChanged(int lsChannel);
+    void checkLoadProgress();
 
 private:
     QString mClientName;
@@ -141,10 +165,31 @@ private:
     void destroyClient();
     QMap<int, LsDevice> adevs;
     QMap<int, LsDevice> mdevs;
-    QMap<int, LsChannel> chans;
+    QMap<int, LsChannel> chans; // By id given with requestAddSfz()
     QList<int> freeAudioChannels;
     QList<int> freeMidiPorts;
 
+    // Our own devices, cached so that only new ports have to be queried
+    LsDevice audioDev;
+    LsDevice midiDev;
+    QString portName(LsDevice &dev, int index);
+
+    // SFZ channels are added in batches: all requests received before the
+    // batch is processed share one update of the device ports.
+    struct PendingSfz
+    {
+        int id;
+        QString file;
+    };
+    QList<PendingSfz> pendingSfzs;
+    QString addSfzChannel(QString file, LsChannel* info);
+
+    // Instruments are loaded by Linuxsampler in the background. Progress is
+    // checked on channel info events, and polled in case events are missed.
+    QMap<int, int> loadProgress; // Last progress by id, while loading
+    QTimer loadProgressTimer{this};
+    void checkLoadProgress(int id);
+
     QProcess* process = nullptr;
 
     const int SERVER_PORT = 8888;
@@ -155,7 +200,7 @@ private:
     const char* KEY_PORTS = "PORTS";
     const char* VAL_0 = "0";
 
-    QTimer connectionCheckTimer;
+    QTimer connectionCheckTimer{this};
     void setupConnectionCheckTimer();
 };
 
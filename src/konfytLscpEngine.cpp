@@ -23,13 +23,22 @@
 
 KonfytLscpEngine::KonfytLscpEngine(QObject *parent) : KonfytBaseSoundEngine(parent)
 {
+    qRegisterMetaType<KonfytLscp::LsChannel>("KonfytLscp::LsChannel");
+
     connect(&ls, &KonfytLscp::print, this, &KonfytLscpEngine::print);
     connect(&ls, &KonfytLscp::initialised, this, &KonfytLscpEngine::onLsInitialised);
+    connect(&ls, &KonfytLscp::sfzAdded, this, &KonfytLscpEngine::onSfzAdded);
+    connect(&ls, &KonfytLscp::sfzLoadProgress, this, &KonfytLscpEngine::onSfzLoadProgress);
+
+    ls.moveToThread(&lscpThread);
+    lscpThread.start();
 }
 
 KonfytLscpEngine::~KonfytLscpEngine()
 {
-    ls.deinit();
+    emit ls.requestDeinit();
+    lscpThread.quit();
+    lscpThread.wait();
 }
 
 QString KonfytLscpEngine::engineName()
@@ -41,17 +50,22 @@ void KonfytLscpEngine::initEngine(KonfytJackEngine *jackEngine)
 {
     mJackEngine = jackEngine;
 
-    ls.init();
+    emit ls.requestInit();
 }
 
 QString KonfytLscpEngine::jackClientName()
 {
-    return ls.jackClientName();
+    return mClientName;
 }
 
+/* The channel is added in the LSCP thread. The JACK port names are known once
+ * sfzAdded() is emitted. */
 int KonfytLscpEngine::addSfz(QString path)
 {
-    return ls.addSfzChannelAndPorts(path);
+    int id = idCounter++;
+    channels.insert(id, KonfytLscp::LsChannel());
+    emit ls.requestAddSfz(id, path);
+    return id;
 }
 
 QString KonfytLscpEngine::pluginName(int id)
@@ -61,13 +75,13 @@ QString KonfytLscpEngine::pluginName(int id)
 
 QString KonfytLscpEngine::midiInJackPortName(int id)
 {
-    KonfytLscp::LsChannel info = ls.getSfzChannelInfo(id);
+    KonfytLscp::LsChannel info = channels.value(id);
     return info.midiJackPort;
 }
 
 QStringList KonfytLscpEngine::audioOutJackPortNames(int id)
 {
-    KonfytLscp::LsChannel info = ls.getSfzChannelInfo(id);
+    KonfytLscp::LsChannel info = channels.value(id);
     QStringList ret;
     ret.append(info.audioLeftJackPort);
     ret.append(info.audioRightJackPort);
@@ -76,7 +90,8 @@ QStringList KonfytLscpEngine::audioOutJackPortNames(int id)
 
 void KonfytLscpEngine::removeSfz(int id)
 {
-    ls.removeSfzChannel(id);
+    channels.remove(id);
+    emit ls.requestRemoveSfz(id);
 }
 
 void KonfytLscpEngine::setGain(int id, float newGain)
@@ -84,6 +99,13 @@ void KonfytLscpEngine::setGain(int id, float newGain)
     print("TODO: setGain " + n2s(id) + " to " + n2s(newGain));
 }
 
+/* Instruments are loaded by Linuxsampler in the background after the channel
+ * has been added. */
+bool KonfytLscpEngine::reportsLoadProgress()
+{
+    return true;
+}
+
 void KonfytLscpEngine::onLsInitialised(bool error, QString errMsg)
 {
     if (error) {
@@ -119,11 +141,32 @@ void KonfytLscpEngine::onLsInitialised(bool error, QString errMsg)
     }
 
     foreach (const QString& client, orphaned) {
-        ls.removeAllRelatedToClient(client);
+        emit ls.requestRemoveAllRelatedToClient(client);
     }
 
-    // Device setup
-    ls.setupDevices(mJackEngine->clientName() + end);
+    // Device setup. Requests are handled in order, so SFZs may be added
+    // right away.
+    mClientName = mJackEngine->clientName() + end;
+    emit ls.requestSetupDevices(mClientName);
 
     emit initDone("");
 }
+
+void KonfytLscpEngine::onSfzAdded(int id, KonfytLscp::LsChannel info, QString error)
+{
+    // Ignore if removed in the meantime
+    if (!channels.contains(id)) { return; }
+
+    if (error.isEmpty()) {
+        channels.insert(id, info);
+    }
+    emit sfzAdded(id, error);
+}
+
+void KonfytLscpEngine::onSfzLoadProgress(int id, int percent)
+{
+    // Ignore if removed in the meantime
+    if (!channels.contains(id)) { return; }
+
+    emit sfzLoadProgress(id, percent);
+}
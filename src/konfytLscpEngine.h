@@ -25,8 +25,12 @@
 #include "konfytLscp.h"
 #include "konfytBaseSoundEngine.h"
 
+#include <QMap>
 #include <QObject>
+#include <QThread>
 
+/* SFZ engine using Linuxsampler, controlled via LSCP from a worker thread.
+ * SFZs are added asynchronously, see KonfytBaseSoundEngine::sfzAdded(). */
 class KonfytLscpEngine : public KonfytBaseSoundEngine
 {
 public:
@@ -42,13 +46,21 @@ public:
     QStringList audioOutJackPortNames(int id) override;
     void removeSfz(int id) override;
     void setGain(int id, float newGain) override;
+    bool reportsLoadProgress() override;
 
 private:
     KonfytLscp ls;
+    QThread lscpThread;
     KonfytJackEngine* mJackEngine = nullptr;
+    QString mClientName;
+
+    int idCounter = 0;
+    QMap<int, KonfytLscp::LsChannel> channels; // Empty until added
 
 private slots:
     void onLsInitialised(bool error, QString errMsg);
+    void onSfzAdded(int id, KonfytLscp::LsChannel info, QString error);
+    void onSfzLoadProgress(int id, int percent);
 
 };
 
@@ -21,6 +21,10 @@
 
 #include "konfytPatchEngine.h"
 
+#include <QFileInfo>
+#include <QSet>
+#include <QTimer>
+
 #include <iostream>
 
 
@@ -49,6 +53,10 @@ void KonfytPatchEngine::initPatchEngine(KonfytJackEngine* newJackClient,
     fluidsynthEngine.initFluidsynth(jack->getSampleRate());
     jack->setFluidsynthEngine(&fluidsynthEngine);
 
+    layerLoader.setFluidsynthEngine(&fluidsynthEngine);
+    connect(&layerLoader, &KonfytLayerLoader::soundfontProgramLoaded,
+            this, &KonfytPatchEngine::onSoundfontProgramLoaded);
+
     // Initialise SFZ Backend
 
     bridge = appInfo.bridge;
@@ -56,11 +64,23 @@ void KonfytPatchEngine::initPatchEngine(KonfytJackEngine* newJackClient,
         // Create bridge engine (each plugin is hosted in new Konfyt process)
         sfzEngine = new KonfytBridgeEngine();
         static_cast<KonfytBridgeEngine*>(sfzEngine)->setKonfytExePath(appInfo.exePath);
+#ifdef KONFYT_USE_SAMPLER
+        // Workers render with our own sampler into shared memory
+        static_cast<KonfytBridgeEngine*>(sfzEngine)->setSharedMemoryTransport(appInfo.bridgeShm);
+#endif
     }
+#ifdef KONFYT_USE_SAMPLER
+    else if (appInfo.sampler) {
+        // Use our own sampler in our JACK client
+        sfzEngine = new KonfytSamplerEngine();
+    }
+#endif
 #ifdef KONFYT_USE_CARLA
     else if (appInfo.carla) {
         // Use local Carla engine
-        sfzEngine = new KonfytCarlaEngine();
+        KonfytCarlaEngine* carla = new KonfytCarlaEngine();
+        carla->setInProcess(appInfo.carlaInProcess);
+        sfzEngine = carla;
     }
 #endif
     else {
@@ -76,10 +96,20 @@ void KonfytPatchEngine::initPatchEngine(KonfytJackEngine* newJackClient,
             this, &KonfytPatchEngine::statusInfo);
     connect(sfzEngine, &KonfytBaseSoundEngine::initDone,
             this, &KonfytPatchEngine::onSfzEngineInitDone);
+    connect(sfzEngine, &KonfytBaseSoundEngine::sfzAdded,
+            this, &KonfytPatchEngine::onSfzAdded);
+    connect(sfzEngine, &KonfytBaseSoundEngine::sfzLoadProgress,
+            this, &KonfytPatchEngine::onSfzLoadProgress);
 
     sfzEngine->initEngine(jack);
 }
 
+/* True once the SFZ engine has finished initialising, successfully or not. */
+bool KonfytPatchEngine::isSfzEngineInitialised()
+{
+    return sfzEngineInitDone;
+}
+
 /* Returns names of JACK clients that refer to engines in use by us. */
 QStringList KonfytPatchEngine::ourJackClientNames()
 {
@@ -115,37 +145,68 @@ void KonfytPatchEngine::unloadPatch(KonfytPatch *patch)
     }
 
     patches.removeAll(patch);
+    patchLastUsed.remove(patch);
     if (mCurrentPatch == patch) { mCurrentPatch = nullptr; }
 }
 
-/* Load patch, replacing the current patch. */
+/* Load patch, replacing the current patch.
+ * Layers of the new patch that are not loaded yet are loaded first, while the
+ * previous patch is still active. The changes to switch from the previous patch
+ * to the new one are then determined and applied together, so the JACK process
+ * callback never sees the two patches partially active. */
 void KonfytPatchEngine::loadPatchAndSetCurrent(KonfytPatch *patch)
 {
     if (patch == nullptr) { return; }
 
-    // Deactivate routes for current patch
-    if (patch != mCurrentPatch) {
-        if (mCurrentPatch != nullptr) {
-            if (!mCurrentPatch->alwaysActive) {
+    KonfytPatch* previousPatch = mCurrentPatch;
+    mCurrentPatch = patch;
+
+    loadPatchLayers(patch);
+    prioritizeLayerLoads(patch);
 
-                foreach (KfPatchLayerSharedPtr layer, mCurrentPatch->layers()) {
-                    setLayerActive(layer, false);
-                }
+    QList<LayerStateChange> changes;
+
+    // Deactivate routes for previous patch
+    if ( (previousPatch != nullptr) && (previousPatch != patch) ) {
+        if (!previousPatch->alwaysActive) {
 
+            foreach (KfPatchLayerSharedPtr layer, previousPatch->layers()) {
+                if (layer->hasError()) { continue; }
+                if (!layer->jackState.valid) { continue; }
+                LayerStateChange change {previousPatch, layer, layer->jackState};
+                change.target.active = false;
+                changes.append(change);
             }
+
         }
     }
 
-    mCurrentPatch = patch;
-    loadPatch(patch);
+    changes.append(patchLayerStateChanges(patch));
+
+    applyLayerStateChanges(changes);
+
+    touchPatch(patch);
+    scheduleResidencyUpdate();
 }
 
 void KonfytPatchEngine::loadPatch(KonfytPatch *patch)
+{
+    loadPatchLayers(patch);
+
+    applyLayerStateChanges(patchLayerStateChanges(patch));
+}
+
+/* Load all layers of the patch that have not been loaded into their respective
+ * engines yet. Routing, gain, etc. are not applied here. */
+void KonfytPatchEngine::loadPatchLayers(KonfytPatch *patch)
 {
     bool patchIsNew = false;
     if ( !patches.contains(patch) ) {
         patchIsNew = true;
         patches.append(patch);
+        foreach (KfPatchLayerSharedPtr layer, patch->layers()) {
+            layer->jackState = LayerJackState();
+        }
     }
 
     // SFZ layers
@@ -161,9 +222,9 @@ void KonfytPatchEngine::loadPatch(KonfytPatch *patch)
     // Fluidsynth layers
     foreach (KfPatchLayerSharedPtr layer, patch->getSfLayerList()) {
         if (patchIsNew) { layer->soundfontData.synthInEngine = nullptr; }
-        if ( layer->soundfontData.synthInEngine == nullptr ) {
-            loadSoundfontLayer(layer);
-            // Gain, solo, mute, bus and routing is done later
+        if ( (layer->soundfontData.synthInEngine == nullptr) && !layer->isLoading() ) {
+            loadSoundfontLayer(layer, layerLoadPriority(patch));
+            // Gain, solo, mute, bus and routing is done when loading completes
         }
     }
 
@@ -183,18 +244,92 @@ void KonfytPatchEngine::loadPatch(KonfytPatch *patch)
             loadMidiOutputPort(layer);
         }
     }
+}
+
+/* Determine the target JACK engine state (routing, gain and, if the patch is
+ * current or always active, active state based on solo and mute) of all the
+ * layers in the patch. */
+QList<KonfytPatchEngine::LayerStateChange> KonfytPatchEngine::patchLayerStateChanges(
+        KonfytPatch *patch)
+{
+    QList<LayerStateChange> changes;
+
+    bool setActive = patch->alwaysActive || (patch == mCurrentPatch);
+    bool solo = patchHasSoloLayer(patch);
 
-    // All layers are now loaded. Now set gains, activate routes, etc.
     foreach (KfPatchLayerSharedPtr layer, patch->layers()) {
-        updateLayerRouting(layer);
-        updateLayerGain(layer);
-        updateLayerPatchMidiFilterInJackEngine(patch, layer);
+        if (layer->hasError()) { continue; }
+        if (layer->isLoading()) { continue; }
+
+        LayerStateChange change {patch, layer, layer->jackState};
+        resolveLayerRouting(layer, &change.target);
+        change.target.gain = konfytConvertGain(layer->gain());
+        if (setActive) {
+            change.target.active = layerActiveBySoloMute(layer, solo);
+        }
+        changes.append(change);
+    }
+
+    return changes;
+}
+
+/* Apply the changes that differ from the current layer states. All of them are
+ * applied while the JACK process callback is paused, i.e. in between two
+ * process cycles. */
+void KonfytPatchEngine::applyLayerStateChanges(const QList<LayerStateChange> &changes)
+{
+    QList<LayerStateChange> toApply;
+    foreach (const LayerStateChange &change, changes) {
+        if (layerStateDiffers(change.layer->jackState, change.target)) {
+            toApply.append(change);
+        }
     }
+    if (toApply.isEmpty()) { return; }
 
-    // Set layers active based on solo and mute
-    if (patch->alwaysActive || (patch == mCurrentPatch)) {
-        updatePatchLayersSoloMute(patch);
+    jack->pauseJackProcessing(true);
+    foreach (const LayerStateChange &change, toApply) {
+        applyLayerState(change.patch, change.layer, change.target);
     }
+    // Change the delays in the same cycle as the layers
+    jack->updateLatencyCompensation();
+    jack->pauseJackProcessing(false);
+}
+
+/* Update the layer in the JACK engine, only changing the parts of the target
+ * state that differ from the current state. */
+void KonfytPatchEngine::applyLayerState(KonfytPatch *patch,
+                                        KfPatchLayerSharedPtr layer,
+                                        const LayerJackState &target)
+{
+    LayerJackState current = layer->jackState;
+
+    if (!current.valid || !current.sameRoutingAs(target)) {
+        applyLayerRouting(layer, target);
+    }
+    if (!current.valid || (current.gain != target.gain)) {
+        applyLayerGain(layer, target.gain);
+    }
+    if (!current.valid) {
+        // The patch MIDI filter only changes with setPatchFilter(), which
+        // applies it directly. It only has to be applied here the first time.
+        updateLayerPatchMidiFilterInJackEngine(patch, layer);
+    }
+    if (!current.valid || (current.active != target.active)) {
+        setLayerActive(layer, target.active);
+    }
+
+    layer->jackState = target;
+    layer->jackState.valid = true;
+}
+
+bool KonfytPatchEngine::layerStateDiffers(const LayerJackState &current,
+                                          const LayerJackState &target)
+{
+    if (!current.valid) { return true; }
+    if (!current.sameRoutingAs(target)) { return true; }
+    if (current.gain != target.gain) { return true; }
+    if (current.active != target.active) { return true; }
+    return false;
 }
 
 KfPatchLayerWeakPtr KonfytPatchEngine::addSfProgramLayer(
@@ -221,6 +356,55 @@ KfPatchLayerWeakPtr KonfytPatchEngine::addSfProgramLayer(
     return layer.toWeakRef();
 }
 
+/* Change the program of a loaded soundfont layer to another program in the
+ * same soundfont, without reloading the layer. Returns false if the layer is
+ * not a loaded soundfont layer or the program could not be set. */
+bool KonfytPatchEngine::setSfLayerProgram(KfPatchLayerWeakPtr patchLayer,
+                                          KonfytSoundPreset newProgram)
+{
+    KfPatchLayerSharedPtr layer = patchLayer.toStrongRef();
+    KONFYT_ASSERT_RETURN_VAL(layer, false);
+
+    if (layer->layerType() != KonfytPatchLayer::TypeSoundfontProgram) { return false; }
+    if (layer->isLoading() || layer->hasError()) { return false; }
+    KfFluidSynth* synth = layer->soundfontData.synthInEngine;
+    if (!synth) { return false; }
+
+    if (!fluidsynthEngine.setSoundfontProgram(synth, newProgram)) { return false; }
+
+    layer->soundfontData.program = newProgram;
+    layer->setName(layer->soundfontData.parentSoundfont + "/" + newProgram.name);
+    return true;
+}
+
+/* Set the number of soundfonts to keep loaded after the last layer using
+ * them has been unloaded. */
+void KonfytPatchEngine::setSoundfontCacheSize(int size)
+{
+    if (size <= 0) {
+        foreach (quint64 jobId, soundfontPreloadJobs) {
+            layerLoader.cancelJob(jobId);
+        }
+        soundfontPreloadJobs.clear();
+    }
+    fluidsynthEngine.setSoundfontCacheSize(size);
+}
+
+/* Load the soundfonts into the soundfont cache in the background, replacing
+ * previously requested preloads that haven't started yet. */
+void KonfytPatchEngine::preloadSoundfonts(QStringList soundfontPaths)
+{
+    foreach (quint64 jobId, soundfontPreloadJobs) {
+        layerLoader.cancelJob(jobId);
+    }
+    soundfontPreloadJobs.clear();
+
+    foreach (QString path, soundfontPaths) {
+        soundfontPreloadJobs.append(
+                    layerLoader.preloadSoundfont(path, LoadPriorityPreload));
+    }
+}
+
 void KonfytPatchEngine::removeLayer(KfPatchLayerWeakPtr layer)
 {
     KONFYT_ASSERT_RETURN(mCurrentPatch);
@@ -248,6 +432,8 @@ void KonfytPatchEngine::moveLayer(KfPatchLayerWeakPtr layer, int newIndex)
 void KonfytPatchEngine::unloadLayer(KfPatchLayerWeakPtr layer)
 {
     KfPatchLayerSharedPtr l = layer.toStrongRef();
+    if (l->isLoading()) { cancelLayerLoad(l); }
+
     if (l->layerType() == KonfytPatchLayer::TypeSoundfontProgram) {
         if (l->soundfontData.synthInEngine) {
             // First remove from JACK engine
@@ -287,6 +473,8 @@ void KonfytPatchEngine::unloadLayer(KfPatchLayerWeakPtr layer)
             l->audioInPortData.jackRouteRight = nullptr;
         }
     }
+
+    l->jackState = LayerJackState();
 }
 
 void KonfytPatchEngine::reloadLayer(KfPatchLayerWeakPtr layer)
@@ -300,6 +488,16 @@ bool KonfytPatchEngine::isPatchLoaded(KonfytPatch *patch)
     return patches.contains(patch);
 }
 
+bool KonfytPatchEngine::isPatchReady(KonfytPatch *patch)
+{
+    if (!isPatchLoaded(patch)) { return false; }
+    foreach (KfPatchLayerSharedPtr layer, patch->layers()) {
+        if (layer->hasError()) { continue; }
+        if (!layer->isReady()) { return false; }
+    }
+    return true;
+}
+
 KfPatchLayerWeakPtr KonfytPatchEngine::addSfzLayer(QString path)
 {
     KONFYT_ASSERT_RETURN_VAL(mCurrentPatch, KfPatchLayerWeakPtr());
@@ -328,7 +526,17 @@ KfPatchLayerWeakPtr KonfytPatchEngine::addSfzLayer(QString path)
 void KonfytPatchEngine::updateLayerRouting(KfPatchLayerSharedPtr layer)
 {
     if (layer->hasError()) { return; }
+    if (layer->isLoading()) { return; } // Routing is applied when done loading
 
+    resolveLayerRouting(layer, &layer->jackState);
+    applyLayerRouting(layer, layer->jackState);
+}
+
+/* Look up the project ports and bus the layer has to be routed to and fill
+ * in the routing part of state. */
+void KonfytPatchEngine::resolveLayerRouting(KfPatchLayerSharedPtr layer,
+                                            LayerJackState *state)
+{
     KonfytPatchLayer::LayerType layerType = layer->layerType();
 
     PrjAudioBus bus;
@@ -372,54 +580,73 @@ void KonfytPatchEngine::updateLayerRouting(KfPatchLayerSharedPtr layer)
         }
     }
 
+    state->midiInPort = midiInPort.jackPort;
+    state->busLeft = bus.leftJackPort;
+    state->busRight = bus.rightJackPort;
+    state->midiOutPort = nullptr;
+    state->audioInLeft = nullptr;
+    state->audioInRight = nullptr;
+
+    if (layerType == KonfytPatchLayer::TypeMidiOut) {
+
+        int portId = layer->midiOutputPortData.portIdInProject;
+        if (mCurrentProject->midiOutPort_exists(portId)) {
+            state->midiOutPort = mCurrentProject->midiOutPort_getPort(portId).jackPort;
+        } else {
+            print(QString("WARNING: Layer %1 invalid MIDI out port %2")
+                  .arg(layer->name()).arg(portId));
+        }
+
+    } else if (layerType == KonfytPatchLayer::TypeAudioIn) {
+
+        // The port number refers to a stereo port pair in the project.
+        int portId = layer->audioInPortData.portIdInProject;
+        if (mCurrentProject->audioInPort_exists(portId)) {
+            PrjAudioInPort portPair = mCurrentProject->audioInPort_getPort(portId);
+            state->audioInLeft = portPair.leftJackPort;
+            state->audioInRight = portPair.rightJackPort;
+        } else {
+            print(QString("WARNING: Layer %1 invalid audio input port %2")
+                  .arg(layer->name()).arg(portId));
+        }
+
+    }
+}
+
+/* Set the layer routes in the JACK engine according to the routing in state. */
+void KonfytPatchEngine::applyLayerRouting(KfPatchLayerSharedPtr layer,
+                                          const LayerJackState &state)
+{
+    KonfytPatchLayer::LayerType layerType = layer->layerType();
+
     if (layerType ==  KonfytPatchLayer::TypeSoundfontProgram) {
 
-        LayerSoundfontData sfData = layer->soundfontData;
-        jack->setSoundfontRouting( sfData.portsInJackEngine, midiInPort.jackPort,
-                                   bus.leftJackPort, bus.rightJackPort );
+        jack->setSoundfontRouting(layer->soundfontData.portsInJackEngine,
+                                  state.midiInPort,
+                                  state.busLeft, state.busRight);
 
     } else if (layerType == KonfytPatchLayer::TypeSfz) {
 
-        LayerSfzData pluginData = layer->sfzData;
-        jack->setPluginRouting(pluginData.portsInJackEngine,
-                               midiInPort.jackPort,
-                               bus.leftJackPort, bus.rightJackPort);
+        jack->setPluginRouting(layer->sfzData.portsInJackEngine,
+                               state.midiInPort,
+                               state.busLeft, state.busRight);
 
     } else if (layerType == KonfytPatchLayer::TypeMidiOut) {
 
-        LayerMidiOutData portData = layer->midiOutputPortData;
-        if (mCurrentProject->midiOutPort_exists(portData.portIdInProject)) {
-
-            PrjMidiPort prjMidiOutPort = mCurrentProject->midiOutPort_getPort( portData.portIdInProject );
-            jack->setMidiRoute(portData.jackRoute, midiInPort.jackPort,
-                               prjMidiOutPort.jackPort);
-
-        } else {
-            print(QString("WARNING: Layer %1 invalid MIDI out port %2")
-                  .arg(layer->name()).arg(portData.portIdInProject));
+        if (state.midiOutPort) {
+            jack->setMidiRoute(layer->midiOutputPortData.jackRoute,
+                               state.midiInPort, state.midiOutPort);
         }
 
     } else if (layerType == KonfytPatchLayer::TypeAudioIn) {
 
-        // The port number in audioInLayerStruct refers to a stereo port pair index in the project.
-        // The bus number in audioInLayerStruct refers to a bus in the project with a left and right jack port.
-        // We have to retrieve the port pair and bus from the project in order to get the left and right port Jack port numbers.
-        LayerAudioInData audioPortData = layer->audioInPortData;
-        if (mCurrentProject->audioInPort_exists(audioPortData.portIdInProject)) {
-
-            PrjAudioInPort portPair = mCurrentProject->audioInPort_getPort(audioPortData.portIdInProject);
+        if (state.audioInLeft && state.audioInRight) {
             // Left channel Bus routing
-            jack->setAudioRoute(audioPortData.jackRouteLeft,
-                                portPair.leftJackPort,
-                                bus.leftJackPort);
+            jack->setAudioRoute(layer->audioInPortData.jackRouteLeft,
+                                state.audioInLeft, state.busLeft);
             // Right channel Bus routing
-            jack->setAudioRoute(audioPortData.jackRouteRight,
-                                portPair.rightJackPort,
-                                bus.rightJackPort);
-
-        } else {
-            print(QString("WARNING: Layer %1 invalid audio input port %2")
-                  .arg(layer->name()).arg(audioPortData.portIdInProject));
+            jack->setAudioRoute(layer->audioInPortData.jackRouteRight,
+                                state.audioInRight, state.busRight);
         }
 
     } else if (layerType == KonfytPatchLayer::TypeUninitialized) {
@@ -437,13 +664,18 @@ void KonfytPatchEngine::updateLayerGain(KfPatchLayerSharedPtr layer)
 {
     if (layer->hasError()) { return; }
 
+    applyLayerGain(layer, konfytConvertGain(layer->gain()));
+}
+
+void KonfytPatchEngine::applyLayerGain(KfPatchLayerSharedPtr layer, float gain)
+{
     KonfytPatchLayer::LayerType layerType = layer->layerType();
 
     if (layerType ==  KonfytPatchLayer::TypeSoundfontProgram) {
 
         LayerSoundfontData sfData = layer->soundfontData;
         if (sfData.synthInEngine == nullptr) { return; } // Layer not loaded yet
-        fluidsynthEngine.setGain( sfData.synthInEngine, konfytConvertGain(layer->gain()) );
+        fluidsynthEngine.setGain(sfData.synthInEngine, gain);
 
     } else if (layerType == KonfytPatchLayer::TypeSfz) {
 
@@ -451,18 +683,16 @@ void KonfytPatchEngine::updateLayerGain(KfPatchLayerSharedPtr layer)
         if (pluginData.indexInEngine == -1) { return; } // Layer not loaded yet
         // Set gain of JACK ports instead of sfzEngine->setGain() since this
         // isn't implemented for all engine types yet.
-        jack->setPluginGain(pluginData.portsInJackEngine, konfytConvertGain(layer->gain()) );
+        jack->setPluginGain(pluginData.portsInJackEngine, gain);
 
     } else if (layerType == KonfytPatchLayer::TypeAudioIn) {
 
         LayerAudioInData audioPortData = layer->audioInPortData;
         if (audioPortData.jackRouteLeft == nullptr) { return; } // Layer not loaded yet
         // Left channel Gain
-        jack->setAudioRouteGain(audioPortData.jackRouteLeft,
-                                konfytConvertGain(layer->gain()));
+        jack->setAudioRouteGain(audioPortData.jackRouteLeft, gain);
         // Right channel Gain
-        jack->setAudioRouteGain(audioPortData.jackRouteRight,
-                                konfytConvertGain(layer->gain()));
+        jack->setAudioRouteGain(audioPortData.jackRouteRight, gain);
 
     } else if (layerType == KonfytPatchLayer::TypeMidiOut) {
 
@@ -477,40 +707,53 @@ void KonfytPatchEngine::updateLayerGain(KfPatchLayerSharedPtr layer)
         KONFYT_ASSERT_FAIL("Unknown layer type.");
 
     }
+
+    layer->jackState.gain = gain;
 }
 
 void KonfytPatchEngine::updatePatchLayersSoloMute(KonfytPatch *patch)
 {
     if (patch == nullptr) { return; }
 
-    QList<KfPatchLayerWeakPtr> layerList = patch->layers();
-
-    // Determine solo
-    bool solo = false;
-    foreach (KfPatchLayerSharedPtr layer, layerList) {
-        if (layer->isSolo()) {
-            solo = true;
-            break;
-        }
-    }
+    bool solo = patchHasSoloLayer(patch);
 
     // Activate/deactivate routing based on solo/mute
-    foreach (KfPatchLayerSharedPtr layer, layerList) {
+    QList<LayerStateChange> changes;
+    foreach (KfPatchLayerSharedPtr layer, patch->layers()) {
 
         if (layer->hasError()) { continue; }
+        if (!layer->jackState.valid) { continue; }
+
+        LayerStateChange change {patch, layer, layer->jackState};
+        change.target.active = layerActiveBySoloMute(layer, solo);
+        changes.append(change);
+    }
 
-        bool activate = false;
-        if (solo && layer->isSolo()) { activate = true; }
-        if (!solo) { activate = true; }
-        if (layer->isMute()) { activate = false; }
+    applyLayerStateChanges(changes);
+}
 
-        setLayerActive(layer, activate);
+bool KonfytPatchEngine::patchHasSoloLayer(KonfytPatch *patch)
+{
+    foreach (KfPatchLayerSharedPtr layer, patch->layers()) {
+        if (layer->isSolo()) { return true; }
     }
+    return false;
+}
+
+bool KonfytPatchEngine::layerActiveBySoloMute(KfPatchLayerSharedPtr layer,
+                                              bool patchSolo)
+{
+    bool activate = false;
+    if (patchSolo && layer->isSolo()) { activate = true; }
+    if (!patchSolo) { activate = true; }
+    if (layer->isMute()) { activate = false; }
+    return activate;
 }
 
 void KonfytPatchEngine::setLayerActive(KfPatchLayerSharedPtr layer, bool active)
 {
     if (layer->hasError()) { return; }
+    if (layer->isLoading()) { return; }
 
     KonfytPatchLayer::LayerType layerType = layer->layerType();
 
@@ -541,6 +784,8 @@ void KonfytPatchEngine::setLayerActive(KfPatchLayerSharedPtr layer, bool active)
         KONFYT_ASSERT_FAIL("Unknown layer type.");
 
     }
+
+    layer->jackState.active = active;
 }
 
 void KonfytPatchEngine::updateLayerPatchMidiFilterInJackEngine(
@@ -550,6 +795,7 @@ void KonfytPatchEngine::updateLayerPatchMidiFilterInJackEngine(
     KONFYT_ASSERT_RETURN(!layer.isNull());
 
     if (layer->hasError()) { return; }
+    if (layer->isLoading()) { return; }
 
     if (layer->layerType() == KonfytPatchLayer::TypeSoundfontProgram) {
 
@@ -583,9 +829,234 @@ void KonfytPatchEngine::setPatchFilter(KonfytPatch *patch, KonfytMidiFilter filt
     KONFYT_ASSERT_RETURN(patches.contains(patch));
 
     patch->patchMidiFilter = filter;
+    jack->pauseJackProcessing(true);
     foreach (KfPatchLayerSharedPtr layer, patch->layers()) {
         updateLayerPatchMidiFilterInJackEngine(patch, layer);
     }
+    jack->pauseJackProcessing(false);
+}
+
+void KonfytPatchEngine::setDatabase(KonfytDatabase *db)
+{
+    mDatabase = db;
+}
+
+/* Set the memory budget (in bytes) for loaded patches. With no limit (0), all
+ * patches of the project are eventually preloaded. */
+void KonfytPatchEngine::setMemoryBudget(qint64 bytes)
+{
+    mMemoryBudget = qMax(bytes, qint64(0));
+    scheduleResidencyUpdate();
+}
+
+qint64 KonfytPatchEngine::memoryBudget() const
+{
+    return mMemoryBudget;
+}
+
+void KonfytPatchEngine::touchPatch(KonfytPatch *patch)
+{
+    patchUseCounter++;
+    patchLastUsed[patch] = patchUseCounter;
+}
+
+/* Residency is updated from the event loop so that a patch switch completes
+ * as soon as the new patch is active. */
+void KonfytPatchEngine::scheduleResidencyUpdate()
+{
+    if (residencyUpdateScheduled) { return; }
+    residencyUpdateScheduled = true;
+    QTimer::singleShot(0, this, &KonfytPatchEngine::updateResidency);
+}
+
+/* Returns the index of the current patch in the project patch list. If the
+ * current patch is not part of the project (e.g. the preview patch), the most
+ * recently used project patch is used. Returns -1 if there is none. */
+int KonfytPatchEngine::residencyAnchorIndex(const QList<KonfytPatch*> &prjPatches)
+{
+    int anchor = prjPatches.indexOf(mCurrentPatch);
+    if (anchor >= 0) { return anchor; }
+
+    quint64 lastUsed = 0;
+    for (int i=0; i < prjPatches.count(); i++) {
+        quint64 used = patchLastUsed.value(prjPatches[i], 0);
+        if (used > lastUsed) {
+            lastUsed = used;
+            anchor = i;
+        }
+    }
+    return anchor;
+}
+
+/* Patches that are kept loaded regardless of the memory budget: the current
+ * patch, the previous and next patches in the project and always active
+ * patches. */
+QList<KonfytPatch*> KonfytPatchEngine::pinnedPatches()
+{
+    QList<KonfytPatch*> ret;
+    if (mCurrentPatch) { ret.append(mCurrentPatch); }
+    if (!mCurrentProject) { return ret; }
+
+    QList<KonfytPatch*> prjPatches = mCurrentProject->getPatchList();
+    int anchor = residencyAnchorIndex(prjPatches);
+    for (int i = anchor-1; (anchor >= 0) && (i <= anchor+1); i++) {
+        KonfytPatch* patch = prjPatches.value(i, nullptr);
+        if (patch && !ret.contains(patch)) { ret.append(patch); }
+    }
+    foreach (KonfytPatch* patch, prjPatches) {
+        if (patch->alwaysActive && !ret.contains(patch)) { ret.append(patch); }
+    }
+
+    return ret;
+}
+
+/* Returns the project patches ordered by distance from the current patch,
+ * with the next patch before the previous one at each distance. */
+QList<KonfytPatch*> KonfytPatchEngine::projectPatchesByDistance()
+{
+    QList<KonfytPatch*> ret;
+    if (!mCurrentProject) { return ret; }
+
+    QList<KonfytPatch*> prjPatches = mCurrentProject->getPatchList();
+    int anchor = qMax(residencyAnchorIndex(prjPatches), 0);
+    for (int d=0; d < prjPatches.count(); d++) {
+        if (anchor + d < prjPatches.count()) {
+            ret.append(prjPatches[anchor + d]);
+        }
+        if ( (d > 0) && (anchor - d >= 0) ) {
+            ret.append(prjPatches[anchor - d]);
+        }
+    }
+
+    return ret;
+}
+
+/* Estimate of the memory used by the layer when loaded, in bytes. */
+qint64 KonfytPatchEngine::layerMemoryCost(KfPatchLayerSharedPtr layer)
+{
+    KonfytSoundType type;
+    QString filename;
+    if (layer->layerType() == KonfytPatchLayer::TypeSoundfontProgram) {
+        type = KfSoundTypeSoundfont;
+        filename = layer->soundfontData.parentSoundfont;
+    } else if (layer->layerType() == KonfytPatchLayer::TypeSfz) {
+        type = KfSoundTypeSfz;
+        filename = layer->sfzData.path;
+    } else {
+        // MIDI output and audio input layers use negligible memory
+        return 0;
+    }
+
+    if (mDatabase) {
+        return mDatabase->estimatedMemoryUse(type, filename);
+    } else {
+        return QFileInfo(filename).size();
+    }
+}
+
+/* Estimate of the memory used by the patches when loaded, in bytes. Sounds
+ * used by more than one layer are loaded only once and thus counted once. */
+qint64 KonfytPatchEngine::memoryCost(const QList<KonfytPatch*> &patchList)
+{
+    qint64 cost = 0;
+    QSet<QString> counted;
+    foreach (KonfytPatch* patch, patchList) {
+        foreach (KfPatchLayerSharedPtr layer, patch->layers()) {
+            if (layer->hasError()) { continue; }
+            QString key;
+            if (layer->layerType() == KonfytPatchLayer::TypeSoundfontProgram) {
+                key = layer->soundfontData.parentSoundfont;
+            } else if (layer->layerType() == KonfytPatchLayer::TypeSfz) {
+                key = layer->sfzData.path;
+            }
+            if (key.isEmpty() || counted.contains(key)) { continue; }
+            counted.insert(key);
+            cost += layerMemoryCost(layer);
+        }
+    }
+    return cost;
+}
+
+/* Unload the least recently used project patch that is not in the keep list.
+ * Of patches that have not been used, the one furthest from the current patch
+ * is unloaded first. Returns false if there was no patch to unload. */
+bool KonfytPatchEngine::evictLeastRecentlyUsedPatch(const QList<KonfytPatch*> &keep)
+{
+    QList<KonfytPatch*> candidates = projectPatchesByDistance();
+
+    KonfytPatch* lru = nullptr;
+    for (int i = candidates.count()-1; i >= 0; i--) {
+        KonfytPatch* patch = candidates[i];
+        if (!patches.contains(patch)) { continue; }
+        if (keep.contains(patch)) { continue; }
+        if ( (lru == nullptr) ||
+             (patchLastUsed.value(patch, 0) < patchLastUsed.value(lru, 0)) )
+        {
+            lru = patch;
+        }
+    }
+    if (lru == nullptr) { return false; }
+
+    print("Unloading patch to stay within memory budget: " + lru->name());
+    unloadPatch(lru);
+    emit patchResidencyChanged(lru, false);
+
+    return true;
+}
+
+/* Ensure pinned patches are loaded, unload least recently used patches while
+ * over the memory budget and preload the patches closest to the current one
+ * while they fit in the budget. At most one patch is loaded per call, after
+ * which another update is scheduled, so the event loop is not blocked for
+ * long. */
+void KonfytPatchEngine::updateResidency()
+{
+    residencyUpdateScheduled = false;
+    if (!mCurrentProject) { return; }
+
+    QList<KonfytPatch*> pinned = pinnedPatches();
+    foreach (KonfytPatch* patch, pinned) {
+        if (!patches.contains(patch)) {
+            loadPatch(patch);
+            emit patchResidencyChanged(patch, true);
+            scheduleResidencyUpdate();
+            return;
+        }
+    }
+
+    if (mMemoryBudget > 0) {
+        while (memoryCost(patches) > mMemoryBudget) {
+            if (!evictLeastRecentlyUsedPatch(pinned)) { break; }
+        }
+    }
+
+    // Wait for the SFZ engine before giving it more to load. This is
+    // rescheduled when an SFZ layer is ready.
+    if (sfzLayersLoading()) { return; }
+
+    foreach (KonfytPatch* patch, projectPatchesByDistance()) {
+        if (patches.contains(patch)) { continue; }
+        if ( (mMemoryBudget > 0) && (memoryCost(patches + QList<KonfytPatch*>{patch}) > mMemoryBudget) ) {
+            // Patches further away won't be preloaded before this one
+            break;
+        }
+        loadPatch(patch);
+        emit patchResidencyChanged(patch, true);
+        scheduleResidencyUpdate();
+        return;
+    }
+}
+
+/* True if the SFZ engine is still loading SFZ layers of loaded patches. */
+bool KonfytPatchEngine::sfzLayersLoading()
+{
+    foreach (KonfytPatch* patch, patches) {
+        foreach (KfPatchLayerSharedPtr layer, patch->getPluginLayerList()) {
+            if (layer->hasError()) { continue; }
+            if (!layer->isReady()) { return true; }
+        }
+    }
+    return false;
 }
 
 void KonfytPatchEngine::setMidiPickupRange(int range)
@@ -697,6 +1168,9 @@ void KonfytPatchEngine::setLayerFilter(KfPatchLayerWeakPtr patchLayer, KonfytMid
     KfPatchLayerSharedPtr l = patchLayer.toStrongRef();
     l->setMidiFilter(filter);
 
+    // The filter is set in the JACK engine when loading completes
+    if (l->isLoading()) { return; }
+
     // And also in the respective engine.
     if (l->layerType() == KonfytPatchLayer::TypeSoundfontProgram) {
 
@@ -759,8 +1233,19 @@ void KonfytPatchEngine::loadSfzLayer(KfPatchLayerSharedPtr layer)
 
     layer->sfzData.indexInEngine = ID;
     layer->setName(sfzEngine->pluginName(ID));
+    // The instrument may still be loading after the SFZ has been added
+    layer->setLoadProgress(sfzEngine->reportsLoadProgress() ? 0 : 100);
     // Add to JACK engine
 
+    KfJackInternalPlugin* internal = sfzEngine->internalPlugin(ID);
+    if (internal) {
+        // Rendered in our own JACK process callback, no ports to connect
+        layer->sfzData.portsInJackEngine = jack->addInternalPlugin(
+                    internal, layer->midiFilter());
+        emit patchLayerLoaded(layer);
+        return;
+    }
+
     // Find the plugin midi input port
     layer->sfzData.midiInPort = sfzEngine->midiInJackPortName(ID);
 
@@ -783,26 +1268,138 @@ void KonfytPatchEngine::loadSfzLayer(KfPatchLayerSharedPtr layer)
     KfJackPluginPorts* jackPorts = jack->addPluginPortsAndConnect( spec );
     layer->sfzData.portsInJackEngine = jackPorts;
 
+    if (layer->sfzData.midiInPort.isEmpty()) {
+        // The SFZ is added asynchronously and the plugin ports are not known
+        // yet. Routing etc. is applied when done, see onSfzAdded().
+        layer->setLoading(true);
+        return;
+    }
+
     emit patchLayerLoaded(layer);
 }
 
-void KonfytPatchEngine::loadSoundfontLayer(KfPatchLayerSharedPtr layer)
+/* Start loading the soundfont program in the background. The layer is added
+ * to the JACK engine when done, see onSoundfontProgramLoaded(). */
+void KonfytPatchEngine::loadSoundfontLayer(KfPatchLayerSharedPtr layer, int priority)
 {
-    // Load in Fluidsynth engine
-    layer->soundfontData.synthInEngine =
-            fluidsynthEngine.addSoundfontProgram(
+    if (pendingLayerLoads.isEmpty()) {
+        // Start of a new batch of loads
+        layerLoadTimer.start();
+        layerLoadsQueued = 0;
+    }
+
+    layer->setLoading(true);
+    quint64 jobId = layerLoader.loadSoundfontProgram(
                 layer->soundfontData.parentSoundfont,
-                layer->soundfontData.program);
-    if (!layer->soundfontData.synthInEngine) {
+                layer->soundfontData.program,
+                priority);
+    pendingLayerLoads.insert(jobId, layer.toWeakRef());
+    layerLoadsQueued++;
+}
+
+/* Layers of the current patch are loaded before layers of patches that are
+ * preloaded in the background. */
+int KonfytPatchEngine::layerLoadPriority(KonfytPatch *patch)
+{
+    if (patch == mCurrentPatch) {
+        return LoadPriorityCurrentPatch;
+    } else {
+        return LoadPriorityBackground;
+    }
+}
+
+/* Move the queued loads of the patch's layers to the front of the queue, e.g.
+ * when switching to a patch that was being preloaded in the background. */
+void KonfytPatchEngine::prioritizeLayerLoads(KonfytPatch *patch)
+{
+    QList<KfPatchLayerWeakPtr> patchLayers = patch->layers();
+    QHashIterator<quint64, KfPatchLayerWeakPtr> i(pendingLayerLoads);
+    while (i.hasNext()) {
+        i.next();
+        if (patchLayers.contains(i.value())) {
+            layerLoader.setJobPriority(i.key(), layerLoadPriority(patch));
+        }
+    }
+}
+
+/* Show the progress of the background loads and print the total time when
+ * all loads are done. */
+void KonfytPatchEngine::reportLayerLoadProgress()
+{
+    int done = layerLoadsQueued - pendingLayerLoads.count();
+    if (pendingLayerLoads.isEmpty()) {
+        emit statusInfo("Sounds loaded.");
+        print(QString("Loaded %1 layers in %2 ms")
+              .arg(layerLoadsQueued).arg(layerLoadTimer.elapsed()));
+    } else {
+        emit statusInfo(QString("Loading sounds: %1 of %2")
+                        .arg(done).arg(layerLoadsQueued));
+    }
+}
+
+/* A soundfont program has finished loading in the background. Add it to the
+ * JACK engine and apply the layer routing, gain, etc. */
+void KonfytPatchEngine::onSoundfontProgramLoaded(quint64 jobId, KfFluidSynth *synth)
+{
+    if (!pendingLayerLoads.contains(jobId)) {
+        // Load was cancelled in the meantime
+        if (synth) { fluidsynthEngine.removeSoundfontProgram(synth); }
+        return;
+    }
+    KfPatchLayerSharedPtr layer = pendingLayerLoads.take(jobId).toStrongRef();
+    reportLayerLoadProgress();
+    if (layer.isNull()) {
+        // Layer was removed in the meantime
+        if (synth) { fluidsynthEngine.removeSoundfontProgram(synth); }
+        return;
+    }
+    layer->setLoading(false);
+
+    if (!synth) {
         layer->setErrorMessage("Failed to load soundfont.");
+        emit patchLayerLoaded(layer);
         return;
     }
 
+    layer->setErrorMessage("");
+    layer->soundfontData.synthInEngine = synth;
+
     // Add to Jack engine (this also assigns the midi filter)
-    KfJackPluginPorts* jackPorts = jack->addSoundfont(
-                layer->soundfontData.synthInEngine);
+    KfJackPluginPorts* jackPorts = jack->addSoundfont(synth);
     layer->soundfontData.portsInJackEngine = jackPorts;
     jack->setSoundfontMidiFilter(jackPorts, layer->midiFilter());
+
+    KonfytPatch* patch = patchOfLayer(layer);
+    if (patch) {
+        applyLayerStateChanges(patchLayerStateChanges(patch));
+    }
+
+    emit patchLayerLoaded(layer);
+}
+
+/* Discard the result of a background load that is still in progress. */
+void KonfytPatchEngine::cancelLayerLoad(KfPatchLayerSharedPtr layer)
+{
+    bool cancelled = false;
+    QMutableHashIterator<quint64, KfPatchLayerWeakPtr> i(pendingLayerLoads);
+    while (i.hasNext()) {
+        i.next();
+        if (i.value() == layer) {
+            i.remove();
+            cancelled = true;
+        }
+    }
+    layer->setLoading(false);
+    if (cancelled) { reportLayerLoadProgress(); }
+}
+
+/* Returns the loaded patch that contains the layer, or nullptr if none. */
+KonfytPatch *KonfytPatchEngine::patchOfLayer(KfPatchLayerSharedPtr layer)
+{
+    foreach (KonfytPatch* patch, patches) {
+        if (patch->layers().contains(layer.toWeakRef())) { return patch; }
+    }
+    return nullptr;
 }
 
 void KonfytPatchEngine::loadAudioInputPort(KfPatchLayerSharedPtr layer)
@@ -861,6 +1458,72 @@ void KonfytPatchEngine::loadMidiOutputPort(KfPatchLayerSharedPtr layer)
     }
 }
 
+/* The SFZ engine finished adding an SFZ asynchronously. Connect the JACK
+ * ports of the layer to the plugin and apply the layer's state. */
+void KonfytPatchEngine::onSfzAdded(int id, QString error)
+{
+    KonfytPatch* patch = nullptr;
+    KfPatchLayerSharedPtr layer = sfzLayerInEngine(id, &patch);
+    if (!layer) { return; } // Layer was unloaded in the meantime
+
+    layer->setLoading(false);
+
+    if (!error.isEmpty()) {
+        layer->setErrorMessage("Failed to load SFZ: " + error);
+        emit patchLayerLoaded(layer);
+        return;
+    }
+
+    layer->sfzData.midiInPort = sfzEngine->midiInJackPortName(id);
+    QStringList audioLR = sfzEngine->audioOutJackPortNames(id);
+    layer->sfzData.audioOutPortLeft = audioLR.value(0);
+    layer->sfzData.audioOutPortRight = audioLR.value(1);
+    jack->setPluginConnections(layer->sfzData.portsInJackEngine,
+                               layer->sfzData.midiInPort,
+                               layer->sfzData.audioOutPortLeft,
+                               layer->sfzData.audioOutPortRight);
+
+    applyLayerStateChanges(patchLayerStateChanges(patch));
+
+    emit patchLayerLoaded(layer);
+}
+
+/* The SFZ engine is still loading the instrument of an SFZ layer. */
+void KonfytPatchEngine::onSfzLoadProgress(int id, int percent)
+{
+    KonfytPatch* patch = nullptr;
+    KfPatchLayerSharedPtr layer = sfzLayerInEngine(id, &patch);
+    if (!layer) { return; }
+
+    if (percent < 0) {
+        layer->setErrorMessage("Failed to load instrument: " + layer->sfzData.path);
+        layer->setLoadProgress(100);
+    } else {
+        layer->setLoadProgress(percent);
+    }
+    emit patchLayerLoadProgress(layer);
+
+    if (layer->isReady()) {
+        // Preloading of other patches waits for SFZ layers to be ready
+        scheduleResidencyUpdate();
+    }
+}
+
+/* Returns the loaded SFZ layer with the id in the SFZ engine and sets patch to
+ * the patch containing it. Returns null if there is none. */
+KfPatchLayerSharedPtr KonfytPatchEngine::sfzLayerInEngine(int id, KonfytPatch **patch)
+{
+    foreach (KonfytPatch* p, patches) {
+        foreach (KfPatchLayerSharedPtr layer, p->getPluginLayerList()) {
+            if (layer->sfzData.indexInEngine == id) {
+                *patch = p;
+                return layer;
+            }
+        }
+    }
+    return KfPatchLayerSharedPtr();
+}
+
 void KonfytPatchEngine::onSfzEngineInitDone(QString error)
 {
     if (error.isEmpty()) {
@@ -875,6 +1538,7 @@ void KonfytPatchEngine::onSfzEngineInitDone(QString error)
                     layer->sfzData.portsInJackEngine = nullptr;
                 }
                 layer->sfzData.indexInEngine = -1;
+                layer->jackState = LayerJackState();
             }
             loadPatch(patch);
         }
@@ -882,5 +1546,8 @@ void KonfytPatchEngine::onSfzEngineInitDone(QString error)
     } else {
         print("SFZ engine initialisation error: " + error);
     }
+
+    sfzEngineInitDone = true;
+    emit sfzEngineInitialised();
 }
 
@@ -24,17 +24,24 @@
 
 #include "konfytAudio.h"
 #include "konfytBridgeEngine.h"
+#include "konfytDatabase.h"
 #include "konfytFluidsynthEngine.h"
 #include "konfytJackEngine.h"
+#include "konfytLayerLoader.h"
 #include "konfytLscpEngine.h"
 #include "konfytPatch.h"
 #include "konfytProject.h"
 #ifdef KONFYT_USE_CARLA
     #include "konfytCarlaEngine.h"
 #endif
+#ifdef KONFYT_USE_SAMPLER
+    #include "konfytSamplerEngine.h"
+#endif
 
 #include <jack/jack.h>
 
+#include <QElapsedTimer>
+#include <QHash>
 #include <QObject>
 
 class KonfytPatchEngine : public QObject
@@ -51,6 +58,7 @@ public:
     // ----------------------------------------------------
     void initPatchEngine(KonfytJackEngine* newJackClient, KonfytAppInfo appInfo);
     QStringList ourJackClientNames();
+    bool isSfzEngineInitialised();
     void panic(bool p);
     void setMidiPickupRange(int range);
 
@@ -66,10 +74,18 @@ public:
     void unloadLayer(KfPatchLayerWeakPtr layer);
     void reloadLayer(KfPatchLayerWeakPtr layer);
     bool isPatchLoaded(KonfytPatch* patch);
+    bool isPatchReady(KonfytPatch* patch);  // Loaded and all sounds ready to play
 
     KonfytPatch* currentPatch();
     void setPatchFilter(KonfytPatch* patch, KonfytMidiFilter filter);
 
+    // ----------------------------------------------------
+    // Patch residency
+    // ----------------------------------------------------
+    void setDatabase(KonfytDatabase* db);   // Used for layer memory estimates
+    void setMemoryBudget(qint64 bytes);     // 0 for no limit
+    qint64 memoryBudget() const;
+
     // ----------------------------------------------------
     // Modify layers
     // ----------------------------------------------------
@@ -96,6 +112,10 @@ public:
 
     // Soundfont / Fluidsynth layers
     KfPatchLayerWeakPtr addSfProgramLayer(QString soundfontPath, KonfytSoundPreset newProgram);
+    bool setSfLayerProgram(KfPatchLayerWeakPtr patchLayer, KonfytSoundPreset newProgram);
+    // Keep recently used soundfonts loaded, e.g. while previewing
+    void setSoundfontCacheSize(int size);
+    void preloadSoundfonts(QStringList soundfontPaths);
 
     // SFZ layers
     KfPatchLayerWeakPtr addSfzLayer(QString path);
@@ -110,6 +130,9 @@ signals:
     void print(QString msg);
     void statusInfo(QString msg);
     void patchLayerLoaded(KfPatchLayerWeakPtr layer);
+    void patchLayerLoadProgress(KfPatchLayerWeakPtr layer);
+    void patchResidencyChanged(KonfytPatch* patch, bool loaded);
+    void sfzEngineInitialised();
     
 private:
     KonfytPatch* mCurrentPatch = nullptr;
@@ -118,25 +141,86 @@ private:
 
     QList<KonfytPatch*> patches;
 
+    void loadPatchLayers(KonfytPatch* patch);
     void loadSfzLayer(KfPatchLayerSharedPtr layer);
-    void loadSoundfontLayer(KfPatchLayerSharedPtr layer);
+    void loadSoundfontLayer(KfPatchLayerSharedPtr layer, int priority);
     void loadAudioInputPort(KfPatchLayerSharedPtr layer);
     void loadMidiOutputPort(KfPatchLayerSharedPtr layer);
     void updateLayerRouting(KfPatchLayerSharedPtr layer);
+    void resolveLayerRouting(KfPatchLayerSharedPtr layer, LayerJackState* state);
+    void applyLayerRouting(KfPatchLayerSharedPtr layer, const LayerJackState &state);
     void updateLayerGain(KfPatchLayerSharedPtr layer);
+    void applyLayerGain(KfPatchLayerSharedPtr layer, float gain);
     void updatePatchLayersSoloMute(KonfytPatch* patch);
+    bool patchHasSoloLayer(KonfytPatch* patch);
+    bool layerActiveBySoloMute(KfPatchLayerSharedPtr layer, bool patchSolo);
     void setLayerActive(KfPatchLayerSharedPtr layer, bool active);
     void updateLayerPatchMidiFilterInJackEngine(KonfytPatch* patch, KfPatchLayerSharedPtr layer);
 
+    // Patch switching: changes are determined first, then only the layers
+    // whose state differs are updated, together in one pause of the JACK engine.
+    struct LayerStateChange
+    {
+        KonfytPatch* patch;
+        KfPatchLayerSharedPtr layer;
+        LayerJackState target;
+    };
+    QList<LayerStateChange> patchLayerStateChanges(KonfytPatch* patch);
+    void applyLayerStateChanges(const QList<LayerStateChange> &changes);
+    void applyLayerState(KonfytPatch* patch, KfPatchLayerSharedPtr layer,
+                         const LayerJackState &target);
+    bool layerStateDiffers(const LayerJackState &current,
+                           const LayerJackState &target);
+
+    // Patch residency: the current patch, its neighbours in the project and
+    // always active patches are kept loaded. Other patches are preloaded in
+    // the background while they fit in the memory budget, and the least
+    // recently used ones are unloaded when the budget is exceeded.
+    KonfytDatabase* mDatabase = nullptr;
+    qint64 mMemoryBudget = 0;
+    QHash<KonfytPatch*, quint64> patchLastUsed;
+    quint64 patchUseCounter = 0;
+    bool residencyUpdateScheduled = false;
+    void touchPatch(KonfytPatch* patch);
+    void scheduleResidencyUpdate();
+    int residencyAnchorIndex(const QList<KonfytPatch*> &prjPatches);
+    QList<KonfytPatch*> pinnedPatches();
+    QList<KonfytPatch*> projectPatchesByDistance();
+    qint64 layerMemoryCost(KfPatchLayerSharedPtr layer);
+    qint64 memoryCost(const QList<KonfytPatch*> &patchList);
+    bool evictLeastRecentlyUsedPatch(const QList<KonfytPatch*> &keep);
+    bool sfzLayersLoading();
+
     KonfytFluidsynthEngine fluidsynthEngine;
 
+    // Background loading of layers
+    KonfytLayerLoader layerLoader;
+    QHash<quint64, KfPatchLayerWeakPtr> pendingLayerLoads;
+    enum LayerLoadPriority { LoadPriorityPreload = -1, LoadPriorityBackground = 0,
+                             LoadPriorityCurrentPatch = 1 };
+    int layerLoadPriority(KonfytPatch* patch);
+    void prioritizeLayerLoads(KonfytPatch* patch);
+    void cancelLayerLoad(KfPatchLayerSharedPtr layer);
+    QList<quint64> soundfontPreloadJobs;
+    // Progress of the current batch of background loads
+    QElapsedTimer layerLoadTimer;
+    int layerLoadsQueued = 0;
+    void reportLayerLoadProgress();
+    KonfytPatch* patchOfLayer(KfPatchLayerSharedPtr layer);
+
     KonfytBaseSoundEngine* sfzEngine;
+    KfPatchLayerSharedPtr sfzLayerInEngine(int id, KonfytPatch** patch);
+    bool sfzEngineInitDone = false;
     bool bridge = false;
 
     KonfytJackEngine* jack;
 
 private slots:
     void onSfzEngineInitDone(QString error);
+    void onSfzAdded(int id, QString error);
+    void onSfzLoadProgress(int id, int percent);
+    void updateResidency();
+    void onSoundfontProgramLoaded(quint64 jobId, KfFluidSynth* synth);
 };
 
 #endif // KONFYT_PATCH_ENGINE_H
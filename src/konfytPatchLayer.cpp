@@ -36,6 +36,32 @@ QString KonfytPatchLayer::errorMessage() const
     return mErrorMessage;
 }
 
+void KonfytPatchLayer::setLoading(bool loading)
+{
+    mLoading = loading;
+}
+
+bool KonfytPatchLayer::isLoading() const
+{
+    return mLoading;
+}
+
+void KonfytPatchLayer::setLoadProgress(int percent)
+{
+    mLoadProgress = qBound(0, percent, 100);
+}
+
+int KonfytPatchLayer::loadProgress() const
+{
+    return mLoadProgress;
+}
+
+/* True if the layer is loaded and ready to be played. */
+bool KonfytPatchLayer::isReady() const
+{
+    return !mLoading && (mLoadProgress >= 100);
+}
+
 QList<KonfytMidiEvent> KonfytPatchLayer::getMidiSendListEvents()
 {
     QList<KonfytMidiEvent> events;
@@ -71,6 +71,29 @@ struct LayerAudioInData
     KfJackAudioRoute* jackRouteRight = nullptr;
 };
 
+// ----------------------------------------------------
+// State of a layer as last applied to the JACK engine
+// ----------------------------------------------------
+struct LayerJackState
+{
+    bool valid = false; // False until the state has been fully applied once
+    bool active = false;
+    float gain = 1;
+    KfJackMidiPort* midiInPort = nullptr;
+    KfJackMidiPort* midiOutPort = nullptr;     // MIDI out layers
+    KfJackAudioPort* audioInLeft = nullptr;    // Audio in layers
+    KfJackAudioPort* audioInRight = nullptr;
+    KfJackAudioPort* busLeft = nullptr;
+    KfJackAudioPort* busRight = nullptr;
+
+    bool sameRoutingAs(const LayerJackState &s) const
+    {
+        return (midiInPort == s.midiInPort) && (midiOutPort == s.midiOutPort)
+                && (audioInLeft == s.audioInLeft) && (audioInRight == s.audioInRight)
+                && (busLeft == s.busLeft) && (busRight == s.busRight);
+    }
+};
+
 
 // ----------------------------------------------------
 // Class
@@ -119,6 +142,15 @@ public:
     bool hasError() const;
     QString errorMessage() const;
 
+    // True while the layer is being loaded in the background
+    void setLoading(bool loading);
+    bool isLoading() const;
+    // Progress (0 to 100) of sounds that are still streamed in by their engine
+    // after the layer has been loaded, e.g. SFZ instruments.
+    void setLoadProgress(int percent);
+    int loadProgress() const;
+    bool isReady() const;
+
     // Depending on the layer type, one of the following is used:
     // TODO: MERGE BELOW INTO LAYER
     LayerSoundfontData    soundfontData;
@@ -126,12 +158,17 @@ public:
     LayerMidiOutData      midiOutputPortData;
     LayerAudioInData      audioInPortData;
 
+    // Maintained by the patch engine
+    LayerJackState        jackState;
+
     QList<MidiSendItem> midiSendList;
     QList<KonfytMidiEvent> getMidiSendListEvents();
 
 private:
     LayerType mLayerType = TypeUninitialized;
     QString mErrorMessage;
+    bool mLoading = false;
+    int mLoadProgress = 100;
     float mGain = 1.0;
     bool mSolo = false;
     bool mMute = false;
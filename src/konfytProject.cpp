@@ -21,8 +21,29 @@
 
 #include "konfytProject.h"
 
+#include <QElapsedTimer>
+#include <QRunnable>
+#include <QThreadPool>
+
 #include <iostream>
 
+
+/* Reads a patch file, used to read the patch files of a project in parallel. */
+class KonfytPatchFileReader : public QRunnable
+{
+public:
+    QString filename;
+    KonfytPatch* patch = nullptr;
+    QString errors;
+    bool ok = false;
+
+    void run() override
+    {
+        patch = new KonfytPatch();
+        ok = patch->loadPatchFromFile(filename, &errors);
+    }
+};
+
 KonfytProject::KonfytProject(QObject *parent) :
     QObject(parent)
 {
@@ -262,6 +283,7 @@ bool KonfytProject::loadProject(QString filename)
     r.setNamespaceProcessing(false);
 
     QString patchFilename;
+    QStringList patchFilenames;
     patchList.clear();
     midiInPortMap.clear();
     midiOutPortMap.clear();
@@ -294,20 +316,8 @@ bool KonfytProject::loadProject(QString filename)
 
                 }
 
-                // Add new patch
-                KonfytPatch* pt = new KonfytPatch();
-                QString errors;
-                patchFilename = dir.path() + "/" + patchFilename;
-                print("loadProject: Loading patch " + patchFilename);
-                if (pt->loadPatchFromFile(patchFilename, &errors)) {
-                    this->addPatch(pt);
-                } else {
-                    // Error message on loading patch.
-                    print("loadProject: Error loading patch: " + patchFilename);
-                }
-                if (!errors.isEmpty()) {
-                    print("Load errors for patch " + patchFilename + ":\n" + errors);
-                }
+                // Patch files are read after the project file, in parallel
+                patchFilenames.append(dir.path() + "/" + patchFilename);
 
             } else if (r.name() == XML_PRJ_PATCH_LIST_NUMBERS) {
 
@@ -550,6 +560,8 @@ bool KonfytProject::loadProject(QString filename)
 
     file.close();
 
+    loadPatchFiles(patchFilenames);
+
     postExternalAppsRead(); // Commit loaded list. Used for backwards compatibility.
 
     // Check if we have at least one audio output bus. If not, create a default one.
@@ -568,6 +580,43 @@ bool KonfytProject::loadProject(QString filename)
     return true;
 }
 
+/* Read the patch files in parallel and add the patches to the project in the
+ * order of the filenames. */
+void KonfytProject::loadPatchFiles(QStringList filenames)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QList<KonfytPatchFileReader*> readers;
+    QThreadPool pool;
+    foreach (QString filename, filenames) {
+        KonfytPatchFileReader* reader = new KonfytPatchFileReader();
+        reader->setAutoDelete(false);
+        reader->filename = filename;
+        readers.append(reader);
+        pool.start(reader);
+    }
+    pool.waitForDone();
+
+    foreach (KonfytPatchFileReader* reader, readers) {
+        if (reader->ok) {
+            this->addPatch(reader->patch);
+        } else {
+            // Error message on loading patch.
+            print("loadProject: Error loading patch: " + reader->filename);
+            delete reader->patch;
+        }
+        if (!reader->errors.isEmpty()) {
+            print("Load errors for patch " + reader->filename + ":\n" + reader->errors);
+        }
+        delete reader;
+    }
+
+    print(QString("loadProject: Read %1 patch files in %2 ms (%3 threads)")
+          .arg(filenames.count()).arg(timer.elapsed())
+          .arg(pool.maxThreadCount()));
+}
+
 void KonfytProject::setProjectName(QString newName)
 {
     projectName = newName;
@@ -249,6 +249,8 @@ private:
 
     int getUniqueIdHelper(QList<int> ids);
 
+    void loadPatchFiles(QStringList filenames);
+
     QMap<int, ExternalApp> externalApps;
     int getUniqueExternalAppId();
     void clearExternalApps();
@@ -0,0 +1,938 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytSampler.h"
+
+#include <QFileInfo>
+
+#include <math.h>
+#include <string.h>
+
+
+// ============================================================================
+// KfSamplerRegion
+// ============================================================================
+
+bool KfSamplerRegion::matches(int note, int velocity) const
+{
+    return (note >= loKey) && (note <= hiKey)
+            && (velocity >= loVel) && (velocity <= hiVel);
+}
+
+// ============================================================================
+// KfSamplerInstrument
+// ============================================================================
+
+KfSamplerInstrument::~KfSamplerInstrument()
+{
+    qDeleteAll(samples);
+}
+
+/* Reads the regions of the SFZ. Regions without a sample file are skipped. */
+bool KfSamplerInstrument::parse(QString filename, QString *error)
+{
+    QList<KonfytSfzReader::Opcodes> regionOpcodes;
+    if (!KonfytSfzReader::readRegions(filename, &regionOpcodes, error)) {
+        return false;
+    }
+
+    foreach (const KonfytSfzReader::Opcodes &opcodes, regionOpcodes) {
+        KfSamplerRegion region;
+        if (setRegion(opcodes, &region)) {
+            regions.append(region);
+        }
+    }
+
+    if (regions.isEmpty()) {
+        *error = "No regions with samples.";
+        return false;
+    }
+    return true;
+}
+
+int KfSamplerInstrument::sampleCount() const
+{
+    return samples.count();
+}
+
+/* Opens the sample file and loads its head, or the whole sample if it is
+ * needed in memory. Regions using a sample that failed to load are silent. */
+bool KfSamplerInstrument::loadSample(int index, QString *error)
+{
+    KONFYT_ASSERT_RETURN_VAL((index >= 0) && (index < samples.count()), false);
+    KfSamplerSample* s = samples[index];
+
+    SF_INFO info;
+    memset(&info, 0, sizeof(info));
+    SNDFILE* file = sf_open(s->encodedPath.constData(), SFM_READ, &info);
+    if (!file) {
+        *error = QString("%1: %2").arg(s->path).arg(sf_strerror(nullptr));
+        return false;
+    }
+
+    setLoopFromFile(s, file);
+
+    s->channels = info.channels;
+    s->sampleRate = info.samplerate;
+    s->frames = info.frames;
+    if (s->looped || (s->channels > 2)) {
+        s->headFrames = s->frames;
+    } else {
+        s->headFrames = qMin(s->frames, (sf_count_t)KONFYT_SAMPLER_HEAD_FRAMES);
+    }
+
+    s->head.resize(s->headFrames * s->channels);
+    sf_count_t read = sf_readf_float(file, s->head.data(), s->headFrames);
+    sf_close(file);
+
+    if (read < s->headFrames) {
+        *error = s->path + ": Could not read sample data.";
+        s->frames = 0;
+        s->headFrames = 0;
+        s->head.clear();
+        return false;
+    }
+    return true;
+}
+
+/* Regions that don't specify a loop mode use the loop of the sample file if
+ * it has one, in which case the whole sample is loaded in memory. */
+void KfSamplerInstrument::setLoopFromFile(KfSamplerSample *s, SNDFILE *file)
+{
+    SF_INSTRUMENT inst;
+    memset(&inst, 0, sizeof(inst));
+    bool hasLoop = sf_command(file, SFC_GET_INSTRUMENT, &inst, sizeof(inst))
+                    && (inst.loop_count > 0)
+                    && (inst.loops[0].mode != SF_LOOP_NONE);
+
+    for (int i=0; i < regions.count(); i++) {
+        KfSamplerRegion& r = regions[i];
+        if (r.sample != s) { continue; }
+        if (!r.loopModeSet && hasLoop) {
+            r.loopMode = KfSamplerRegion::LoopContinuous;
+        }
+        if ( (r.loopMode == KfSamplerRegion::LoopContinuous)
+             || (r.loopMode == KfSamplerRegion::LoopSustain) ) {
+            if ( (r.loopEnd < 0) && hasLoop ) {
+                r.loopStart = inst.loops[0].start;
+                r.loopEnd = inst.loops[0].end;
+            }
+            s->looped = true;
+        }
+    }
+}
+
+KfSamplerSample *KfSamplerInstrument::sample(QString path)
+{
+    KfSamplerSample* s = samplesByPath.value(path);
+    if (!s) {
+        s = new KfSamplerSample();
+        s->path = path;
+        s->encodedPath = QFile::encodeName(path);
+        samples.append(s);
+        samplesByPath.insert(path, s);
+    }
+    return s;
+}
+
+/* Sets the region from its opcodes. Returns false if the region can't be
+ * played, e.g. it has no sample file. */
+bool KfSamplerInstrument::setRegion(const KonfytSfzReader::Opcodes &opcodes,
+                                    KfSamplerRegion *r)
+{
+    QString path = opcodes.value("sample");
+    if (path.isEmpty() || path.startsWith('*')) { return false; }
+    if (!QFileInfo::exists(path)) { return false; }
+    r->sample = sample(path);
+
+    if (opcodes.contains("key")) {
+        int key = noteValue(opcodes.value("key"), 60);
+        r->loKey = key;
+        r->hiKey = key;
+        r->keyCenter = key;
+    }
+    r->loKey = noteValue(opcodes.value("lokey"), r->loKey);
+    r->hiKey = noteValue(opcodes.value("hikey"), r->hiKey);
+    r->keyCenter = noteValue(opcodes.value("pitch_keycenter"), r->keyCenter);
+    r->loVel = (int)floatValue(opcodes, "lovel", r->loVel);
+    r->hiVel = (int)floatValue(opcodes, "hivel", r->hiVel);
+
+    QString trigger = opcodes.value("trigger");
+    if (trigger == "release") {
+        r->trigger = KfSamplerRegion::TriggerRelease;
+    }
+
+    r->seqLength = qMax(1, (int)floatValue(opcodes, "seq_length", r->seqLength));
+    r->seqPosition = qMax(1, (int)floatValue(opcodes, "seq_position", r->seqPosition));
+    r->loRand = floatValue(opcodes, "lorand", r->loRand);
+    r->hiRand = floatValue(opcodes, "hirand", r->hiRand);
+    r->group = (int)floatValue(opcodes, "group", r->group);
+    r->offBy = (int)floatValue(opcodes, "off_by", r->offBy);
+
+    r->offset = (sf_count_t)floatValue(opcodes, "offset", r->offset);
+    r->end = (sf_count_t)floatValue(opcodes, "end", r->end);
+    QString loopMode = opcodes.value("loop_mode", opcodes.value("loopmode"));
+    if (!loopMode.isEmpty()) {
+        r->loopModeSet = true;
+        if (loopMode == "one_shot") {
+            r->loopMode = KfSamplerRegion::LoopOneShot;
+        } else if (loopMode == "loop_continuous") {
+            r->loopMode = KfSamplerRegion::LoopContinuous;
+        } else if (loopMode == "loop_sustain") {
+            r->loopMode = KfSamplerRegion::LoopSustain;
+        } else {
+            r->loopMode = KfSamplerRegion::LoopNone;
+        }
+    }
+    r->loopStart = (sf_count_t)floatValue(opcodes, "loop_start",
+                                          floatValue(opcodes, "loopstart", r->loopStart));
+    r->loopEnd = (sf_count_t)floatValue(opcodes, "loop_end",
+                                        floatValue(opcodes, "loopend", r->loopEnd));
+    if ( (r->loopMode == KfSamplerRegion::LoopContinuous)
+         || (r->loopMode == KfSamplerRegion::LoopSustain) ) {
+        r->sample->looped = true;
+    }
+
+    r->keytrack = floatValue(opcodes, "pitch_keytrack", r->keytrack);
+    r->tune = floatValue(opcodes, "tune", 0)
+              + 100 * floatValue(opcodes, "transpose", 0);
+    r->bendUp = floatValue(opcodes, "bend_up", r->bendUp);
+    r->bendDown = floatValue(opcodes, "bend_down", r->bendDown);
+
+    r->gain = powf(10, floatValue(opcodes, "volume", 0) / 20);
+    r->ampVeltrack = floatValue(opcodes, "amp_veltrack", r->ampVeltrack);
+    r->pan = qBound(-100.0f, floatValue(opcodes, "pan", r->pan), 100.0f);
+
+    r->ampegDelay = floatValue(opcodes, "ampeg_delay", r->ampegDelay);
+    r->ampegAttack = floatValue(opcodes, "ampeg_attack", r->ampegAttack);
+    r->ampegHold = floatValue(opcodes, "ampeg_hold", r->ampegHold);
+    r->ampegDecay = floatValue(opcodes, "ampeg_decay", r->ampegDecay);
+    r->ampegSustain = qBound(0.0f, floatValue(opcodes, "ampeg_sustain",
+                                              r->ampegSustain), 100.0f);
+    r->ampegRelease = floatValue(opcodes, "ampeg_release", r->ampegRelease);
+
+    return true;
+}
+
+/* Returns the MIDI note of a number or note name, e.g. 60, c4 or f#3. */
+int KfSamplerInstrument::noteValue(QString value, int defaultValue)
+{
+    value = value.trimmed().toLower();
+    if (value.isEmpty()) { return defaultValue; }
+
+    bool ok;
+    int note = value.toInt(&ok);
+    if (ok) { return qBound(0, note, 127); }
+
+    static const QString names = "c d ef g a b";
+    int semitone = names.indexOf(value[0]);
+    if (semitone < 0) { return defaultValue; }
+    int i = 1;
+    if (value.mid(i, 1) == "#") {
+        semitone++;
+        i++;
+    } else if (value.mid(i, 1) == "b") {
+        semitone--;
+        i++;
+    }
+    int octave = value.mid(i).toInt(&ok);
+    if (!ok) { return defaultValue; }
+
+    return qBound(0, (octave + 1) * 12 + semitone, 127);
+}
+
+float KfSamplerInstrument::floatValue(const KonfytSfzReader::Opcodes &opcodes,
+                                      QString opcode, float defaultValue)
+{
+    bool ok;
+    float value = opcodes.value(opcode).toFloat(&ok);
+    return ok ? value : defaultValue;
+}
+
+// ============================================================================
+// KfSamplerStreamer
+// ============================================================================
+
+KfSamplerStreamer::KfSamplerStreamer()
+{
+    for (int i=0; i < KONFYT_SAMPLER_STREAMS; i++) {
+        streams[i].ring = (float*)calloc(KONFYT_SAMPLER_STREAM_FRAMES * 2,
+                                         sizeof(float));
+    }
+}
+
+KfSamplerStreamer::~KfSamplerStreamer()
+{
+    stop();
+    for (int i=0; i < KONFYT_SAMPLER_STREAMS; i++) {
+        closeStream(&streams[i]);
+        free(streams[i].ring);
+    }
+}
+
+void KfSamplerStreamer::stop()
+{
+    quit = true;
+    wait();
+}
+
+/* Returns the stream that will be filled from the frame of the sample onwards,
+ * or -1 if no stream is available. */
+int KfSamplerStreamer::startStream(const KfSamplerSample *sample, sf_count_t fromFrame)
+{
+    for (int i=0; i < KONFYT_SAMPLER_STREAMS; i++) {
+        Stream* s = &streams[i];
+        if (s->state.load(std::memory_order_acquire) != StreamFree) { continue; }
+        if (!s->ring) { continue; }
+        s->sample = sample;
+        s->startFrame = fromFrame;
+        s->channels = sample->channels;
+        s->state.store(StreamRequested, std::memory_order_release);
+        return i;
+    }
+    exhausted.fetch_add(1, std::memory_order_relaxed);
+    return -1;
+}
+
+QString KfSamplerStreamer::takeExhaustionReport()
+{
+    int count = exhausted.exchange(0, std::memory_order_relaxed);
+    if (count == 0) { return ""; }
+    return QString("Sampler ran out of disk streams (%1 shared by all SFZs). "
+                   "%2 notes only played the part of the sample in memory.")
+            .arg(KONFYT_SAMPLER_STREAMS).arg(count);
+}
+
+/* Returns the data of the frame in the stream, or null if it is not available.
+ * ended is set if the frame is past the end of the sample. */
+const float *KfSamplerStreamer::streamFrame(int stream, sf_count_t frame, bool *ended)
+{
+    Stream* s = &streams[stream];
+    sf_count_t i = frame - s->startFrame;
+    // Load ended first, so written is final if it is set
+    bool end = s->ended.load(std::memory_order_acquire);
+    sf_count_t written = s->written.load(std::memory_order_acquire);
+
+    *ended = false;
+    if (i < 0) { return nullptr; }
+    if (i >= written) {
+        // Not read from disk yet
+        *ended = end;
+        return nullptr;
+    }
+    if (i < written - KONFYT_SAMPLER_STREAM_FRAMES) { return nullptr; }
+
+    return s->ring + (i % KONFYT_SAMPLER_STREAM_FRAMES) * s->channels;
+}
+
+void KfSamplerStreamer::setStreamPosition(int stream, sf_count_t frame)
+{
+    Stream* s = &streams[stream];
+    s->read.store(qMax((sf_count_t)0, frame - s->startFrame),
+                  std::memory_order_release);
+}
+
+void KfSamplerStreamer::stopStream(int stream)
+{
+    streams[stream].state.store(StreamStopping, std::memory_order_release);
+}
+
+void KfSamplerStreamer::waitUntilStopped(int stream)
+{
+    while ( isRunning()
+            && (streams[stream].state.load(std::memory_order_acquire) != StreamFree) ) {
+        msleep(1);
+    }
+}
+
+void KfSamplerStreamer::run()
+{
+    while (!quit) {
+        bool busy = false;
+        for (int i=0; i < KONFYT_SAMPLER_STREAMS; i++) {
+            Stream* s = &streams[i];
+            switch (s->state.load(std::memory_order_acquire)) {
+            case StreamRequested:
+                openStream(s);
+                busy = true;
+                break;
+            case StreamActive:
+                if (fillStream(s)) { busy = true; }
+                break;
+            case StreamStopping:
+                closeStream(s);
+                break;
+            default:
+                break;
+            }
+        }
+        if (!busy) { usleep(500); }
+    }
+}
+
+void KfSamplerStreamer::openStream(Stream *s)
+{
+    SF_INFO info;
+    memset(&info, 0, sizeof(info));
+    s->file = sf_open(s->sample->encodedPath.constData(), SFM_READ, &info);
+    if ( !s->file || (sf_seek(s->file, s->startFrame, SEEK_SET) < 0) ) {
+        // Voice will end at the end of the sample's head
+        s->ended.store(true, std::memory_order_release);
+    }
+    // The stream may have been stopped in the meantime
+    int expected = StreamRequested;
+    s->state.compare_exchange_strong(expected, StreamActive);
+}
+
+/* Read the next chunk from disk if there is space in the ring buffer.
+ * Returns true if anything was read. */
+bool KfSamplerStreamer::fillStream(Stream *s)
+{
+    if (s->ended.load(std::memory_order_relaxed)) { return false; }
+
+    sf_count_t written = s->written.load(std::memory_order_relaxed);
+    sf_count_t read = s->read.load(std::memory_order_acquire);
+    sf_count_t space = KONFYT_SAMPLER_STREAM_FRAMES - (written - read);
+    if (space < KONFYT_SAMPLER_STREAM_CHUNK) { return false; }
+
+    sf_count_t pos = written % KONFYT_SAMPLER_STREAM_FRAMES;
+    sf_count_t n = qMin((sf_count_t)KONFYT_SAMPLER_STREAM_CHUNK,
+                        KONFYT_SAMPLER_STREAM_FRAMES - pos);
+    sf_count_t got = sf_readf_float(s->file, s->ring + pos * s->channels, n);
+    if (got > 0) {
+        s->written.store(written + got, std::memory_order_release);
+    }
+    if (got < n) {
+        s->ended.store(true, std::memory_order_release);
+    }
+    return true;
+}
+
+void KfSamplerStreamer::closeStream(Stream *s)
+{
+    if (s->file) {
+        sf_close(s->file);
+        s->file = nullptr;
+    }
+    s->sample = nullptr;
+    s->written = 0;
+    s->read = 0;
+    s->ended = false;
+    s->state.store(StreamFree, std::memory_order_release);
+}
+
+// ============================================================================
+// KfSamplerSynth
+// ============================================================================
+
+KfSamplerSynth::KfSamplerSynth(KfSamplerStreamer *streamer, double sampleRate) :
+    mStreamer(streamer),
+    mSampleRate(sampleRate)
+{
+
+}
+
+/* Must only be deleted once not processed in the JACK process callback
+ * anymore. */
+KfSamplerSynth::~KfSamplerSynth()
+{
+    for (int i=0; i < KONFYT_SAMPLER_VOICES; i++) {
+        Voice* v = &voices[i];
+        if (v->stream >= 0) {
+            mStreamer->stopStream(v->stream);
+            // The streamer may still use the sample of the instrument
+            mStreamer->waitUntilStopped(v->stream);
+            v->stream = -1;
+        }
+    }
+}
+
+void KfSamplerSynth::setInstrument(KfSamplerInstrument *instrument)
+{
+    mInstrument.store(instrument, std::memory_order_release);
+}
+
+KfSamplerInstrument *KfSamplerSynth::instrument() const
+{
+    return mInstrument.load(std::memory_order_acquire);
+}
+
+void KfSamplerSynth::setGain(float gain)
+{
+    mGain = gain;
+}
+
+/* Insert event sorted by time, after events with the same time. */
+void KfSamplerSynth::midiEvent(const KonfytMidiEvent &ev, jack_nframes_t time)
+{
+    if (eventCount >= KONFYT_SAMPLER_MAX_EVENTS) { return; }
+
+    int i = eventCount;
+    while ( (i > 0) && (events[i-1].time > time) ) {
+        events[i] = events[i-1];
+        i--;
+    }
+    events[i].time = time;
+    events[i].ev = ev;
+    eventCount++;
+}
+
+/* Render the events received in the previous cycle at their times. */
+void KfSamplerSynth::process(float *left, float *right, jack_nframes_t nframes)
+{
+    memset(left, 0, sizeof(float) * nframes);
+    memset(right, 0, sizeof(float) * nframes);
+
+    if (!mInstrument.load(std::memory_order_acquire)) {
+        // Not loaded yet
+        eventCount = 0;
+        return;
+    }
+
+    jack_nframes_t pos = 0;
+    int e = 0;
+    while (pos < nframes) {
+        while ( (e < eventCount) && (events[e].time <= pos) ) {
+            handleEvent(events[e].ev);
+            e++;
+        }
+        jack_nframes_t next = nframes;
+        if ( (e < eventCount) && (events[e].time < nframes) ) {
+            next = events[e].time;
+        }
+        for (int i=0; i < KONFYT_SAMPLER_VOICES; i++) {
+            if (voices[i].region) {
+                renderVoice(&voices[i], left + pos, right + pos, next - pos);
+            }
+        }
+        pos = next;
+    }
+    while (e < eventCount) {
+        handleEvent(events[e].ev);
+        e++;
+    }
+    eventCount = 0;
+
+    float gain = mGain * volume * expression;
+    if (gain != 1) {
+        for (jack_nframes_t i=0; i < nframes; i++) {
+            left[i] *= gain;
+            right[i] *= gain;
+        }
+    }
+}
+
+void KfSamplerSynth::handleEvent(const KonfytMidiEvent &ev)
+{
+    switch (ev.type()) {
+    case MIDI_EVENT_TYPE_NOTEON:
+        if (ev.velocity() > 0) {
+            noteOn(ev.note(), ev.velocity());
+        } else {
+            noteOff(ev.note());
+        }
+        break;
+    case MIDI_EVENT_TYPE_NOTEOFF:
+        noteOff(ev.note());
+        break;
+    case MIDI_EVENT_TYPE_CC:
+        if (ev.data1() == 64) {
+            // Sustain pedal
+            sustain = ev.data2() > MIDI_SUSTAIN_THRESH;
+            if (!sustain) {
+                for (int i=0; i < KONFYT_SAMPLER_VOICES; i++) {
+                    if (voices[i].region && voices[i].sustained) {
+                        releaseVoice(&voices[i]);
+                    }
+                }
+            }
+        } else if (ev.data1() == 7) {
+            float v = ev.data2() / 127.0f;
+            volume = v * v;
+        } else if (ev.data1() == 11) {
+            float v = ev.data2() / 127.0f;
+            expression = v * v;
+        } else if (ev.data1() == 120) {
+            // All sound off
+            for (int i=0; i < KONFYT_SAMPLER_VOICES; i++) {
+                if (voices[i].region) { killVoice(&voices[i]); }
+            }
+        } else if (ev.data1() == MIDI_CC_ALL_NOTES_OFF) {
+            sustain = false;
+            for (int i=0; i < KONFYT_SAMPLER_VOICES; i++) {
+                if (voices[i].region) { releaseVoice(&voices[i]); }
+            }
+        }
+        break;
+    case MIDI_EVENT_TYPE_PITCHBEND:
+    {
+        int value = ev.pitchbendValueSigned();
+        pitchbend = (value >= 0) ? (float)value / MIDI_PITCHBEND_SIGNED_MAX
+                                 : -(float)value / MIDI_PITCHBEND_SIGNED_MIN;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void KfSamplerSynth::noteOn(int note, int velocity)
+{
+    if ( (note < 0) || (note > 127) ) { return; }
+    noteVelocity[note] = velocity;
+
+    KfSamplerInstrument* inst = mInstrument.load(std::memory_order_relaxed);
+    float r = random();
+    for (int i=0; i < inst->regions.count(); i++) {
+        KfSamplerRegion* region = &(inst->regions[i]);
+        if (region->trigger != KfSamplerRegion::TriggerAttack) { continue; }
+        if (!region->matches(note, velocity)) { continue; }
+
+        // Round robins
+        int seq = region->seqCounter;
+        region->seqCounter = (seq + 1) % region->seqLength;
+        if (seq != region->seqPosition - 1) { continue; }
+        if ( (r < region->loRand) || (r >= region->hiRand) ) { continue; }
+
+        startRegion(region, note, velocity);
+    }
+}
+
+void KfSamplerSynth::noteOff(int note)
+{
+    if ( (note < 0) || (note > 127) ) { return; }
+
+    for (int i=0; i < KONFYT_SAMPLER_VOICES; i++) {
+        Voice* v = &voices[i];
+        if (!v->region || !v->held || (v->note != note)) { continue; }
+        v->held = false;
+        if (v->region->loopMode == KfSamplerRegion::LoopOneShot) { continue; }
+        if (sustain) {
+            v->sustained = true;
+        } else {
+            releaseVoice(v);
+        }
+    }
+
+    // Release samples, e.g. piano key release noise
+    KfSamplerInstrument* inst = mInstrument.load(std::memory_order_relaxed);
+    int velocity = noteVelocity[note];
+    for (int i=0; i < inst->regions.count(); i++) {
+        KfSamplerRegion* region = &(inst->regions[i]);
+        if (region->trigger != KfSamplerRegion::TriggerRelease) { continue; }
+        if (!region->matches(note, velocity)) { continue; }
+        Voice* v = startRegion(region, note, velocity);
+        if (v) { v->held = false; }
+    }
+}
+
+/* Start a voice playing the region. Returns null if nothing is played. */
+KfSamplerSynth::Voice *KfSamplerSynth::startRegion(KfSamplerRegion *region,
+                                                   int note, int velocity)
+{
+    const KfSamplerSample* s = region->sample;
+    if (s->frames == 0) { return nullptr; } // Not loaded
+
+    // Exclusive groups
+    if (region->group) {
+        for (int i=0; i < KONFYT_SAMPLER_VOICES; i++) {
+            Voice* v = &voices[i];
+            if (v->region && (v->region->offBy == region->group)) {
+                killVoice(v);
+            }
+        }
+    }
+
+    // Use a free voice, or steal the oldest
+    Voice* v = &voices[0];
+    for (int i=0; i < KONFYT_SAMPLER_VOICES; i++) {
+        if (!voices[i].region) {
+            v = &voices[i];
+            break;
+        }
+        if (voices[i].started < v->started) { v = &voices[i]; }
+    }
+    if (v->region) { killVoice(v); }
+
+    v->end = s->frames;
+    if ( (region->end >= 0) && (region->end < s->frames) ) { v->end = region->end + 1; }
+    v->pos = region->offset;
+    if (v->pos >= v->end) { return nullptr; }
+
+    float cents = (note - region->keyCenter) * region->keytrack + region->tune;
+    v->step = (s->sampleRate / mSampleRate) * pow(2.0, cents / 1200.0);
+
+    float vel = velocity / 127.0f;
+    float veltrack = region->ampVeltrack / 100;
+    float velGain = (veltrack >= 0) ? 1 - veltrack * (1 - vel * vel)
+                                    : 1 + veltrack * vel * vel;
+    float pan = region->pan / 100;
+    v->gainLeft = region->gain * velGain * qMin(1.0f, 1 - pan);
+    v->gainRight = region->gain * velGain * qMin(1.0f, 1 + pan);
+
+    v->stream = -1;
+    if (s->streamed()) {
+        v->stream = mStreamer->startStream(s, qMax(s->headFrames, region->offset));
+        if (v->stream < 0) {
+            // No streams available, only play what is in memory
+            v->end = qMin(v->end, s->headFrames);
+        }
+    }
+
+    v->region = region;
+    v->note = note;
+    v->held = true;
+    v->sustained = false;
+    v->started = ++voiceCounter;
+    v->envLevel = 0;
+    setEnvStage(v, Voice::EnvDelay);
+    return v;
+}
+
+void KfSamplerSynth::releaseVoice(Voice *v)
+{
+    v->held = false;
+    v->sustained = false;
+    if (v->envStage != Voice::EnvDone) {
+        setEnvStage(v, Voice::EnvRelease);
+    }
+}
+
+void KfSamplerSynth::killVoice(Voice *v)
+{
+    if (v->stream >= 0) {
+        mStreamer->stopStream(v->stream);
+        v->stream = -1;
+    }
+    v->region = nullptr;
+    v->envStage = Voice::EnvDone;
+}
+
+/* Start an envelope stage, skipping stages with zero length. */
+void KfSamplerSynth::setEnvStage(Voice *v, Voice::EnvStage stage)
+{
+    const KfSamplerRegion* r = v->region;
+    v->envStage = stage;
+    switch (stage) {
+    case Voice::EnvDelay:
+        v->envFrames = r->ampegDelay * mSampleRate;
+        if (v->envFrames <= 0) { setEnvStage(v, Voice::EnvAttack); }
+        break;
+    case Voice::EnvAttack:
+        v->envFrames = r->ampegAttack * mSampleRate;
+        if (v->envFrames <= 0) {
+            v->envLevel = 1;
+            setEnvStage(v, Voice::EnvHold);
+        } else {
+            v->envDelta = (1 - v->envLevel) / v->envFrames;
+        }
+        break;
+    case Voice::EnvHold:
+        v->envLevel = 1;
+        v->envFrames = r->ampegHold * mSampleRate;
+        if (v->envFrames <= 0) { setEnvStage(v, Voice::EnvDecay); }
+        break;
+    case Voice::EnvDecay:
+        // Exponential decay, -60 dB over the decay time
+        v->envSustain = r->ampegSustain / 100;
+        v->envFrames = r->ampegDecay * mSampleRate;
+        if ( (v->envFrames <= 0) || (v->envLevel <= qMax(v->envSustain, 0.001f)) ) {
+            setEnvStage(v, Voice::EnvSustain);
+        } else {
+            v->envFactor = pow(0.001, 1.0 / v->envFrames);
+        }
+        break;
+    case Voice::EnvSustain:
+        v->envLevel = v->envSustain;
+        if (v->envLevel <= 0) { v->envStage = Voice::EnvDone; }
+        break;
+    case Voice::EnvRelease:
+        v->envFrames = r->ampegRelease * mSampleRate;
+        if (v->envFrames <= 0) {
+            v->envStage = Voice::EnvDone;
+        } else {
+            v->envFactor = pow(0.001, 1.0 / v->envFrames);
+        }
+        break;
+    case Voice::EnvDone:
+        break;
+    }
+}
+
+void KfSamplerSynth::renderVoice(Voice *v, float *left, float *right,
+                                 jack_nframes_t nframes)
+{
+    const KfSamplerRegion* r = v->region;
+    const KfSamplerSample* s = r->sample;
+
+    double step = v->step;
+    if (pitchbend != 0) {
+        float cents = (pitchbend > 0) ? pitchbend * r->bendUp : -pitchbend * r->bendDown;
+        step *= pow(2.0, cents / 1200.0);
+    }
+
+    bool loop = v->looping();
+    sf_count_t loopStart = qMax((sf_count_t)0, r->loopStart);
+    sf_count_t loopEnd = (r->loopEnd >= 0) ? qMin(r->loopEnd, s->frames - 1) : s->frames - 1;
+    if (loopStart >= loopEnd) { loop = false; }
+    int right1 = (s->channels > 1) ? 1 : 0;
+
+    for (jack_nframes_t i=0; i < nframes; i++) {
+        sf_count_t index = (sf_count_t)v->pos;
+        if (!loop && (index >= v->end)) {
+            killVoice(v);
+            return;
+        }
+        bool ended;
+        const float* a = frame(v, index, &ended);
+        if (a) {
+            sf_count_t nextIndex = index + 1;
+            if (loop && (nextIndex > loopEnd)) { nextIndex = loopStart; }
+            const float* b = nullptr;
+            if (loop || (nextIndex < v->end)) { b = frame(v, nextIndex, &ended); }
+            if (!b) { b = a; }
+
+            float frac = v->pos - index;
+            float l = a[0] + (b[0] - a[0]) * frac;
+            float rr = a[right1] + (b[right1] - a[right1]) * frac;
+            left[i] += l * v->gainLeft * v->envLevel;
+            right[i] += rr * v->gainRight * v->envLevel;
+        } else if (ended) {
+            killVoice(v);
+            return;
+        }
+        // Else not streamed from disk in time and silent
+
+        // Envelope
+        switch (v->envStage) {
+        case Voice::EnvDelay:
+            if (--v->envFrames <= 0) { setEnvStage(v, Voice::EnvAttack); }
+            break;
+        case Voice::EnvAttack:
+            v->envLevel += v->envDelta;
+            if (--v->envFrames <= 0) { setEnvStage(v, Voice::EnvHold); }
+            break;
+        case Voice::EnvHold:
+            if (--v->envFrames <= 0) { setEnvStage(v, Voice::EnvDecay); }
+            break;
+        case Voice::EnvDecay:
+            v->envLevel *= v->envFactor;
+            // Sustain of zero ends the voice once inaudible, as in release
+            if (v->envLevel <= qMax(v->envSustain, 0.001f)) {
+                setEnvStage(v, Voice::EnvSustain);
+            }
+            break;
+        case Voice::EnvRelease:
+            v->envLevel *= v->envFactor;
+            if (v->envLevel < 0.001f) { v->envStage = Voice::EnvDone; }
+            break;
+        default:
+            break;
+        }
+        if (v->envStage == Voice::EnvDone) {
+            killVoice(v);
+            return;
+        }
+
+        v->pos += step;
+        if (loop && (v->pos >= loopEnd + 1)) {
+            v->pos -= loopEnd + 1 - loopStart;
+        }
+    }
+
+    if (v->stream >= 0) {
+        mStreamer->setStreamPosition(v->stream, (sf_count_t)v->pos);
+    }
+}
+
+/* Returns the data of a frame of the voice's sample from memory or its stream,
+ * or null if not available. ended is set if past the end of the sample. */
+const float *KfSamplerSynth::frame(Voice *v, sf_count_t index, bool *ended)
+{
+    const KfSamplerSample* s = v->region->sample;
+    *ended = false;
+    if (index < s->headFrames) {
+        return s->head.constData() + index * s->channels;
+    }
+    if ( (index >= s->frames) || (v->stream < 0) ) {
+        *ended = true;
+        return nullptr;
+    }
+    return mStreamer->streamFrame(v->stream, index, ended);
+}
+
+float KfSamplerSynth::random()
+{
+    // xorshift, as rand() is not suitable in the process callback
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return (randomState & 0xFFFFFF) / (float)0x1000000;
+}
+
+bool KfSamplerSynth::Voice::looping() const
+{
+    if (region->loopMode == KfSamplerRegion::LoopContinuous) { return true; }
+    if (region->loopMode == KfSamplerRegion::LoopSustain) {
+        return held || sustained;
+    }
+    return false;
+}
+
+// ============================================================================
+// KfSamplerLoader
+// ============================================================================
+
+KfSamplerLoader::KfSamplerLoader(QObject *parent) : QObject(parent)
+{
+    connect(this, &KfSamplerLoader::requestLoad,
+            this, &KfSamplerLoader::doLoad, Qt::QueuedConnection);
+}
+
+void KfSamplerLoader::doLoad(int id, KfSamplerInstrument *instrument)
+{
+    int count = instrument->sampleCount();
+    int loadedCount = 0;
+    int lastPercent = 0;
+    for (int i=0; i < count; i++) {
+        if (instrument->cancelled) { break; }
+
+        QString error;
+        if (instrument->loadSample(i, &error)) {
+            loadedCount++;
+        } else {
+            print("Failed to load sample " + error);
+        }
+
+        int percent = (i + 1) * 100 / count;
+        if ( (percent != lastPercent) && (percent < 100) ) {
+            emit loadProgress(id, percent);
+            lastPercent = percent;
+        }
+    }
+
+    QString error;
+    if (!instrument->cancelled && (loadedCount == 0)) {
+        error = "No samples could be loaded.";
+    }
+    emit loaded(id, instrument, error);
+}
@@ -0,0 +1,296 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_SAMPLER_H
+#define KONFYT_SAMPLER_H
+
+#include "konfytJackStructs.h"
+#include "konfytMidi.h"
+#include "konfytSfzReader.h"
+
+#include <sndfile.h>
+
+#include <QObject>
+#include <QThread>
+#include <QVector>
+
+#include <atomic>
+
+#define KONFYT_SAMPLER_HEAD_FRAMES 16384    // Frames of a streamed sample kept in memory
+#define KONFYT_SAMPLER_STREAM_FRAMES 16384  // Ring buffer of a stream
+#define KONFYT_SAMPLER_STREAM_CHUNK 4096    // Frames read from disk at a time
+#define KONFYT_SAMPLER_STREAMS 128          // Streams shared by all instruments
+#define KONFYT_SAMPLER_VOICES 64            // Voices per instrument
+#define KONFYT_SAMPLER_MAX_EVENTS 512       // MIDI events per process cycle
+
+// ----------------------------------------------------
+// Sample file used by regions. Only the head of the file is loaded in memory
+// and the rest is streamed from disk while playing, unless the file is short,
+// played looped or has more than two channels, in which case it is loaded
+// completely.
+// ----------------------------------------------------
+struct KfSamplerSample
+{
+    QString path;
+    QByteArray encodedPath;
+    bool looped = false;      // Used by a looping region
+    int channels = 0;
+    double sampleRate = 0;
+    sf_count_t frames = 0;    // Length of the file
+    sf_count_t headFrames = 0;
+    QVector<float> head;      // Interleaved
+
+    bool streamed() const { return headFrames < frames; }
+};
+
+// ----------------------------------------------------
+// Region of an SFZ instrument with the supported opcodes
+// ----------------------------------------------------
+struct KfSamplerRegion
+{
+    enum Trigger { TriggerAttack, TriggerRelease };
+    enum LoopMode { LoopNone, LoopOneShot, LoopContinuous, LoopSustain };
+
+    KfSamplerSample* sample = nullptr;
+    int loKey = 0;
+    int hiKey = 127;
+    int loVel = 1;
+    int hiVel = 127;
+    Trigger trigger = TriggerAttack;
+    // Round robins
+    int seqLength = 1;
+    int seqPosition = 1;
+    int seqCounter = 0;
+    float loRand = 0;
+    float hiRand = 1;
+    // Exclusive groups, e.g. a closed hihat stops an open one
+    int group = 0;
+    int offBy = 0;
+    // Playback
+    sf_count_t offset = 0;
+    sf_count_t end = -1;      // Last frame played, -1 for end of sample
+    LoopMode loopMode = LoopNone;
+    bool loopModeSet = false; // Otherwise the loop of the sample file is used
+    sf_count_t loopStart = 0;
+    sf_count_t loopEnd = -1;
+    // Pitch, cents
+    int keyCenter = 60;
+    float keytrack = 100;
+    float tune = 0;
+    float bendUp = 200;
+    float bendDown = -200;
+    // Amplitude
+    float gain = 1;
+    float ampVeltrack = 100;  // Percent
+    float pan = 0;            // -100 to 100
+    // Amplitude envelope, seconds and percent
+    float ampegDelay = 0;
+    float ampegAttack = 0;
+    float ampegHold = 0;
+    float ampegDecay = 0;
+    float ampegSustain = 100;
+    float ampegRelease = 0.001f;
+
+    bool matches(int note, int velocity) const;
+};
+
+// ----------------------------------------------------
+// SFZ instrument. The SFZ is parsed first, after which the samples are loaded
+// one by one, e.g. in a background thread.
+// ----------------------------------------------------
+class KfSamplerInstrument
+{
+public:
+    ~KfSamplerInstrument();
+
+    bool parse(QString filename, QString* error);
+    int sampleCount() const;
+    bool loadSample(int index, QString* error);
+
+    QVector<KfSamplerRegion> regions;
+    std::atomic<bool> cancelled{false}; // Stop loading
+
+private:
+    QList<KfSamplerSample*> samples;
+    QHash<QString, KfSamplerSample*> samplesByPath;
+    KfSamplerSample* sample(QString path);
+    bool setRegion(const KonfytSfzReader::Opcodes &opcodes, KfSamplerRegion* r);
+    void setLoopFromFile(KfSamplerSample* s, SNDFILE* file);
+    static int noteValue(QString value, int defaultValue);
+    static float floatValue(const KonfytSfzReader::Opcodes &opcodes,
+                            QString opcode, float defaultValue);
+};
+
+// ----------------------------------------------------
+// Streams the parts of samples that are not in memory from disk, for all
+// instruments. Streams are started and read in the JACK process thread and
+// filled in the streamer thread, without locks.
+// ----------------------------------------------------
+class KfSamplerStreamer : public QThread
+{
+public:
+    KfSamplerStreamer();
+    ~KfSamplerStreamer();
+
+    void stop();
+
+    // Used in the JACK process thread
+    int startStream(const KfSamplerSample* sample, sf_count_t fromFrame); // -1 if none free
+    const float* streamFrame(int stream, sf_count_t frame, bool* ended);
+    void setStreamPosition(int stream, sf_count_t frame); // Earliest frame still needed
+    void stopStream(int stream);
+
+    // Used in the main thread once streams are not used in the process thread anymore
+    void waitUntilStopped(int stream);
+    // Message if notes could not get a stream since the last call, else empty
+    QString takeExhaustionReport();
+
+protected:
+    void run() override;
+
+private:
+    enum StreamState { StreamFree, StreamRequested, StreamActive, StreamStopping };
+    struct Stream
+    {
+        std::atomic<int> state{StreamFree};
+        const KfSamplerSample* sample = nullptr;
+        sf_count_t startFrame = 0;
+        SNDFILE* file = nullptr;
+        int channels = 0;
+        float* ring = nullptr;
+        std::atomic<sf_count_t> written{0}; // Frames from startFrame
+        std::atomic<sf_count_t> read{0};
+        std::atomic<bool> ended{false};     // No more frames to write
+    };
+    Stream streams[KONFYT_SAMPLER_STREAMS];
+    std::atomic<bool> quit{false};
+    std::atomic<int> exhausted{0}; // Streams requested while none were free
+
+    void openStream(Stream* s);
+    bool fillStream(Stream* s);
+    void closeStream(Stream* s);
+};
+
+// ----------------------------------------------------
+// Plays an instrument, rendered in our JACK process callback
+// ----------------------------------------------------
+class KfSamplerSynth : public KfJackInternalPlugin
+{
+public:
+    KfSamplerSynth(KfSamplerStreamer* streamer, double sampleRate);
+    ~KfSamplerSynth();
+
+    // Set once the instrument has been loaded
+    void setInstrument(KfSamplerInstrument* instrument);
+    KfSamplerInstrument* instrument() const;
+    void setGain(float gain);
+
+    // KfJackInternalPlugin interface
+    void midiEvent(const KonfytMidiEvent &ev, jack_nframes_t time) override;
+    void process(float *left, float *right, jack_nframes_t nframes) override;
+
+private:
+    struct Voice
+    {
+        enum EnvStage { EnvDelay, EnvAttack, EnvHold, EnvDecay, EnvSustain,
+                        EnvRelease, EnvDone };
+
+        KfSamplerRegion* region = nullptr; // Null when free
+        int note = 0;
+        bool held = false;       // Key is down
+        bool sustained = false;  // Key released while sustain pedal down
+        double pos = 0;
+        double step = 0;         // Frames per output frame without pitchbend
+        sf_count_t end = 0;
+        float gainLeft = 1;
+        float gainRight = 1;
+        int stream = -1;
+        quint64 started = 0;
+        // Envelope
+        EnvStage envStage = EnvDone;
+        float envLevel = 0;
+        float envDelta = 0;      // Added during attack
+        float envFactor = 1;     // Multiplied during decay and release
+        float envSustain = 1;
+        sf_count_t envFrames = 0; // Remaining in stage
+
+        bool looping() const;
+    };
+
+    struct Event
+    {
+        jack_nframes_t time;
+        KonfytMidiEvent ev;
+    };
+
+    KfSamplerStreamer* mStreamer;
+    double mSampleRate;
+    std::atomic<KfSamplerInstrument*> mInstrument{nullptr};
+    std::atomic<float> mGain{1};
+
+    Voice voices[KONFYT_SAMPLER_VOICES];
+    quint64 voiceCounter = 0;
+    Event events[KONFYT_SAMPLER_MAX_EVENTS];
+    int eventCount = 0;
+
+    // MIDI state
+    bool sustain = false;
+    float pitchbend = 0;     // -1 to 1
+    float volume = 1;        // CC7
+    float expression = 1;    // CC11
+    int noteVelocity[128] = {0}; // For release triggers
+    quint32 randomState = 1;
+    float random();
+
+    void handleEvent(const KonfytMidiEvent &ev);
+    void noteOn(int note, int velocity);
+    void noteOff(int note);
+    Voice* startRegion(KfSamplerRegion* region, int note, int velocity);
+    void releaseVoice(Voice* v);
+    void killVoice(Voice* v);
+    void setEnvStage(Voice* v, Voice::EnvStage stage);
+    void renderVoice(Voice* v, float* left, float* right, jack_nframes_t nframes);
+    const float* frame(Voice* v, sf_count_t index, bool* ended);
+};
+
+// ----------------------------------------------------
+// Loads the samples of instruments in a worker thread
+// ----------------------------------------------------
+class KfSamplerLoader : public QObject
+{
+    Q_OBJECT
+public:
+    explicit KfSamplerLoader(QObject* parent = nullptr);
+
+signals:
+    void print(QString msg);
+    void requestLoad(int id, KfSamplerInstrument* instrument);
+    // Percent of the samples loaded
+    void loadProgress(int id, int percent);
+    // Done or cancelled. The error message is set if no samples could be loaded.
+    void loaded(int id, KfSamplerInstrument* instrument, QString error);
+
+private slots:
+    void doLoad(int id, KfSamplerInstrument* instrument);
+};
+
+#endif // KONFYT_SAMPLER_H
@@ -0,0 +1,191 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytSamplerEngine.h"
+
+
+KonfytSamplerEngine::KonfytSamplerEngine(QObject *parent) :
+    KonfytBaseSoundEngine(parent)
+{
+    qRegisterMetaType<KfSamplerInstrument*>("KfSamplerInstrument*");
+
+    connect(&loader, &KfSamplerLoader::print, this, &KonfytSamplerEngine::print);
+    connect(&loader, &KfSamplerLoader::loadProgress,
+            this, &KonfytSamplerEngine::onLoadProgress);
+    connect(&loader, &KfSamplerLoader::loaded,
+            this, &KonfytSamplerEngine::onLoaded);
+
+    loader.moveToThread(&loaderThread);
+
+    // Disk streams are shared by all SFZs, report when they ran out
+    streamCheckTimer.setInterval(1000);
+    connect(&streamCheckTimer, &QTimer::timeout, this, [=]()
+    {
+        QString report = streamer.takeExhaustionReport();
+        if (!report.isEmpty()) { print(report); }
+    });
+}
+
+KonfytSamplerEngine::~KonfytSamplerEngine()
+{
+    foreach (const SamplerSfz &sfz, sfzs) {
+        sfz.instrument->cancelled = true;
+    }
+    loaderThread.quit();
+    loaderThread.wait();
+
+    // The JACK client has been stopped, so synths are not processed anymore
+    foreach (const SamplerSfz &sfz, sfzs) {
+        delete sfz.synth;
+        delete sfz.instrument;
+    }
+    sfzs.clear();
+    qDeleteAll(cancelledInstruments);
+    cancelledInstruments.clear();
+
+    streamer.stop();
+}
+
+QString KonfytSamplerEngine::engineName()
+{
+    return "SamplerEngine";
+}
+
+void KonfytSamplerEngine::initEngine(KonfytJackEngine *jackEngine)
+{
+    jack = jackEngine;
+
+    loaderThread.start();
+    streamer.start();
+    streamCheckTimer.start();
+
+    emit initDone("");
+}
+
+/* Reads the SFZ and starts loading its samples in the background. Returns the
+ * ID, or -1 if the SFZ could not be read. */
+int KonfytSamplerEngine::addSfz(QString path)
+{
+    KfSamplerInstrument* instrument = new KfSamplerInstrument();
+    QString error;
+    if (!instrument->parse(path, &error)) {
+        print("Failed to read SFZ " + path + ": " + error);
+        delete instrument;
+        return -1;
+    }
+
+    int id = idCounter++;
+    SamplerSfz sfz;
+    sfz.path = path;
+    sfz.name = QString("sampler_%1_sfz").arg(id);
+    sfz.instrument = instrument;
+    sfz.synth = new KfSamplerSynth(&streamer, jack->getSampleRate());
+    sfzs.insert(id, sfz);
+
+    print(QString("Loading sfz: %1, %2 regions, %3 samples")
+          .arg(path).arg(instrument->regions.count())
+          .arg(instrument->sampleCount()));
+    emit loader.requestLoad(id, instrument);
+
+    return id;
+}
+
+QString KonfytSamplerEngine::pluginName(int id)
+{
+    KONFYT_ASSERT( sfzs.contains(id) );
+
+    return sfzs.value(id).name;
+}
+
+QString KonfytSamplerEngine::midiInJackPortName(int /*id*/)
+{
+    return ""; // No JACK ports, see internalPlugin()
+}
+
+QStringList KonfytSamplerEngine::audioOutJackPortNames(int /*id*/)
+{
+    return {"", ""}; // No JACK ports, see internalPlugin()
+}
+
+void KonfytSamplerEngine::removeSfz(int id)
+{
+    KONFYT_ASSERT_RETURN( sfzs.contains(id) );
+
+    // Already removed from JACK by the patch engine
+    SamplerSfz sfz = sfzs.take(id);
+    delete sfz.synth;
+    if (sfz.loading) {
+        sfz.instrument->cancelled = true;
+        cancelledInstruments.append(sfz.instrument);
+    } else {
+        delete sfz.instrument;
+    }
+}
+
+void KonfytSamplerEngine::setGain(int id, float newGain)
+{
+    KONFYT_ASSERT_RETURN( sfzs.contains(id) );
+
+    sfzs.value(id).synth->setGain(newGain);
+}
+
+bool KonfytSamplerEngine::reportsLoadProgress()
+{
+    return true;
+}
+
+KfJackInternalPlugin *KonfytSamplerEngine::internalPlugin(int id)
+{
+    KONFYT_ASSERT_RETURN_VAL( sfzs.contains(id), nullptr );
+
+    return sfzs.value(id).synth;
+}
+
+void KonfytSamplerEngine::onLoadProgress(int id, int percent)
+{
+    // Ignore if removed in the meantime
+    if (!sfzs.contains(id)) { return; }
+
+    emit sfzLoadProgress(id, percent);
+}
+
+void KonfytSamplerEngine::onLoaded(int id, KfSamplerInstrument *instrument,
+                                   QString error)
+{
+    if (cancelledInstruments.removeAll(instrument)) {
+        delete instrument;
+        return;
+    }
+    if (!sfzs.contains(id)) { return; }
+
+    SamplerSfz& sfz = sfzs[id];
+    sfz.loading = false;
+    if (!error.isEmpty()) {
+        print("Failed to load sfz " + sfz.path + ": " + error);
+        emit sfzLoadProgress(id, -1);
+        return;
+    }
+
+    sfz.synth->setInstrument(instrument);
+    print("Loaded sfz: " + sfz.path);
+    emit sfzLoadProgress(id, 100);
+}
@@ -0,0 +1,80 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_SAMPLER_ENGINE_H
+#define KONFYT_SAMPLER_ENGINE_H
+
+#include "konfytBaseSoundEngine.h"
+#include "konfytSampler.h"
+
+#include <QMap>
+#include <QThread>
+#include <QTimer>
+
+/* SFZ engine that plays SFZs with our own sampler, rendered in our JACK
+ * process callback. The samples of an SFZ are loaded in the background after
+ * it has been added, with the progress reported with sfzLoadProgress(). */
+class KonfytSamplerEngine : public KonfytBaseSoundEngine
+{
+    Q_OBJECT
+public:
+    explicit KonfytSamplerEngine(QObject *parent = 0);
+    ~KonfytSamplerEngine();
+
+    // KonfytBaseSoundEngine interface
+    QString engineName() override;
+    void initEngine(KonfytJackEngine *jackEngine) override;
+    int addSfz(QString path) override;
+    QString pluginName(int id) override;
+    QString midiInJackPortName(int id) override;
+    QStringList audioOutJackPortNames(int id) override;
+    void removeSfz(int id) override;
+    void setGain(int id, float newGain) override;
+    bool reportsLoadProgress() override;
+    KfJackInternalPlugin* internalPlugin(int id) override;
+
+private:
+    struct SamplerSfz
+    {
+        QString path;
+        QString name;
+        KfSamplerSynth* synth = nullptr;
+        KfSamplerInstrument* instrument = nullptr;
+        bool loading = true;
+    };
+
+    KonfytJackEngine* jack = nullptr;
+    int idCounter = 0;
+    QMap<int, SamplerSfz> sfzs;
+    KfSamplerStreamer streamer;
+    QTimer streamCheckTimer{this};
+    KfSamplerLoader loader;
+    QThread loaderThread;
+    // Removed while loading, deleted when the loader is done
+    QList<KfSamplerInstrument*> cancelledInstruments;
+
+private slots:
+    void onLoadProgress(int id, int percent);
+    void onLoaded(int id, KfSamplerInstrument* instrument, QString error);
+};
+
+#endif // KONFYT_SAMPLER_ENGINE_H
@@ -0,0 +1,319 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytSearchIndex.h"
+
+#include <QSet>
+#include <QtMath>
+
+#include <algorithm>
+#include <numeric>
+
+// Number of names searched between checks for cancellation
+#define KONFYT_SEARCH_CANCEL_CHECK_INTERVAL 1024
+
+
+void KonfytSearchIndex::build(const QList<KonfytDbEntry> &sfonts,
+                              const QList<KonfytDbEntry> &patches,
+                              const QList<KonfytDbEntry> &sfzs)
+{
+    docs.clear();
+    trigramDocs.clear();
+    lastQuery.clear();
+    lastMatches.clear();
+
+    auto addDoc = [this](const KonfytDbEntry &entry, int preset, QString text)
+    {
+        Doc doc;
+        doc.entry = entry;
+        doc.preset = preset;
+        doc.text = normalize(text);
+        int id = docs.count();
+        docs.append(doc);
+
+        QSet<quint64> added;
+        for (int i=0; i + 3 <= doc.text.length(); i++) {
+            quint64 key = trigramKey(doc.text.constData() + i);
+            if (added.contains(key)) { continue; }
+            added.insert(key);
+            trigramDocs[key].append(id);
+        }
+    };
+
+    // Soundfonts and their programs
+    foreach (const KonfytDbEntry &entry, sfonts) {
+        addDoc(entry, -1, entry.filename());
+        KfSoundPtr sf = entry.sound();
+        for (int i=0; i < sf->presets.count(); i++) {
+            addDoc(entry, i, sf->presets[i].name);
+        }
+    }
+
+    // Patches, including their layer names
+    foreach (const KonfytDbEntry &entry, patches) {
+        QString text = entry.filename();
+        foreach (const KonfytSoundPreset &layer, entry.sound()->presets) {
+            text += " " + layer.name;
+        }
+        addDoc(entry, -1, text);
+    }
+
+    // SFZs
+    foreach (const KonfytDbEntry &entry, sfzs) {
+        addDoc(entry, -1, entry.filename());
+    }
+}
+
+/* Search for entries matching all the words in the query. If there are no
+ * such entries, entries that approximately match are returned instead. */
+bool KonfytSearchIndex::search(QString query, KonfytSearchResults *results,
+                               std::function<bool()> cancelled)
+{
+    results->sfonts.clear();
+    results->patches.clear();
+    results->sfzs.clear();
+
+    // Normalized text has single spaces between words
+    QString text = normalize(query);
+    QStringList words;
+    if (!text.isEmpty()) { words = text.split(' '); }
+    if (words.isEmpty()) {
+        lastQuery.clear();
+        return true;
+    }
+    QString normalizedQuery = words.join(' ');
+
+    // Find candidates. If the query extends the previous one, its matches
+    // can only be within the previous matches.
+    QVector<int> candidates;
+    if (!lastQuery.isEmpty() && normalizedQuery.startsWith(lastQuery)) {
+        candidates = lastMatches;
+    } else {
+        bool indexed = false;
+        foreach (const QString &word, words) {
+            if (word.length() < 3) { continue; }
+            QVector<int> wordDocs = docsWithAllTrigrams(word);
+            if (indexed) {
+                QVector<int> both;
+                std::set_intersection(candidates.constBegin(), candidates.constEnd(),
+                                      wordDocs.constBegin(), wordDocs.constEnd(),
+                                      std::back_inserter(both));
+                candidates = both;
+            } else {
+                candidates = wordDocs;
+                indexed = true;
+            }
+        }
+        if (!indexed) {
+            // Only short words, search everything
+            candidates.resize(docs.count());
+            std::iota(candidates.begin(), candidates.end(), 0);
+        }
+    }
+
+    // Verify candidates contain all the words
+    QVector<int> matches;
+    for (int i=0; i < candidates.count(); i++) {
+        if ( ((i % KONFYT_SEARCH_CANCEL_CHECK_INTERVAL) == 0) && cancelled() ) {
+            return false;
+        }
+        const Doc &doc = docs[candidates[i]];
+        bool all = true;
+        foreach (const QString &word, words) {
+            if (!doc.text.contains(word)) {
+                all = false;
+                break;
+            }
+        }
+        if (all) { matches.append(candidates[i]); }
+    }
+
+    if (matches.isEmpty()) {
+        // Fuzzy matches can't be refined further, so don't remember them.
+        matches = fuzzyMatches(words, cancelled);
+        if (cancelled()) { return false; }
+        lastQuery.clear();
+    } else {
+        lastQuery = normalizedQuery;
+        lastMatches = matches;
+    }
+
+    collectResults(matches, words, results);
+    return true;
+}
+
+QString KonfytSearchIndex::normalize(QString text)
+{
+    return text.toLower().simplified();
+}
+
+quint64 KonfytSearchIndex::trigramKey(const QChar *c)
+{
+    return (quint64(c[0].unicode()) << 32) | (quint64(c[1].unicode()) << 16)
+            | c[2].unicode();
+}
+
+/* Indexes of docs containing all the trigrams of the word, ascending. These
+ * are the docs that may contain the word. */
+QVector<int> KonfytSearchIndex::docsWithAllTrigrams(const QString &word)
+{
+    QList<const QVector<int>*> lists;
+    for (int i=0; i + 3 <= word.length(); i++) {
+        auto it = trigramDocs.constFind(trigramKey(word.constData() + i));
+        if (it == trigramDocs.constEnd()) { return QVector<int>(); }
+        lists.append(&it.value());
+    }
+
+    // Intersect starting with the shortest list
+    std::sort(lists.begin(), lists.end(),
+              [](const QVector<int>* a, const QVector<int>* b)
+    {
+        return a->count() < b->count();
+    });
+    QVector<int> ret = *lists.first();
+    for (int i=1; i < lists.count(); i++) {
+        QVector<int> both;
+        std::set_intersection(ret.constBegin(), ret.constEnd(),
+                              lists[i]->constBegin(), lists[i]->constEnd(),
+                              std::back_inserter(both));
+        ret = both;
+    }
+    return ret;
+}
+
+/* Docs containing most of the trigrams of the words, e.g. with a typo. */
+QVector<int> KonfytSearchIndex::fuzzyMatches(const QStringList &words,
+                                             std::function<bool()> cancelled)
+{
+    QSet<quint64> trigrams;
+    foreach (const QString &word, words) {
+        for (int i=0; i + 3 <= word.length(); i++) {
+            trigrams.insert(trigramKey(word.constData() + i));
+        }
+    }
+    if (trigrams.isEmpty()) { return QVector<int>(); }
+
+    QHash<int, int> hits;
+    foreach (quint64 key, trigrams) {
+        if (cancelled()) { return QVector<int>(); }
+        foreach (int id, trigramDocs.value(key)) {
+            hits[id]++;
+        }
+    }
+
+    int threshold = qCeil(trigrams.count() * KONFYT_SEARCH_FUZZY_THRESHOLD);
+    QVector<int> ret;
+    QHashIterator<int, int> i(hits);
+    while (i.hasNext()) {
+        i.next();
+        if (i.value() >= threshold) { ret.append(i.key()); }
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+/* Higher scores for words at the start of the name or of a word in the name,
+ * and for whole words. Approximate matches score by the number of trigrams
+ * found. Shorter names score slightly higher. */
+int KonfytSearchIndex::score(const Doc &doc, const QStringList &words)
+{
+    auto isSeparator = [](QChar c) { return !c.isLetterOrNumber(); };
+
+    int ret = 0;
+    foreach (const QString &word, words) {
+        int pos = doc.text.indexOf(word);
+        if (pos >= 0) {
+            ret += 100;
+            if (pos == 0) {
+                ret += 50;
+            } else if (isSeparator(doc.text[pos - 1])) {
+                ret += 30;
+            }
+            int end = pos + word.length();
+            if ( (end == doc.text.length()) || isSeparator(doc.text[end]) ) {
+                ret += 20;
+            }
+        } else {
+            for (int i=0; i + 3 <= word.length(); i++) {
+                if (doc.text.contains(word.mid(i, 3))) { ret += 10; }
+            }
+        }
+    }
+    return ret - doc.text.length() / 10;
+}
+
+/* Rank the matches and group them into results, as soundfonts (with only the
+ * matching programs, or all programs if the soundfont itself matches), patches
+ * and SFZs. */
+void KonfytSearchIndex::collectResults(const QVector<int> &matches,
+                                       const QStringList &words,
+                                       KonfytSearchResults *results)
+{
+    QVector<QPair<int, int>> ranked; // Negative score (to sort descending), doc
+    foreach (int id, matches) {
+        ranked.append(qMakePair(-score(docs[id], words), id));
+    }
+    std::sort(ranked.begin(), ranked.end());
+
+    // Soundfonts by filename
+    QHash<QString, int> sfontIndex; // Index in results
+    QSet<QString> wholeSfonts;
+    QHash<QString, KfSoundPtr> programSfonts; // With all programs
+
+    foreach (const auto &r, ranked) {
+        const Doc &doc = docs[r.second];
+        QString filename = doc.entry.filename();
+
+        if (doc.entry.type() == KfSoundTypeSoundfont) {
+            if (wholeSfonts.contains(filename)) { continue; }
+            int i = sfontIndex.value(filename, -1);
+            if (doc.preset < 0) {
+                // Soundfont name match. Include all programs
+                wholeSfonts.insert(filename);
+                KfSoundPtr sf = programSfonts.value(filename);
+                if (!sf) { sf = doc.entry.sound(); }
+                if (i >= 0) {
+                    results->sfonts.replace(i, sf);
+                } else {
+                    sfontIndex.insert(filename, results->sfonts.count());
+                    results->sfonts.append(sf);
+                }
+            } else {
+                KfSoundPtr sf = programSfonts.value(filename);
+                if (i < 0) {
+                    sf = doc.entry.sound();
+                    programSfonts.insert(filename, sf);
+                    KfSoundPtr sfresult(new KonfytSound(*sf));
+                    sfresult->presets.clear();
+                    i = results->sfonts.count();
+                    sfontIndex.insert(filename, i);
+                    results->sfonts.append(sfresult);
+                }
+                results->sfonts[i]->presets.append(sf->presets.value(doc.preset));
+            }
+        } else if (doc.entry.type() == KfSoundTypePatch) {
+            results->patches.append(doc.entry.sound());
+        } else if (doc.entry.type() == KfSoundTypeSfz) {
+            results->sfzs.append(doc.entry.sound());
+        }
+    }
+}
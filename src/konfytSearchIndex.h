@@ -0,0 +1,88 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_SEARCH_INDEX_H
+#define KONFYT_SEARCH_INDEX_H
+
+#include "konfytDatabaseFile.h"
+
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QVector>
+
+#include <functional>
+
+// Minimum fraction of the query trigrams a name must contain to be a fuzzy
+// match, used when nothing contains the query itself.
+#define KONFYT_SEARCH_FUZZY_THRESHOLD 0.6
+
+struct KonfytSearchResults
+{
+    int id = 0;
+    QList<KfSoundPtr> sfonts; // Only containing the matching programs
+    QList<KfSoundPtr> patches;
+    QList<KfSoundPtr> sfzs;
+};
+
+/* Index of the names and paths of library entries for fast searching.
+ * Names are normalized once when the index is built, and a trigram index is
+ * used to find the names containing each search word. Results are ranked,
+ * e.g. matches at the start of a word rank higher.
+ * The matches of the previous query are remembered, so a query that extends
+ * the previous one (e.g. while typing) only searches within those.
+ * Only the sounds of matching entries are decoded for the results. */
+class KonfytSearchIndex
+{
+public:
+    void build(const QList<KonfytDbEntry> &sfonts, const QList<KonfytDbEntry> &patches,
+               const QList<KonfytDbEntry> &sfzs);
+
+    // Returns false if cancelled (cancelled() is checked periodically).
+    bool search(QString query, KonfytSearchResults* results,
+                std::function<bool()> cancelled);
+
+    static QString normalize(QString text);
+
+private:
+    // A searchable name: a library entry, or a program of a soundfont
+    struct Doc
+    {
+        KonfytDbEntry entry;
+        int preset = -1; // Index of soundfont program, -1 for the entry itself
+        QString text;    // Normalized
+    };
+    QVector<Doc> docs;
+    QHash<quint64, QVector<int>> trigramDocs; // Doc indexes, ascending
+
+    QString lastQuery;
+    QVector<int> lastMatches;
+
+    static quint64 trigramKey(const QChar* c);
+    QVector<int> docsWithAllTrigrams(const QString &word);
+    QVector<int> fuzzyMatches(const QStringList &words, std::function<bool()> cancelled);
+    int score(const Doc &doc, const QStringList &words);
+    void collectResults(const QVector<int> &matches, const QStringList &words,
+                        KonfytSearchResults* results);
+};
+
+#endif // KONFYT_SEARCH_INDEX_H
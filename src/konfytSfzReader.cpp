@@ -0,0 +1,348 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytSfzReader.h"
+#include "konfytSoundfontReader.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <QtEndian>
+
+#include <algorithm>
+#include <sys/stat.h>
+
+
+bool KonfytSfzReader::readInfo(KonfytSound *sound, QString *error)
+{
+    QString dummyError;
+    if (!error) { error = &dummyError; }
+
+    sound->sampleDataSize = 0;
+    sound->sampleCount = 0;
+    sound->regionCount = 0;
+
+    QString suffix = QFileInfo(sound->filename).suffix().toLower();
+    if (suffix == "sfz") {
+        return readSfz(sound, error);
+    } else if (suffix == "gig") {
+        return readGig(sound, error);
+    } else {
+        *error = "Unsupported file type.";
+        return false;
+    }
+}
+
+bool KonfytSfzReader::readSfz(KonfytSound *sound, QString *error)
+{
+    SfzState state;
+    state.rootDir = QFileInfo(sound->filename).absolutePath();
+    state.includedFiles.insert(QDir::cleanPath(sound->filename));
+
+    if (!readSfzFile(sound->filename, &state, 0, error)) { return false; }
+
+    sound->regionCount = state.regions;
+    foreach (const QString &sample, state.samples) {
+        struct stat st;
+        if (stat(QFile::encodeName(sample).constData(), &st) != 0) { continue; }
+        sound->sampleDataSize += st.st_size;
+        sound->sampleCount++;
+    }
+    return true;
+}
+
+bool KonfytSfzReader::readRegions(QString filename, QList<Opcodes> *regions,
+                                  QString *error)
+{
+    QString dummyError;
+    if (!error) { error = &dummyError; }
+
+    SfzState state;
+    state.rootDir = QFileInfo(filename).absolutePath();
+    state.includedFiles.insert(QDir::cleanPath(filename));
+    state.regionOpcodes = regions;
+
+    return readSfzFile(filename, &state, 0, error);
+}
+
+bool KonfytSfzReader::readSfzFile(QString filename, SfzState *state, int depth,
+                                  QString *error)
+{
+    if (depth > KONFYT_SFZ_MAX_INCLUDE_DEPTH) {
+        *error = "Too many nested includes.";
+        return false;
+    }
+
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        *error = "Could not open file " + filename;
+        return false;
+    }
+    if (file.size() > KONFYT_SFZ_MAX_FILE_SIZE) {
+        *error = "File too large: " + filename;
+        return false;
+    }
+    QString text = stripComments(QString::fromUtf8(file.readAll()));
+
+    foreach (QString line, text.split('\n')) {
+        line = line.trimmed();
+        if (line.isEmpty()) { continue; }
+
+        if (line.startsWith("#define")) {
+            // #define $NAME value
+            QStringList parts = line.simplified().split(' ');
+            if (parts.count() >= 3) {
+                state->defines.insert(parts[1], parts.mid(2).join(' '));
+            }
+            continue;
+        }
+
+        line = substituteDefines(line, state->defines);
+
+        if (line.startsWith("#include")) {
+            // #include "file", relative to the directory of the main file
+            int start = line.indexOf('"');
+            int end = line.lastIndexOf('"');
+            if ((start < 0) || (end <= start)) { continue; }
+            QString include = line.mid(start + 1, end - start - 1).replace('\\', '/');
+            include = QDir::cleanPath(QDir(state->rootDir).filePath(include));
+            if (state->includedFiles.contains(include)) { continue; }
+            state->includedFiles.insert(include);
+            if (!readSfzFile(include, state, depth + 1, error)) { return false; }
+            continue;
+        }
+
+        parseSfzLine(line, state);
+    }
+    return true;
+}
+
+/* Remove block (slash-star) and line (double slash) comments. */
+QString KonfytSfzReader::stripComments(const QString &text)
+{
+    QString ret;
+    ret.reserve(text.length());
+    int i = 0;
+    while (i < text.length()) {
+        if ( (text[i] == '/') && (i + 1 < text.length()) ) {
+            if (text[i + 1] == '/') {
+                // Up to end of line, keeping the newline
+                while ((i < text.length()) && (text[i] != '\n')) { i++; }
+                continue;
+            } else if (text[i + 1] == '*') {
+                int end = text.indexOf("*/", i + 2);
+                if (end < 0) { break; }
+                // Keep newlines so lines stay separate
+                ret += QString(text.mid(i, end - i).count('\n'), '\n');
+                i = end + 2;
+                continue;
+            }
+        }
+        ret += text[i];
+        i++;
+    }
+    return ret;
+}
+
+QString KonfytSfzReader::substituteDefines(QString line,
+                                           const QHash<QString, QString> &defines)
+{
+    if (!line.contains('$')) { return line; }
+
+    // Longest names first, so e.g. $NOTE is not replaced within $NOTE2
+    QStringList names = defines.keys();
+    std::sort(names.begin(), names.end(), [](const QString &a, const QString &b)
+    {
+        return a.length() > b.length();
+    });
+    foreach (const QString &name, names) {
+        line.replace(name, defines.value(name));
+    }
+    return line;
+}
+
+/* Parse the headers and opcodes of a line. An opcode value extends up to the
+ * next header or opcode, since sample paths may contain spaces. */
+void KonfytSfzReader::parseSfzLine(const QString &line, SfzState *state)
+{
+    static const QRegularExpression tokenRegex("<(\\w+)>|(?<![^\\s>])(\\w+)=");
+
+    QList<QRegularExpressionMatch> tokens;
+    QRegularExpressionMatchIterator it = tokenRegex.globalMatch(line);
+    while (it.hasNext()) {
+        tokens.append(it.next());
+    }
+
+    for (int i=0; i < tokens.count(); i++) {
+        const QRegularExpressionMatch &token = tokens[i];
+        QString header = token.captured(1);
+        if (!header.isEmpty()) {
+            if (header == "region") { state->regions++; }
+            if (state->regionOpcodes) { startHeader(header, state); }
+            continue;
+        }
+
+        QString opcode = token.captured(2);
+        int valueEnd = (i + 1 < tokens.count()) ? tokens[i + 1].capturedStart()
+                                                : line.length();
+        QString value = line.mid(token.capturedEnd(),
+                                 valueEnd - token.capturedEnd()).trimmed();
+        if (opcode == "sample") {
+            QString path = addSample(value, state);
+            if (!path.isEmpty()) { value = path; }
+        } else if (opcode == "default_path") {
+            state->defaultPath = value.replace('\\', '/');
+        }
+        if (state->regionOpcodes) { setOpcode(opcode, value, state); }
+    }
+}
+
+/* Adds the sample to the set of samples and returns its absolute path, or an
+ * empty string for generated samples. */
+QString KonfytSfzReader::addSample(QString sample, SfzState *state)
+{
+    if (sample.isEmpty() || sample.startsWith('*')) { return ""; } // E.g. *sine
+
+    QString path = state->defaultPath + sample.replace('\\', '/');
+    if (QDir::isRelativePath(path)) {
+        path = QDir(state->rootDir).filePath(path);
+    }
+    path = QDir::cleanPath(path);
+    state->samples.insert(path);
+    return path;
+}
+
+/* Opcodes of a header apply to the headers below it, up to the next header of
+ * the same or a higher level. */
+void KonfytSfzReader::startHeader(const QString &header, SfzState *state)
+{
+    if (header == "global") {
+        state->global.clear();
+        state->master.clear();
+        state->group.clear();
+        state->level = LevelGlobal;
+    } else if (header == "master") {
+        state->master.clear();
+        state->group.clear();
+        state->level = LevelMaster;
+    } else if (header == "group") {
+        state->group.clear();
+        state->level = LevelGroup;
+    } else if (header == "region") {
+        // Lower levels override higher ones
+        Opcodes opcodes = state->global;
+        foreach (const Opcodes &level, QList<Opcodes>({state->master, state->group})) {
+            for (auto it = level.constBegin(); it != level.constEnd(); ++it) {
+                opcodes.insert(it.key(), it.value());
+            }
+        }
+        state->regionOpcodes->append(opcodes);
+        state->level = LevelRegion;
+    } else {
+        // E.g. <control>, <curve> and <effect> don't apply to regions
+        state->level = LevelNone;
+    }
+}
+
+void KonfytSfzReader::setOpcode(const QString &opcode, const QString &value,
+                                SfzState *state)
+{
+    switch (state->level) {
+    case LevelGlobal:
+        state->global.insert(opcode, value);
+        break;
+    case LevelMaster:
+        state->master.insert(opcode, value);
+        break;
+    case LevelGroup:
+        state->group.insert(opcode, value);
+        break;
+    case LevelRegion:
+        state->regionOpcodes->last().insert(opcode, value);
+        break;
+    case LevelNone:
+        break;
+    }
+}
+
+bool KonfytSfzReader::readGig(KonfytSound *sound, QString *error)
+{
+    QFile file(sound->filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        *error = "Could not open file.";
+        return false;
+    }
+
+    KonfytSoundfontReader::ChunkHeader riff;
+    if (!KonfytSoundfontReader::readChunkHeader(&file, &riff) || (riff.id != "RIFF")) {
+        *error = "Not a RIFF file.";
+        return false;
+    }
+    if (file.read(4) != "DLS ") {
+        *error = "Not a GIG file.";
+        return false;
+    }
+    qint64 riffEnd = qMin(file.pos() - 4 + (qint64)riff.size, file.size());
+    readGigList(&file, riffEnd, sound);
+
+    // Large instruments have the rest of their samples in extension files
+    QString base = sound->filename;
+    base.chop(QFileInfo(base).suffix().length());
+    for (int i=1; i <= KONFYT_GIG_MAX_EXTENSION_FILES; i++) {
+        QFileInfo extension(QString("%1gx%2").arg(base).arg(i, 2, 10, QChar('0')));
+        if (!extension.exists()) { break; }
+        sound->sampleDataSize += extension.size();
+    }
+    return true;
+}
+
+/* Walk the chunks up to end, descending into the instrument and region lists
+ * to count regions. The wave pool is skipped and only its size is used. */
+void KonfytSfzReader::readGigList(QFile *file, qint64 end, KonfytSound *sound)
+{
+    while (file->pos() + 8 <= end) {
+        KonfytSoundfontReader::ChunkHeader chunk;
+        if (!KonfytSoundfontReader::readChunkHeader(file, &chunk)) { return; }
+        qint64 chunkEnd = qMin(file->pos() + (qint64)chunk.size, end);
+
+        if ( (chunk.id == "LIST") && (chunk.size >= 4) ) {
+            QByteArray listType = file->read(4);
+            if ( (listType == "rgn ") || (listType == "rgn2") ) {
+                sound->regionCount++;
+            } else if (listType == "wvpl") {
+                sound->sampleDataSize += chunk.size - 4;
+            } else if ( (listType == "lins") || (listType == "ins ")
+                        || (listType == "lrgn") ) {
+                readGigList(file, chunkEnd, sound);
+            }
+        } else if ( (chunk.id == "ptbl") && (chunk.size >= 8) ) {
+            // Pool table: size of header, number of samples
+            QByteArray data = file->read(8);
+            if (data.size() == 8) {
+                sound->sampleCount = qFromLittleEndian<quint32>(
+                            (const uchar*)data.constData() + 4);
+            }
+        }
+
+        if (!file->seek(chunkEnd + (chunk.size & 1))) { return; }
+    }
+}
@@ -0,0 +1,89 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_SFZ_READER_H
+#define KONFYT_SFZ_READER_H
+
+#include "konfytStructs.h"
+
+#include <QFile>
+#include <QHash>
+#include <QSet>
+#include <QString>
+
+#define KONFYT_SFZ_MAX_FILE_SIZE (16 * 1024 * 1024) // Sanity limit, bytes
+#define KONFYT_SFZ_MAX_INCLUDE_DEPTH 16
+#define KONFYT_GIG_MAX_EXTENSION_FILES 99
+
+/* Reads information about SFZ and GIG instruments without loading them: the
+ * number of regions, and the number and total size of the samples used.
+ * For SFZ, #define and #include are resolved and the sizes of the referenced
+ * sample files are summed. For GIG, the RIFF structure is walked without
+ * reading the sample data, and extension files (.gx01 etc.) are included. */
+class KonfytSfzReader
+{
+public:
+    typedef QHash<QString, QString> Opcodes;
+
+    // Sets sampleDataSize, sampleCount and regionCount of the sound. Returns
+    // false if the file could not be read, with the reason in error.
+    static bool readInfo(KonfytSound* sound, QString* error = nullptr);
+
+    // Reads the opcodes of each region of an SFZ, including those inherited
+    // from the enclosing <global>, <master> and <group> headers. Sample paths
+    // are made absolute. Returns false if the file could not be read.
+    static bool readRegions(QString filename, QList<Opcodes>* regions,
+                            QString* error = nullptr);
+
+private:
+    enum SfzLevel { LevelNone, LevelGlobal, LevelMaster, LevelGroup, LevelRegion };
+    struct SfzState
+    {
+        QString rootDir;      // Directory of the main file, includes and samples are relative to it
+        QString defaultPath;  // default_path opcode
+        QHash<QString, QString> defines;
+        QSet<QString> includedFiles;
+        QSet<QString> samples;
+        int regions = 0;
+        // Only used by readRegions()
+        QList<Opcodes>* regionOpcodes = nullptr;
+        SfzLevel level = LevelNone;
+        Opcodes global;
+        Opcodes master;
+        Opcodes group;
+    };
+    static bool readSfz(KonfytSound* sound, QString* error);
+    static bool readSfzFile(QString filename, SfzState* state, int depth,
+                            QString* error);
+    static QString stripComments(const QString &text);
+    static QString substituteDefines(QString line, const QHash<QString, QString> &defines);
+    static void parseSfzLine(const QString &line, SfzState* state);
+    static QString addSample(QString sample, SfzState* state);
+    static void startHeader(const QString &header, SfzState* state);
+    static void setOpcode(const QString &opcode, const QString &value,
+                          SfzState* state);
+
+    static bool readGig(KonfytSound* sound, QString* error);
+    static void readGigList(QFile* file, qint64 end, KonfytSound* sound);
+};
+
+#endif // KONFYT_SFZ_READER_H
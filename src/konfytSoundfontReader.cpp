@@ -0,0 +1,194 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#include "konfytSoundfontReader.h"
+
+#include <QFileInfo>
+#include <QScopedPointer>
+#include <QtEndian>
+
+#include <algorithm>
+
+// Record sizes in the pdta chunk, as defined in the SoundFont 2.04 spec
+#define SF_PHDR_RECORD_SIZE 38
+#define SF_SHDR_RECORD_SIZE 46
+#define SF_NAME_LENGTH 20
+
+
+KfSoundPtr KonfytSoundfontReader::soundfontFromFile(QString filename, QString *error)
+{
+    KfSoundPtr ret;
+    QString dummyError;
+    if (!error) { error = &dummyError; }
+
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        *error = "Could not open file.";
+        return ret;
+    }
+
+    // RIFF header with sfbk form type
+    ChunkHeader riff;
+    if (!readChunkHeader(&file, &riff) || (riff.id != "RIFF")) {
+        *error = "Not a RIFF file.";
+        return ret;
+    }
+    if (file.read(4) != "sfbk") {
+        *error = "Not a soundfont file.";
+        return ret;
+    }
+    qint64 riffEnd = qMin(file.pos() - 4 + (qint64)riff.size, file.size());
+
+    QScopedPointer<KonfytSound> sf(new KonfytSound(KfSoundTypeSoundfont));
+    QByteArray pdta;
+    bool pdtaFound = false;
+
+    while (file.pos() + 8 <= riffEnd) {
+        ChunkHeader chunk;
+        if (!readChunkHeader(&file, &chunk)) { break; }
+        qint64 chunkEnd = file.pos() + chunk.size;
+
+        if (chunk.id == "LIST") {
+            QByteArray listType = file.read(4);
+            if (listType == "sdta") {
+                // Only the sizes of the sample data are needed, the data is skipped.
+                if (!readSdta(&file, chunkEnd, sf.data())) {
+                    *error = "Invalid sample data chunk.";
+                    return ret;
+                }
+            } else if (listType == "pdta") {
+                if ( (chunk.size < 4) || (chunk.size > KONFYT_SF_MAX_PDTA_SIZE) ) {
+                    *error = "Invalid preset data chunk size.";
+                    return ret;
+                }
+                pdta = file.read(chunk.size - 4);
+                if (pdta.size() != (int)chunk.size - 4) {
+                    *error = "Preset data chunk truncated.";
+                    return ret;
+                }
+                pdtaFound = true;
+            }
+        }
+
+        // Chunks are padded to an even size
+        if (!file.seek(chunkEnd + (chunk.size & 1))) { break; }
+    }
+
+    if (!pdtaFound) {
+        *error = "No preset data chunk.";
+        return ret;
+    }
+    if (!readPdta(pdta, sf.data(), error)) {
+        return ret;
+    }
+
+    QFileInfo fi(filename);
+    sf->filename = filename;
+    sf->name = fi.fileName();
+    sf->fileSize = fi.size();
+
+    ret.reset(sf.take());
+    return ret;
+}
+
+bool KonfytSoundfontReader::readChunkHeader(QFile *file, ChunkHeader *header)
+{
+    QByteArray data = file->read(8);
+    if (data.size() != 8) { return false; }
+
+    header->id = data.left(4);
+    header->size = qFromLittleEndian<quint32>((const uchar*)data.constData() + 4);
+    return true;
+}
+
+bool KonfytSoundfontReader::skipChunk(QFile *file, quint32 size)
+{
+    return file->seek(file->pos() + size + (size & 1));
+}
+
+/* Read the sizes of the sample data sub-chunks without reading the data. */
+bool KonfytSoundfontReader::readSdta(QFile *file, qint64 end, KonfytSound *sf)
+{
+    while (file->pos() + 8 <= end) {
+        ChunkHeader chunk;
+        if (!readChunkHeader(file, &chunk)) { return false; }
+        if ( (chunk.id == "smpl") || (chunk.id == "sm24") ) {
+            sf->sampleDataSize += chunk.size;
+        }
+        if (!skipChunk(file, chunk.size)) { return false; }
+    }
+    return true;
+}
+
+/* Extract the presets and sample count from the preset data chunk. */
+bool KonfytSoundfontReader::readPdta(const QByteArray &pdta, KonfytSound *sf,
+                                     QString *error)
+{
+    const uchar* data = (const uchar*)pdta.constData();
+    const uchar* phdr = nullptr;
+    int phdrCount = 0;
+    int shdrCount = 0;
+
+    int pos = 0;
+    while (pos + 8 <= pdta.size()) {
+        QByteArray id = pdta.mid(pos, 4);
+        quint32 size = qFromLittleEndian<quint32>(data + pos + 4);
+        pos += 8;
+        if (size > (quint32)(pdta.size() - pos)) {
+            *error = "Preset data sub-chunk " + QString(id) + " truncated.";
+            return false;
+        }
+        if (id == "phdr") {
+            phdr = data + pos;
+            phdrCount = size / SF_PHDR_RECORD_SIZE;
+        } else if (id == "shdr") {
+            shdrCount = size / SF_SHDR_RECORD_SIZE;
+        }
+        pos += size + (size & 1);
+    }
+
+    // The last record of each list is a terminal record and is not counted.
+    if (phdrCount < 2) {
+        *error = "No presets found.";
+        return false;
+    }
+    for (int i=0; i < phdrCount - 1; i++) {
+        const uchar* rec = phdr + i * SF_PHDR_RECORD_SIZE;
+        const char* name = (const char*)rec;
+        KonfytSoundPreset p;
+        p.name = QString(QByteArray(name, qstrnlen(name, SF_NAME_LENGTH)));
+        p.program = qFromLittleEndian<quint16>(rec + SF_NAME_LENGTH);
+        p.bank = qFromLittleEndian<quint16>(rec + SF_NAME_LENGTH + 2);
+        sf->presets.append(p);
+    }
+    sf->sampleCount = qMax(0, shdrCount - 1);
+
+    // Same order as the presets are listed by Fluidsynth
+    std::sort(sf->presets.begin(), sf->presets.end(),
+              [](const KonfytSoundPreset &a, const KonfytSoundPreset &b)
+    {
+        if (a.bank != b.bank) { return a.bank < b.bank; }
+        return a.program < b.program;
+    });
+
+    return true;
+}
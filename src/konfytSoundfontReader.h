@@ -0,0 +1,56 @@
+/******************************************************************************
+ *
+ * Copyright 2024 Gideon van der Kolf
+ *
+ * This file is part of Konfyt.
+ *
+ *     Konfyt is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     Konfyt is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with Konfyt.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+
+#ifndef KONFYT_SOUNDFONT_READER_H
+#define KONFYT_SOUNDFONT_READER_H
+
+#include "konfytStructs.h"
+
+#include <QByteArray>
+#include <QFile>
+
+#define KONFYT_SF_MAX_PDTA_SIZE (64 * 1024 * 1024) // Sanity limit, bytes
+
+/* Reads the preset information of an SF2/SF3 soundfont directly from the RIFF
+ * file. Only the preset data (pdta) chunk is read; the sample data (sdta)
+ * chunk is skipped, so this is fast even for very large soundfonts. */
+class KonfytSoundfontReader
+{
+public:
+    // Returns null if the file could not be read, with the reason in error.
+    static KfSoundPtr soundfontFromFile(QString filename, QString* error = nullptr);
+
+    // RIFF helpers, also used for other RIFF based formats
+    struct ChunkHeader
+    {
+        QByteArray id;
+        quint32 size = 0;
+    };
+    static bool readChunkHeader(QFile* file, ChunkHeader* header);
+    static bool skipChunk(QFile* file, quint32 size);
+
+private:
+    static bool readSdta(QFile* file, qint64 end, KonfytSound* sf);
+    static bool readPdta(const QByteArray &pdta, KonfytSound* sf, QString* error);
+};
+
+#endif // KONFYT_SOUNDFONT_READER_H
@@ -47,6 +47,15 @@ struct KonfytSound
     KonfytSoundType type = KfSoundTypeUndefined;
     QString filename;
     QString name;
+    qint64 fileSize = 0; // Bytes, 0 if unknown
+    qint64 sampleDataSize = 0; // Bytes of sample data in file (or sample files of SFZ), 0 if unknown
+    int sampleCount = 0;
+    int regionCount = 0; // SFZ/GIG regions, 0 if unknown
+    bool infoRead = false; // SFZ/GIG info was read from the file (even if it failed)
+    // File identity when scanned, used to detect changes when rescanning
+    qint64 fileModified = 0; // ms since epoch
+    quint64 fileInode = 0;
+    QByteArray fileFingerprint;
     QList<KonfytSoundPreset> presets;
 };
 
@@ -56,10 +65,15 @@ struct KonfytAppInfo
 {
     QString exePath;
     bool bridge = false;
+    bool bridgeShm = false;
     bool headless = false;
     bool carla = false;
+    bool carlaInProcess = false;
+    bool sampler = false;
     QStringList filesToLoad;
     QString jackClientName;
+    QString bridgeServer; // Bridge worker mode: server of the parent process
+    QString exportDatabaseFile; // Library database is exported as XML to this file
 };
 
 
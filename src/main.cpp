@@ -46,6 +46,11 @@ void printAllVersionInfo()
     printAppNameAndVersion();
     print("");
     print(getCompileVersionText());
+    QString runtimeText = getRuntimeVersionText();
+    if (!runtimeText.isEmpty()) {
+        print("");
+        print(runtimeText);
+    }
 }
 
 void printUsage()
@@ -67,11 +72,33 @@ void printUsage()
     print("  -q, --headless         Hide GUI");
     print("  -b, --bridge           Load sfz's in separate processes (experimental feature,");
     print("                           uses Carla)");
+    print("  --bridgeshm            With --bridge, return the audio of the separate");
+    print("                           processes through shared memory instead of JACK");
+    print("                           ports. Uses Konfyt's own sampler.");
+#ifndef KONFYT_USE_SAMPLER
+    print("                           Note: This version of Konfyt was compiled without");
+    print("                           sampler support.");
+#endif
     print("  -c, --carla            Use Carla to load sfz's and not Linuxsampler");
 #ifndef KONFYT_USE_CARLA
     print("                           Note: This version of Konfyt was compiled without");
     print("                           Carla support.");
 #endif
+    print("  -i, --inprocess        Use Carla to load sfz's and run it inside Konfyt's");
+    print("                           own JACK client, without JACK ports or added");
+    print("                           latency per sfz");
+#ifndef KONFYT_CARLA_INPROCESS
+    print("                           Note: This version of Konfyt was compiled without");
+    print("                           in-process Carla support.");
+#endif
+    print("  -s, --sampler          Use Konfyt's own sampler to load sfz's and not");
+    print("                           Linuxsampler or Carla");
+#ifndef KONFYT_USE_SAMPLER
+    print("                           Note: This version of Konfyt was compiled without");
+    print("                           sampler support.");
+#endif
+    print("  --exportdb <file>      Export the library database to an XML file after it");
+    print("                           has been loaded");
     print("  -x, --noxcbev          Do not set the QT_XCB_GL_INTEGRATION=none environment");
     print("                           variable. This environment variable is used to");
     print("                           prevent some functionality from stopping when the");
@@ -89,8 +116,13 @@ int main(int argc, char *argv[])
     QStringList argsBridge({"-b", "--bridge"});
     QStringList argsHeadless({"-q", "--headless"});
     QStringList argsCarla({"-c", "--carla"});
+    QStringList argsCarlaInProcess({"-i", "--inprocess"});
+    QStringList argsSampler({"-s", "--sampler"});
     QStringList argsNoXcbEv({"-x", "--noxcbev"});
     QStringList argsScan({"--scan"});
+    QStringList argsBridgeWorker({"--bridgeworker"});
+    QStringList argsBridgeShm({"--bridgeshm"});
+    QStringList argsExportDb({"--exportdb"});
 
     // Handle arguments
 
@@ -134,6 +166,17 @@ int main(int argc, char *argv[])
                 appInfo.carla = true;
                 print("Carla mode.");
 
+            } else if (argsCarlaInProcess.contains(arg)) {
+
+                appInfo.carla = true;
+                appInfo.carlaInProcess = true;
+                print("Carla in-process mode.");
+
+            } else if (argsSampler.contains(arg)) {
+
+                appInfo.sampler = true;
+                print("Sampler mode.");
+
             } else if (argsNoXcbEv.contains(arg)) {
 
                 setXcbEv = false;
@@ -143,6 +186,20 @@ int main(int argc, char *argv[])
 
                 scanMode = true;
 
+            } else if (argsBridgeWorker.contains(arg)) {
+
+                nextIsValue = true;
+                prevArg = arg;
+
+            } else if (argsBridgeShm.contains(arg)) {
+
+                appInfo.bridgeShm = true;
+
+            } else if (argsExportDb.contains(arg)) {
+
+                nextIsValue = true;
+                prevArg = arg;
+
             } else {
                 if (arg[0] == '-') {
                     print(QString("Invalid argument %1. Ignoring it.").arg(arg));
@@ -155,6 +212,11 @@ int main(int argc, char *argv[])
             if (argsJackname.contains(prevArg)) {
                 appInfo.jackClientName = arg;
                 print("JACK name specified: " + appInfo.jackClientName);
+            } else if (argsBridgeWorker.contains(prevArg)) {
+                appInfo.bridgeServer = arg;
+                print("Bridge worker for server: " + appInfo.bridgeServer);
+            } else if (argsExportDb.contains(prevArg)) {
+                appInfo.exportDatabaseFile = arg;
             }
             nextIsValue = false;
         }
@@ -180,7 +242,32 @@ int main(int argc, char *argv[])
 
         return a.exec();
 
-    } else {
+    }
+#ifdef KONFYT_USE_SAMPLER
+    else if (appInfo.bridgeShm && !appInfo.bridgeServer.isEmpty()) {
+
+        // Shared memory bridge worker: the program is started by the bridge
+        // engine of another instance to render an SFZ in shared memory. Run
+        // without GUI and JACK client until the other instance goes away.
+
+        QApplication a(argc, argv);
+
+        KonfytBridgeShmWorker w;
+        w.connect(&w, &KonfytBridgeShmWorker::print, &w, [=](QString msg)
+        {
+            print(msg);
+        });
+        w.connect(&w, &KonfytBridgeShmWorker::disconnected, &w, [=]()
+        {
+            qApp->exit();
+        });
+        w.connectToServer(appInfo.bridgeServer);
+
+        return a.exec();
+
+    }
+#endif
+    else {
 
         // Normal mode: run GUI.
 
@@ -44,10 +44,12 @@ MainWindow::MainWindow(QWidget *parent, KonfytAppInfo appInfoArg) :
     initTriggers();
     setupFilesystemView();
     setupPatchListAdapter();
+    setupLibraryTree();
     setupDatabase();
     setupExternalApps();
     // ----------------------------------------------------
     setupInitialProjectFromCmdLineArgs();
+    setupBridgeWorker();
 
     scanDirForProjects(projectsDir);
     setupGuiMenuButtons();
@@ -203,6 +205,8 @@ void MainWindow::printArgumentsInfo()
     print("Arguments:");
     if (appInfo.carla) { print(" - Carla mode"); }
     if (appInfo.bridge) { print(" - Bridging is enabled."); }
+    if (appInfo.bridgeShm) { print(" - Bridging through shared memory"); }
+    if (!appInfo.bridgeServer.isEmpty()) { print(" - Bridge worker for " + appInfo.bridgeServer); }
 
 
     print(QString(" - Files to load: %1")
@@ -272,13 +276,26 @@ void MainWindow::onJackXrunOccurred()
     print(text);
 }
 
-void MainWindow::onJackPortRegisteredOrConnected()
+void MainWindow::onJackPortsChanged(QList<KonfytJackPortRegistry::Change> changes)
 {
-    // Refresh ports/connections tree
-    updateConnectionsTree();
+    QSet<int> types;
+    foreach (const KonfytJackPortRegistry::Change& change, changes) {
+        types.insert(change.type);
+    }
 
-    // Refresh the other JACK connections page
-    updateJackPage();
+    // Refresh ports/connections tree if it lists the type of ports that changed.
+    // It is refreshed anyway when the connections page is shown.
+    if (ui->stackedWidget->currentWidget() == ui->connectionsPage) {
+        if (types.contains(connectionsTreePortType())) {
+            updateConnectionsTree();
+        }
+    }
+
+    // Update the other JACK connections page. If it is not shown, it is
+    // rebuilt from the port registry when it is shown again.
+    if (ui->stackedWidget->currentWidget() == ui->otherJackConsPage) {
+        updateJackPagePorts(changes);
+    }
 
     // Update warnings section
     updateGUIWarnings();
@@ -316,6 +333,10 @@ void MainWindow::showSettingsDialog()
         ui->comboBox_Settings_filemanager->setCurrentIndex( ui->comboBox_Settings_filemanager->count()-1 );
     }
 
+    ui->spinBox_settings_memoryBudget->setValue(mPatchMemoryBudgetMB);
+    ui->checkBox_settings_latencyCompensation->setChecked(mLatencyCompensation);
+    ui->checkBox_settings_directAudioInput->setChecked(mDirectAudioInput);
+
     // Switch to settings page
     ui->stackedWidget->setCurrentWidget(ui->SettingsPage);
 }
@@ -644,6 +665,9 @@ void MainWindow::applySettings()
     setSfzDir(ui->comboBox_settings_sfzDirs->currentText());
     mFilemanager = ui->comboBox_Settings_filemanager->currentText();
     promptOnQuit = ui->checkBox_settings_promptOnQuit->isChecked();
+    setPatchMemoryBudget(ui->spinBox_settings_memoryBudget->value());
+    setLatencyCompensation(ui->checkBox_settings_latencyCompensation->isChecked());
+    setDirectAudioInput(ui->checkBox_settings_directAudioInput->isChecked());
 
     print("Settings applied.");
 
@@ -696,6 +720,12 @@ bool MainWindow::loadSettingsFile(QString dir)
                     mFilemanager = r.readElementText();
                 } else if (r.name() == XML_SETTINGS_PROMPT_ON_QUIT) {
                     promptOnQuit = Qstr2bool(r.readElementText());
+                } else if (r.name() == XML_SETTINGS_MEMORY_BUDGET) {
+                    setPatchMemoryBudget(r.readElementText().toInt());
+                } else if (r.name() == XML_SETTINGS_LATENCY_COMPENSATION) {
+                    setLatencyCompensation(Qstr2bool(r.readElementText()));
+                } else if (r.name() == XML_SETTINGS_DIRECT_AUDIO_INPUT) {
+                    setDirectAudioInput(Qstr2bool(r.readElementText()));
                 } else {
                     r.skipCurrentElement();
                 }
@@ -740,6 +770,9 @@ bool MainWindow::saveSettingsFile()
     stream.writeTextElement(XML_SETTINGS_SFZDIR, mSfzDir);
     stream.writeTextElement(XML_SETTINGS_FILEMAN, mFilemanager);
     stream.writeTextElement(XML_SETTINGS_PROMPT_ON_QUIT, bool2str(promptOnQuit));
+    stream.writeTextElement(XML_SETTINGS_MEMORY_BUDGET, n2s(mPatchMemoryBudgetMB));
+    stream.writeTextElement(XML_SETTINGS_LATENCY_COMPENSATION, bool2str(mLatencyCompensation));
+    stream.writeTextElement(XML_SETTINGS_DIRECT_AUDIO_INPUT, bool2str(mDirectAudioInput));
 
     stream.writeEndElement(); // Settings
 
@@ -934,6 +967,25 @@ void MainWindow::updatePortsBussesTree()
 
 }
 
+/* Returns the type of JACK ports listed in the connections tree for the bus or
+ * port selected in the ports/buses tree, or OtherPortType if none are listed. */
+KonfytJackPortRegistry::PortType MainWindow::connectionsTreePortType()
+{
+    QTreeWidgetItem* current = ui->tree_portsBusses->currentItem();
+    if (!current) { return KonfytJackPortRegistry::OtherPortType; }
+
+    if (current->parent() == busParent) {
+        return KonfytJackPortRegistry::AudioInput;
+    } else if (current->parent() == audioInParent) {
+        return KonfytJackPortRegistry::AudioOutput;
+    } else if (current->parent() == midiOutParent) {
+        return KonfytJackPortRegistry::MidiInput;
+    } else if (current->parent() == midiInParent) {
+        return KonfytJackPortRegistry::MidiOutput;
+    }
+    return KonfytJackPortRegistry::OtherPortType;
+}
+
 void MainWindow::updateConnectionsTree()
 {
     ProjectPtr prj = mCurrentProject;
@@ -995,7 +1047,14 @@ void MainWindow::updateConnectionsTree()
         leftCons = prj->midiInPort_getClients(j);
     }
 
-    QList<QString> portsInTree = conPortsMap.values();
+    QStringList inTree = conPortsMap.values();
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 14, 0))
+    QSet<QString> portsInTree(inTree.begin(), inTree.end());
+    QSet<QString> available(l.begin(), l.end());
+#else
+    QSet<QString> portsInTree = inTree.toSet();
+    QSet<QString> available = l.toSet();
+#endif
 
     // Determine which JACK ports to add to tree
     QStringList toAdd;
@@ -1021,9 +1080,9 @@ void MainWindow::updateConnectionsTree()
 
     // Determine which JACK ports to remove from tree
     QStringList toRemTemp;
-    for (int i=0; i < portsInTree.count(); i++) {
-        if (!l.contains(portsInTree[i])) {
-            toRemTemp.append(portsInTree[i]);
+    foreach (const QString& port, portsInTree) {
+        if (!available.contains(port)) {
+            toRemTemp.append(port);
         }
     }
 
@@ -1081,7 +1140,7 @@ void MainWindow::updateConnectionsTree()
     for (int i=0; i < items.count(); i++) {
         QTreeWidgetItem* item = items[i];
         QString port = conPortsMap[item];
-        if ( !l.contains(port) ) {
+        if ( !available.contains(port) ) {
             // Mark red
             item->setBackground(0, QBrush(inactiveColor));
         } else {
@@ -1590,7 +1649,8 @@ void MainWindow::loadProject(ProjectPtr prj)
     patchListAdapter.setPatchNumbersVisible(prj->getShowPatchListNumbers());
     patchListAdapter.setPatchNotesVisible(prj->getShowPatchListNotes());
 
-    loadAllPatches();
+    // Only the first patch is loaded here. The patch engine preloads the
+    // rest in the background, within the memory budget.
     setCurrentPatchByIndex(0);
 
     print("Project loaded.");
@@ -1763,22 +1823,33 @@ KonfytSoundPreset MainWindow::selectedSoundfontProgramInLibOrFs()
 }
 
 /* Returns the type of item in the library tree. */
-MainWindow::LibraryTreeItemType MainWindow::libraryTreeItemType(QTreeWidgetItem *item)
+MainWindow::LibraryTreeItemType MainWindow::libraryTreeItemType(const QModelIndex &index)
 {
-    if (item == libraryPatchTree.rootTreeItem) { return libTreePatchesRoot; }
-    else if (libraryPatchTree.soundsMap.contains(item)) { return libTreePatch; }
-    else if (item == librarySfzTree.rootTreeItem) { return libTreeSFZRoot; }
-    else if (librarySfzTree.foldersMap.contains(item)) { return libTreeSFZFolder; }
-    else if (librarySfzTree.soundsMap.contains(item)) { return libTreeSFZ; }
-    else if (item == librarySfontTree.rootTreeItem) { return libTreeSoundfontRoot; }
-    else if (librarySfontTree.foldersMap.contains(item)) { return libTreeSoundfontFolder; }
-    else if (librarySfontTree.soundsMap.contains(item)) { return libTreeSoundfont; }
-    else { return libTreeInvalid; }
+    KonfytLibraryModel::ItemKind kind = libraryModel.itemKind(index);
+    switch (libraryModel.soundType(index)) {
+    case KfSoundTypePatch:
+        if (kind == KonfytLibraryModel::KindSection) { return libTreePatchesRoot; }
+        if (kind == KonfytLibraryModel::KindSound) { return libTreePatch; }
+        break;
+    case KfSoundTypeSfz:
+        if (kind == KonfytLibraryModel::KindSection) { return libTreeSFZRoot; }
+        if (kind == KonfytLibraryModel::KindFolder) { return libTreeSFZFolder; }
+        if (kind == KonfytLibraryModel::KindSound) { return libTreeSFZ; }
+        break;
+    case KfSoundTypeSoundfont:
+        if (kind == KonfytLibraryModel::KindSection) { return libTreeSoundfontRoot; }
+        if (kind == KonfytLibraryModel::KindFolder) { return libTreeSoundfontFolder; }
+        if (kind == KonfytLibraryModel::KindSound) { return libTreeSoundfont; }
+        break;
+    default:
+        break;
+    }
+    return libTreeInvalid;
 }
 
 MainWindow::LibraryTreeItemType MainWindow::librarySelectedTreeItemType()
 {
-    return libraryTreeItemType( ui->treeWidget_Library->currentItem() );
+    return libraryTreeItemType( ui->treeView_Library->currentIndex() );
 }
 
 /* Returns the currently selected patch in the library, or a null one if nothing
@@ -1787,7 +1858,7 @@ KfSoundPtr MainWindow::librarySelectedPatch()
 {
     KfSoundPtr ret;
     if ( librarySelectedTreeItemType() == libTreePatch ) {
-        ret = libraryPatchTree.soundsMap.value(ui->treeWidget_Library->currentItem());
+        ret = libraryModel.sound(ui->treeView_Library->currentIndex());
     }
     return ret;
 }
@@ -1798,7 +1869,7 @@ KfSoundPtr MainWindow::librarySelectedSfont()
 {
     KfSoundPtr ret;
     if ( librarySelectedTreeItemType() == libTreeSoundfont ) {
-        ret = librarySfontTree.soundsMap.value(ui->treeWidget_Library->currentItem());
+        ret = libraryModel.sound(ui->treeView_Library->currentIndex());
     }
     return ret;
 }
@@ -1807,7 +1878,7 @@ KfSoundPtr MainWindow::librarySelectedSfz()
 {
     KfSoundPtr ret;
     if ( librarySelectedTreeItemType() == libTreeSFZ ) {
-        ret = librarySfzTree.soundsMap.value(ui->treeWidget_Library->currentItem());
+        ret = libraryModel.sound(ui->treeView_Library->currentIndex());
     }
     return ret;
 }
@@ -1838,7 +1909,7 @@ KfSoundPtr MainWindow::selectedSoundInLibOrFs()
         // Library is currently visible
 
         if ( librarySelectedTreeItemType() == libTreePatch ) {
-            ret = libraryPatchTree.soundsMap.value(ui->treeWidget_Library->currentItem());
+            ret = libraryModel.sound(ui->treeView_Library->currentIndex());
 
         } else if ( librarySelectedTreeItemType() == libTreeSoundfont ) {
 
@@ -1856,7 +1927,7 @@ KfSoundPtr MainWindow::selectedSoundInLibOrFs()
             }
 
         } else if ( librarySelectedTreeItemType() == libTreeSFZ ) {
-            ret = librarySfzTree.soundsMap.value(ui->treeWidget_Library->currentItem());
+            ret = libraryModel.sound(ui->treeView_Library->currentIndex());
         }
 
     } else {
@@ -1929,53 +2000,57 @@ void MainWindow::showSfontInfoInLibFsInfoArea(QString filename)
     ui->textBrowser_LibraryBottom->append("\nDouble-click to load program list.");
 }
 
-void MainWindow::resetLibraryTree(MainWindow::LibraryTree &libTree, QString name)
+void MainWindow::setupLibraryTree()
 {
-    libTree.rootTreeItem = new QTreeWidgetItem();
-    libTree.rootTreeItem->setText(0, name);
-    libTree.rootTreeItem->setIcon(0, mFolderIcon);
-    libTree.foldersMap.clear();
-    libTree.soundsMap.clear();
+    libraryModel.setIcons(mFolderIcon, mFileIcon);
+    ui->treeView_Library->setModel(&libraryModel);
+    connect(ui->treeView_Library->selectionModel(), &QItemSelectionModel::currentChanged,
+            this, &MainWindow::onLibraryTreeCurrentChanged);
 }
 
-void MainWindow::buildLibraryTree(QTreeWidgetItem *twi, KfDbTreeItemPtr dbTreeItem,
-                                  MainWindow::LibraryTree *libTree)
+/* Show the specified sections in the library tree. The expanded and current
+ * items are kept where they still exist. */
+void MainWindow::setLibraryTreeSections(QList<KonfytLibraryModel::Section> sections,
+                                        QString groupText)
 {
-    if (!dbTreeItem->hasChildren() && (twi != libTree->rootTreeItem)) {
-        // Sound item: has no children and is not the root item
-        libTree->soundsMap.insert(twi, dbTreeItem->data);
-        twi->setIcon(0, mFileIcon);
-    } else {
-        // Root or intermediate folder item
-        twi->setIcon(0, mFolderIcon);
-        if (twi != libTree->rootTreeItem) {
-            // Not the root, add to folders map
-            libTree->foldersMap.insert(twi, dbTreeItem->path);
-        }
-    }
-    twi->setToolTip(0, twi->text(0));
+    QStringList expanded;
+    libraryExpandedKeys(QModelIndex(), &expanded);
+    QString current = libraryModel.itemKey(ui->treeView_Library->currentIndex());
 
-    foreach (KfDbTreeItemPtr dbChild, dbTreeItem->children) {
-        QTreeWidgetItem* child = new QTreeWidgetItem();
-        child->setText(0, dbChild->name);
-        buildLibraryTree(child, dbChild, libTree);
-        twi->addChild(child);
-    }
-}
+    libraryModel.setSections(sections, groupText);
 
-void MainWindow::buildSfzTree(KfDbTreeItemPtr dbTreeItem)
-{
-    buildLibraryTree(librarySfzTree.rootTreeItem, dbTreeItem, &librarySfzTree);
+    foreach (QString key, expanded) {
+        QModelIndex index = libraryModel.indexOfKey(key);
+        if (index.isValid()) { ui->treeView_Library->expand(index); }
+    }
+    QModelIndex currentIndex = libraryModel.indexOfKey(current);
+    if (currentIndex.isValid()) {
+        ui->treeView_Library->setCurrentIndex(currentIndex);
+    } else {
+        onLibraryTreeCurrentChanged();
+    }
 }
 
-void MainWindow::buildSfTree(KfDbTreeItemPtr dbTreeItem)
+/* Adds the keys of the expanded items under parent to the list. */
+void MainWindow::libraryExpandedKeys(const QModelIndex &parent, QStringList *keys)
 {
-    buildLibraryTree(librarySfontTree.rootTreeItem, dbTreeItem, &librarySfontTree);
+    for (int row=0; row < libraryModel.rowCount(parent); row++) {
+        QModelIndex index = libraryModel.index(row, 0, parent);
+        if (ui->treeView_Library->isExpanded(index)) {
+            keys->append(libraryModel.itemKey(index));
+            libraryExpandedKeys(index, keys);
+        }
+    }
 }
 
-void MainWindow::buildPatchTree(KfDbTreeItemPtr dbTreeItem)
+/* Refresh the library tree with the current mode (all entries or search). */
+void MainWindow::refreshLibraryTree()
 {
-    buildLibraryTree(libraryPatchTree.rootTreeItem, dbTreeItem, &libraryPatchTree);
+    if (mLibrarySearchModeActive) {
+        fillLibraryTreeWithSearch(ui->lineEdit_Search->text());
+    } else {
+        fillLibraryTreeWithAll();
+    }
 }
 
 /* Returns index of current patch, or -1 if none. */
@@ -2006,6 +2081,19 @@ void MainWindow::loadCurrentPatchAndUpdateGui()
  * preview patch, and loads the preview patch into the patch engine. */
 void MainWindow::loadPreviewPatchAndUpdateGui()
 {
+    KfSoundPtr s = selectedSoundInLibOrFs();
+
+    // Load the neighbouring soundfonts in the background in case they are
+    // auditioned next.
+    preloadPreviewNeighbours();
+
+    // Selecting another program of the soundfont that is already loaded only
+    // requires a program change.
+    if (setPreviewPatchProgram(s)) {
+        updateWindowTitle();
+        return;
+    }
+
     // Unload preview patch if it is loaded
     pengine.unloadPatch(&mPreviewPatch);
     // Clear preview patch
@@ -2015,7 +2103,6 @@ void MainWindow::loadPreviewPatchAndUpdateGui()
 
     // Add selected library/filesystem item as a layer to the patch
 
-    KfSoundPtr s = selectedSoundInLibOrFs();
     if (s) {
         if (s->type == KfSoundTypeSoundfont) {
 
@@ -2039,17 +2126,6 @@ void MainWindow::loadPreviewPatchAndUpdateGui()
     updateWindowTitle();
 }
 
-void MainWindow::loadAllPatches()
-{
-    ProjectPtr prj = mCurrentProject;
-    if (!prj) { return; }
-
-    foreach (KonfytPatch* patch, prj->getPatchList()) {
-        pengine.loadPatch(patch);
-        patchListAdapter.setPatchLoaded(patch, true);
-    }
-}
-
 void MainWindow::updatePatchView()
 {
     clearPatchLayersFromGuiOnly();
@@ -2132,6 +2208,12 @@ void MainWindow::onPatchSelected(KonfytPatch *patch)
 
 void MainWindow::onPatchLayerLoaded(KfPatchLayerWeakPtr patchLayer)
 {
+    if (patchLayer == bridgeClientLayer) {
+        KfPatchLayerSharedPtr layer = patchLayer.toStrongRef();
+        bridgeClient.sendSfzLoaded(layer ? layer->errorMessage() : "Layer removed");
+        bridgeClientLayer.clear();
+    }
+
     foreach (KonfytLayerWidget* w, layerWidgetList) {
         if (w->getPatchLayer() == patchLayer) {
             // Refresh in indicator handler, as JACK routes may have changed
@@ -2141,33 +2223,59 @@ void MainWindow::onPatchLayerLoaded(KfPatchLayerWeakPtr patchLayer)
             w->refresh();
         }
     }
+    updatePatchListReady();
 }
 
-/* Fill the library tree widget with all the entries in the database. */
-void MainWindow::fillLibraryTreeWithAll()
+/* An engine is still streaming in the sounds of a loaded layer. */
+void MainWindow::onPatchLayerLoadProgress(KfPatchLayerWeakPtr patchLayer)
 {
-    mLibrarySearchModeActive = false; // Controls the behaviour when the user selects a tree item
-    ui->treeWidget_Library->clear();
+    foreach (KonfytLayerWidget* w, layerWidgetList) {
+        if (w->getPatchLayer() == patchLayer) {
+            w->refresh();
+        }
+    }
+    updatePatchListReady();
+}
 
-    // Create parent soundfonts tree item, with soundfont children
-    resetLibraryTree(librarySfontTree, QString("%1 [%2]")
-                     .arg(TREE_ITEM_SOUNDFONTS).arg(db.soundfontCount()));
-    buildSfTree(db.sfontTree.root);
+/* Dim the loaded patches in the patch list that are not ready to play yet. */
+void MainWindow::updatePatchListReady()
+{
+    ProjectPtr prj = mCurrentProject;
+    if (!prj) { return; }
 
-    // Create parent patches tree item, with patch children
-    resetLibraryTree(libraryPatchTree, QString("%1 [%2]")
-                     .arg(TREE_ITEM_PATCHES).arg(db.patchCount()));
-    buildPatchTree(db.patchTree.root);
+    foreach (KonfytPatch* patch, prj->getPatchList()) {
+        patchListAdapter.setPatchReady(patch, !pengine.isPatchLoaded(patch)
+                                              || pengine.isPatchReady(patch));
+    }
+}
 
-    // Create parent sfz item, with one child indicating the number of items
-    resetLibraryTree(librarySfzTree, QString("%1 [%2]")
-                     .arg(TREE_ITEM_SFZ).arg(db.sfzCount()));
-    buildSfzTree(db.sfzTree.root);
+/* The patch engine loaded or unloaded a patch to manage memory use. */
+void MainWindow::onPatchResidencyChanged(KonfytPatch *patch, bool loaded)
+{
+    ProjectPtr prj = mCurrentProject;
+    if (!prj) { return; }
+    if (prj->getPatchIndex(patch) < 0) { return; } // E.g. preview patch
 
-    // Add items to tree
-    ui->treeWidget_Library->insertTopLevelItem(0, librarySfontTree.rootTreeItem);
-    ui->treeWidget_Library->insertTopLevelItem(0, librarySfzTree.rootTreeItem);
-    ui->treeWidget_Library->insertTopLevelItem(0, libraryPatchTree.rootTreeItem);
+    patchListAdapter.setPatchLoaded(patch, loaded);
+    patchListAdapter.setPatchReady(patch, !loaded || pengine.isPatchReady(patch));
+}
+
+/* Fill the library tree widget with all the entries in the database. */
+void MainWindow::fillLibraryTreeWithAll()
+{
+    mLibrarySearchModeActive = false; // Controls the behaviour when the user selects a tree item
+
+    QList<KonfytLibraryModel::Section> sections;
+    sections.append({KfSoundTypePatch,
+                     QString("%1 [%2]").arg(TREE_ITEM_PATCHES).arg(db.patchCount()),
+                     db.patchTree.root});
+    sections.append({KfSoundTypeSfz,
+                     QString("%1 [%2]").arg(TREE_ITEM_SFZ).arg(db.sfzCount()),
+                     db.sfzTree.root});
+    sections.append({KfSoundTypeSoundfont,
+                     QString("%1 [%2]").arg(TREE_ITEM_SOUNDFONTS).arg(db.soundfontCount()),
+                     db.sfontTree.root});
+    setLibraryTreeSections(sections);
 }
 
 void MainWindow::preparePreviewMenu()
@@ -2248,38 +2356,36 @@ void MainWindow::fillLibraryTreeWithSearch(QString search)
 {
     mLibrarySearchModeActive = true; // Controls the behaviour when the user selects a tree item
     db.search(search);
+    // The tree is filled when the search is finished
+}
 
-    ui->treeWidget_Library->clear();
-
-    QTreeWidgetItem* twiResults = new QTreeWidgetItem();
-    twiResults->setText(0, TREE_ITEM_SEARCH_RESULTS);
-
-    // Soundfonts
-    resetLibraryTree(librarySfontTree, QString("%1 [%2 (%3 programs)]")
-                     .arg(TREE_ITEM_SOUNDFONTS).arg(db.getNumSfontsResults())
-                     .arg(db.getNumSfontProgramResults()));
-    buildSfTree(db.sfontTree_results.root);
-
-    // Patches
-    resetLibraryTree(libraryPatchTree, QString("%1 [%2]")
-                     .arg(TREE_ITEM_PATCHES).arg(db.getNumPatchesResults()));
-    buildPatchTree(db.patchTree_results.root);
-
-    // SFZ
-    resetLibraryTree(librarySfzTree, QString("%1 [%2]")
-                     .arg(TREE_ITEM_SFZ).arg(db.getNumSfzResults()));
-    buildSfzTree(db.sfzTree_results.root);
+/* Fill the library tree widget with the search results. */
+void MainWindow::onDatabaseSearchFinished()
+{
+    // Search results may arrive after the search has been cleared
+    if (!mLibrarySearchModeActive) { return; }
 
-    // Add items to tree
-    twiResults->addChild(libraryPatchTree.rootTreeItem);
-    twiResults->addChild(librarySfzTree.rootTreeItem);
-    twiResults->addChild(librarySfontTree.rootTreeItem);
+    QList<KonfytLibraryModel::Section> sections;
+    sections.append({KfSoundTypePatch,
+                     QString("%1 [%2]").arg(TREE_ITEM_PATCHES)
+                     .arg(db.getNumPatchesResults()),
+                     db.patchTree_results.root});
+    sections.append({KfSoundTypeSfz,
+                     QString("%1 [%2]").arg(TREE_ITEM_SFZ).arg(db.getNumSfzResults()),
+                     db.sfzTree_results.root});
+    sections.append({KfSoundTypeSoundfont,
+                     QString("%1 [%2 (%3 programs)]").arg(TREE_ITEM_SOUNDFONTS)
+                     .arg(db.getNumSfontsResults()).arg(db.getNumSfontProgramResults()),
+                     db.sfontTree_results.root});
+    setLibraryTreeSections(sections, TREE_ITEM_SEARCH_RESULTS);
 
-    ui->treeWidget_Library->insertTopLevelItem(0, twiResults);
-    ui->treeWidget_Library->expandItem(twiResults);
-    ui->treeWidget_Library->expandItem(libraryPatchTree.rootTreeItem);
-    ui->treeWidget_Library->expandItem(librarySfzTree.rootTreeItem);
-    ui->treeWidget_Library->expandItem(librarySfontTree.rootTreeItem);
+    // Show the results
+    QTreeView* view = ui->treeView_Library;
+    QModelIndex results = libraryModel.index(0, 0);
+    view->expand(results);
+    for (int row=0; row < sections.count(); row++) {
+        view->expand(libraryModel.index(row, 0, results));
+    }
 }
 
 void MainWindow::setupLibraryContextMenu()
@@ -2314,11 +2420,7 @@ void MainWindow::onActionRemoveLibraryPatchTriggered()
         msgBox("Failed to remove patch file.", f.fileName());
     }
 
-    // Remove from library tree
-    QTreeWidgetItem* item = libraryPatchTree.soundsMap.key(patch);
-    if (item) {
-        delete item;
-    }
+    refreshLibraryTree();
 }
 
 void MainWindow::setupFilesystemView()
@@ -2634,13 +2736,14 @@ bool MainWindow::fileExtensionIsSoundfont(QString filepath)
     return ( fileExtensionIs(filepath, "sf2") || fileExtensionIs(filepath, "sf3") );
 }
 
-void MainWindow::on_treeWidget_Library_itemClicked(QTreeWidgetItem *item, int /*column*/)
+void MainWindow::on_treeView_Library_clicked(const QModelIndex &index)
 {
     // Expand / unexpand item due to click (makes things a lot easier)
     // Note (2022-10-27, Ubuntu Studio 22.04, KDE Plasma 5.24.6) calling setExpaned
     // for leaf items interferes with the itemDoubleClicked signal.
-    if (item->childCount()) {
-        item->setExpanded(!item->isExpanded());
+    if (libraryModel.hasChildren(index)) {
+        QTreeView* view = ui->treeView_Library;
+        view->setExpanded(index, !view->isExpanded(index));
     }
 }
 
@@ -2677,8 +2780,7 @@ void MainWindow::setCurrentPatchByIndex(int index)
     setCurrentPatch(prj->getPatch(index));
 }
 
-void MainWindow::on_treeWidget_Library_currentItemChanged(
-        QTreeWidgetItem* /*current*/, QTreeWidgetItem* /*previous*/)
+void MainWindow::onLibraryTreeCurrentChanged()
 {
     if ( librarySelectedTreeItemType() == libTreePatch ) {
 
@@ -2691,7 +2793,8 @@ void MainWindow::on_treeWidget_Library_currentItemChanged(
 
     } else if ( librarySelectedTreeItemType() == libTreeSFZ ) {
 
-        showSfzContentInLibFsInfoArea(librarySelectedSfz()->filename);
+        showSfzContentInLibFsInfoArea(librarySelectedSfz()->filename,
+                                      librarySelectedSfz());
 
     } else {
         clearLibFsInfoArea();
@@ -2734,11 +2837,25 @@ void MainWindow::on_lineEdit_Search_returnPressed()
     }
 }
 
+/* Search text changed. The library is searched as the user types. */
+void MainWindow::on_lineEdit_Search_textChanged(const QString &text)
+{
+    if (text.trimmed().isEmpty()) {
+        if (mLibrarySearchModeActive) {
+            fillLibraryTreeWithAll();
+        }
+    } else {
+        fillLibraryTreeWithSearch(text);
+    }
+}
+
 /* Clear search button clicked. */
 void MainWindow::on_toolButton_ClearSearch_clicked()
 {
     ui->lineEdit_Search->clear();
-    fillLibraryTreeWithAll();
+    if (mLibrarySearchModeActive) {
+        fillLibraryTreeWithAll();
+    }
     ui->lineEdit_Search->setFocus();
 }
 
@@ -2755,7 +2872,7 @@ void MainWindow::on_listWidget_LibraryBottom_currentRowChanged(int currentRow)
 }
 
 /* Adds SFZ to current patch in engine and in GUI. */
-void MainWindow::addSfzToCurrentPatch(QString sfzPath)
+KfPatchLayerWeakPtr MainWindow::addSfzToCurrentPatch(QString sfzPath)
 {
     newPatchIfCurrentNull();
 
@@ -2766,6 +2883,8 @@ void MainWindow::addSfzToCurrentPatch(QString sfzPath)
     addPatchLayerToGUI(layer);
 
     patchModified();
+
+    return layer;
 }
 
 /* Adds soundfont program to current patch in engine and in GUI. */
@@ -2834,10 +2953,12 @@ void MainWindow::setPreviewMode(bool previewModeOn)
 
     if (mPreviewMode) {
         setMasterGainFloat(previewGain); // To update GUI slider
+        pengine.setSoundfontCacheSize(PREVIEW_SOUNDFONT_CACHE_SIZE);
         loadPreviewPatchAndUpdateGui();
     } else {
         setMasterGainFloat(masterGain); // To update GUI slider
         pengine.unloadPatch(&mPreviewPatch);
+        pengine.setSoundfontCacheSize(0);
         loadCurrentPatchAndUpdateGui();
     }
 }
@@ -3048,6 +3169,10 @@ void MainWindow::initAboutDialog()
     txt.replace(REPLACE_TXT_APP_VERSION, APP_VERSION);
     txt.replace(REPLACE_TXT_APP_YEAR, APP_YEAR);
     QString cvtext = getCompileVersionText();
+    QString rvtext = getRuntimeVersionText();
+    if (!rvtext.isEmpty()) {
+        cvtext.append("\n\n" + rvtext);
+    }
     cvtext.replace("\n", "<br>\n");
     txt.replace(REPLACE_TXT_MORE_VERSION, cvtext);
     ui->textBrowser_about->setHtml(txt);
@@ -3095,6 +3220,24 @@ void MainWindow::setSfzDir(QString path)
     db.setSfzDir(path);
 }
 
+void MainWindow::setPatchMemoryBudget(int mb)
+{
+    mPatchMemoryBudgetMB = qMax(mb, 0);
+    pengine.setMemoryBudget(qint64(mPatchMemoryBudgetMB) * 1024 * 1024);
+}
+
+void MainWindow::setLatencyCompensation(bool compensate)
+{
+    mLatencyCompensation = compensate;
+    jack.setLatencyCompensation(compensate);
+}
+
+void MainWindow::setDirectAudioInput(bool direct)
+{
+    mDirectAudioInput = direct;
+    jack.setDirectAudioInput(direct);
+}
+
 /* Creates the settings dir if it doesn't exist. */
 void MainWindow::createSettingsDir()
 {
@@ -3123,6 +3266,13 @@ void MainWindow::onDatabaseScanFinished()
     ui->stackedWidget->setCurrentWidget(ui->PatchPage);
 }
 
+/* Entries were updated from changes in the library directories. */
+void MainWindow::onDatabaseLibraryChanged()
+{
+    refreshLibraryTree();
+    saveDatabase();
+}
+
 void MainWindow::setupDatabase()
 {
     connect(&db, &KonfytDatabase::print, this, &MainWindow::print);
@@ -3136,8 +3286,26 @@ void MainWindow::setupDatabase()
     connect(&db, &KonfytDatabase::sfontInfoLoadedFromFile,
             this, &MainWindow::onDatabaseSfontInfoLoaded);
 
-    // Check if database file exists.
-    if (db.loadDatabaseFromFile(settingsDir + "/" + DATABASE_FILE)) {
+    connect(&db, &KonfytDatabase::searchFinished,
+            this, &MainWindow::onDatabaseSearchFinished);
+
+    connect(&db, &KonfytDatabase::libraryChanged,
+            this, &MainWindow::onDatabaseLibraryChanged);
+    db.setWatchEnabled(true);
+
+    // Check if database file exists. The XML database of older versions is
+    // left as is, so older versions can still use it.
+    QString dbFile = settingsDir + "/" + DATABASE_FILE;
+    QString xmlFile = settingsDir + "/" + DATABASE_XML_FILE;
+    bool loaded = false;
+    if (QFileInfo::exists(dbFile)) {
+        loaded = db.loadDatabaseFromFile(dbFile);
+    } else if (db.loadDatabaseFromFile(xmlFile)) {
+        print("Database loaded from XML file of an older version. Saving to " + dbFile);
+        db.saveDatabaseToFile(dbFile);
+        loaded = true;
+    }
+    if (loaded) {
         print("Database loaded from file. Rescan to refresh.");
         print("Database contains:");
         print("   " + n2s(db.soundfontCount()) + " sf2/3 soundfonts.");
@@ -3146,16 +3314,22 @@ void MainWindow::setupDatabase()
     } else {
         print("No database file found.");
         // Check if old database location exists
-        QString oldDir = QDir::homePath() + "/.konfyt/konfyt.database";
+        QString oldDir = QDir::homePath() + "/.konfyt/" + DATABASE_XML_FILE;
         if (db.loadDatabaseFromFile(oldDir)) {
             print("Found database file in old location. Saving to new location.");
-            db.saveDatabaseToFile(settingsDir + "/" + DATABASE_FILE);
+            db.saveDatabaseToFile(dbFile);
         } else {
             // Still no database file.
             print("You can scan directories to create a database from Settings.");
         }
     }
 
+    if (!appInfo.exportDatabaseFile.isEmpty()) {
+        if (db.saveDatabaseToXmlFile(appInfo.exportDatabaseFile)) {
+            print("Database exported to " + appInfo.exportDatabaseFile);
+        }
+    }
+
     fillLibraryTreeWithAll(); // Fill the tree widget with all the database entries
 }
 
@@ -3199,7 +3373,7 @@ void MainWindow::on_pushButtonSettings_RescanLibrary_clicked()
 void MainWindow::on_pushButtonSettings_QuickRescanLibrary_clicked()
 {
     applySettings();
-    db.clearDatabase_exceptSoundfonts();
+    // Only new and changed files are scanned
     scanForDatabase();
 }
 
@@ -4651,16 +4825,15 @@ void MainWindow::on_listWidget_LibraryBottom_itemDoubleClicked(QListWidgetItem*
 }
 
 /* Library tree: item double clicked. */
-void MainWindow::on_treeWidget_Library_itemDoubleClicked(
-        QTreeWidgetItem *item, int /*column*/)
+void MainWindow::on_treeView_Library_doubleClicked(const QModelIndex &index)
 {
     if (mPreviewMode) { setPreviewMode(false); }
 
-    if ( libraryTreeItemType(item) == libTreePatch ) {
+    if ( libraryTreeItemType(index) == libTreePatch ) {
 
         addPatchToProjectFromFile(librarySelectedPatch()->filename);
 
-    } else if (libraryTreeItemType(item) == libTreeSoundfont) {
+    } else if (libraryTreeItemType(index) == libTreeSoundfont) {
 
         // Select the first soundfont program
         ui->listWidget_LibraryBottom->setCurrentRow(0);
@@ -4669,7 +4842,7 @@ void MainWindow::on_treeWidget_Library_itemDoubleClicked(
             addSoundfontProgramToCurrentPatch(sf->filename, selectedSoundfontProgramInLibOrFs());
         }
 
-    } else if ( libraryTreeItemType(item) == libTreeSFZ ) {
+    } else if ( libraryTreeItemType(index) == libTreeSFZ ) {
 
         addSfzToCurrentPatch( librarySelectedSfz()->filename );
 
@@ -4686,8 +4859,7 @@ void MainWindow::on_tabWidget_library_currentChanged(int /*index*/)
                     ui->treeWidget_filesystem->currentItem(), nullptr);
     } else {
         // Library tab selected
-        on_treeWidget_Library_currentItemChanged(
-                    ui->treeWidget_Library->currentItem(), nullptr);
+        onLibraryTreeCurrentChanged();
     }
 }
 
@@ -5780,10 +5952,105 @@ void MainWindow::setupPatchEngine()
     });
     connect(&pengine, &KonfytPatchEngine::patchLayerLoaded,
             this, &MainWindow::onPatchLayerLoaded);
+    connect(&pengine, &KonfytPatchEngine::patchLayerLoadProgress,
+            this, &MainWindow::onPatchLayerLoadProgress);
+    connect(&pengine, &KonfytPatchEngine::patchResidencyChanged,
+            this, &MainWindow::onPatchResidencyChanged);
+    pengine.setDatabase(&db);
 
     pengine.initPatchEngine(&jack, appInfo);
 }
 
+/* In bridge worker mode, connect to the bridge engine of the parent process
+ * once our SFZ engine is ready, and load the SFZs it sends in the current
+ * patch. The process exits when the parent goes away. */
+void MainWindow::setupBridgeWorker()
+{
+    if (appInfo.bridgeServer.isEmpty()) { return; }
+
+    connect(&bridgeClient, &KonfytBridgeClient::loadSfz, this, [=](QString path)
+    {
+        print("Bridge worker loading SFZ: " + path);
+        KfPatchLayerSharedPtr layer = addSfzToCurrentPatch(path).toStrongRef();
+        if (!layer) {
+            bridgeClient.sendSfzLoaded("Failed to add layer");
+        } else if (layer->isLoading()) {
+            // Reply when loaded, see onPatchLayerLoaded()
+            bridgeClientLayer = layer;
+        } else {
+            bridgeClient.sendSfzLoaded(layer->errorMessage());
+        }
+    });
+    connect(&bridgeClient, &KonfytBridgeClient::disconnected, this, [=]()
+    {
+        print("Bridge server disconnected, exiting.");
+        qApp->exit();
+    });
+
+    if (pengine.isSfzEngineInitialised()) {
+        bridgeClient.connectToServer(appInfo.bridgeServer);
+    } else {
+        connect(&pengine, &KonfytPatchEngine::sfzEngineInitialised, this, [=]()
+        {
+            bridgeClient.connectToServer(appInfo.bridgeServer);
+        });
+    }
+}
+
+/* If the preview patch is loaded with a single layer of the same soundfont as
+ * the specified sound, change the layer's program to the sound's program.
+ * Returns false if the preview patch has to be reloaded instead. */
+bool MainWindow::setPreviewPatchProgram(KfSoundPtr sound)
+{
+    if (!sound) { return false; }
+    if (sound->type != KfSoundTypeSoundfont) { return false; }
+    if (sound->presets.isEmpty()) { return false; }
+    if (pengine.currentPatch() != &mPreviewPatch) { return false; }
+
+    QList<KfPatchLayerWeakPtr> layers = mPreviewPatch.layers();
+    if (layers.count() != 1) { return false; }
+    KfPatchLayerSharedPtr layer = layers[0].toStrongRef();
+    if (!layer) { return false; }
+    if (layer->layerType() != KonfytPatchLayer::TypeSoundfontProgram) { return false; }
+    if (layer->soundfontData.parentSoundfont != sound->filename) { return false; }
+
+    return pengine.setSfLayerProgram(layer, sound->presets.value(0));
+}
+
+/* Preload the soundfonts above and below the selected item in the library or
+ * filesystem view, so that moving to them in preview mode is quick. */
+void MainWindow::preloadPreviewNeighbours()
+{
+    QStringList paths;
+
+    if (ui->tabWidget_library->currentWidget() == ui->tab_library) {
+        QModelIndex current = ui->treeView_Library->currentIndex();
+        QModelIndexList neighbours;
+        neighbours.append(ui->treeView_Library->indexBelow(current));
+        neighbours.append(ui->treeView_Library->indexAbove(current));
+        foreach (QModelIndex index, neighbours) {
+            if (libraryModel.itemKind(index) != KonfytLibraryModel::KindSound) { continue; }
+            if (libraryModel.soundType(index) != KfSoundTypeSoundfont) { continue; }
+            KfSoundPtr sound = libraryModel.sound(index);
+            if (sound) { paths.append(sound->filename); }
+        }
+    } else {
+        QTreeWidget* tree = ui->treeWidget_filesystem;
+        QTreeWidgetItem* current = tree->currentItem();
+        if (current) {
+            QList<QTreeWidgetItem*> neighbours;
+            neighbours.append(tree->itemBelow(current));
+            neighbours.append(tree->itemAbove(current));
+            foreach (QTreeWidgetItem* item, neighbours) {
+                QString path = fsMap.value(item).filePath();
+                if (fileExtensionIsSoundfont(path)) { paths.append(path); }
+            }
+        }
+    }
+
+    pengine.preloadSoundfonts(paths);
+}
+
 /* Update the input and output port settings for the preview patch layer. */
 void MainWindow::updatePreviewPatchLayer()
 {
@@ -5834,10 +6101,10 @@ void MainWindow::closeEvent(QCloseEvent *event)
 }
 
 /* Context menu requested for a library tree item. */
-void MainWindow::on_treeWidget_Library_customContextMenuRequested(const QPoint &pos)
+void MainWindow::on_treeView_Library_customContextMenuRequested(const QPoint &pos)
 {
-    libraryMenuItem = ui->treeWidget_Library->itemAt(pos);
-    LibraryTreeItemType itemType = libraryTreeItemType( libraryMenuItem );
+    libraryMenuIndex = ui->treeView_Library->indexAt(pos);
+    LibraryTreeItemType itemType = libraryTreeItemType( libraryMenuIndex );
 
     libraryContextMenu.clear();
 
@@ -5859,26 +6126,26 @@ void MainWindow::on_treeWidget_Library_customContextMenuRequested(const QPoint &
 /* Action triggered from library tree view to open item in file manager. */
 void MainWindow::on_actionOpen_In_File_Manager_library_triggered()
 {
-    if (!libraryMenuItem) { return; }
+    if (!libraryMenuIndex.isValid()) { return; }
 
     QString path;
 
-    LibraryTreeItemType itemType = libraryTreeItemType( libraryMenuItem );
+    LibraryTreeItemType itemType = libraryTreeItemType( libraryMenuIndex );
 
     if ( itemType == libTreeSoundfontRoot ) { path = this->mSoundfontsDir; }
     else if ( itemType == libTreePatchesRoot ) { path = this->mPatchesDir; }
     else if ( itemType == libTreeSFZRoot) { path = this->mSfzDir; }
     else if ( itemType == libTreeSoundfontFolder ) {
-        path = librarySfontTree.foldersMap.value( libraryMenuItem );
+        path = libraryModel.path( libraryMenuIndex );
     }
     else if ( itemType == libTreeSoundfont ) {
-        path = librarySfontTree.soundsMap.value(libraryMenuItem)->filename;
+        path = libraryModel.sound(libraryMenuIndex)->filename;
     }
     else if ( itemType == libTreeSFZFolder ) {
-        path = librarySfzTree.foldersMap.value( libraryMenuItem );
+        path = libraryModel.path( libraryMenuIndex );
     }
     else if ( itemType == libTreeSFZ ) {
-        path = librarySfzTree.soundsMap.value(libraryMenuItem)->filename;
+        path = libraryModel.sound(libraryMenuIndex)->filename;
     }
     else if ( itemType == libTreePatch ) {
         path = this->mPatchesDir;
@@ -5893,10 +6160,19 @@ void MainWindow::on_actionOpen_In_File_Manager_library_triggered()
     openFileManager(path);
 }
 
-void MainWindow::showSfzContentInLibFsInfoArea(QString filename)
+/* Show the contents of the SFZ file, preceded by the info from the database if
+ * the entry is specified. */
+void MainWindow::showSfzContentInLibFsInfoArea(QString filename, KfSoundPtr sfz)
 {
     ui->stackedWidget_libraryBottom->setCurrentWidget(ui->page_libraryBottom_Text);
     ui->textBrowser_LibraryBottom->clear();
+    if (sfz && sfz->regionCount) {
+        qint64 memory = db.estimatedMemoryUse(KfSoundTypeSfz, sfz->filename);
+        ui->textBrowser_LibraryBottom->append(
+                    QString("Regions: %1, samples: %2 (%3 MB), estimated RAM: %4 MB\n")
+                    .arg(sfz->regionCount).arg(sfz->sampleCount)
+                    .arg(sfz->sampleDataSize/1024/1024).arg(memory/1024/1024));
+    }
     ui->textBrowser_LibraryBottom->append(loadSfzFileText(filename));
     QScrollBar* v = ui->textBrowser_LibraryBottom->verticalScrollBar();
     v->setValue(0);
@@ -6522,44 +6798,113 @@ void MainWindow::showJackPage()
     updateJackPage();
 }
 
+/* Update the other JACK connections page. The port trees are only rebuilt if
+ * the ports changed since they were last built. */
 void MainWindow::updateJackPage()
 {
     ProjectPtr prj = mCurrentProject;
     if (!prj) { return; }
 
-    QStringList outPorts;
-    QStringList inPorts;
-    QList<KonfytJackConPair> conList;
-    if (jackPage_audio) {
-        // Audio Jack ports
-        outPorts = jack.getAudioOutputPortsList();
-        inPorts = jack.getAudioInputPortsList();
-        conList = prj->getJackAudioConList();
-    } else {
-        // MIDI Jack ports
-        outPorts = jack.getMidiOutputPortsList();
-        inPorts = jack.getMidiInputPortsList();
-        conList = prj->getJackMidiConList();
+    bool upToDate = jackPagePortsValid && (jackPagePortsAudio == jackPage_audio)
+            && (jackPagePortsVersion == jack.jackPortsVersion());
+    if (!upToDate) {
+        QStringList outPorts;
+        QStringList inPorts;
+        if (jackPage_audio) {
+            // Audio Jack ports
+            outPorts = jack.getAudioOutputPortsList();
+            inPorts = jack.getAudioInputPortsList();
+        } else {
+            // MIDI Jack ports
+            outPorts = jack.getMidiOutputPortsList();
+            inPorts = jack.getMidiInputPortsList();
+        }
+
+        // Update JACK output ports
+        ui->treeWidget_jackPortsOut->clear();
+        jackPageOutItems.clear();
+        for (int i=0; i < outPorts.count(); i++) {
+            addJackPagePortItem(outPorts[i], true);
+        }
+
+        // Update JACK input ports
+        ui->treeWidget_jackportsIn->clear();
+        jackPageInItems.clear();
+        for (int i=0; i < inPorts.count(); i++) {
+            addJackPagePortItem(inPorts[i], false);
+        }
+
+        jackPagePortsValid = true;
+        jackPagePortsAudio = jackPage_audio;
+        jackPagePortsVersion = jack.jackPortsVersion();
     }
 
-    // Update JACK output ports
-    ui->treeWidget_jackPortsOut->clear();
-    for (int i=0; i < outPorts.count(); i++) {
-        QString client_port = outPorts[i];
-        if (jackPortBelongstoUs(client_port)) { continue; }
-        QTreeWidgetItem* item = new QTreeWidgetItem();
-        item->setText(0,client_port);
-        ui->treeWidget_jackPortsOut->addTopLevelItem(item);
+    updateJackPageConnectionsList();
+}
+
+/* Apply port changes to the port trees of the other JACK connections page,
+ * instead of rebuilding them. */
+void MainWindow::updateJackPagePorts(QList<KonfytJackPortRegistry::Change> changes)
+{
+    if (!jackPagePortsValid || (jackPagePortsAudio != jackPage_audio)) {
+        updateJackPage();
+        return;
     }
 
-    // Update JACK input ports
-    ui->treeWidget_jackportsIn->clear();
-    for (int i=0; i < inPorts.count(); i++) {
-        QString client_port = inPorts[i];
-        if (jackPortBelongstoUs(client_port)) { continue; }
-        QTreeWidgetItem* item = new QTreeWidgetItem();
-        item->setText(0,client_port);
+    KonfytJackPortRegistry::PortType outType = jackPage_audio ?
+                KonfytJackPortRegistry::AudioOutput : KonfytJackPortRegistry::MidiOutput;
+    KonfytJackPortRegistry::PortType inType = jackPage_audio ?
+                KonfytJackPortRegistry::AudioInput : KonfytJackPortRegistry::MidiInput;
+
+    bool changed = false;
+    foreach (const KonfytJackPortRegistry::Change& change, changes) {
+        if ((change.type != outType) && (change.type != inType)) { continue; }
+        bool out = (change.type == outType);
+        QHash<QString, QTreeWidgetItem*>& items = out ? jackPageOutItems : jackPageInItems;
+
+        if (change.kind == KonfytJackPortRegistry::Change::PortRenamed) {
+            delete items.take(change.oldName);
+        } else if (change.kind == KonfytJackPortRegistry::Change::PortRemoved) {
+            delete items.take(change.port);
+        }
+        if (change.kind != KonfytJackPortRegistry::Change::PortRemoved) {
+            addJackPagePortItem(change.port, out);
+        }
+        changed = true;
+    }
+    // Changes of other port types don't affect the page
+    jackPagePortsVersion = jack.jackPortsVersion();
+
+    if (changed) {
+        updateJackPageConnectionsList();
+    }
+}
+
+void MainWindow::addJackPagePortItem(QString port, bool output)
+{
+    if (jackPortBelongstoUs(port)) { return; }
+
+    QTreeWidgetItem* item = new QTreeWidgetItem();
+    item->setText(0, port);
+    if (output) {
+        ui->treeWidget_jackPortsOut->addTopLevelItem(item);
+        jackPageOutItems.insert(port, item);
+    } else {
         ui->treeWidget_jackportsIn->addTopLevelItem(item);
+        jackPageInItems.insert(port, item);
+    }
+}
+
+void MainWindow::updateJackPageConnectionsList()
+{
+    ProjectPtr prj = mCurrentProject;
+    if (!prj) { return; }
+
+    QList<KonfytJackConPair> conList;
+    if (jackPage_audio) {
+        conList = prj->getJackAudioConList();
+    } else {
+        conList = prj->getJackMidiConList();
     }
 
     // Fill connections list with connections from project
@@ -6568,7 +6913,8 @@ void MainWindow::updateJackPage()
         KonfytJackConPair portPair = conList[i];
         QListWidgetItem* item = new QListWidgetItem( portPair.toString() );
         // Colour red if one of the ports aren't present in JACK.
-        if ( !outPorts.contains(portPair.srcPort) || !inPorts.contains(portPair.destPort) ) {
+        if ( !jack.jackPortExists(portPair.srcPort)
+             || !jack.jackPortExists(portPair.destPort) ) {
             item->setBackground(QBrush(Qt::red));
         }
         ui->listWidget_jackConnections->addItem( item );
@@ -7218,8 +7564,8 @@ void MainWindow::setupJack()
 {
     connect(&jack, &KonfytJackEngine::print, this, &MainWindow::onJackPrint);
 
-    connect(&jack, &KonfytJackEngine::jackPortRegisteredOrConnected,
-            this, &MainWindow::onJackPortRegisteredOrConnected);
+    connect(&jack, &KonfytJackEngine::jackPortsChanged,
+            this, &MainWindow::onJackPortsChanged);
 
     connect(&jack, &KonfytJackEngine::midiEventsReceived,
             this, &MainWindow::onJackMidiEventsReceived);
@@ -30,6 +30,7 @@
 #include "konfytFluidsynthEngine.h"
 #include "konfytJackEngine.h"
 #include "konfytLayerWidget.h"
+#include "konfytLibraryModel.h"
 #include "konfytMidiFilter.h"
 #include "konfytPatchEngine.h"
 #include "konfytPatchLayer.h"
@@ -66,7 +67,8 @@
 #define APP_RESTART_CODE 1000
 
 #define SETTINGS_FILE "konfyt.settings"
-#define DATABASE_FILE "konfyt.database"
+#define DATABASE_FILE "konfyt.librarydb"
+#define DATABASE_XML_FILE "konfyt.database" // Used by older versions
 #define MIDI_MAP_PRESETS_FILE "konfytMidiMapPresets"
 
 #define SAVED_MIDI_SEND_ITEMS_DIR "savedMidiSendItems"
@@ -79,6 +81,8 @@
 #define TREE_ITEM_PATCHES "Patches"
 #define TREE_ITEM_SFZ "SFZ"
 
+#define PREVIEW_SOUNDFONT_CACHE_SIZE 4 // Soundfonts kept loaded in preview mode
+
 #define TREECON_COL_PORT 0
 #define TREECON_COL_L 1
 #define TREECON_COL_R 2
@@ -90,6 +94,9 @@
 #define XML_SETTINGS_SFZDIR "sfzDir"
 #define XML_SETTINGS_FILEMAN "filemanager"
 #define XML_SETTINGS_PROMPT_ON_QUIT "promptOnQuit"
+#define XML_SETTINGS_MEMORY_BUDGET "patchMemoryBudgetMB"
+#define XML_SETTINGS_LATENCY_COMPENSATION "latencyCompensation"
+#define XML_SETTINGS_DIRECT_AUDIO_INPUT "directAudioInput"
 
 #define XML_MIDI_MAP_PRESETS "midiMapPresets"
 #define XML_MIDI_MAP_PRESET "midiMapPreset"
@@ -220,7 +227,7 @@ private:
     void showPatchInLibFsInfoArea();
     void showSfontInfoInLibFsInfoArea(QString filename);
     void showSelectedSfontProgramList();
-    void showSfzContentInLibFsInfoArea(QString filename);
+    void showSfzContentInLibFsInfoArea(QString filename, KfSoundPtr sfz = KfSoundPtr());
     QString loadSfzFileText(QString filename);
 private slots:
     void on_tabWidget_library_currentChanged(int index);
@@ -239,22 +246,15 @@ private slots:
 
     // Library tree
 private:
-    struct LibraryTree {
-        QTreeWidgetItem* rootTreeItem = nullptr;
-        QMap<QTreeWidgetItem*, QString> foldersMap; // Intermediate (non-root, non-bottom) items
-        QMap<QTreeWidgetItem*, KfSoundPtr> soundsMap; // Bottom-most items in tree
-    };
-    LibraryTree librarySfontTree;
-    LibraryTree librarySfzTree;
-    LibraryTree libraryPatchTree;
-    void resetLibraryTree(LibraryTree &libTree, QString name);
+    KonfytLibraryModel libraryModel;
+    void setupLibraryTree();
+    void setLibraryTreeSections(QList<KonfytLibraryModel::Section> sections,
+                                QString groupText = QString());
+    void libraryExpandedKeys(const QModelIndex &parent, QStringList* keys);
+    void refreshLibraryTree();
 
     QIcon mFolderIcon {":/icons/folder.png"};
     QIcon mFileIcon {":/icons/picture.png"};
-    void buildLibraryTree(QTreeWidgetItem* twi, KfDbTreeItemPtr dbTreeItem, LibraryTree* libTree);
-    void buildSfzTree(KfDbTreeItemPtr dbTreeItem);
-    void buildSfTree(KfDbTreeItemPtr dbTreeItem);
-    void buildPatchTree(KfDbTreeItemPtr dbTreeItem);
 
     enum LibraryTreeItemType {
         libTreeInvalid,
@@ -267,7 +267,7 @@ private:
         libTreeSoundfontFolder,
         libTreeSoundfont
     };
-    LibraryTreeItemType libraryTreeItemType(QTreeWidgetItem* item);
+    LibraryTreeItemType libraryTreeItemType(const QModelIndex &index);
     LibraryTreeItemType librarySelectedTreeItemType();
     KfSoundPtr librarySelectedPatch();
     KfSoundPtr librarySelectedSfont();
@@ -278,17 +278,18 @@ private:
     void fillLibraryTreeWithSearch(QString search);
 
     QMenu libraryContextMenu;
-    QTreeWidgetItem* libraryMenuItem = nullptr;
+    QPersistentModelIndex libraryMenuIndex;
     QAction* actionRemoveLibraryPatch = nullptr;
     void setupLibraryContextMenu();
 
 private slots:
     void onActionRemoveLibraryPatchTriggered();
-    void on_treeWidget_Library_itemClicked(QTreeWidgetItem *item, int column);
-    void on_treeWidget_Library_currentItemChanged(QTreeWidgetItem *current, QTreeWidgetItem *previous);
-    void on_treeWidget_Library_itemDoubleClicked(QTreeWidgetItem *item, int column);
-    void on_treeWidget_Library_customContextMenuRequested(const QPoint &pos);
+    void on_treeView_Library_clicked(const QModelIndex &index);
+    void onLibraryTreeCurrentChanged();
+    void on_treeView_Library_doubleClicked(const QModelIndex &index);
+    void on_treeView_Library_customContextMenuRequested(const QPoint &pos);
     void on_lineEdit_Search_returnPressed();
+    void on_lineEdit_Search_textChanged(const QString &text);
     void on_toolButton_ClearSearch_clicked();
     void on_actionOpen_In_File_Manager_library_triggered();
 
@@ -301,6 +302,8 @@ private slots:
     void onDatabaseScanFinished();
     void onDatabaseScanStatus(QString msg);
     void onDatabaseSfontInfoLoaded(KfSoundPtr sf);
+    void onDatabaseLibraryChanged();
+    void onDatabaseSearchFinished();
 
     // Filesystem view
 private:
@@ -342,6 +345,12 @@ private slots:
 private:
     KonfytPatchEngine pengine;
     void setupPatchEngine();
+
+    // Bridge worker mode: SFZs are loaded for the bridge engine of the parent
+    // Konfyt process.
+    KonfytBridgeClient bridgeClient;
+    KfPatchLayerWeakPtr bridgeClientLayer; // Loading, reply when done
+    void setupBridgeWorker();
     KonfytPatch* mCurrentPatch = nullptr; // Current patch being played
 
     // Patch preview
@@ -351,6 +360,8 @@ private:
     int previewPatchMidiInChannel = -1;
     int previewPatchBus = 0;
     void updatePreviewPatchLayer();
+    bool setPreviewPatchProgram(KfSoundPtr sound);
+    void preloadPreviewNeighbours();
 
     // Current patch functions
     int currentPatchIndex();
@@ -358,14 +369,13 @@ private:
     void setCurrentPatchByIndex(int index);
 
     void newPatchIfCurrentNull();
-    void addSfzToCurrentPatch(QString sfzPath);
+    KfPatchLayerWeakPtr addSfzToCurrentPatch(QString sfzPath);
     void addSoundfontProgramToCurrentPatch(QString soundfontPath, KonfytSoundPreset p);
     void addMidiPortToCurrentPatch(int port);
     void addAudioInPortToCurrentPatch(int port);
 
     void loadCurrentPatchAndUpdateGui();
     void loadPreviewPatchAndUpdateGui();
-    void loadAllPatches();
 
     // GUI patch functions
     bool mPreviewMode = false;               // Set by setPreviewMode()
@@ -375,9 +385,12 @@ private:
     PatchListWidgetAdapter patchListAdapter;
     void setupPatchListAdapter();
     bool patchNote_ignoreChange = false;
+    void updatePatchListReady();
 private slots:
     void onPatchSelected(KonfytPatch* patch);
     void onPatchLayerLoaded(KfPatchLayerWeakPtr patchLayer);
+    void onPatchLayerLoadProgress(KfPatchLayerWeakPtr patchLayer);
+    void onPatchResidencyChanged(KonfytPatch* patch, bool loaded);
 
     // Layers
 private:
@@ -497,6 +510,7 @@ private:
     void connectionsTreeSelectAndEditMidiOutPort(int portId);
     void updatePortsBussesTree();
     void updateConnectionsTree();
+    KonfytJackPortRegistry::PortType connectionsTreePortType();
     void clearPortsBussesConnectionsData();
 
     QTreeWidgetItem* busParent = nullptr;
@@ -552,6 +566,12 @@ private:
     QString mSfzDir;
     void setSfzDir(QString path);
     QString mFilemanager;
+    int mPatchMemoryBudgetMB = 0;
+    void setPatchMemoryBudget(int mb);
+    bool mLatencyCompensation = true;
+    void setLatencyCompensation(bool compensate);
+    bool mDirectAudioInput = false;
+    void setDirectAudioInput(bool direct);
     void createSettingsDir();
     bool loadSettingsFile(QString dir);
     bool saveSettingsFile();
@@ -731,7 +751,7 @@ private slots:
     void onJackMidiEventsReceived();
     void onJackAudioEventsReceived();
     void onJackXrunOccurred();
-    void onJackPortRegisteredOrConnected();
+    void onJackPortsChanged(QList<KonfytJackPortRegistry::Change> changes);
 
     // ========================================================================
     // External apps
@@ -831,6 +851,15 @@ private:
     void setupJackPage();
     void showJackPage();
     void updateJackPage();
+    void updateJackPagePorts(QList<KonfytJackPortRegistry::Change> changes);
+    void updateJackPageConnectionsList();
+    // Port trees as built from the JACK port registry
+    bool jackPagePortsValid = false;
+    bool jackPagePortsAudio = true;
+    quint64 jackPagePortsVersion = 0;
+    QHash<QString, QTreeWidgetItem*> jackPageOutItems;
+    QHash<QString, QTreeWidgetItem*> jackPageInItems;
+    void addJackPagePortItem(QString port, bool output);
     void updateJackPageButtonStates();
 private slots:
     void on_pushButton_ShowJackPage_clicked();
@@ -124,6 +124,17 @@ void PatchListWidgetAdapter::setPatchLoaded(KonfytPatch *patch, bool loaded)
     updatePatchItem(patch);
 }
 
+void PatchListWidgetAdapter::setPatchReady(KonfytPatch *patch, bool ready)
+{
+    if (patch == nullptr) { return; }
+    KONFYT_ASSERT_RETURN(patchDataMap.contains(patch));
+
+    PatchData& data = patchDataMap[patch];
+    if (data.ready == ready) { return; }
+    data.ready = ready;
+    updatePatchItem(patch);
+}
+
 void PatchListWidgetAdapter::setCurrentPatch(KonfytPatch *patch)
 {
     KonfytPatch* lastPatch = mCurrentPatch;
@@ -175,8 +186,10 @@ void PatchListWidgetAdapter::updatePatchItem(KonfytPatch *patch)
     txt.append(patch->name());
     data.item->setText(txt);
 
-    if (data.loaded) {
+    if (data.loaded && data.ready) {
         data.item->setForeground(QBrush(Qt::white));
+    } else if (data.loaded) {
+        data.item->setForeground(QBrush(Qt::lightGray));
     } else {
         data.item->setForeground(QBrush(Qt::gray));
     }
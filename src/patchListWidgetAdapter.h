@@ -48,6 +48,8 @@ public:
     void setPatchNumbersVisible(bool visible);
     void setPatchNotesVisible(bool visible);
     void setPatchLoaded(KonfytPatch* patch, bool loaded);
+    // Loaded patches of which not all sounds are ready to play yet are dimmed
+    void setPatchReady(KonfytPatch* patch, bool ready);
     void setCurrentPatch(KonfytPatch* patch);
 
 signals:
@@ -59,6 +61,7 @@ private:
     struct PatchData
     {
         bool loaded = false;
+        bool ready = true;
         QListWidgetItem* item = nullptr;
     };
     const QString notenames = "CDEFGAB";
@@ -23,23 +23,30 @@
 
 #include <konfytDatabase.h>
 
+#include <QStorageInfo>
+#include <QThread>
+
 
 RemoteScannerServer::RemoteScannerServer(QObject *parent) : QObject(parent)
 {
-    process.setProgram(qApp->arguments().value(0));
-    process.setArguments({"--scan"});
-
-    connect(&process, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished),
-           this, &RemoteScannerServer::onProcessFinished);
-
     connect(&server, &QLocalServer::newConnection,
             this, &RemoteScannerServer::onNewConnection);
 }
 
+RemoteScannerServer::~RemoteScannerServer()
+{
+    running = false;
+    foreach (Worker* worker, workers) {
+        removeWorker(worker);
+    }
+}
+
 void RemoteScannerServer::scan(QStringList soundfonts)
 {
-    sfontScanList = soundfonts;
-    sfontScanIndex = 0;
+    sfontQueue = soundfonts;
+    sfontCount = soundfonts.count();
+    errors = 0;
+    successes = 0;
 
     if (soundfonts.isEmpty()) {
         print("No soundfonts to scan.");
@@ -49,7 +56,7 @@ void RemoteScannerServer::scan(QStringList soundfonts)
 
     QLocalServer::removeServer(REMOTE_SCANNER_SOCKET_NAME);
     if (server.listen(REMOTE_SCANNER_SOCKET_NAME)) {
-        scanStatus("Starting scan process...");
+        scanStatus("Starting scan processes...");
     } else {
         print("Could not start server: " + server.errorString());
         print("Soundfont scanning failed.");
@@ -57,22 +64,109 @@ void RemoteScannerServer::scan(QStringList soundfonts)
         return;
     }
 
+    int count = qMin(defaultProcessCount(soundfonts.first()), soundfonts.count());
+    print(QString("Scanning %1 soundfonts with %2 processes.")
+          .arg(soundfonts.count()).arg(count));
+
     running = true;
-    process.start();
+    for (int i=0; i < count; i++) {
+        Worker* worker = new Worker();
+        workers.append(worker);
+        startWorker(worker);
+    }
 }
 
-void RemoteScannerServer::sendSfont()
+/* One process per core, but only one for rotational storage where parallel
+ * reads result in seeking which makes scanning slower. */
+int RemoteScannerServer::defaultProcessCount(QString path)
 {
+    if (isRotationalStorage(path)) { return 1; }
+
+    return qBound(1, QThread::idealThreadCount(), REMOTE_SCANNER_MAX_PROCESSES);
+}
+
+/* Returns true if the file is on a rotational drive (i.e. hard disk), false
+ * if not or unknown. */
+bool RemoteScannerServer::isRotationalStorage(QString path)
+{
+    QStorageInfo storage(QFileInfo(path).path());
+    QString device = QFileInfo(QString(storage.device())).fileName();
+    if (device.isEmpty()) { return false; }
+
+    // For a partition, the queue info is in the directory of the parent device.
+    QString sysPath = QFileInfo("/sys/class/block/" + device).canonicalFilePath();
+    if (sysPath.isEmpty()) { return false; }
+    foreach (QString dir, QStringList({sysPath, QFileInfo(sysPath).path()})) {
+        QFile file(dir + "/queue/rotational");
+        if (file.open(QIODevice::ReadOnly)) {
+            return file.readAll().trimmed() == "1";
+        }
+    }
+    return false;
+}
+
+void RemoteScannerServer::startWorker(Worker *worker)
+{
+    worker->process = new QProcess(this);
+    worker->process->setProgram(qApp->arguments().value(0));
+    worker->process->setArguments({"--scan"});
+    connect(worker->process,
+            QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished),
+            this, [=]()
+    {
+        onProcessFinished(worker);
+    });
+    worker->process->start();
+}
+
+void RemoteScannerServer::sendNextSfont(Worker *worker)
+{
+    if (sfontQueue.isEmpty()) {
+        // No more work for this process
+        worker->sfont.clear();
+        worker->process->terminate();
+        return;
+    }
+
     // Send the file name of the next soundfont file to be scanned to the client.
-    QString sf = sfontScanList.value(sfontScanIndex);
-    scanStatus(sf);
-    socket->write(QString("%1\n").arg(sf).toLocal8Bit());
+    worker->sfont = sfontQueue.takeFirst();
+    scanStatus(QString("%1 of %2: %3").arg(sfontCount - sfontQueue.count())
+               .arg(sfontCount).arg(worker->sfont));
+    worker->socket->write(QString("%1\n").arg(worker->sfont).toLocal8Bit());
 }
 
-void RemoteScannerServer::stopProcess()
+void RemoteScannerServer::removeWorker(Worker *worker)
 {
+    workers.removeAll(worker);
+    if (worker->socket) {
+        worker->socket->disconnect(this);
+        worker->socket->deleteLater();
+    }
+    if (worker->process) {
+        worker->process->disconnect(this);
+        worker->process->terminate();
+        worker->process->deleteLater();
+    }
+    delete worker;
+}
+
+/* Finish when all processes are done. */
+void RemoteScannerServer::checkFinished()
+{
+    if (!running) { return; }
+    if (!workers.isEmpty()) { return; }
+
     running = false;
-    process.terminate();
+    if (!sfontQueue.isEmpty()) {
+        // All processes exited without doing the remaining work
+        print(QString("Scan processes failed. %1 soundfonts not scanned.")
+              .arg(sfontQueue.count()));
+        errors += sfontQueue.count();
+        sfontQueue.clear();
+    }
+    server.close();
+    printFinished();
+    emit finished();
 }
 
 void RemoteScannerServer::printFinished()
@@ -83,57 +177,79 @@ void RemoteScannerServer::printFinished()
     print(QString("    Successes: %1").arg(successes));
 }
 
-void RemoteScannerServer::onProcessFinished(int /*exitCode*/,
-                                            QProcess::ExitStatus /*exitStatus*/)
+void RemoteScannerServer::onProcessFinished(Worker *worker)
 {
     if (!running) { return; }
 
-    print("Scan process crashed. Restarting...");
-    print("Error loading soundfont: " + sfontScanList.value(sfontScanIndex));
-    scanStatus("Scan process crashed. Restarting...");
-
-    sfontScanIndex++;
-    errors++;
+    bool crashedOnSfont = !worker->sfont.isEmpty();
+    if (crashedOnSfont) {
+        print("Scan process crashed. Restarting...");
+        print("Error loading soundfont: " + worker->sfont);
+        scanStatus("Scan process crashed. Restarting...");
+        errors++;
+        emit sfontFailed(worker->sfont);
+    }
 
-    if (sfontScanIndex < sfontScanList.count()) {
-        process.start();
+    // Restart the process if there is still work. A process that exits before
+    // it received any work is not restarted, to prevent an endless loop if the
+    // process can't start.
+    if (crashedOnSfont && !sfontQueue.isEmpty()) {
+        if (worker->socket) {
+            worker->socket->disconnect(this);
+            worker->socket->deleteLater();
+            worker->socket = nullptr;
+        }
+        worker->process->deleteLater();
+        worker->sfont.clear();
+        startWorker(worker);
     } else {
-        printFinished();
-        emit finished();
+        removeWorker(worker);
+        checkFinished();
     }
 }
 
 void RemoteScannerServer::onNewConnection()
 {
-    scanStatus("New local socket connection");
-
-    socket = server.nextPendingConnection();
-    connect(socket, &QLocalSocket::readyRead,
-            this, &RemoteScannerServer::onSocketReadyRead);
-
-    if (sfontScanIndex < sfontScanList.count()) {
-        sendSfont();
-    } else {
-        printFinished();
-        stopProcess();
-        emit finished();
-    }
+    QLocalSocket* socket = server.nextPendingConnection();
+    connect(socket, &QLocalSocket::readyRead, this, [=]()
+    {
+        onSocketReadyRead(socket);
+    });
 }
 
-void RemoteScannerServer::onSocketReadyRead()
+void RemoteScannerServer::onSocketReadyRead(QLocalSocket *socket)
 {
+    Worker* worker = nullptr;
+    foreach (Worker* w, workers) {
+        if (w->socket == socket) { worker = w; }
+    }
+
     while (!socket->atEnd()) {
         QByteArray line = socket->readLine();
         line.replace("\n", "");
 
-        // See RemoteScannerClient::onSocketReadyRead() for format of message
+        // See RemoteScannerClient for format of messages
+
+        if (line.startsWith("hello")) {
+            qint64 pid = line.split(' ').value(1).toLongLong();
+            foreach (Worker* w, workers) {
+                if (w->process->processId() == pid) { worker = w; }
+            }
+            if (!worker) {
+                print("Unknown scan process connected.");
+                socket->deleteLater();
+                return;
+            }
+            worker->socket = socket;
+            sendNextSfont(worker);
 
-        if (line.startsWith("soundfont")) {
+        } else if (line.startsWith("soundfont") && worker) {
             int len = line.split(' ').value(1).toInt();
 
             if (len == 0) {
-                print("Error loading soundfont: " + sfontScanList.value(sfontScanIndex));
+                print("Error loading soundfont: " + worker->sfont);
                 errors++;
+                emit sfontFailed(worker->sfont);
             } else {
                 successes++;
                 QByteArray xml = socket->read(len);
@@ -143,14 +259,7 @@ void RemoteScannerServer::onSocketReadyRead()
                 emit newSoundfont(s);
             }
 
-            sfontScanIndex++;
-            if (sfontScanIndex < sfontScanList.count()) {
-                sendSfont();
-            } else {
-                printFinished();
-                stopProcess();
-                emit finished();
-            }
+            sendNextSfont(worker);
         }
     }
 }
@@ -159,6 +268,11 @@ RemoteScannerClient::RemoteScannerClient(QObject *parent) : QObject(parent)
 {
     connect(&socket, &QLocalSocket::readyRead,
             this, &RemoteScannerClient::onSocketReadyRead);
+    connect(&socket, &QLocalSocket::connected, this, [=]()
+    {
+        // Identify this process to the server
+        socket.write(QString("hello %1\n").arg(qApp->applicationPid()).toLocal8Bit());
+    });
     connect(&timer, &QTimer::timeout, this, &RemoteScannerClient::onTimerTick);
 }
 
@@ -33,21 +33,23 @@
 #include <QTimer>
 
 #define REMOTE_SCANNER_SOCKET_NAME "konfyt_scanner"
+#define REMOTE_SCANNER_MAX_PROCESSES 8
 
-/* RemoteScannerServer starts a Konfyt process with the --scan option and also
- * starts a QLocalServer.
- * In the separate Konfyt process, RemoteScannerClient connects to the server
- * with QLocalSocket.
+/* RemoteScannerServer starts a pool of Konfyt processes with the --scan option
+ * and also starts a QLocalServer.
+ * In each separate Konfyt process, RemoteScannerClient connects to the server
+ * with QLocalSocket and sends "hello x\n" where x is its process id, so the
+ * server knows which process is on which connection.
  * The server then sends a soundfont file name and waits for a reply.
  * The client loads the soundfont file, extracts info, and replies:
  * "soundfont x\n" followed by XML data representing the soundfont file, where
  * x is the length of the XML data.
  * If an error occurred, x is zero and no XML data is sent.
  * After receiving the soundfont reply, the server continues by sending the next
- * soundfont file name to be scanned.
- * If the separate Konfyt process crashes, the server automatically restarts
- * the process and assumes that the last sent soundfont file name was the cause
- * of the crash and cannot be loaded.
+ * soundfont file name in the queue to the same process.
+ * If one of the Konfyt processes crashes, the server automatically restarts
+ * the process and assumes that the last soundfont file name sent to it was the
+ * cause of the crash and cannot be loaded.
  */
 
 class RemoteScannerServer : public QObject
@@ -55,6 +57,7 @@ class RemoteScannerServer : public QObject
     Q_OBJECT
 public:
     explicit RemoteScannerServer(QObject *parent = nullptr);
+    ~RemoteScannerServer();
 
     void scan(QStringList soundfonts);
 
@@ -63,26 +66,37 @@ signals:
     void scanStatus(QString msg);
     void finished();
     void newSoundfont(KfSoundPtr s);
+    void sfontFailed(QString filename); // Soundfont failed to load or crashed the scanner
 
 private:
+    struct Worker
+    {
+        QProcess* process = nullptr;
+        QLocalSocket* socket = nullptr;
+        QString sfont; // Soundfont being scanned, empty if none
+    };
+
     QLocalServer server;
-    QLocalSocket* socket = nullptr;
-    QProcess process;
+    QList<Worker*> workers;
     bool running = false;
 
-    QStringList sfontScanList;
-    int sfontScanIndex = 0;
+    QStringList sfontQueue;
+    int sfontCount = 0;
     int errors = 0;
     int successes = 0;
 
-    void sendSfont();
-    void stopProcess();
+    int defaultProcessCount(QString path);
+    bool isRotationalStorage(QString path);
+    void startWorker(Worker* worker);
+    void sendNextSfont(Worker* worker);
+    void removeWorker(Worker* worker);
+    void checkFinished();
     void printFinished();
+    void onProcessFinished(Worker* worker);
+    void onSocketReadyRead(QLocalSocket* socket);
 
 private slots:
-    void onProcessFinished(int exitCode, QProcess::ExitStatus exitStatus);
     void onNewConnection();
-    void onSocketReadyRead();
 };
 
 class RemoteScannerClient : public QObject